@@ -0,0 +1,32 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Helpers shared by the benchmarks. The time is measured as processor-time,
+ * so only single-threaded code should be timed with it.
+ */
+
+/* Get the processor-time used so far in milliseconds */
+#define BENCH_MS() ((double)clock() * 1000.0 / CLOCKS_PER_SEC)
+
+/* Print the total time of a benchmark and the time per operation */
+#define BENCH_PRINT(name, ms, num)                                          \
+	printf("%-44s %10.3f ms %12.1f ns/op\n", (name), (ms),              \
+			(ms) * 1000000.0 / (num))
+
+/*
+ * Get a pseudo-random number between 0 and 0x7fffffff, so every run of a
+ * benchmark uses the same input. The seed is a uint32_t updated in-place.
+ */
+#define BENCH_RAND(seed)                                                    \
+	((seed) = (seed) * 1103515245 + 12345, ((seed) >> 1) & 0x7fffffff)
+
+/* Get a pseudo-random float between min and max */
+#define BENCH_RANDF(seed, min, max)                                         \
+	((min) + ((max) - (min)) * (BENCH_RAND(seed) / (float)0x7fffffff))
+
+#endif
@@ -0,0 +1,209 @@
+#include "bench.h"
+#include "vector.h"
+#include "matrix.h"
+
+#include <string.h>
+
+/*
+ * Micro-benchmarks for the kernels of the math-library used by the rigs and
+ * the renderer. The library-functions are compared with scalar versions in
+ * the benchmark, which also serve as the reference for the results.
+ */
+
+#define BENCH_MATS    1024
+#define BENCH_REPEAT  200
+#define BENCH_TOL     0.0001
+
+static mat4_t bench_a[BENCH_MATS];
+static mat4_t bench_b[BENCH_MATS];
+static mat4_t bench_out[BENCH_MATS];
+static mat4_t bench_ref[BENCH_MATS];
+static vec4_t bench_v[BENCH_MATS];
+static vec4_t bench_vout[BENCH_MATS];
+static vec4_t bench_vref[BENCH_MATS];
+
+
+static void bench_mult_ref(mat4_t m1, mat4_t m2, mat4_t out)
+{
+	int i, j, k;
+	mat4_t conv;
+
+	for(i = 0; i < 4; i++) {
+		for(j = 0; j < 4; j++) {
+			conv[j * 4 + i] = 0;
+
+			for(k = 0; k < 4; k++)
+				conv[j * 4 + i] += m1[k * 4 + i] * m2[j * 4 + k];
+		}
+	}
+
+	memcpy(out, conv, sizeof(mat4_t));
+}
+
+
+static void bench_trans_ref(vec4_t in, mat4_t mat, vec4_t out)
+{
+	int i;
+
+	for(i = 0; i < 4; i++) {
+		out[i] = in[0] * mat[0x0 + i] + in[1] * mat[0x4 + i] +
+			in[2] * mat[0x8 + i] + in[3] * mat[0xc + i];
+	}
+}
+
+
+/*
+ * Get the largest difference between two lists of floats.
+ */
+static float bench_diff(float *a, float *b, int num)
+{
+	int i;
+	float d;
+	float err = 0;
+
+	for(i = 0; i < num; i++) {
+		d = a[i] - b[i];
+		err = MAX(err, ABS(d));
+	}
+
+	return err;
+}
+
+
+/*
+ * Create random transformation-matrices, which are well-conditioned so they
+ * can be inverted.
+ */
+static void bench_fill(void)
+{
+	uint32_t seed = 1;
+	vec4_t q;
+	int i;
+	int k;
+
+	for(i = 0; i < BENCH_MATS; i++) {
+		for(k = 0; k < 4; k++)
+			q[k] = BENCH_RANDF(seed, -1, 1);
+
+		vec4_nrm(q, q);
+		mat4_rfqat_s(bench_a[i], q[0], q[1], q[2], q[3]);
+		mat4_rfqat_s(bench_b[i], q[1], q[2], q[3], q[0]);
+
+		for(k = 0; k < 3; k++) {
+			bench_a[i][0xc + k] = BENCH_RANDF(seed, -10, 10);
+			bench_b[i][0xc + k] = BENCH_RANDF(seed, -10, 10);
+			bench_a[i][k * 5] *= BENCH_RANDF(seed, 0.5, 2);
+		}
+
+		for(k = 0; k < 3; k++)
+			bench_v[i][k] = BENCH_RANDF(seed, -10, 10);
+
+		bench_v[i][3] = 1;
+	}
+}
+
+
+int main(void)
+{
+	mat4_t idt;
+	double t;
+	float err;
+	int i;
+	int r;
+
+	bench_fill();
+
+#ifdef __SSE__
+	printf("Math-library built with SSE\n");
+#else
+	printf("Math-library built without SSE\n");
+#endif
+
+	/* Multiply matrices */
+	t = BENCH_MS();
+	for(r = 0; r < BENCH_REPEAT; r++) {
+		for(i = 0; i < BENCH_MATS; i++)
+			bench_mult_ref(bench_a[i], bench_b[i], bench_ref[i]);
+	}
+	BENCH_PRINT("mat4_mult: scalar", BENCH_MS() - t,
+			BENCH_REPEAT * BENCH_MATS);
+
+	t = BENCH_MS();
+	for(r = 0; r < BENCH_REPEAT; r++) {
+		for(i = 0; i < BENCH_MATS; i++)
+			mat4_mult(bench_a[i], bench_b[i], bench_out[i]);
+	}
+	BENCH_PRINT("mat4_mult", BENCH_MS() - t, BENCH_REPEAT * BENCH_MATS);
+
+	err = bench_diff(bench_out[0], bench_ref[0], BENCH_MATS * 16);
+	if(err > BENCH_TOL) {
+		printf("mat4_mult differs from the reference by %f\n", err);
+		return 1;
+	}
+
+	/* Multiply a list of matrices by one matrix */
+	t = BENCH_MS();
+	for(r = 0; r < BENCH_REPEAT; r++) {
+		for(i = 0; i < BENCH_MATS; i++)
+			bench_mult_ref(bench_a[0], bench_b[i], bench_ref[i]);
+	}
+	BENCH_PRINT("mat4_mult_batch: scalar", BENCH_MS() - t,
+			BENCH_REPEAT * BENCH_MATS);
+
+	t = BENCH_MS();
+	for(r = 0; r < BENCH_REPEAT; r++)
+		mat4_mult_batch(bench_a[0], bench_b, bench_out, BENCH_MATS);
+	BENCH_PRINT("mat4_mult_batch", BENCH_MS() - t,
+			BENCH_REPEAT * BENCH_MATS);
+
+	err = bench_diff(bench_out[0], bench_ref[0], BENCH_MATS * 16);
+	if(err > BENCH_TOL) {
+		printf("mat4_mult_batch differs from the reference by %f\n",
+				err);
+		return 1;
+	}
+
+	/* Invert matrices, checking that m * inv(m) is the identity */
+	t = BENCH_MS();
+	for(r = 0; r < BENCH_REPEAT; r++) {
+		for(i = 0; i < BENCH_MATS; i++)
+			mat4_inv(bench_out[i], bench_a[i]);
+	}
+	BENCH_PRINT("mat4_inv", BENCH_MS() - t, BENCH_REPEAT * BENCH_MATS);
+
+	mat4_idt(idt);
+	for(i = 0; i < BENCH_MATS; i++) {
+		bench_mult_ref(bench_a[i], bench_out[i], bench_ref[i]);
+
+		err = bench_diff(bench_ref[i], idt, 16);
+		if(err > BENCH_TOL) {
+			printf("mat4_inv differs from the inverse by %f\n",
+					err);
+			return 1;
+		}
+	}
+
+	/* Transform vectors */
+	t = BENCH_MS();
+	for(r = 0; r < BENCH_REPEAT; r++) {
+		for(i = 0; i < BENCH_MATS; i++)
+			bench_trans_ref(bench_v[i], bench_a[i], bench_vref[i]);
+	}
+	BENCH_PRINT("vec4_trans: scalar", BENCH_MS() - t,
+			BENCH_REPEAT * BENCH_MATS);
+
+	t = BENCH_MS();
+	for(r = 0; r < BENCH_REPEAT; r++) {
+		for(i = 0; i < BENCH_MATS; i++)
+			vec4_trans(bench_v[i], bench_a[i], bench_vout[i]);
+	}
+	BENCH_PRINT("vec4_trans", BENCH_MS() - t, BENCH_REPEAT * BENCH_MATS);
+
+	err = bench_diff(bench_vout[0], bench_vref[0], BENCH_MATS * 4);
+	if(err > BENCH_TOL) {
+		printf("vec4_trans differs from the reference by %f\n", err);
+		return 1;
+	}
+
+	return 0;
+}
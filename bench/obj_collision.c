@@ -0,0 +1,138 @@
+#include "bench.h"
+#include "object.h"
+#include "job.h"
+
+#include <stdlib.h>
+
+/*
+ * Let objects walk through fields of solid props and time the simulation,
+ * which is dominated by the collision-checks. With the collision-grid the
+ * cost should depend on the number of props close to the objects and not on
+ * the total number of props.
+ */
+
+#define BENCH_SIZES   3
+#define BENCH_MOVERS  32
+#define BENCH_TICKS   500
+static const int bench_num[BENCH_SIZES] = {0, 128, 256};
+
+
+static int bench_run(int num, short wld, short *prop, short plr)
+{
+	int i;
+	int side;
+	uint32_t seed = 1;
+	uint32_t id = 1;
+	short slot;
+	vec3_t pos;
+	double t;
+	char name[64];
+
+	if(obj_init() < 0)
+		return -1;
+
+	/* The floor */
+	vec3_set(pos, 0, 0, 0);
+	if(obj_set(id++, OBJ_M_STATIC, pos, wld, NULL, 0, 0) < 0)
+		goto err_close_obj;
+
+	/* Place the props on a square grid covering the floor */
+	side = 1;
+	while(side * side < num)
+		side++;
+
+	for(i = 0; i < num; i++) {
+		vec3_set(pos, -28.0 + 56.0 * (i % side) / side,
+				-28.0 + 56.0 * (i / side) / side, 0);
+
+		if(obj_set(id++, OBJ_M_STATIC, pos, prop[i % 2], NULL, 0,
+					0) < 0)
+			goto err_close_obj;
+	}
+
+	/* The objects walking in random directions */
+	for(i = 0; i < BENCH_MOVERS; i++) {
+		pos[0] = BENCH_RANDF(seed, -28, 28);
+		pos[1] = BENCH_RANDF(seed, -28, 28);
+		pos[2] = 0;
+
+		slot = obj_set(id++, OBJ_M_MODEL | OBJ_M_GRAV | OBJ_M_MOVE |
+				OBJ_M_SOLID, pos, plr, NULL, 0, 0);
+		if(slot < 0)
+			goto err_close_obj;
+
+		vec2_set(g_obj.mov[slot], 0, 1);
+		g_obj.dir[slot][0] = BENCH_RANDF(seed, -1, 1);
+		g_obj.dir[slot][1] = BENCH_RANDF(seed, -1, 1);
+		g_obj.dir[slot][2] = 0;
+	}
+
+	t = BENCH_MS();
+	obj_sys_update(BENCH_TICKS * TICK_TIME);
+	t = BENCH_MS() - t;
+
+	obj_close();
+
+	sprintf(name, "obj_sys_update: %d props", num);
+	BENCH_PRINT(name, t, BENCH_TICKS * BENCH_MOVERS);
+	return 0;
+
+err_close_obj:
+	obj_close();
+	return -1;
+}
+
+
+int main(void)
+{
+	int i;
+	int ret = 1;
+	short wld;
+	short prop[2];
+	short plr;
+
+	/* Load the models without a window */
+	if(ren_init(NULL, REN_MODE_NULL) < 0)
+		return 1;
+
+	if(mdl_init() < 0)
+		goto err_destroy_ren;
+
+	wld = mdl_load("wld", "res/models/plane.amo", 0, 0, MDL_TYPE_DEFAULT);
+	prop[0] = mdl_load("slp", "res/models/slope.amo", 0, 0,
+			MDL_TYPE_DEFAULT);
+	prop[1] = mdl_load("tst", "res/models/test.amo", 0, 0,
+			MDL_TYPE_DEFAULT);
+	plr = mdl_load("plr", "res/models/player.amo", 0, 0,
+			MDL_TYPE_DEFAULT);
+
+	if(wld < 0 || prop[0] < 0 || prop[1] < 0 || plr < 0)
+		goto err_close_mdl;
+
+	if(inp_init() < 0)
+		goto err_close_mdl;
+
+	/* Run the simulation on the calling thread only */
+	if(job_init(0) < 0)
+		goto err_close_inp;
+
+	for(i = 0; i < BENCH_SIZES; i++) {
+		if(bench_run(bench_num[i], wld, prop, plr) < 0)
+			goto err_close_job;
+	}
+
+	ret = 0;
+
+err_close_job:
+	job_close();
+
+err_close_inp:
+	inp_close();
+
+err_close_mdl:
+	mdl_close();
+
+err_destroy_ren:
+	ren_destroy();
+	return ret;
+}
@@ -0,0 +1,117 @@
+#include "bench.h"
+#include "object.h"
+
+#include <stdlib.h>
+
+/*
+ * Compare the lookup of objects by their ID using the lookup-table with a
+ * linear search over all slots, like obj_sel_id() used to do.
+ */
+
+#define BENCH_SIZES   3
+#define BENCH_LOOKUPS 200000
+static const int bench_num[BENCH_SIZES] = {128, 1024, 8192};
+
+
+static short bench_sel_linear(uint32_t id)
+{
+	short i;
+
+	for(i = 0; i < g_obj.alloc; i++) {
+		if(g_obj.mask[i] != OBJ_M_NONE && g_obj.id[i] == id)
+			return i;
+	}
+
+	return -1;
+}
+
+
+static int bench_run(int num)
+{
+	int i;
+	uint32_t seed = 1;
+	uint32_t *id;
+	uint32_t *key;
+	vec3_t pos;
+	double t;
+	double t_hash;
+	double t_lin;
+	long sum_hash = 0;
+	long sum_lin = 0;
+	char name[64];
+
+	if(!(id = malloc(num * sizeof(uint32_t))))
+		return -1;
+
+	if(!(key = malloc(BENCH_LOOKUPS * sizeof(uint32_t))))
+		goto err_free_id;
+
+	if(obj_init() < 0)
+		goto err_free_key;
+
+	for(i = 0; i < num; i++) {
+		do {
+			id[i] = BENCH_RAND(seed);
+		} while(obj_sel_id(id[i]) >= 0);
+
+		vec3_set(pos, i, 0, 0);
+		if(obj_set(id[i], OBJ_M_DATA, pos, -1, NULL, 0, 0) < 0)
+			goto err_close_obj;
+	}
+
+	/* Look up existing IDs and every eighth time a missing one */
+	for(i = 0; i < BENCH_LOOKUPS; i++) {
+		if(i % 8 == 7)
+			key[i] = BENCH_RAND(seed);
+		else
+			key[i] = id[BENCH_RAND(seed) % num];
+	}
+
+	t = BENCH_MS();
+	for(i = 0; i < BENCH_LOOKUPS; i++)
+		sum_hash += obj_sel_id(key[i]);
+	t_hash = BENCH_MS() - t;
+
+	t = BENCH_MS();
+	for(i = 0; i < BENCH_LOOKUPS; i++)
+		sum_lin += bench_sel_linear(key[i]);
+	t_lin = BENCH_MS() - t;
+
+	if(sum_hash != sum_lin) {
+		printf("The lookups returned different slots\n");
+		goto err_close_obj;
+	}
+
+	obj_close();
+	free(key);
+	free(id);
+
+	sprintf(name, "obj_sel_id: %d objects", num);
+	BENCH_PRINT(name, t_hash, BENCH_LOOKUPS);
+	sprintf(name, "linear search: %d objects", num);
+	BENCH_PRINT(name, t_lin, BENCH_LOOKUPS);
+	return 0;
+
+err_close_obj:
+	obj_close();
+
+err_free_key:
+	free(key);
+
+err_free_id:
+	free(id);
+	return -1;
+}
+
+
+int main(void)
+{
+	int i;
+
+	for(i = 0; i < BENCH_SIZES; i++) {
+		if(bench_run(bench_num[i]) < 0)
+			return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,435 @@
+#include "bench.h"
+#include "object.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Insert and delete objects with random IDs, which keeps the order-list of
+ * the object-table sorted on every change.
+ *
+ * The order-list is a sorted array, so every insert and delete also moves the
+ * entries behind it. To show what that costs compared to a structure with
+ * O(log n) updates, the same inserts and deletes are also run with thousands
+ * of entries on a sorted array and on a treap, together with walking through
+ * all entries in order, like the object-systems do on every tick.
+ */
+
+#define BENCH_SIZES     3
+#define BENCH_ROUNDS    10
+static const int bench_num[BENCH_SIZES] = {1000, 4000, 16000};
+
+#define BENCH_CMP_SIZES 3
+#define BENCH_WALKS     100
+static const int bench_cmp_num[BENCH_CMP_SIZES] = {1000, 4000, 16000};
+
+
+static void bench_shuffle(int *buf, int num, uint32_t seed)
+{
+	int i;
+	int j;
+	int tmp;
+
+	for(i = num - 1; i > 0; i--) {
+		j = BENCH_RAND(seed) % (i + 1);
+		tmp = buf[i];
+		buf[i] = buf[j];
+		buf[j] = tmp;
+	}
+}
+
+
+static int bench_check_order(void)
+{
+	int i;
+
+	for(i = 1; i < g_obj.num; i++) {
+		if(g_obj.id[g_obj.order[i - 1]] >= g_obj.id[g_obj.order[i]])
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Fill the object-table with objects and delete them again, several times.
+ */
+static int bench_run(int num)
+{
+	int i;
+	int r;
+	uint32_t seed = 1;
+	uint32_t id;
+	int *slot;
+	vec3_t pos;
+	double t;
+	double t_ins = 0;
+	double t_del = 0;
+	char name[64];
+
+	if(!(slot = malloc(num * sizeof(int))))
+		return -1;
+
+	if(obj_init() < 0)
+		goto err_free_slot;
+
+	for(r = 0; r < BENCH_ROUNDS; r++) {
+		/* Insert the objects with unique random IDs */
+		t = BENCH_MS();
+		for(i = 0; i < num; i++) {
+			do {
+				id = BENCH_RAND(seed);
+			} while(obj_sel_id(id) >= 0);
+
+			vec3_set(pos, i, 0, 0);
+			slot[i] = obj_set(id, OBJ_M_DATA, pos, -1, NULL, 0, 0);
+			if(slot[i] < 0)
+				goto err_close_obj;
+		}
+		t_ins += BENCH_MS() - t;
+
+		if(g_obj.num != num || bench_check_order() < 0) {
+			printf("The order-list is invalid after inserting\n");
+			goto err_close_obj;
+		}
+
+		/* Delete the objects in random order */
+		bench_shuffle(slot, num, seed);
+
+		t = BENCH_MS();
+		for(i = 0; i < num; i++) {
+			obj_del(slot[i]);
+
+			if(i == num / 2 && bench_check_order() < 0) {
+				printf("The order-list is invalid after deleting\n");
+				goto err_close_obj;
+			}
+		}
+		t_del += BENCH_MS() - t;
+
+		if(g_obj.num != 0) {
+			printf("The order-list is not empty after deleting\n");
+			goto err_close_obj;
+		}
+	}
+
+	obj_close();
+	free(slot);
+
+	sprintf(name, "obj_set: %d objects", num);
+	BENCH_PRINT(name, t_ins, BENCH_ROUNDS * num);
+	sprintf(name, "obj_del: %d objects", num);
+	BENCH_PRINT(name, t_del, BENCH_ROUNDS * num);
+	return 0;
+
+err_close_obj:
+	obj_close();
+
+err_free_slot:
+	free(slot);
+	return -1;
+}
+
+
+/*
+ * The structures to compare the order-list with. Both hold the indices of the
+ * entries in ascending order of their keys.
+ */
+static uint32_t *bench_key;
+static uint32_t *bench_pri;
+static int *bench_lft;
+static int *bench_rgt;
+
+
+/*
+ * Insert an entry into a sorted array using a binary search and moving the
+ * following entries back, like the order-list of the object-table.
+ */
+static void bench_arr_ins(int *lst, int num, int n)
+{
+	int low = 0;
+	int high = num;
+	int mid;
+
+	while(low < high) {
+		mid = low + ((high - low) / 2);
+
+		if(bench_key[lst[mid]] <= bench_key[n])
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	memmove(&lst[low + 1], &lst[low], (num - low) * sizeof(int));
+	lst[low] = n;
+}
+
+
+/*
+ * Remove an entry from a sorted array, moving the following entries forward.
+ */
+static void bench_arr_rmv(int *lst, int num, int n)
+{
+	int low = 0;
+	int high = num;
+	int mid;
+
+	while(low < high) {
+		mid = low + ((high - low) / 2);
+
+		if(bench_key[lst[mid]] < bench_key[n])
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	memmove(&lst[low], &lst[low + 1], (num - low - 1) * sizeof(int));
+}
+
+
+/*
+ * Split a treap into the entries with a key lower than the given one and the
+ * remaining ones.
+ */
+static void bench_split(int t, uint32_t key, int *l, int *r)
+{
+	if(t < 0) {
+		*l = -1;
+		*r = -1;
+		return;
+	}
+
+	if(bench_key[t] < key) {
+		bench_split(bench_rgt[t], key, &bench_rgt[t], r);
+		*l = t;
+	}
+	else {
+		bench_split(bench_lft[t], key, l, &bench_lft[t]);
+		*r = t;
+	}
+}
+
+
+static int bench_merge(int l, int r)
+{
+	if(l < 0)
+		return r;
+
+	if(r < 0)
+		return l;
+
+	if(bench_pri[l] > bench_pri[r]) {
+		bench_rgt[l] = bench_merge(bench_rgt[l], r);
+		return l;
+	}
+
+	bench_lft[r] = bench_merge(l, bench_lft[r]);
+	return r;
+}
+
+
+/*
+ * Insert an entry into a treap in O(log n).
+ *
+ * Returns: The new root of the treap
+ */
+static int bench_tree_ins(int t, int n)
+{
+	if(t < 0 || bench_pri[n] > bench_pri[t]) {
+		bench_split(t, bench_key[n], &bench_lft[n], &bench_rgt[n]);
+		return n;
+	}
+
+	if(bench_key[n] < bench_key[t])
+		bench_lft[t] = bench_tree_ins(bench_lft[t], n);
+	else
+		bench_rgt[t] = bench_tree_ins(bench_rgt[t], n);
+
+	return t;
+}
+
+
+/*
+ * Remove an entry from a treap in O(log n).
+ *
+ * Returns: The new root of the treap
+ */
+static int bench_tree_rmv(int t, int n)
+{
+	if(t == n)
+		return bench_merge(bench_lft[t], bench_rgt[t]);
+
+	if(bench_key[n] < bench_key[t])
+		bench_lft[t] = bench_tree_rmv(bench_lft[t], n);
+	else
+		bench_rgt[t] = bench_tree_rmv(bench_rgt[t], n);
+
+	return t;
+}
+
+
+/*
+ * Walk through the entries in order and get a checksum depending on the order.
+ */
+static uint32_t bench_arr_walk(int *lst, int num)
+{
+	uint32_t sum = 0;
+	int i;
+
+	for(i = 0; i < num; i++)
+		sum = sum * 31 + bench_key[lst[i]];
+
+	return sum;
+}
+
+
+static uint32_t bench_tree_walk(int t, int *stk)
+{
+	uint32_t sum = 0;
+	int top = 0;
+
+	while(t >= 0 || top > 0) {
+		while(t >= 0) {
+			stk[top++] = t;
+			t = bench_lft[t];
+		}
+
+		t = stk[--top];
+		sum = sum * 31 + bench_key[t];
+		t = bench_rgt[t];
+	}
+
+	return sum;
+}
+
+
+/*
+ * Run the same inserts, walks and deletes on a sorted array and on a treap.
+ */
+static int bench_cmp(int num)
+{
+	int i;
+	uint32_t seed = 1;
+	int *lst;
+	int *stk;
+	int *ord;
+	int root = -1;
+	uint32_t sum_arr = 0;
+	uint32_t sum_tree = 0;
+	double t;
+	double t_arr[3];
+	double t_tree[3];
+	char name[64];
+
+	bench_key = malloc(num * sizeof(uint32_t));
+	bench_pri = malloc(num * sizeof(uint32_t));
+	bench_lft = malloc(num * sizeof(int));
+	bench_rgt = malloc(num * sizeof(int));
+	lst = malloc(num * sizeof(int));
+	stk = malloc(num * sizeof(int));
+	ord = malloc(num * sizeof(int));
+
+	if(!bench_key || !bench_pri || !bench_lft || !bench_rgt || !lst ||
+			!stk || !ord)
+		goto err_free;
+
+	/* Use unique keys in random order */
+	for(i = 0; i < num; i++) {
+		bench_key[i] = (uint32_t)i * 2654435761U;
+		bench_pri[i] = BENCH_RAND(seed);
+		ord[i] = i;
+	}
+
+	t = BENCH_MS();
+	for(i = 0; i < num; i++)
+		bench_arr_ins(lst, i, i);
+	t_arr[0] = BENCH_MS() - t;
+
+	t = BENCH_MS();
+	for(i = 0; i < num; i++)
+		root = bench_tree_ins(root, i);
+	t_tree[0] = BENCH_MS() - t;
+
+	t = BENCH_MS();
+	for(i = 0; i < BENCH_WALKS; i++)
+		sum_arr += bench_arr_walk(lst, num);
+	t_arr[1] = BENCH_MS() - t;
+
+	t = BENCH_MS();
+	for(i = 0; i < BENCH_WALKS; i++)
+		sum_tree += bench_tree_walk(root, stk);
+	t_tree[1] = BENCH_MS() - t;
+
+	if(sum_arr != sum_tree) {
+		printf("The sorted array and the treap differ\n");
+		goto err_free;
+	}
+
+	bench_shuffle(ord, num, seed);
+
+	t = BENCH_MS();
+	for(i = 0; i < num; i++)
+		bench_arr_rmv(lst, num - i, ord[i]);
+	t_arr[2] = BENCH_MS() - t;
+
+	t = BENCH_MS();
+	for(i = 0; i < num; i++)
+		root = bench_tree_rmv(root, ord[i]);
+	t_tree[2] = BENCH_MS() - t;
+
+	if(root != -1) {
+		printf("The treap is not empty after deleting\n");
+		goto err_free;
+	}
+
+	sprintf(name, "sorted array insert: %d", num);
+	BENCH_PRINT(name, t_arr[0], num);
+	sprintf(name, "treap insert: %d", num);
+	BENCH_PRINT(name, t_tree[0], num);
+	sprintf(name, "sorted array walk: %d", num);
+	BENCH_PRINT(name, t_arr[1], BENCH_WALKS * num);
+	sprintf(name, "treap walk: %d", num);
+	BENCH_PRINT(name, t_tree[1], BENCH_WALKS * num);
+	sprintf(name, "sorted array delete: %d", num);
+	BENCH_PRINT(name, t_arr[2], num);
+	sprintf(name, "treap delete: %d", num);
+	BENCH_PRINT(name, t_tree[2], num);
+
+	free(ord);
+	free(stk);
+	free(lst);
+	free(bench_rgt);
+	free(bench_lft);
+	free(bench_pri);
+	free(bench_key);
+	return 0;
+
+err_free:
+	free(ord);
+	free(stk);
+	free(lst);
+	free(bench_rgt);
+	free(bench_lft);
+	free(bench_pri);
+	free(bench_key);
+	return -1;
+}
+
+
+int main(void)
+{
+	int i;
+
+	for(i = 0; i < BENCH_SIZES; i++) {
+		if(bench_run(bench_num[i]) < 0)
+			return 1;
+	}
+
+	for(i = 0; i < BENCH_CMP_SIZES; i++) {
+		if(bench_cmp(bench_cmp_num[i]) < 0)
+			return 1;
+	}
+
+	return 0;
+}
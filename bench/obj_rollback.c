@@ -0,0 +1,158 @@
+#include "bench.h"
+#include "object.h"
+#include "job.h"
+
+/*
+ * Measure the cost of a rollback depending on how late an input arrives. The
+ * input is inserted into the log that many ticks in the past, so the state at
+ * that tick is restored and all following ticks are simulated again.
+ */
+
+#define BENCH_SIZES   5
+#define BENCH_PROPS   128
+#define BENCH_MOVERS  32
+#define BENCH_START   100
+#define BENCH_REPEAT  20
+static const int bench_lat[BENCH_SIZES] = {1, 5, 10, 25, 49};
+
+
+static int bench_setup(short wld, short *prop, short plr)
+{
+	int i;
+	uint32_t seed = 1;
+	uint32_t id = 1;
+	short slot;
+	vec3_t pos;
+
+	vec3_set(pos, 0, 0, 0);
+	if(obj_set(id++, OBJ_M_STATIC, pos, wld, NULL, 0, 0) < 0)
+		return -1;
+
+	for(i = 0; i < BENCH_PROPS; i++) {
+		pos[0] = BENCH_RANDF(seed, -28, 28);
+		pos[1] = BENCH_RANDF(seed, -28, 28);
+		pos[2] = 0;
+
+		if(obj_set(id++, OBJ_M_STATIC, pos, prop[i % 2], NULL, 0,
+					0) < 0)
+			return -1;
+	}
+
+	for(i = 0; i < BENCH_MOVERS; i++) {
+		pos[0] = BENCH_RANDF(seed, -28, 28);
+		pos[1] = BENCH_RANDF(seed, -28, 28);
+		pos[2] = 0;
+
+		slot = obj_set(id++, OBJ_M_MODEL | OBJ_M_GRAV | OBJ_M_MOVE |
+				OBJ_M_SOLID, pos, plr, NULL, 0, 0);
+		if(slot < 0)
+			return -1;
+
+		vec2_set(g_obj.mov[slot], 0, 1);
+		g_obj.dir[slot][0] = BENCH_RANDF(seed, -1, 1);
+		g_obj.dir[slot][1] = BENCH_RANDF(seed, -1, 1);
+		g_obj.dir[slot][2] = 0;
+	}
+
+	return 0;
+}
+
+
+static void bench_run(int lat)
+{
+	int i;
+	uint32_t now = BENCH_START * TICK_TIME;
+	uint32_t id;
+	vec2_t mov;
+	double t;
+	double sum = 0;
+	char name[64];
+
+	for(i = 0; i < BENCH_REPEAT; i++) {
+		/* Let one of the objects change its direction too late */
+		id = BENCH_PROPS + 2 + i % BENCH_MOVERS;
+		vec2_set(mov, (i % 2) ? 1 : -1, 1);
+		inp_push(INP_PIPE_IN, id, INP_M_MOV, now - lat * TICK_TIME, mov,
+				NULL);
+		inp_update();
+
+		t = BENCH_MS();
+		obj_sys_update(now);
+		sum += BENCH_MS() - t;
+
+		/* Simulate the next tick without new inputs */
+		now += TICK_TIME;
+		inp_update();
+		obj_sys_update(now);
+	}
+
+	sprintf(name, "rollback: %d ticks late", lat);
+	BENCH_PRINT(name, sum, BENCH_REPEAT);
+}
+
+
+int main(void)
+{
+	int i;
+	int ret = 1;
+	short wld;
+	short prop[2];
+	short plr;
+
+	/* Load the models without a window */
+	if(ren_init(NULL, REN_MODE_NULL) < 0)
+		return 1;
+
+	if(mdl_init() < 0)
+		goto err_destroy_ren;
+
+	wld = mdl_load("wld", "res/models/plane.amo", 0, 0, MDL_TYPE_DEFAULT);
+	prop[0] = mdl_load("slp", "res/models/slope.amo", 0, 0,
+			MDL_TYPE_DEFAULT);
+	prop[1] = mdl_load("tst", "res/models/test.amo", 0, 0,
+			MDL_TYPE_DEFAULT);
+	plr = mdl_load("plr", "res/models/player.amo", 0, 0,
+			MDL_TYPE_DEFAULT);
+
+	if(wld < 0 || prop[0] < 0 || prop[1] < 0 || plr < 0)
+		goto err_close_mdl;
+
+	/* Run the simulation on the calling thread only */
+	if(job_init(0) < 0)
+		goto err_close_mdl;
+
+	for(i = 0; i < BENCH_SIZES; i++) {
+		if(inp_init() < 0)
+			goto err_close_job;
+
+		if(obj_init() < 0) {
+			inp_close();
+			goto err_close_job;
+		}
+
+		if(bench_setup(wld, prop, plr) < 0) {
+			obj_close();
+			inp_close();
+			goto err_close_job;
+		}
+
+		/* Fill the snapshot-ring before the first rollback */
+		obj_sys_update(BENCH_START * TICK_TIME);
+
+		bench_run(bench_lat[i]);
+		obj_close();
+		inp_close();
+	}
+
+	ret = 0;
+
+err_close_job:
+	job_close();
+
+err_close_mdl:
+	mdl_close();
+
+err_destroy_ren:
+	ren_destroy();
+	return ret;
+}
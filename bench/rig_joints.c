@@ -0,0 +1,181 @@
+#include "bench.h"
+#include "model.h"
+#include "rig.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Compare the old recursive calculation of the joint-matrices with the
+ * linear one in rig_finish() on the player-model. The time of rig_finish()
+ * also includes updating the two hooks of the model.
+ */
+
+#define BENCH_RIGS    1000
+#define BENCH_REPEAT  10
+#define BENCH_TOL     0.0001
+
+
+/*
+ * The recursive calculation as used before the joints were ordered, writing
+ * to separate buffers.
+ */
+static void bench_joints_rec(struct model_rig *rig, int idx, mat4_t *base,
+		mat4_t *trans)
+{
+	struct model *mdl;
+	int i;
+	mat4_t mat;
+	int par;
+
+	mat4_t loc_posm;
+	mat4_t loc_rotm;
+	mat4_t loc_trans_mat;
+	vec4_t tmp;
+
+	mdl = models[rig->model];
+
+	mat4_idt(loc_rotm);
+	vec4_cpy(tmp, rig->loc_rot[idx]);
+	mat4_rfqat_s(loc_rotm, tmp[0], tmp[1], tmp[2], tmp[3]);
+	mat4_idt(loc_posm);
+	mat4_pfpos(loc_posm, rig->loc_pos[idx]);
+	mat4_mult(loc_posm, loc_rotm, loc_trans_mat);
+
+	mat4_mult(mdl->jnt_buf[idx].loc_bind_mat, loc_trans_mat, mat);
+
+	if((par = mdl->jnt_buf[idx].par) != -1)
+		mat4_mult(base[par], mat, mat);
+
+	mat4_cpy(base[idx], mat);
+	mat4_mult(mat, mdl->jnt_buf[idx].inv_bind_mat, trans[idx]);
+
+	for(i = 0; i < mdl->jnt_buf[idx].child_num; i++) {
+		bench_joints_rec(rig, mdl->jnt_buf[idx].child_buf[i], base,
+				trans);
+	}
+}
+
+
+int main(void)
+{
+	struct model_rig *rig[BENCH_RIGS];
+	struct model *mdl;
+	mat4_t *base;
+	mat4_t *trans;
+	uint32_t seed = 1;
+	short slot;
+	int ret = 1;
+	int num = 0;
+	int jnt_num;
+	int i;
+	int j;
+	int k;
+	double t;
+	double t_rec = 0;
+	double t_lin = 0;
+	float err = 0;
+	float d;
+
+	/* Load the model without a window */
+	if(ren_init(NULL, REN_MODE_NULL) < 0)
+		return 1;
+
+	if(mdl_init() < 0)
+		goto err_destroy_ren;
+
+	slot = mdl_load("plr", "res/models/player.amo", 0, 0,
+			MDL_TYPE_DEFAULT);
+	if(slot < 0)
+		goto err_close_mdl;
+
+	/* Set up the rig-pools and the pose-cache used by the rigs */
+	rig_pool_init();
+	rig_pose_init();
+
+	mdl = models[slot];
+	jnt_num = mdl->jnt_num;
+
+	base = malloc(BENCH_RIGS * jnt_num * sizeof(mat4_t));
+	trans = malloc(BENCH_RIGS * jnt_num * sizeof(mat4_t));
+	if(!base || !trans)
+		goto err_free_buf;
+
+	/*
+	 * Give every rig its own random pose. The rigs are never updated, so
+	 * they don't share a pose and rig_finish() always has to calculate
+	 * the joints.
+	 */
+	for(num = 0; num < BENCH_RIGS; num++) {
+		if(!(rig[num] = rig_derive(slot)))
+			goto err_free_rigs;
+
+		for(j = 0; j < jnt_num; j++) {
+			for(k = 0; k < 3; k++) {
+				rig[num]->loc_pos[j][k] =
+					BENCH_RANDF(seed, -0.1, 0.1);
+			}
+
+			for(k = 0; k < 4; k++) {
+				rig[num]->loc_rot[j][k] =
+					BENCH_RANDF(seed, -1, 1);
+			}
+
+			vec4_nrm(rig[num]->loc_rot[j], rig[num]->loc_rot[j]);
+		}
+	}
+
+	for(i = 0; i < BENCH_REPEAT; i++) {
+		t = BENCH_MS();
+		for(j = 0; j < BENCH_RIGS; j++) {
+			bench_joints_rec(rig[j], mdl->jnt_root,
+					base + j * jnt_num,
+					trans + j * jnt_num);
+		}
+		t_rec += BENCH_MS() - t;
+
+		t = BENCH_MS();
+		for(j = 0; j < BENCH_RIGS; j++)
+			rig_finish(rig[j]);
+		t_lin += BENCH_MS() - t;
+	}
+
+	/* Both ways have to calculate the same matrices */
+	for(j = 0; j < BENCH_RIGS; j++) {
+		for(i = 0; i < jnt_num; i++) {
+			for(k = 0; k < 16; k++) {
+				d = trans[j * jnt_num + i][k] -
+					rig[j]->trans_mat[i][k];
+				err = MAX(err, ABS(d));
+			}
+		}
+	}
+
+	if(err > BENCH_TOL) {
+		printf("The joint-matrices differ by %f\n", err);
+		goto err_free_rigs;
+	}
+
+	BENCH_PRINT("rig joints: recursive", t_rec,
+			BENCH_REPEAT * BENCH_RIGS);
+	BENCH_PRINT("rig joints: rig_finish", t_lin,
+			BENCH_REPEAT * BENCH_RIGS);
+	ret = 0;
+
+err_free_rigs:
+	for(i = 0; i < num; i++)
+		rig_free(rig[i]);
+
+err_free_buf:
+	free(base);
+	free(trans);
+	rig_pose_close();
+	rig_pool_close();
+
+err_close_mdl:
+	mdl_close();
+
+err_destroy_ren:
+	ren_destroy();
+	return ret;
+}
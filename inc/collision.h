@@ -139,6 +139,125 @@ struct col_pck_ray {
 extern int col_init_pck_ray(struct col_pck_ray *pck, vec3_t pos, vec3_t dir);
 
 
+/*
+ * 
+ * TRIANGLE-BLOCKS
+ *
+ */
+
+/*
+ * A block of triangles in structure-of-arrays layout, so multiple triangles
+ * can be checked at once. The corners are stored as [corner][axis][lane]. The
+ * unnormalized normals are precalculated, as they don't change when moving
+ * the triangles.
+ */
+#define COL_BLK_NUM    4
+
+struct col_trig_blk {
+	float vtx[3][3][COL_BLK_NUM];
+	float nrm[3][COL_BLK_NUM];
+};
+
+
+/*
+ * Write a triangle to a lane of a triangle-block and calculate the normal.
+ *
+ * @blk: Pointer to the block
+ * @lane: The lane to write the triangle to
+ * @p0: The first corner of the triangle
+ * @p1: The second corner of the triangle
+ * @p2: The third corner of the triangle
+ */
+extern void col_blk_set(struct col_trig_blk *blk, int lane, vec3_t p0,
+		vec3_t p1, vec3_t p2);
+
+
+/*
+ * Copy a list of triangle-blocks and move the triangles by an offset.
+ *
+ * @out: The list to write the moved blocks to
+ * @in: The list of blocks to copy
+ * @num: The number of blocks
+ * @off: The offset to move the triangles by
+ */
+extern void col_blk_move(struct col_trig_blk *out, struct col_trig_blk *in,
+		int num, vec3_t off);
+
+
+/*
+ * 
+ * BOUNDING-VOLUME-HIERARCHY
+ *
+ */
+
+/*
+ * The maximum number of triangles in a leaf and the maximum depth of the
+ * hierarchy, which also limits the size of the stack used for traversal.
+ */
+#define COL_BVH_LEAF   4
+#define COL_BVH_DEPTH  48
+
+/*
+ * A node of the hierarchy. Inner nodes reference the first of their two
+ * children, which are always stored next to each other. Leaves reference the
+ * first of their triangles in the triangle-list.
+ */
+struct col_bvh_node {
+	vec3_t min;
+	vec3_t max;
+
+	/* Index of the first child or the first triangle */
+	int idx;
+
+	/* The number of triangles for leaves, 0 for inner nodes */
+	int num;
+
+	/* The index of the first triangle-block of a leaf */
+	int blk;
+};
+
+/*
+ * A bounding-volume-hierarchy over a triangle-mesh, used to only check the
+ * triangles close to a collider.
+ */
+struct col_bvh {
+	int                  node_num;
+	struct col_bvh_node  *node;
+
+	/* The indices of the triangles, sorted by the leaves */
+	int                  *tri;
+
+	/*
+	 * The triangles of the leaves packed into triangle-blocks, with each
+	 * leaf starting at a new block.
+	 */
+	int                  blk_num;
+	struct col_trig_blk  *blk;
+};
+
+
+/*
+ * Build a bounding-volume-hierarchy over a triangle-mesh.
+ *
+ * @bvh: Pointer to the hierarchy to build
+ * @vtx: The vertices of the mesh
+ * @idx: The vertex-indices of all triangles
+ * @num: The number of triangles
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+extern int col_bvh_build(struct col_bvh *bvh, vec3_t *vtx, int3_t *idx,
+		int num);
+
+
+/*
+ * Free the memory allocated for a bounding-volume-hierarchy.
+ *
+ * @bvh: Pointer to the hierarchy
+ */
+extern void col_bvh_free(struct col_bvh *bvh);
+
+
 /*
  * 
  * COLLISION-CHECKS
@@ -174,6 +293,24 @@ extern int col_b2b_check(vec3_t min1, vec3_t max1, vec3_t min2, vec3_t max2);
 extern void col_s2t_check(struct col_pck_sphere *pck, vec3_t p0, vec3_t p1, vec3_t p2);
 
 
+/*
+ * Check the sphere, as set in the given collision-package, for collision with
+ * a list of triangle-blocks. The triangles are moved by the offset, if one is
+ * given, and converted to eSpace first. If SSE is available, four triangles
+ * are checked at once to sort out the ones which can't collide with the
+ * sphere, before running col_s2t_check() on the remaining ones. Therefore the
+ * results are the same as when calling col_s2t_check() for each triangle.
+ *
+ * @pck: The collision-package containing data about the sphere
+ * @blk: The list of triangle-blocks
+ * @num: The number of triangles
+ * @off: The offset of the triangles in world-space or NULL if the triangles
+ * 	are already in world-space
+ */
+extern void col_s2t_check_batch(struct col_pck_sphere *pck,
+		struct col_trig_blk *blk, int num, vec3_t off);
+
+
 /*
  * Check if the sphere, as set in the given collision-package, intersects with
  * any of the given triangles. The coordinates of the traingle-corners have to
@@ -215,4 +352,38 @@ extern void col_r2b_check(struct col_pck_ray *pck, vec3_t min, vec3_t max);
 extern void col_r2t_check(struct col_pck_ray *pck, vec3_t p0, vec3_t p1,
 		vec3_t p2);
 
+
+/*
+ * Check the sphere, as set in the given collision-package, for collision with
+ * all triangles of a mesh, whose bounding-box overlaps with the given box. The
+ * mesh is moved by the offset and converted to eSpace before checking the
+ * triangles, using the triangle-blocks of the leaves. Instead of the blocks of
+ * the hierarchy, a copy which has already been moved to world-space can be
+ * used.
+ *
+ * @pck: The collision-package containing data about the sphere
+ * @bvh: The hierarchy over the mesh
+ * @blk: The triangle-blocks to use or NULL to use the ones of the hierarchy
+ * @off: The offset of the mesh in world-space
+ * @min: The lower corner of the box relative to the mesh
+ * @max: The higher corner of the box relative to the mesh
+ */
+extern void col_bvh_s2t_check(struct col_pck_sphere *pck, struct col_bvh *bvh,
+		struct col_trig_blk *blk, vec3_t off, vec3_t min, vec3_t max);
+
+
+/*
+ * Check a ray for collision with the triangles of a mesh. Only the nodes the
+ * ray passes before the closest intersection found so far are visited. The
+ * mesh is moved by the offset before checking the triangles.
+ *
+ * @pck: The package containing the ray-data and to write the result to
+ * @bvh: The hierarchy over the mesh
+ * @vtx: The vertices of the mesh
+ * @idx: The vertex-indices of all triangles
+ * @off: The offset of the mesh in world-space
+ */
+extern void col_bvh_r2t_check(struct col_pck_ray *pck, struct col_bvh *bvh,
+		vec3_t *vtx, int3_t *idx, vec3_t off);
+
 #endif
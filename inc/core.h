@@ -12,6 +12,7 @@
 #include "object.h"
 #include "camera.h"
 #include "world.h"
+#include "job.h"
 
 
 /* The updates-per-second */
@@ -0,0 +1,83 @@
+#ifndef _JOB_H
+#define _JOB_H
+
+#include "sdl.h"
+
+/*
+ * The maximum number of worker-threads. The calling thread always takes part
+ * in processing the jobs, so there are atmost JOB_THREAD_MAX + 1 threads
+ * working on a batch.
+ */
+#define JOB_THREAD_MAX 8
+
+/* Batches with less jobs are processed by the calling thread alone */
+#define JOB_MIN_NUM    4
+
+/*
+ * A job-function called once for every job in a batch.
+ *
+ * @idx: The index of the job in the batch
+ * @thrd: The index of the executing thread, with 0 being the calling thread
+ * @data: The data passed with the batch
+ */
+typedef void (*job_fn)(int idx, int thrd, void *data);
+
+struct job_wrapper {
+	/* The worker-threads */
+	int                  thrd_num;
+	SDL_Thread           *thrd[JOB_THREAD_MAX];
+
+	/* Used to wake up the workers and to wait for them to finish */
+	SDL_mutex            *mtx;
+	SDL_cond             *start;
+	SDL_cond             *done;
+
+	/* The current batch */
+	job_fn               fnc;
+	void                 *data;
+	int                  num;
+	SDL_atomic_t         next;
+
+	/*
+	 * The number of workers still processing the current batch and the
+	 * generation of the batch, which is incremented for every new batch.
+	 */
+	int                  active;
+	uint32_t             gen;
+
+	char                 running;
+};
+
+
+/* The global job-wrapper-instance */
+extern struct job_wrapper g_job;
+
+
+/*
+ * Initialize the job-system and start the worker-threads.
+ *
+ * @thrd_num: The number of worker-threads or a negative value to use one
+ * 	thread less than the number of available cores
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+extern int job_init(int thrd_num);
+
+
+/*
+ * Stop the worker-threads and close the job-system.
+ */
+extern void job_close(void);
+
+
+/*
+ * Process a batch of jobs and wait until all of them are done. The jobs may
+ * run in any order and on any thread, so they must not depend on each other.
+ *
+ * @fnc: The job-function
+ * @num: The number of jobs
+ * @data: The data to pass to the job-function
+ */
+extern void job_run(job_fn fnc, int num, void *data);
+
+#endif
@@ -22,6 +22,7 @@ extern void mat4_zero(mat4_t m);
 extern void mat4_idt(mat4_t m);
 extern void mat4_cpy(mat4_t out, mat4_t in);
 extern void mat4_mult(mat4_t m1, mat4_t m2, mat4_t out);
+extern void mat4_mult_batch(mat4_t m, mat4_t *in, mat4_t *out, int num);
 extern void mat4_inv(mat4_t out, mat4_t in);
 extern void mat4_transp(mat4_t out, mat4_t in);
 extern void mat4_print(mat4_t m);
@@ -5,6 +5,7 @@
 #include "vector.h"
 #include "matrix.h"
 #include "shape.h"
+#include "collision.h"
 #include "sdl.h"
 #include "asset.h"
 #include "camera.h"
@@ -14,6 +15,23 @@
 #define MDL_NAME_MAX            8
 #define MDL_SLOTS             256
 
+/*
+ * The max. number of draws in the draw-list. If the list is full, it is
+ * flushed early.
+ */
+#define MDL_DRAW_MAX         1024
+
+/*
+ * The IK-chains set up when loading a rigged model. The aim-chain ends at the
+ * parent-joint of the first hook and turns up to MDL_IK_AIM_JNT joints, so the
+ * hook points at the view-target. The foot-chains are two-bone-chains ending
+ * at the joints with the names in MDL_IK_FOOT_NAMES, which are placed on the
+ * ground. Chains the model doesn't have are disabled.
+ */
+#define MDL_IK_AIM_JNT          6
+#define MDL_IK_FOOT_MAX         2
+#define MDL_IK_FOOT_NAMES       {"foot.L", "foot.R"}
+
 enum mdl_status {
 	MDL_OK =                0,
 	MDL_ERR_CREATING =      1,
@@ -46,6 +64,9 @@ struct mdl_col {
 	vec3_t         *cm_nrm;
 	vec4_t         *cm_equ;
 
+	/* The hierarchy over the triangles of the collision-mesh */
+	struct col_bvh cm_bvh;
+
 	/*
 	 * rig-collision-boxes
 	 */
@@ -75,14 +96,69 @@ struct mdl_joint {
 
 	/* The inverse-rest-matrix relative to the model-origin */
 	mat4_t inv_bind_mat;
+
+	/*
+	 * The max. angle in radians the joint may be rotated away from the
+	 * rest-pose by inverse-kinematics, see mdl_calc_limits().
+	 */
+	float lim;
+};
+
+/*
+ * The limit of a joint is the largest rotation reached in any animation of the
+ * model plus a padding in radians. Joints, which are rotated less than the
+ * minimum by all animations, are not limited.
+ */
+#define MDL_JNT_LIM_PAD  0.1745
+#define MDL_JNT_LIM_MIN  0.0175
+
+/*
+ * A compressed key of a joint-track. The rotation is stored using the
+ * smallest-three encoding, see qat_pack(). The progress is quantized to 16
+ * bits. The position is stored separately, see struct mdl_pos.
+ */
+struct mdl_key {
+	uint16_t prog;
+	uint16_t rot[3];
+};
+
+/* The quantization-range of the progress of a key */
+#define MDL_KEY_PROG_MAX 65535.0
+#define MDL_KEY_POS_MAX  65535.0
+
+/*
+ * The positions of a track, which moves the joint out of the rest-position.
+ * The positions of the keys are quantized to 16 bits within the range of the
+ * track. If the position doesn't change, only the range is stored.
+ */
+struct mdl_pos {
+	/* Used to decode the positions: pos = min + pos_key * scl */
+	vec3_t            min;
+	vec3_t            scl;
+
+	/*
+	 * The offset of the quantized position of the first key in
+	 * pos_key_buf, or -1 if the position is constant.
+	 */
+	int               key_off;
 };
 
-struct mdl_keyfr {
-	float prog;
+/*
+ * The keys of a single joint in an animation, which are stored in order of
+ * their progress. Joints without a track keep the rest-pose. If a joint is
+ * missing in a keyframe of an animated joint, the track contains a key with
+ * the rest-pose instead, so the joint is interpolated the same way.
+ */
+struct mdl_track {
+	short             jnt;
+	short             key_num;
+	int               key_off;
 
-	char   *mask;
-	vec3_t *pos;
-	vec4_t *rot;
+	/*
+	 * The index of the positions in pos_buf, or -1 if the joint stays in
+	 * the rest-position.
+	 */
+	int               pos;
 };
 
 struct mdl_anim {
@@ -90,8 +166,22 @@ struct mdl_anim {
 
 	float dur;
 
-	int               keyfr_num;
-	struct mdl_keyfr  *keyfr_buf;
+	/* The tracks of the animated joints, ordered by the joint-index */
+	int               trk_num;
+	struct mdl_track  *trk_buf;
+
+	/* The keys of all tracks */
+	int               key_num;
+	struct mdl_key    *key_buf;
+
+	/*
+	 * The positions of the tracks and the quantized positions of their
+	 * keys, with three values per key.
+	 */
+	int               pos_num;
+	struct mdl_pos    *pos_buf;
+	int               pos_key_num;
+	uint16_t          *pos_key_buf;
 };
 
 struct mdl_hook {
@@ -144,12 +234,24 @@ struct model {
 	struct mdl_joint  *jnt_buf;
 	int               jnt_root;
 
+	/* The joint-indices in parent-before-child order */
+	int               *jnt_ord;
+
 	int               anim_num;
 	struct mdl_anim   *anim_buf;
 
 	int               hook_num;
 	struct mdl_hook   *hook_buf;
 
+	/* The IK-chains to aim the first hook and to place the feet */
+	char                 ik_aim_ok;
+	struct rig_ik_chain  ik_aim;
+	short                ik_foot_num;
+	struct rig_ik_chain  ik_foot[MDL_IK_FOOT_MAX];
+
+	/* The height of the foot-joints above the ground in the rest-pose */
+	float                ik_foot_hgt[MDL_IK_FOOT_MAX];
+
 	struct mdl_col    col;
 
 	uint8_t           status;
@@ -254,14 +356,25 @@ extern short mdl_load_ffd(char *name, FILE *fd, short tex_slot, short shd_slot,
 
 
 /*
- * Render a model with a model-matrix.
+ * Add a model to the draw-list of the current frame. The matrices are copied
+ * and the joint-palette is written immediately, so the rig can be changed
+ * afterwards. The model is drawn with the next call of mdl_flush().
  *
  * @slot: The slot of the model to render
- * @mat_pos: The position-matrix
- * @mat_rot: The rotation-matrix
+ * @mat_pos: The position-matrix or NULL for the identity
+ * @mat_rot: The rotation-matrix or NULL for the identity
  * @rig: Pointer to a rig or NULL if the model has none
  */
-extern void mdl_render(short slot, mat4_t mat_pos, mat4_t rot_mat,
+extern void mdl_submit(short slot, mat4_t mat_pos, mat4_t rot_mat,
 		struct model_rig *rig);
 
+
+/*
+ * Sort the draw-list by shader, texture and mesh and draw all models in it.
+ * The shader, texture and vertices are only bound if they differ from the
+ * previous draw. Skyboxes are always drawn first. The list is empty
+ * afterwards.
+ */
+extern void mdl_flush(void);
+
 #endif
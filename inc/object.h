@@ -13,9 +13,25 @@
 #include "controller.h"
 #include "core.h"
 
-#define OBJ_LIM      128
+/*
+ * The object-table starts with OBJ_ALLOC_MIN slots and doubles its size every
+ * time it runs full, until the limit is reached. As slots are stored as shorts,
+ * the limit can't exceed 0x7fff.
+ */
+#define OBJ_ALLOC_MIN  32
+#define OBJ_LIM        0x7fff
 #define OBJ_DATA_MAX   128
 
+/*
+ * An object-handle combines the slot of an object with the generation of the
+ * slot, which is incremented every time an object is removed from the slot.
+ * This way handles to deleted objects can be detected, even if the slot has
+ * been reused by a new object.
+ */
+#define OBJ_HDL(slot, gen)  (((uint32_t)(gen) << 16) | ((uint32_t)(slot) & 0xffff))
+#define OBJ_HDL_SLOT(hdl)   ((short)((hdl) & 0xffff))
+#define OBJ_HDL_GEN(hdl)    ((uint16_t)((hdl) >> 16))
+
 /*
  * The different object-masks specifying behaviour and datahandling for the
  * objects.
@@ -48,36 +64,51 @@
 
 #define OBJ_A_ALL (OBJ_A_ID|OBJ_A_MASK|OBJ_A_POS|OBJ_A_VEL|OBJ_A_MOV|OBJ_A_BUF)
 
-
 /*
- * The object-movement-log used to periodically store the objects current
- * position, velocity and input which will be used to correct a objects
- * movement by using a log-entry as a startpoint to reenact the movement of the
- * object.
- *
- * The movement-log allows new entries to be append at the end, but not inserted
- * in between. It also allows entries with the same timestamp to be updated with
- * new data after it has already been inserted.
- *
- * The used list is a rotating list which overwrites old data with new data if
- * the entry-limit has been reached, while keeping the elements in sorted order
- * from lowest timestamp to highest timestamp.
+ * The distances to the camera from which on rigs are animated with a reduced
+ * LOD, and the radius of the sphere around an object used to check if the
+ * rig is in the view of the camera.
  */
+#define OBJ_RIG_LOD_HALF   15.0
+#define OBJ_RIG_LOD_QUART  40.0
+#define OBJ_RIG_RADIUS     2.0
 
-#define OBJ_LOG_LIM 12
-#define OBJ_LOG_TIME 80
-
-struct obj_log {
-	short start;
-	short num;
-
-	uint32_t  ts[OBJ_LOG_LIM];
+/*
+ * The different capability-lists. Each one contains the slots of all objects
+ * with the given capability, so the systems only have to iterate over the
+ * objects they apply to.
+ */
+#define OBJ_LST_MOVE   0  /* Movable objects                             */
+#define OBJ_LST_RIG    1  /* Objects with an attached rig                */
+#define OBJ_LST_MODEL  2  /* Objects with a model to render              */
+#define OBJ_LST_SOLID  3  /* Solid objects with a model to collide with  */
+#define OBJ_LST_NUM    4
 
-	vec3_t    pos[OBJ_LOG_LIM];
-	vec3_t    vel[OBJ_LOG_LIM];
 
-	vec2_t    mov[OBJ_LOG_LIM];
-	vec3_t    dir[OBJ_LOG_LIM];
+/*
+ * The snapshot-ring stores the hot state of all objects at the beginning of
+ * every tick. When a late input arrives, the exact tick the input belongs to
+ * is restored and only the following ticks are simulated again.
+ *
+ * The ring keeps atmost OBJ_SNAP_TICKS snapshots by default, but never uses
+ * more than OBJ_SNAP_BUDGET bytes. Both limits can be changed with
+ * obj_snap_config().
+ */
+#define OBJ_SNAP_TICKS   50
+#define OBJ_SNAP_BUDGET  (4 << 20)
+
+struct obj_snap {
+	/* The timestamp of the tick or 0 if the snapshot is unused */
+	uint32_t ts;
+
+	/* The copies of the hot buffers, which share a single allocation */
+	uint32_t *mask;
+	uint16_t *gen;
+	uint32_t *obj_ts;
+	vec3_t   *pos;
+	vec3_t   *vel;
+	vec2_t   *mov;
+	vec3_t   *dir;
 };
 
 struct comp_marker {
@@ -87,14 +118,6 @@ struct comp_marker {
 	vec2_t       mov;
 };
 
-struct obj_collision {
-	int mask;
-
-	cube_t box;
-	vec3_t min;
-	vec3_t max;
-};
-
 struct obj_handheld {
 	/* The index of the handheld */
 	short idx;
@@ -107,65 +130,200 @@ struct obj_handheld {
 	vec3_t brl_pos;
 };
 
+/*
+ * The rarely used data of an object, which is kept apart from the data used
+ * every tick.
+ */
+struct obj_cold {
+	/* Handheld */
+	struct obj_handheld      hnd;
+
+	/* Object/Player-Data like Health and Mana */
+	int                      len;
+	char                     data[OBJ_DATA_MAX];
+};
+
+/*
+ * A capability-list containing the slots of the objects in ascending order of
+ * their IDs, so the objects will be processed in the same order on all peers.
+ */
+struct obj_lst {
+	short num;
+	short *slot;
+};
+
+/*
+ * The collision-grid is a uniform grid used as broadphase for the collision
+ * of static solid objects with a collision-mesh. The cells are mapped onto a
+ * fixed number of buckets by hashing the cell-coordinates. Objects covering
+ * more than OBJ_GRID_SPAN cells are kept in a separate list, which is always
+ * checked.
+ */
+#define OBJ_GRID_CELL  4.0
+#define OBJ_GRID_SIZE  1024
+#define OBJ_GRID_SPAN  64
+
+/* The margin added to the boxes used for collision-checks */
+#define OBJ_COL_MARGIN 0.01
+
+/*
+ * How far above the base of an object the ground below a foot is searched.
+ * Feet are only lifted onto ground between the base and this height.
+ */
+#define OBJ_IK_FOOT_REACH 0.5
+
+struct obj_grid_cell {
+	short num;
+	short alloc;
+	short *slot;
+};
+
+struct obj_grid {
+	struct obj_grid_cell     cell[OBJ_GRID_SIZE];
+	struct obj_grid_cell     large;
+};
+
+/*
+ * A buffer to collect the candidates returned by a query of the
+ * collision-grid.
+ */
+struct obj_grid_res {
+	short num;
+	short alloc;
+	short *slot;
+};
+
+/*
+ * An entry in the lookup-table, mapping an object-ID to the slot of the object
+ * in the object-table. Empty entries have the slot -1.
+ */
+struct obj_tbl_entry {
+	uint32_t id;
+	short    slot;
+};
+
 struct obj_wrapper {
+	/*
+	 * The number of allocated slots and the stack of currently unused
+	 * slots, with the lowest slot on top.
+	 */
+	short                    alloc;
+	short                    free_num;
+	short                    *free_lst;
+
+	/*
+	 * The number of objects and the slots of all objects in ascending
+	 * order of their IDs, which is kept sorted when inserting or removing
+	 * objects.
+	 */
 	short                    num;
-	short                    order[OBJ_LIM];
-	uint32_t                 last_ts;
-	uint32_t                 rets;
+	short                    *order;
+
+	/*
+	 * The open-addressing lookup-table to get the slot of an object by
+	 * its ID, using linear probing. The size is a power of two and
+	 * atleast twice the number of allocated slots.
+	 */
+	int                      tbl_size;
+	struct obj_tbl_entry     *tbl;
 
+	/* The generation of each slot */
+	uint16_t                 *gen;
+
+	/* The capability-lists, which are also kept sorted by ID */
+	struct obj_lst           lst[OBJ_LST_NUM];
+
+
+	/*
+	 * The hot data, which is processed every tick.
+	 */
 
 	/* The object-mask and identification-number */
-	uint32_t                 mask[OBJ_LIM];
-	uint32_t                 id[OBJ_LIM];
+	uint32_t                 *mask;
+	uint32_t                 *id;
 
 	/* The runtime-buffers */
-	uint32_t                 ts[OBJ_LIM];
-	vec3_t                   pos[OBJ_LIM];
-	vec3_t                   vel[OBJ_LIM];
-	vec2_t                   mov[OBJ_LIM];
-	vec3_t                   dir[OBJ_LIM];
+	uint32_t                 *ts;
+	vec3_t                   *pos;
+	vec3_t                   *vel;
+	vec2_t                   *mov;
+	vec3_t                   *dir;
+
+	/* The model */
+	short                    *mdl;
 
-	/* The save-buffers for the previous state */
-	uint32_t                 prev_ts[OBJ_LIM];
-	vec3_t                   prev_pos[OBJ_LIM];
-	vec3_t                   prev_dir[OBJ_LIM];
 
-	/* Buffer containing the runtime-log */
-	struct obj_log           log[OBJ_LIM];
+	/*
+	 * The data used when rendering the object every frame.
+	 */
+
+	/* The save-buffers for the previous state */
+	uint32_t                 *prev_ts;
+	vec3_t                   *prev_pos;
+	vec3_t                   *prev_dir;
 
 	/* 
 	 * The point the object is currently looking at in world and
 	 * model-space
 	 */
-	vec3_t                   view_origin[OBJ_LIM];
-	vec3_t                   view_pos[OBJ_LIM];
-	vec3_t                   view_pos_rel[OBJ_LIM];
+	vec3_t                   *view_origin;
+	vec3_t                   *view_pos;
+	vec3_t                   *view_pos_rel;
 
-	/* The model and the rig */
-	short                    mdl[OBJ_LIM];
-	struct model_rig         *rig[OBJ_LIM];
+	/* The rig */
+	struct model_rig         **rig;
 
-	/* The render-matrices */
-	mat4_t                   mat_pos[OBJ_LIM];
-	mat4_t                   mat_rot[OBJ_LIM];
-	float                    vagl[OBJ_LIM][2]; /* 0: z-axis, 1: x-axis */
+	/* The number of rigs per animation-LOD in the last frame */
+	int                      rig_lod_num[RIG_LOD_NUM];
 
-	/* Collision */
-	struct obj_collision     col[OBJ_LIM]; 
+	/* Precalculated matrices */
+	mat4_t                   *pos_mat;
+	mat4_t                   *rot_mat;
 
-	/* Handheld */
-	struct obj_handheld      hnd[OBJ_LIM];
 
-	/* Object/Player-Data like Health and Mana */
-	int                      len[OBJ_LIM];
-	char                     data[OBJ_LIM][OBJ_DATA_MAX];
+	/*
+	 * The collision-data.
+	 */
+
+	/*
+	 * The position other objects collide against. For movable objects
+	 * this is the position at the beginning of the current tick, so the
+	 * objects can be moved in parallel and in any order without seeing
+	 * each others new positions.
+	 */
+	vec3_t                   *col_pos;
+
+	/* The world-space bounding-box of the collision-mesh */
+	vec3_t                   *col_min;
+	vec3_t                   *col_max;
+
+	/*
+	 * The triangle-blocks of the collision-mesh moved to world-space,
+	 * which are cached for all objects in the collision-grid and are
+	 * rebuilt when the object is moved.
+	 */
+	struct col_trig_blk      **col_blk;
+
+	/* The broadphase for static solid objects */
+	struct obj_grid          grid;
 
-	/* Precalculated matrices */
-	mat4_t                   pos_mat[OBJ_LIM];
-	mat4_t                   rot_mat[OBJ_LIM];
 
-	mat4_t                   ren_pos_mat[OBJ_LIM];
-	mat4_t                   ren_rot_mat[OBJ_LIM];
+	/*
+	 * The snapshot-ring, with the configured limits, the number of
+	 * usable snapshots and the number of slots the snapshots have been
+	 * allocated for.
+	 */
+	short                    snap_lim;
+	int                      snap_budget;
+	short                    snap_num;
+	short                    snap_alloc;
+	struct obj_snap          *snap;
+
+
+	/*
+	 * The cold data.
+	 */
+	struct obj_cold          *cold;
 };
 
 
@@ -239,6 +397,26 @@ extern int obj_attach_rig(short slot, short mdlslot);
 extern int obj_mod(short slot, short attr, void *data, int len);
 
 
+/*
+ * Get the handle of an object, which stays valid until the object is deleted.
+ *
+ * @slot: The slot of the object
+ *
+ * Returns: The handle of the object or 0 if the slot is empty
+ */
+extern uint32_t obj_get_hdl(short slot);
+
+
+/*
+ * Get the slot of an object by a handle.
+ *
+ * @hdl: The handle of the object
+ *
+ * Returns: The slot of the object or -1 if the object has been deleted
+ */
+extern short obj_sel_hdl(uint32_t hdl);
+
+
 /*
  * Get an object by seaching for the id.
  *
@@ -6,22 +6,135 @@
 /* 
  * -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
  *             
- *            OBJECT_MOVEMENT_LOG
+ *            OBJECT_SNAPSHOTS
  *
  * -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
  */
 
-extern void obj_log_reset(short slot);
+/*
+ * Initialize the snapshot-ring with the default limits.
+ */
+extern void obj_snap_init(void);
+
+
+/*
+ * Free all snapshots.
+ */
+extern void obj_snap_close(void);
+
+
+/*
+ * Set the limits of the snapshot-ring. All stored snapshots are dropped.
+ *
+ * @ticks: The max. number of ticks which can be restored
+ * @budget: The max. number of bytes to use for the snapshots
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+extern int obj_snap_config(short ticks, int budget);
+
+
+/*
+ * Save the state of all objects at the beginning of a tick. If the object-table
+ * has grown since the last snapshot, the stored snapshots are grown and keep
+ * their contents. Only if they don't fit into the budget anymore, the oldest
+ * ones are dropped.
+ *
+ * @ts: The timestamp of the tick
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+extern int obj_snap_save(uint32_t ts);
+
+
+/*
+ * Restore the state of the objects from the oldest snapshot, which is not
+ * older than the given timestamp. Objects created after the snapshot has been
+ * taken keep their current state.
+ *
+ * @ts: The timestamp to restore
+ *
+ * Returns: 0 on success or -1 if no such snapshot exists
+ */
+extern int obj_snap_load(uint32_t ts);
+
+
+/*
+ * -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ *             
+ *            OBJECT_COLLISION_GRID
+ *
+ * -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=- 
+ */
+
+/*
+ * Initialize the collision-grid.
+ */
+extern void obj_grid_init(void);
+
 
-extern short obj_log_set(short slot, uint32_t ts, vec3_t pos, vec3_t vel,
-		vec2_t mov, vec3_t dir);
+/*
+ * Clear the collision-grid and free the allocated memory.
+ */
+extern void obj_grid_close(void);
+
+
+/*
+ * Calculate the world-space bounding-box of the collision-mesh of an object,
+ * using the collision-box of the model and the collision-position of the
+ * object.
+ *
+ * @slot: The object-slot
+ * @min: The vector to write the lower corner to
+ * @max: The vector to write the higher corner to
+ */
+extern void obj_col_box(short slot, vec3_t min, vec3_t max);
+
+
+/*
+ * Insert an object into the collision-grid. Only static solid objects with a
+ * collision-mesh will be inserted, all other objects are ignored. The
+ * triangles of the collision-mesh are moved to world-space and cached, so
+ * this has to be called again after the object has been moved.
+ *
+ * @slot: The object-slot
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+extern int obj_grid_ins(short slot);
+
+
+/*
+ * Remove an object from the collision-grid. This has to be called before
+ * changing the position or mask of the object.
+ *
+ * @slot: The object-slot
+ */
+extern void obj_grid_rmv(short slot);
+
+
+/*
+ * Collect all solid objects with a collision-mesh, whose bounding-box overlaps
+ * with the given box. Static objects are looked up in the collision-grid,
+ * while movable objects are checked directly. The objects are returned in
+ * ascending order of their IDs.
+ *
+ * @min: The lower corner of the box
+ * @max: The higher corner of the box
+ * @res: The buffer to write the slots of the objects to
+ *
+ * Returns: The number of objects or -1 if an error occurred
+ */
+extern int obj_grid_query(vec3_t min, vec3_t max, struct obj_grid_res *res);
 
-extern char obj_log_near(short slot, uint32_t ts);
 
-extern void obj_log_col(uint32_t ts, char *logi);
+/*
+ * Free a result-buffer used for querying the collision-grid.
+ *
+ * @res: The result-buffer
+ */
+extern void obj_grid_res_free(struct obj_grid_res *res);
 
-extern void obj_log_cpy(short slot, short i, uint32_t *ts, vec3_t pos, vec3_t vel,
-		vec2_t mov, vec3_t dir);
 
 /*
  * -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
@@ -32,6 +145,9 @@ extern void obj_log_cpy(short slot, short i, uint32_t *ts, vec3_t pos, vec3_t ve
  */
 
 
+/* The maximum distance of the point an object is looking at */
+#define OBJ_VIEW_RANGE 10.0
+
 /*
  * Calculate the point the object is currently looking at both in world-space
  * and model-space and write it to the object.
@@ -40,6 +156,18 @@ extern void obj_log_cpy(short slot, short i, uint32_t *ts, vec3_t pos, vec3_t ve
  */
 extern void obj_calc_view(short slot);
 
+/*
+ * Cast a ray straight down from a point and get the distance to the first
+ * solid object below it, ignoring the given object.
+ *
+ * @slot: The slot of the object to ignore
+ * @pos: The origin of the ray in world-space
+ * @max: The max. distance to check
+ *
+ * Returns: The distance to the ground or -1 if nothing has been hit
+ */
+extern float obj_ground_dist(short slot, vec3_t pos, float max);
+
 /*
  * Update the handheld-data based on the current animation.
  *
@@ -176,19 +176,82 @@ extern void gl_render_set_texture(uint32_t hdl, enum mdl_type type);
  * Set the values of the uniform variables during rendering.
  * 
  * @buf: The handle of the uniform buffer
- * @uni: The uniform buffer data
+ * @uni: A pointer to the uniform buffer data
  */
 extern void gl_render_set_uniform_buffer(unsigned int buf,
-                                         struct uni_buffer uni);
+                                         struct uni_buffer *uni);
+
+
+/*
+ * Get the required alignment of the offsets into the palette-ring.
+ * 
+ * Returns: The alignment in bytes
+ */
+extern uint32_t gl_get_palette_align(void);
+
+
+/*
+ * Start using a region of the palette-ring for the current frame and wait
+ * until the GPU has finished reading the palettes written to it previously.
+ * 
+ * @frm: The index of the region
+ */
+extern void gl_begin_palette(int frm);
+
+
+/*
+ * Insert a fence after the draws of the current frame, to protect the region
+ * of the palette-ring until the frame has been rendered.
+ * 
+ * @frm: The index of the region
+ */
+extern void gl_end_palette(int frm);
+
+
+/*
+ * Map a range of the palette-ring, so a joint-palette can be written to it.
+ * The range has to be unmapped again before drawing.
+ * 
+ * @off: The offset of the range in the palette-ring
+ * @size: The size of the range in bytes
+ * 
+ * Returns: A pointer to the mapped range or NULL if an error occured
+ */
+extern void *gl_map_palette(uint32_t off, uint32_t size);
+
+
+/*
+ * Unmap the previously mapped range of the palette-ring.
+ */
+extern void gl_unmap_palette(void);
+
+
+/*
+ * Bind a joint-palette in the palette-ring during rendering.
+ * 
+ * @off: The offset of the palette in the palette-ring
+ */
+extern void gl_render_set_palette(uint32_t off);
+
+
+/*
+ * Bind the transformations of the instances in the palette-ring during
+ * rendering.
+ * 
+ * @off: The offset of the instances in the palette-ring
+ */
+extern void gl_render_set_instances(uint32_t off);
 
 
 /*
  * Draw the model.
  * 
  * @indices: The amount of indices
+ * @inst_num: The number of instances
  * @type: the type of model that should be rendered
  */
-extern void gl_render_draw(size_t indices, enum mdl_type type);
+extern void gl_render_draw(size_t indices, uint32_t inst_num,
+                           enum mdl_type type);
 
 
 /*
@@ -2,10 +2,81 @@
 #define _QUATERNION_H
 
 #include "vector.h"
+#include <stdint.h>
 
 
 extern void qat_add(vec4_t q1, vec4_t q2, vec4_t out);
 
 extern void qat_interp(vec4_t q1, vec4_t q2, float p, vec4_t out);
 
+
+/*
+ * Compress a unit-quaternion to 48 bits using the smallest-three encoding.
+ * The three smallest components are quantized to 15 bits each and the index
+ * of the largest component is stored in the remaining bits.
+ *
+ * @q: The unit-quaternion to compress
+ * @out: The buffer to write the three 16-bit words to
+ */
+extern void qat_pack(vec4_t q, uint16_t *out);
+
+
+/*
+ * Decompress a quaternion compressed with qat_pack().
+ *
+ * @in: The three 16-bit words
+ * @out: The quaternion to write the result to
+ */
+extern void qat_unpack(uint16_t *in, vec4_t out);
+
+
+/*
+ * Get the conjugate of a quaternion, which is the inverse rotation for
+ * unit-quaternions.
+ *
+ * @q: The quaternion
+ * @out: The quaternion to write the result to
+ */
+extern void qat_conj(vec4_t q, vec4_t out);
+
+
+/*
+ * Rotate a vector by a unit-quaternion.
+ *
+ * @q: The unit-quaternion
+ * @v: The vector to rotate
+ * @out: The vector to write the result to
+ */
+extern void qat_rot_vec(vec4_t q, vec3_t v, vec3_t out);
+
+
+/*
+ * Get the rotation of a matrix without scaling as a unit-quaternion.
+ *
+ * @m: The matrix
+ * @out: The quaternion to write the result to
+ */
+extern void qat_from_mat(mat4_t m, vec4_t out);
+
+
+/*
+ * Create a unit-quaternion rotating around an axis.
+ *
+ * @axis: The rotation-axis, which doesn't have to be normalized
+ * @agl: The angle in radians
+ * @out: The quaternion to write the result to
+ */
+extern void qat_from_agl(vec3_t axis, float agl, vec4_t out);
+
+
+/*
+ * Get the shortest rotation turning the direction of one vector into the
+ * direction of another.
+ *
+ * @v1: The vector to rotate from
+ * @v2: The vector to rotate to
+ * @out: The quaternion to write the result to
+ */
+extern void qat_from_vecs(vec3_t v1, vec3_t v2, vec4_t out);
+
 #endif
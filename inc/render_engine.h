@@ -8,7 +8,36 @@
 
 enum ren_mode {
 	REN_MODE_OPENGL,
-	REN_MODE_VULKAN
+	REN_MODE_VULKAN,
+	REN_MODE_NULL
+};
+
+
+/*
+ * The alignment of the palettes in the CPU-side palette-ring of the
+ * null-renderer, matching the usual uniform-buffer alignment of a GPU.
+ */
+#define REN_NULL_ALIGN 256
+
+
+/*
+ * The counters of the render wrapper. They are updated in all modes, so the
+ * numbers of a headless run with the null-renderer can be compared with the
+ * ones of a real renderer.
+ */
+struct ren_stats {
+	uint32_t      frames;       /* The number of finished frames         */
+	uint32_t      draws;        /* The number of draw-calls              */
+	uint32_t      instances;    /* The number of drawn instances         */
+	uint32_t      indices;      /* The number of drawn indices           */
+	uint32_t      shd_changes;  /* The number of shader-binds            */
+	uint32_t      vtx_changes;  /* The number of vertex-buffer-binds     */
+	uint32_t      dat_changes;  /* The number of uniform-binds           */
+	uint32_t      tex_changes;  /* The number of texture-binds           */
+	uint32_t      buffers;      /* The number of created buffers         */
+	uint32_t      textures;     /* The number of created textures        */
+	unsigned long upl_bytes;    /* The bytes uploaded to buffers         */
+	unsigned long pal_bytes;    /* The bytes written to joint-palettes   */
 };
 
 
@@ -17,6 +46,24 @@ enum ren_mode {
  */
 struct ren_wrapper {
 	enum ren_mode mode;
+
+	/*
+	 * The number of the current frame, the region of the palette-ring used
+	 * by this frame, the number of bytes already used in the region and the
+	 * alignment of the palettes.
+	 */
+	uint32_t frame;
+	int      pal_frm;
+	uint32_t pal_head;
+	uint32_t pal_align;
+
+	/*
+	 * The CPU-side palette-ring used by the null-renderer instead of a
+	 * GPU-buffer.
+	 */
+	uint8_t  *null_pal;
+
+	struct ren_stats stats;
 };
 
 /* Define the global render-wrapper */
@@ -28,7 +75,11 @@ extern struct ren_wrapper g_ren;
  * If the function returns with -1 destroy the window and call this function
  * again with a SDL_Window initialized with SDL_WINDOW_OPENGL.
  *
- * @window: A SDL_Window initialized with SDL_WINDOW_VULKAN 
+ * @window: A SDL_Window initialized with SDL_WINDOW_VULKAN, or NULL for the
+ *          null-renderer
+ * @mode: 0 for vulkan, 1 for opengl or REN_MODE_NULL for the null-renderer,
+ *        which doesn't need a window and only records the calls in the
+ *        counters
  * 
  * Returns: 0 on success or -1 if an error occured
  */
@@ -151,8 +202,11 @@ extern int ren_destroy_model_data(uint32_t vao, VkDescriptorSet set);
  * @type: The type of the buffer can be:
  *        GL_ARRAY_BUFFER for vertex buffer
  *        GL_ELEMENT_ARRAY_BUFFER for index buffer
+ *        GL_UNIFORM_BUFFER for uniform buffer, which is only created by
+ *        opengl, as vulkan writes the uniform data to the palette-ring
  * @size: The size of the buffer
- * @buf: The content of the buffer with length 'size'
+ * @buf: The content of the buffer with length 'size'. Vulkan copies it to a
+ *       device-local buffer with the next batch of uploads.
  * @bo: A pointer to the handle of the opengl buffer, which will be set by
  *      the function
  * @buffer: A pointer to the vulkan buffer, which will be filled by the function
@@ -173,23 +227,36 @@ extern void ren_destroy_buffer(uint32_t bo, struct vk_buffer buffer);
 
 
 /*
- * Set the opengl vertex input attributes or the vulkan uniform buffer and
- * texture of a model.
+ * Submit all pending uploads of buffers and textures at once, without waiting
+ * for them to complete. Vulkan submits them before the next frame otherwise.
+ * 
+ * Returns: 0 on success or -1 if an error occured
+ */
+extern int ren_flush_uploads(void);
+
+
+/*
+ * Wait until all frames in flight and pending uploads have been completed.
+ * Call this before destroying buffers, textures or shaders which may still
+ * be used by the GPU.
+ */
+extern void ren_wait_idle(void);
+
+
+/*
+ * Set the opengl vertex input attributes or the vulkan texture of a model.
  * 
  * @vao: The opengl handle of the vao
  * @vbo: The opengl handle of the vertex buffer
  * @stride: The size of one full vertex in the array
  * @rig: A boolean to tell if the model is animated
  * @set: The vulkan descriptor set
- * @uniform_buffer: The vulkan uniform buffer
  * @texture: The vulkan texture
  * 
  * Returns: 0 on success or -1 if an error occured
  */
 extern int ren_set_model_data(uint32_t vao, uint32_t vbo, int stride, int rig,
-			      VkDescriptorSet set,
-			      struct vk_buffer uniform_buffer,
-			      struct vk_texture texture);
+			      VkDescriptorSet set, struct vk_texture texture);
 
 
 /*
@@ -224,30 +291,85 @@ extern void ren_set_vertices(uint32_t vao, struct vk_buffer vtx_buffer,
 
 
 /*
- * Set the opengl uniform buffer and texture or the vulkan descriptor set.
+ * Reserve a joint-palette in the region of the palette-ring for the current
+ * frame and get a pointer to write the joint-matrices to. The memory is
+ * mapped directly, so the palette doesn't have to be copied again. The
+ * palette stays valid until the end of the frame.
+ * Has to be in between ren_start() and ren_end().
+ * 
+ * @jnt_num: The number of joints
+ * @off: A pointer to write the offset of the palette in the ring to
+ * 
+ * Returns: A pointer to write the joint-matrices to or NULL if the region is
+ *          full or an error occured
+ */
+extern void *ren_map_palette(int jnt_num, uint32_t *off);
+
+
+/*
+ * Reserve space for the transformations of the instances of a draw in the
+ * palette-ring, like ren_map_palette(). For every instance the position- and
+ * then the rotation-matrix have to be written.
+ * Has to be in between ren_start() and ren_end().
+ * 
+ * @num: The number of instances, at most REN_INST_MAX
+ * @off: A pointer to write the offset of the instances in the ring to
+ * 
+ * Returns: A pointer to write the matrices to or NULL if the region is full
+ *          or an error occured
+ */
+extern void *ren_map_instances(int num, uint32_t *off);
+
+
+/*
+ * Finish writing a joint-palette or instances. This has to be called after
+ * writing to the pointer returned by ren_map_palette() or ren_map_instances()
+ * and before drawing.
+ */
+extern void ren_unmap_palette(void);
+
+
+/*
+ * Set the texture during rendering. The vulkan texture is part of the
+ * descriptor set and bound with ren_set_render_model_data().
  * 
- * @uni_buf: The opengl handle of the uniform buffer
- * @uni: The uniform buffer data
  * @hdl: The opengl handle of the texture
+ * @type: The type of the model
+ */
+extern void ren_set_texture(uint32_t hdl, enum mdl_type type);
+
+
+/*
+ * Set the opengl uniform buffer or the vulkan descriptor set. As vulkan
+ * renders multiple frames at once, the uniform data is written to the
+ * palette-ring instead of a buffer of the model.
+ * 
+ * @uni_buf: The opengl handle of the uniform buffer
+ * @uni: A pointer to the uniform buffer data
  * @pipeline: The vulkan pipeline
- * @vk_uni_buf: The vulkan uniform buffer
  * @set: The vulkan descriptor set
- * @type: The type of the model
+ * @pal_off: The offset of the joint-palette in the palette-ring, ignored by
+ *           models without a rig
+ * @inst_off: The offset of the instances in the palette-ring
+ *
+ * Returns: 0 on success or -1 if the palette-ring is full
  */
-extern void ren_set_render_model_data(unsigned int uni_buf,
-				     struct uni_buffer uni, uint32_t hdl,
+extern int ren_set_render_model_data(unsigned int uni_buf,
+				     struct uni_buffer *uni,
 				     struct vk_pipeline pipeline,
-				     struct vk_buffer vk_uni_buf,
-				     VkDescriptorSet set, enum mdl_type type);
+				     VkDescriptorSet set, uint32_t pal_off,
+				     uint32_t inst_off);
 
 
 /*
- * Draw the model.
+ * Draw the model. All instances share the vertices, the uniform buffer and
+ * the joint-palette, and read their transformations from the instances.
  * 
  * @indices: The amount of indices
+ * @inst_num: The number of instances
  * @type: The type of the model
  */
-extern void ren_draw(uint32_t indices, enum mdl_type type);
+extern void ren_draw(uint32_t indices, uint32_t inst_num, enum mdl_type type);
 
 
 /*
@@ -259,6 +381,18 @@ extern void ren_draw(uint32_t indices, enum mdl_type type);
  */
 extern int ren_end(SDL_Window *window);
 
+/*
+ * Reset all counters of the render wrapper.
+ */
+extern void ren_reset_stats(void);
+
+
+/*
+ * Print the counters of the render wrapper.
+ */
+extern void ren_print_stats(void);
+
+
 /*
  * Print various information on api version, gpu, etc.
  * 
@@ -3,17 +3,42 @@
 
 #include "rig.h"
 
+/*
+ * The joint-palettes of the rigs and the transformations of the instances are
+ * written to a ring-buffer, which is split into one region per frame. A
+ * palette is bound with a fixed size of REN_PALETTE_SIZE and the instances
+ * with REN_INST_SIZE, as declared in the shaders, but they only occupy the
+ * space actually written, so the buffer has additional space at the end to
+ * keep the last bound range inside the buffer.
+ */
+#define REN_PALETTE_SIZE     (JOINT_MAX_NUM * MAT4_SIZE)
+#define REN_PALETTE_RING     (1024 * 1024)
+#define REN_PALETTE_FRAMES   3
+
+/*
+ * The max. number of instances per draw. Every instance has a position- and
+ * a rotation-matrix.
+ */
+#define REN_INST_MAX         64
+#define REN_INST_SIZE        (REN_INST_MAX * 2 * MAT4_SIZE)
+
+#define REN_PALETTE_PAD      (REN_INST_SIZE > REN_PALETTE_SIZE ? \
+		REN_INST_SIZE : REN_PALETTE_SIZE)
+#define REN_PALETTE_BUF      (REN_PALETTE_FRAMES * REN_PALETTE_RING + \
+		REN_PALETTE_PAD)
+
 enum mdl_type {
 	MDL_TYPE_DEFAULT,
 	MDL_TYPE_SKYBOX
 };
 
+/*
+ * The uniform buffer shared by all instances of a draw. The transformations
+ * of the instances are read from the palette-ring.
+ */
 struct uni_buffer {
-	mat4_t pos_mat;
-	mat4_t rot_mat;
 	mat4_t view;
 	mat4_t proj;
-	mat4_t trans_mat[JOINT_MAX_NUM];
 };
 
 #endif
@@ -8,25 +8,168 @@
 
 #define JOINT_MAX_NUM 100
 
+/* The max. number of animation-layers per rig */
+#define RIG_LAYER_MAX 4
+
+/*
+ * The blend-modes of a layer. The poses of all blend-layers are mixed
+ * according to their weights, and the additive layers are then applied on
+ * top of the mixed pose.
+ */
+#define RIG_LAYER_BLEND  0
+#define RIG_LAYER_ADD    1
+
+/*
+ * The aim-animation covers the pitch from RIG_AIM_MAX degrees at the start to
+ * -RIG_AIM_MAX degrees at the end, with looking straight ahead in the middle.
+ */
+#define RIG_AIM_MAX 70.0
+
+/*
+ * The animation-LODs. Rigs with a reduced LOD only sample the animation every
+ * 2nd or 4th frame and interpolate the joint-matrices in between, while culled
+ * rigs are not updated at all.
+ */
+#define RIG_LOD_FULL   0
+#define RIG_LOD_HALF   1
+#define RIG_LOD_QUART  2
+#define RIG_LOD_CULL   3
+#define RIG_LOD_NUM    4
+
+/*
+ * The max. number of poses in the pose-cache and the number of buckets of the
+ * hash-table used to look them up.
+ */
+#define RIG_POSE_NUM     128
+#define RIG_POSE_HASH    256
+
+/*
+ * The times and weights of the layers are quantized to these steps, so rigs
+ * of the same model in a similar animation-state share the same pose. The
+ * time is given in milliseconds.
+ */
+#define RIG_POSE_TIME    10.0
+#define RIG_POSE_WEIGHT  64.0
+
+/*
+ * The number of rigs allocated at once by the rig-pool of a model.
+ */
+#define RIG_POOL_CHUNK   16
+
+/*
+ * The inverse-kinematics solvers. The two-bone solver places the end of a
+ * chain of three joints analytically, while CCD and FABRIK iteratively move
+ * the end of a longer chain to the target. The aim-solver turns the chain, so
+ * the forward-direction of the hook at its end points at the target.
+ */
+#define RIG_IK_TWO_BONE  0
+#define RIG_IK_CCD       1
+#define RIG_IK_FABRIK    2
+#define RIG_IK_AIM       3
+
+/* The max. number of joints in an IK-chain */
+#define RIG_IK_JNT_MAX   8
+
+/*
+ * The default number of iterations and the tolerances of the solvers. The
+ * tolerance of the aim-solver is an angle in radians.
+ */
+#define RIG_IK_ITER      10
+#define RIG_IK_TOL       0.01
+#define RIG_IK_AIM_TOL   0.005
+
+/*
+ * A chain of joints moved by inverse-kinematics. A chain is only bound to a
+ * model and can be used for all rigs derived from it.
+ */
+struct rig_ik_chain {
+	short     model;
+	char      type;
+
+	/* The joints, ordered from the root to the end of the chain */
+	short     num;
+	short     jnt[RIG_IK_JNT_MAX];
+
+	/*
+	 * The share of the remaining rotation each joint takes per iteration,
+	 * used by CCD and the aim-solver.
+	 */
+	float     wgt[RIG_IK_JNT_MAX];
+
+	/* The hook at the end of the chain, or -1 to use the last joint */
+	short     hook;
+
+	short     iter;
+	float     tol;
+};
+
+/*
+ * The allocation-statistics of the rig-pools.
+ */
+struct rig_pool_stats {
+	int       chunk_num;   /* The number of allocated chunks          */
+	int       rig_num;     /* The number of rigs in use               */
+	int       free_num;    /* The number of unused rig-blocks         */
+	uint32_t  alloc_num;   /* The total number of allocated rigs      */
+	uint32_t  malloc_num;  /* The total number of calls to malloc     */
+};
+
+/*
+ * An animation-layer, playing a single animation of the model.
+ */
+struct rig_layer {
+	short     anim;       /* The animation or -1 if the layer is unused */
+	char      mode;       /* The blend-mode                             */
+	char      loop;       /* 1 to repeat the animation, 0 to stop       */
+	float     time;       /* The current time in milliseconds           */
+	float     speed;      /* The playback-speed, 0 to pause             */
+	float     weight;     /* The weight of the layer                    */
+};
+
 /*
  * A simple rig-struct containing the necessary data for the
  * animation of an object.
  */
 struct model_rig {
 	short     model;
-	
-	short     anim;
-	float     prog;
-	short     keyfr;
-	uint32_t  ts;
 
-	char      jnt_m[JOINT_MAX_NUM];
+	/*
+	 * The animation-layers and the layer, whose time is set by the
+	 * aim-pitch instead of advancing with the playback, or -1 if none.
+	 */
+	struct rig_layer lay[RIG_LAYER_MAX];
+	short     aim;
+
+	/*
+	 * The local transformations of the joints. All joint-buffers are
+	 * allocated for the number of joints of the model.
+	 */
 	int       jnt_num;
-	vec3_t    loc_pos[JOINT_MAX_NUM];
-	vec4_t    loc_rot[JOINT_MAX_NUM];
+	vec3_t    *loc_pos;
+	vec4_t    *loc_rot;
 
-	mat4_t    base_mat[JOINT_MAX_NUM];
-	mat4_t    trans_mat[JOINT_MAX_NUM];
+	/*
+	 * The joint-matrices. These either point to the own buffers of the
+	 * rig or to a pose in the pose-cache, which is shared with other rigs
+	 * and must not be modified.
+	 */
+	mat4_t    *base_mat;
+	mat4_t    *trans_mat;
+	short     pose;
+
+	mat4_t    *own_base_mat;
+	mat4_t    *own_trans_mat;
+
+	/*
+	 * The current LOD, the number of frames and the time since the
+	 * animation has last been sampled, and the joint-matrices of the last
+	 * two samples to interpolate between, with the number of valid ones.
+	 */
+	char      lod;
+	char      lod_frm;
+	float     lod_dt;
+	char      lod_num;
+	mat4_t    *lod_mat[2];
 
 	/*
 	 * Hooks
@@ -41,7 +184,40 @@ struct model_rig {
 
 
 /*
- * Derive a rig from a model and setup the joint-matrices.
+ * Initialize the pose-cache.
+ */
+extern void rig_pose_init(void);
+
+
+/*
+ * Free the pose-cache. All rigs have to be freed before calling this.
+ */
+extern void rig_pose_close(void);
+
+
+/*
+ * Initialize the rig-pools.
+ */
+extern void rig_pool_init(void);
+
+
+/*
+ * Free the rig-pools. All rigs have to be freed before calling this.
+ */
+extern void rig_pool_close(void);
+
+
+/*
+ * Get the allocation-statistics of the rig-pools.
+ *
+ * @stats: The struct to write the statistics to
+ */
+extern void rig_pool_stats(struct rig_pool_stats *stats);
+
+
+/*
+ * Derive a rig from a model and setup the joint-matrices. The rig and all its
+ * buffers are carved from a single block of the rig-pool of the model.
  *
  * @slot: The slot in the model-list to derive the rig from
  *
@@ -59,21 +235,55 @@ extern void rig_free(struct model_rig *rig);
 
 
 /*
- * 
+ * Reset the local transformations of all joints to the rest-pose.
+ *
+ * @rig: Pointer to the rig
  */
 extern void rig_prepare(struct model_rig *rig);
 
 
 /*
- * 
+ * Start playing an animation on a layer. The layer starts at the beginning of
+ * the animation with normal speed and looping.
+ *
+ * @rig: Pointer to the rig
+ * @lay: The index of the layer
+ * @anim: The index of the animation or -1 to disable the layer
+ * @mode: The blend-mode of the layer
+ * @weight: The weight of the layer
+ *
+ * Returns: 0 on success or -1 if an error occurred
  */
-extern void rig_update(struct model_rig *rig);
+extern int rig_play(struct model_rig *rig, short lay, short anim, char mode,
+		float weight);
 
 
 /*
- * Update the rig according to the current animation.
+ * Advance all layers by the given time and write the resulting pose to the
+ * local transformations of the joints. The times and weights of the layers
+ * are quantized, and if another rig of the same model has already been
+ * calculated with the same state, the rig shares the joint-matrices with it
+ * and the animation is not sampled again.
  *
  * @rig: Pointer to the rig to update
+ * @dt: The passed time in milliseconds
+ */
+extern void rig_update(struct model_rig *rig, float dt);
+
+
+/*
+ * Set the time of the aim-layer according to the pitch.
+ *
+ * @rig: Pointer to the rig
+ * @pitch: The pitch in degrees, positive values for looking up
+ */
+extern void rig_set_aim(struct model_rig *rig, float pitch);
+
+
+/*
+ * Set the time of the aim-layer, so the rig will look at the given point.
+ *
+ * @rig: Pointer to the rig
  * @viewp: The position to look at relative to the model
  */
 extern void rig_update_aim(struct model_rig *rig, vec3_t viewp);
@@ -89,23 +299,86 @@ extern void rig_mult_mat(struct model_rig *rig, mat4_t m);
 
 
 /*
- * 
+ * Calculate the joint- and hook-matrices from the local transformations. If
+ * the rig shares a pose, which has already been calculated, only the hooks are
+ * updated.
+ *
+ * @rig: Pointer to the rig
  */
 extern void rig_finish(struct model_rig *rig);
 
 
 /*
- * Update the rotation of the hook, so the forward-vector will point to the
- * specified position in model-space, and use inverse-kinematics to move the
- * joints accordingly.
+ * Set the LOD of the rig for the current frame and check if the animation has
+ * to be sampled. The time passed since the last sample is accumulated in
+ * lod_dt and should be used to update the rig.
+ *
+ * @rig: Pointer to the rig
+ * @lod: The LOD for this frame
+ * @dt: The time passed since the last frame in milliseconds
+ *
+ * Returns: 1 if the animation has to be sampled or 0 if not
+ */
+extern int rig_lod_check(struct model_rig *rig, char lod, float dt);
+
+
+/*
+ * Store the joint-matrices of a new sample and reset the LOD-counters. This
+ * has to be called after rig_finish() every time the animation is sampled.
+ *
+ * @rig: Pointer to the rig
+ */
+extern void rig_lod_store(struct model_rig *rig);
+
+
+/*
+ * Interpolate the joint-matrices between the last two samples according to
+ * the number of frames since the last sample. The hooks are not interpolated
+ * and keep the state of the last sample.
+ *
+ * @rig: Pointer to the rig
+ */
+extern void rig_lod_interp(struct model_rig *rig);
+
+
+/*
+ * Setup an IK-chain by walking up the joint-hierarchy from the last joint.
+ * The weights, the number of iterations and the tolerance are set to the
+ * defaults and can be adjusted afterwards.
  *
- * @rig: Pointer to a rig containing the hooks and joints
- * @hk: The index of the hook
- * @pos: The position to point the forward-vector to
+ * @ik: Pointer to the chain to setup
+ * @slot: The slot of the model
+ * @type: The solver to use
+ * @tip: The index of the last joint of the chain
+ * @num: The number of joints in the chain, has to be 3 for the two-bone solver
+ * @hook: The index of a hook attached to the last joint, which is moved to the
+ *        target instead of the joint, or -1. Required by the aim-solver.
  *
  * Returns: 0 on success or -1 if an error occurred
  */
-extern int rig_hk_lookat(struct model_rig *rig, short hk, vec3_t pos);
+extern int rig_ik_init(struct rig_ik_chain *ik, short slot, char type,
+		short tip, short num, short hook);
+
+
+/*
+ * Move the end of the chain to the target, or for the aim-solver point the
+ * hook at the target. Only the rotations of the joints in the chain are
+ * changed and limited to the joint-limits of the model. All joints and hooks
+ * attached to the chain move with it. This has to be called after rig_finish()
+ * and before rig_lod_store(). No memory is allocated and the number of
+ * iterations is limited by the chain.
+ *
+ * @rig: Pointer to the rig
+ * @ik: Pointer to the chain
+ * @trg: The target-position in model-space
+ * @pole: A position in model-space the middle joint of the two-bone solver
+ *        should bend towards, or NULL to keep the current bend-direction
+ *
+ * Returns: 1 if the target has been reached within the tolerance, 0 if not or
+ *          -1 if an error occurred
+ */
+extern int rig_ik_solve(struct model_rig *rig, struct rig_ik_chain *ik,
+		vec3_t trg, vec3_t pole);
 
 
 #endif
@@ -31,9 +31,11 @@ typedef TTF_Font font_t;
 /*
  * Initialize the SDL-framework and it's submodules.
  *
+ * @headless: 1 to only initialize the submodules, which don't need a display
+ *
  * Returns: 0 on success or -1 if an error occurred
  */
-extern int sdl_init(void);
+extern int sdl_init(char headless);
 
 
 /*
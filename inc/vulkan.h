@@ -20,19 +20,51 @@ struct vk_pipeline {
 	VkPipeline pipeline;
 };
 
+/*
+ * A range of device-memory carved from one of the memory-blocks. An
+ * allocation with a size of 0 is empty and can be freed safely.
+ */
+struct vk_alloc {
+	short block;
+	VkDeviceSize off;
+	VkDeviceSize size;
+};
+
+/*
+ * The usage-statistics of the memory-blocks.
+ */
+struct vk_mem_stats {
+	uint32_t     block_num;      /* The number of memory-blocks          */
+	uint32_t     alloc_num;      /* The number of allocations in them    */
+	uint32_t     dev_alloc_max;  /* The max. number of memory-blocks     */
+	VkDeviceSize dev_size;       /* The size of the device-local blocks  */
+	VkDeviceSize dev_used;       /* The used device-local memory         */
+	VkDeviceSize host_size;      /* The size of the blocks in host-mem.  */
+	VkDeviceSize host_used;      /* The used host-memory                 */
+	uint32_t     upload_submits; /* The number of upload-batches         */
+	VkDeviceSize upload_bytes;   /* The bytes staged for uploads         */
+};
+
+/*
+ * The upload-batch last writing to a buffer or texture is kept, so they only
+ * have to wait for the upload-queue when they are destroyed while their
+ * batch is still recorded or pending.
+ */
 struct vk_buffer {
 	VkBuffer buffer;
-	VkDeviceMemory memory;
+	struct vk_alloc alloc;
 	VkDeviceSize size;
 	uint8_t *data;
+	uint32_t upload;
 };
 
 struct vk_texture {
 	VkImage image;
-	VkDeviceMemory memory;
+	struct vk_alloc alloc;
 	VkImageView image_view;
 	VkSampler sampler;
 	uint32_t mip_levels;
+	uint32_t upload;
 };
 
 
@@ -52,6 +84,14 @@ extern int vk_init(SDL_Window* window);
 extern void vk_destroy(void);
 
 
+/*
+ * Submit the pending uploads and wait until the device is idle, so no frame
+ * in flight still uses a resource. Has to be called before destroying
+ * buffers, textures or pipelines that may have been used for rendering.
+ */
+extern void vk_wait_idle(void);
+
+
 /*
  * Resize the vulkan render area to the current size of the window.
  * 
@@ -121,6 +161,40 @@ extern int vk_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
                             char staging, struct vk_buffer *buffer);
 
 
+/*
+ * Upload data to a buffer created without staging. The copy is recorded to
+ * the current batch of the upload-queue, which is submitted with
+ * vk_upload_flush() or before the next frame. The amount of data is the
+ * size of the buffer.
+ * 
+ * @buffer: Pointer to the buffer to upload to
+ * @data: The data, which will be copied to the staging-memory
+ * 
+ * Returns: 0 on success or -1 if an error occured
+ */
+extern int vk_upload_buffer(struct vk_buffer *buffer, void *data);
+
+
+/*
+ * Submit all uploads recorded in the current batch at once.
+ * 
+ * @wait: 1 to wait until the uploads have been completed, 0 to return right
+ *        after submitting them
+ * 
+ * Returns: 0 on success or -1 if an error occured
+ */
+extern int vk_upload_flush(char wait);
+
+
+/*
+ * Get the usage-statistics of the memory-blocks all buffers and textures are
+ * allocated from.
+ * 
+ * @stats: The struct to write the statistics to
+ */
+extern void vk_get_mem_stats(struct vk_mem_stats *stats);
+
+
 /*
  * Copy data to a buffer created with staging enabled.
  * The amount of data is the size of the buffer.
@@ -140,7 +214,20 @@ extern void vk_destroy_buffer(struct vk_buffer buffer);
 
 
 /*
- * Create a new texture.
+ * Get the palette-ring, a mapped uniform buffer of size REN_PALETTE_BUF, which
+ * is bound to all descriptor sets. The joint-palettes are written directly to
+ * the returned memory.
+ * 
+ * @align: A pointer to write the required alignment of the offsets to or NULL
+ * 
+ * Returns: The mapped memory of the palette-ring
+ */
+extern uint8_t *vk_get_palette(uint32_t *align);
+
+
+/*
+ * Create a new texture. The upload of the pixels and the generation of the
+ * mipmaps are recorded to the current batch of the upload-queue.
  * 
  * @pth: The path to the png of the texture
  * @texture: A pointer to the texture, which will be filled by the function
@@ -159,7 +246,8 @@ extern void vk_destroy_texture(struct vk_texture texture);
 
 
 /*
- * Create a skybox texture.
+ * Create a skybox texture. Like vk_create_texture(), the upload is recorded
+ * to the current batch of the upload-queue.
  *
  * @pths: Six paths to the skybox pngs
  * @skybox: A pointer to the skybox texture, which will be filled by the
@@ -170,18 +258,6 @@ extern void vk_destroy_texture(struct vk_texture texture);
 extern int vk_create_skybox(char *pths[6], struct vk_texture *skybox);
 
 
-/*
- * Tell the pipeline to use this uniform buffer.
- * Doesn't have to be between start_render() and end_render().
- * 
- * @buffer: The uniform buffer with usage VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
- * @set: The constant data for the model
- * 
- * Returns: 0 on success or -1 if an error occured
- */
-extern int vk_set_uniform_buffer(struct vk_buffer buffer, VkDescriptorSet set);
-
-
 /*
  * Tell the pipeline to use this texture.
  * Doesn't have to be between start_render() and end_render().
@@ -195,11 +271,15 @@ extern int vk_set_texture(struct vk_texture texture, VkDescriptorSet set);
 
 
 /*
- * Start rendering.
+ * Start rendering a frame. Up to REN_PALETTE_FRAMES frames are rendered at
+ * once, so this only waits until the GPU has finished the last frame with the
+ * same index.
+ * 
+ * @frm: The index of the frame, the same as the region of the palette-ring
  * 
  * Returns: 0 on success or -1 if an error occured
  */
-extern int vk_render_start(void);
+extern int vk_render_start(int frm);
 
 
 /*
@@ -217,9 +297,13 @@ extern void vk_render_set_pipeline(struct vk_pipeline pipeline);
  * 
  * @pipeline: The pipeline the model uses
  * @set: The descriptor set
+ * @uni_off: The offset of the uniform data in the palette-ring
+ * @pal_off: The offset of the joint-palette in the palette-ring
+ * @inst_off: The offset of the instances in the palette-ring
  */
 extern void vk_render_set_constant_data(struct vk_pipeline pipeline,
-                                        VkDescriptorSet set);
+                                        VkDescriptorSet set, uint32_t uni_off,
+                                        uint32_t pal_off, uint32_t inst_off);
 
 
 /*
@@ -249,12 +333,14 @@ extern void vk_render_set_index_buffer(struct vk_buffer buffer);
  * Has to be in between start_render() and end_render().
  * 
  * @index_count: The amount of indices (not triangles)
+ * @inst_num: The number of instances
  */
-extern void vk_render_draw(uint32_t index_count);
+extern void vk_render_draw(uint32_t index_count, uint32_t inst_num);
 
 
 /*
- * End rendering and display the result on the screen.
+ * End rendering and display the result on the screen. The frame is submitted
+ * without waiting for the GPU to finish it.
  * 
  * Returns: 0 on success or -1 if an error occured
  */
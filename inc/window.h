@@ -46,7 +46,14 @@ struct win_wrapper {
 extern struct win_wrapper g_win;
 
 
-extern int win_init(void);
+/*
+ * Create the window and initialize the render-engine.
+ *
+ * @headless: 1 to use the null-renderer without creating a window
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+extern int win_init(char headless);
 extern void win_close(void);
 
 extern void win_update(void);
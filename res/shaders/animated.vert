@@ -7,10 +7,22 @@ layout(location=3) in ivec4 vtxJnt;
 layout(location=4) in vec4  vtxWgt;
 
 layout(binding=0) uniform UBO {
-	mat4 mpos;
-	mat4 mrot;
 	mat4 view;
 	mat4 proj;
+};
+
+/* The position- and rotation-matrix of every instance */
+layout(binding=3) uniform Instances {
+	mat4 inst[128];
+};
+
+#ifdef VULKAN
+#define INSTANCE gl_InstanceIndex
+#else
+#define INSTANCE gl_InstanceID
+#endif
+
+layout(binding=2) uniform Palette {
 	mat4 jnts[100];
 };
 
@@ -19,7 +31,8 @@ layout(location=1) out vec3 nrm;
 
 void main()
 {
-	vec4 rotnrm;
+	mat4 mpos = inst[2 * INSTANCE];
+	mat4 mrot = inst[2 * INSTANCE + 1];
 	vec4 totalLocPos = vec4(0.0);
 	vec4 totalNrm = vec4(0.0);
 
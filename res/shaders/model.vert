@@ -5,18 +5,29 @@ layout(location=1) in vec2 vtxTex;
 layout(location=2) in vec3 vtxNrm;
 
 layout(binding=0) uniform UBO {
-	mat4 mpos;
-	mat4 mrot;
 	mat4 view;
 	mat4 proj;
 };
 
+/* The position- and rotation-matrix of every instance */
+layout(binding=3) uniform Instances {
+	mat4 inst[128];
+};
+
+#ifdef VULKAN
+#define INSTANCE gl_InstanceIndex
+#else
+#define INSTANCE gl_InstanceID
+#endif
+
 layout(location=0)out vec2 uv;
 layout(location=1)out vec3 nrm;
 
 void main()
 {
 	vec4 rotnrm;
+	mat4 mpos = inst[2 * INSTANCE];
+	mat4 mrot = inst[2 * INSTANCE + 1];
 
 	gl_Position = proj * view * mpos * mrot * vec4(vtxPos, 1.0); 
 
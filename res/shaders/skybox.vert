@@ -3,8 +3,6 @@
 layout(location=0) in vec3 vtxPos;
 
 layout(binding=0) uniform UBO {
-	mat4 mpos;
-	mat4 mrot;
 	mat4 view;
 	mat4 proj;
 };
@@ -35,6 +35,8 @@ extern void ast_close(void)
 {
 	short i;
 
+	/* Wait for the frames still using the textures and shaders */
+	ren_wait_idle();
 
 	/* Close the font-table */
 	for(i = 0; i < TXT_FONT_SLOTS; i++) {
@@ -112,6 +114,9 @@ extern void shd_del(short slot)
 	if(g_ast.shd.mask[slot] == 0)
 		return;
 
+	/* Wait for the frames still using the shader */
+	ren_wait_idle();
+
 	ren_destroy_shader(g_ast.shd.prog[slot], g_ast.shd.pipeline[slot]);
 	g_ast.shd.mask[slot] = 0;
 }
@@ -218,6 +223,9 @@ extern void tex_del(short slot)
 	if(g_ast.tex.mask[slot] == 0)
 		return;
 
+	/* Wait for the frames still using the texture */
+	ren_wait_idle();
+
 	ren_destroy_texture(g_ast.tex.hdl[slot], g_ast.tex.tex[slot]);
 	g_ast.tex.mask[slot] = 0;
 }
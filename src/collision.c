@@ -4,7 +4,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
 #include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 
 extern int col_pln_fpnt(struct col_pln *pln, vec3_t p0, vec3_t p1, vec3_t p2)
@@ -443,6 +449,216 @@ extern void col_s2t_check(struct col_pck_sphere *pck, vec3_t p0, vec3_t p1, vec3
 }
 
 
+extern void col_blk_set(struct col_trig_blk *blk, int lane, vec3_t p0,
+		vec3_t p1, vec3_t p2)
+{
+	vec3_t del1;
+	vec3_t del2;
+	vec3_t nrm;
+	int k;
+
+	vec3_sub(p1, p0, del1);
+	vec3_sub(p2, p0, del2);
+	vec3_cross(del1, del2, nrm);
+
+	for(k = 0; k < 3; k++) {
+		blk->vtx[0][k][lane] = p0[k];
+		blk->vtx[1][k][lane] = p1[k];
+		blk->vtx[2][k][lane] = p2[k];
+
+		blk->nrm[k][lane] = nrm[k];
+	}
+}
+
+
+extern void col_blk_move(struct col_trig_blk *out, struct col_trig_blk *in,
+		int num, vec3_t off)
+{
+	int b;
+	int c;
+	int k;
+	int l;
+
+	for(b = 0; b < num; b++) {
+		for(c = 0; c < 3; c++) {
+			for(k = 0; k < 3; k++) {
+				for(l = 0; l < COL_BLK_NUM; l++) {
+					out[b].vtx[c][k][l] = off[k] +
+						in[b].vtx[c][k][l];
+				}
+			}
+		}
+
+		memcpy(out[b].nrm, in[b].nrm, sizeof(in[b].nrm));
+	}
+}
+
+
+#ifdef __SSE__
+/*
+ * Move the triangles of a block, convert them to eSpace and sort out the ones
+ * which can't collide with the sphere. To be on the safe side, a triangle is
+ * only sorted out if it's clearly outside the area covered by the sphere, the
+ * exact check is done by col_s2t_check().
+ *
+ * @pck: The collision-package containing data about the sphere
+ * @blk: The triangle-block
+ * @off: The offset of the triangles or NULL
+ * @out: The array to write the converted triangles to
+ *
+ * Returns: A mask with a bit set for every lane which has to be checked
+ */
+static int col_s2t_filter(struct col_pck_sphere *pck, struct col_trig_blk *blk,
+		vec3_t off, float out[3][3][COL_BLK_NUM])
+{
+	const float EPSILON = 0.001;
+
+	__m128 p[3][3];
+	__m128 n[3];
+	__m128 rej;
+	__m128 lo;
+	__m128 hi;
+	__m128 nn;
+	__m128 len;
+	__m128 lim;
+	__m128 nv;
+	__m128 d0;
+	__m128 d1;
+	__m128 zero = _mm_setzero_ps();
+	float tmp;
+	int c;
+	int k;
+
+	/* Move the corners and convert them to eSpace */
+	for(c = 0; c < 3; c++) {
+		for(k = 0; k < 3; k++) {
+			p[c][k] = _mm_loadu_ps(blk->vtx[c][k]);
+
+			if(off) {
+				p[c][k] = _mm_add_ps(_mm_set1_ps(off[k]),
+						p[c][k]);
+			}
+
+			p[c][k] = _mm_div_ps(p[c][k],
+					_mm_set1_ps(pck->eRadius[k]));
+
+			_mm_storeu_ps(out[c][k], p[c][k]);
+		}
+	}
+
+	/* Sort out triangles outside the box around the swept sphere */
+	rej = zero;
+	for(k = 0; k < 3; k++) {
+		tmp = pck->basePoint[k] + pck->velocity[k];
+		lo = _mm_set1_ps(MIN(pck->basePoint[k], tmp) - 1.0 - EPSILON);
+		hi = _mm_set1_ps(MAX(pck->basePoint[k], tmp) + 1.0 + EPSILON);
+
+		rej = _mm_or_ps(rej, _mm_cmplt_ps(_mm_max_ps(p[0][k],
+						_mm_max_ps(p[1][k], p[2][k])), lo));
+		rej = _mm_or_ps(rej, _mm_cmpgt_ps(_mm_min_ps(p[0][k],
+						_mm_min_ps(p[1][k], p[2][k])), hi));
+	}
+
+	/*
+	 * Convert the normals to eSpace. As the conversion scales the
+	 * coordinates by 1 / eRadius, the normals have to be scaled by eRadius.
+	 */
+	for(k = 0; k < 3; k++) {
+		n[k] = _mm_mul_ps(_mm_loadu_ps(blk->nrm[k]),
+				_mm_set1_ps(pck->eRadius[k]));
+	}
+
+	nn = zero;
+	nv = zero;
+	d0 = zero;
+	for(k = 0; k < 3; k++) {
+		nn = _mm_add_ps(nn, _mm_mul_ps(n[k], n[k]));
+		nv = _mm_add_ps(nv, _mm_mul_ps(n[k],
+					_mm_set1_ps(pck->velocity[k])));
+		d0 = _mm_add_ps(d0, _mm_mul_ps(n[k], _mm_sub_ps(
+						_mm_set1_ps(pck->basePoint[k]),
+						p[0][k])));
+	}
+
+	len = _mm_sqrt_ps(nn);
+	d1 = _mm_add_ps(d0, nv);
+
+	/* Sort out triangles facing away from the velocity */
+	tmp = vec3_len(pck->velocity) * EPSILON;
+	rej = _mm_or_ps(rej, _mm_cmpgt_ps(nv,
+				_mm_mul_ps(len, _mm_set1_ps(tmp))));
+
+	/*
+	 * Sort out triangles, if the sphere stays on the same side of the
+	 * plane and never gets close enough to touch it.
+	 */
+	lim = _mm_mul_ps(len, _mm_set1_ps(1.0 + EPSILON));
+	rej = _mm_or_ps(rej, _mm_and_ps(_mm_cmpgt_ps(d0, lim),
+				_mm_cmpgt_ps(d1, lim)));
+
+	lim = _mm_sub_ps(zero, lim);
+	rej = _mm_or_ps(rej, _mm_and_ps(_mm_cmplt_ps(d0, lim),
+				_mm_cmplt_ps(d1, lim)));
+
+	/* Always check degenerated triangles */
+	rej = _mm_and_ps(rej, _mm_cmpgt_ps(nn, _mm_set1_ps(0.0000001)));
+
+	return ~_mm_movemask_ps(rej) & 0xf;
+}
+#endif
+
+
+extern void col_s2t_check_batch(struct col_pck_sphere *pck,
+		struct col_trig_blk *blk, int num, vec3_t off)
+{
+	float cvt[3][3][COL_BLK_NUM];
+	vec3_t tri[3];
+	int keep;
+	int cnt;
+	int b;
+	int l;
+	int c;
+	int k;
+
+	for(b = 0; b * COL_BLK_NUM < num; b++) {
+		cnt = MIN(num - b * COL_BLK_NUM, COL_BLK_NUM);
+
+#ifdef __SSE__
+		keep = col_s2t_filter(pck, &blk[b], off, cvt);
+#else
+		/* Move the corners and convert them to eSpace */
+		for(c = 0; c < 3; c++) {
+			for(k = 0; k < 3; k++) {
+				for(l = 0; l < cnt; l++) {
+					cvt[c][k][l] = blk[b].vtx[c][k][l];
+
+					if(off)
+						cvt[c][k][l] += off[k];
+
+					cvt[c][k][l] /= pck->eRadius[k];
+				}
+			}
+		}
+
+		keep = (1 << COL_BLK_NUM) - 1;
+#endif
+
+		/* Run the exact check for the remaining triangles */
+		for(l = 0; l < cnt; l++) {
+			if((keep & (1 << l)) == 0)
+				continue;
+
+			for(c = 0; c < 3; c++) {
+				for(k = 0; k < 3; k++)
+					tri[c][k] = cvt[c][k][l];
+			}
+
+			col_s2t_check(pck, tri[0], tri[1], tri[2]);
+		}
+	}
+}
+
+
 extern void col_r2b_check(struct col_pck_ray *pck, vec3_t min, vec3_t max)
 {
 	vec3_t dirfrac;
@@ -542,3 +758,347 @@ extern void col_r2t_check(struct col_pck_ray *pck, vec3_t p0, vec3_t p1,
 		}
 	}
 }
+
+
+/*
+ * Reorder the triangles, so the triangle with the k-th smallest centroid
+ * along the given axis is at position k, with all smaller ones before and all
+ * greater ones after it.
+ */
+static void col_bvh_select(int *tri, vec3_t *cen, int axis, int num, int k)
+{
+	int lo = 0;
+	int hi = num - 1;
+	int i;
+	int j;
+	int swp;
+	float piv;
+
+	while(lo < hi) {
+		piv = cen[tri[lo + (hi - lo) / 2]][axis];
+		i = lo;
+		j = hi;
+
+		while(i <= j) {
+			while(cen[tri[i]][axis] < piv)
+				i++;
+
+			while(cen[tri[j]][axis] > piv)
+				j--;
+
+			if(i <= j) {
+				swp = tri[i];
+				tri[i] = tri[j];
+				tri[j] = swp;
+				i++;
+				j--;
+			}
+		}
+
+		if(k <= j)
+			hi = j;
+		else if(k >= i)
+			lo = i;
+		else
+			return;
+	}
+}
+
+
+/*
+ * Initialize a node with the given triangles and split it into two children
+ * at the median centroid along the longest axis, until the leaf-size is
+ * reached.
+ */
+static void col_bvh_split(struct col_bvh *bvh, vec3_t *cen, vec3_t *tmin,
+		vec3_t *tmax, int node, int start, int num, int depth)
+{
+	struct col_bvh_node *n = &bvh->node[node];
+	vec3_t cmin;
+	vec3_t cmax;
+	int axis;
+	int mid;
+	int i;
+	int k;
+	int t;
+
+	/* Calculate the bounding-box of the node and the centroids */
+	vec3_cpy(n->min, tmin[bvh->tri[start]]);
+	vec3_cpy(n->max, tmax[bvh->tri[start]]);
+	vec3_cpy(cmin, cen[bvh->tri[start]]);
+	vec3_cpy(cmax, cen[bvh->tri[start]]);
+
+	for(i = start + 1; i < start + num; i++) {
+		t = bvh->tri[i];
+
+		for(k = 0; k < 3; k++) {
+			n->min[k] = MIN(n->min[k], tmin[t][k]);
+			n->max[k] = MAX(n->max[k], tmax[t][k]);
+			cmin[k] = MIN(cmin[k], cen[t][k]);
+			cmax[k] = MAX(cmax[k], cen[t][k]);
+		}
+	}
+
+	/* Get the axis with the largest spread of centroids */
+	axis = 0;
+	for(k = 1; k < 3; k++) {
+		if(cmax[k] - cmin[k] > cmax[axis] - cmin[axis])
+			axis = k;
+	}
+
+	/* Create a leaf if the node can't or shouldn't be split further */
+	if(num <= COL_BVH_LEAF || depth >= COL_BVH_DEPTH - 1 ||
+			cmax[axis] - cmin[axis] <= 0.0) {
+		n->idx = start;
+		n->num = num;
+		return;
+	}
+
+	mid = num / 2;
+	col_bvh_select(bvh->tri + start, cen, axis, num, mid);
+
+	n->idx = bvh->node_num;
+	n->num = 0;
+	bvh->node_num += 2;
+
+	col_bvh_split(bvh, cen, tmin, tmax, n->idx, start, mid, depth + 1);
+	col_bvh_split(bvh, cen, tmin, tmax, bvh->node[node].idx + 1,
+			start + mid, num - mid, depth + 1);
+}
+
+
+extern int col_bvh_build(struct col_bvh *bvh, vec3_t *vtx, int3_t *idx,
+		int num)
+{
+	vec3_t *cen = NULL;
+	vec3_t *tmin = NULL;
+	vec3_t *tmax = NULL;
+	int i;
+	int k;
+
+	bvh->node_num = 0;
+	bvh->node = NULL;
+	bvh->tri = NULL;
+	bvh->blk_num = 0;
+	bvh->blk = NULL;
+
+	if(num <= 0)
+		return 0;
+
+	/* A binary tree with <num> leaves has atmost 2 * <num> - 1 nodes */
+	if(!(bvh->node = malloc((2 * num - 1) * sizeof(struct col_bvh_node))))
+		goto err_free;
+
+	if(!(bvh->tri = malloc(num * sizeof(int))))
+		goto err_free;
+
+	if(!(cen = malloc(num * VEC3_SIZE)))
+		goto err_free;
+
+	if(!(tmin = malloc(num * VEC3_SIZE)))
+		goto err_free;
+
+	if(!(tmax = malloc(num * VEC3_SIZE)))
+		goto err_free;
+
+	/* Calculate the bounding-boxes and centroids of the triangles */
+	for(i = 0; i < num; i++) {
+		bvh->tri[i] = i;
+
+		for(k = 0; k < 3; k++) {
+			tmin[i][k] = MIN(vtx[idx[i][0]][k],
+					MIN(vtx[idx[i][1]][k], vtx[idx[i][2]][k]));
+			tmax[i][k] = MAX(vtx[idx[i][0]][k],
+					MAX(vtx[idx[i][1]][k], vtx[idx[i][2]][k]));
+
+			cen[i][k] = (tmin[i][k] + tmax[i][k]) * 0.5;
+		}
+	}
+
+	bvh->node_num = 1;
+	col_bvh_split(bvh, cen, tmin, tmax, 0, 0, num, 0);
+
+	/* Assign the triangle-blocks to the leaves */
+	for(i = 0; i < bvh->node_num; i++) {
+		if(bvh->node[i].num == 0)
+			continue;
+
+		bvh->node[i].blk = bvh->blk_num;
+		bvh->blk_num += (bvh->node[i].num + COL_BLK_NUM - 1) /
+			COL_BLK_NUM;
+	}
+
+	/* Unused lanes are zeroed */
+	if(!(bvh->blk = calloc(bvh->blk_num, sizeof(struct col_trig_blk))))
+		goto err_free;
+
+	/* Pack the triangles of each leaf into the blocks */
+	for(i = 0; i < bvh->node_num; i++) {
+		struct col_bvh_node *n = &bvh->node[i];
+
+		for(k = 0; k < n->num; k++) {
+			int3_t *t = &idx[bvh->tri[n->idx + k]];
+
+			col_blk_set(&bvh->blk[n->blk + k / COL_BLK_NUM],
+					k % COL_BLK_NUM, vtx[(*t)[0]],
+					vtx[(*t)[1]], vtx[(*t)[2]]);
+		}
+	}
+
+	free(cen);
+	free(tmin);
+	free(tmax);
+	return 0;
+
+err_free:
+	free(cen);
+	free(tmin);
+	free(tmax);
+	col_bvh_free(bvh);
+	return -1;
+}
+
+
+extern void col_bvh_free(struct col_bvh *bvh)
+{
+	free(bvh->node);
+	free(bvh->tri);
+	free(bvh->blk);
+
+	bvh->node_num = 0;
+	bvh->node = NULL;
+	bvh->tri = NULL;
+	bvh->blk_num = 0;
+	bvh->blk = NULL;
+}
+
+
+extern void col_bvh_s2t_check(struct col_pck_sphere *pck, struct col_bvh *bvh,
+		struct col_trig_blk *blk, vec3_t off, vec3_t min, vec3_t max)
+{
+	int stack[COL_BVH_DEPTH + 1];
+	int sp = 0;
+	struct col_bvh_node *n;
+
+	if(bvh->node_num == 0)
+		return;
+
+	/* Use the blocks of the hierarchy if no moved copy is given */
+	if(!blk)
+		blk = bvh->blk;
+
+	stack[sp++] = 0;
+
+	while(sp > 0) {
+		n = &bvh->node[stack[--sp]];
+
+		if(!col_b2b_check(min, max, n->min, n->max))
+			continue;
+
+		/* Visit both children of inner nodes */
+		if(n->num == 0) {
+			stack[sp++] = n->idx;
+			stack[sp++] = n->idx + 1;
+			continue;
+		}
+
+		/* Check all triangles of the leaf */
+		col_s2t_check_batch(pck, &blk[n->blk], n->num, off);
+	}
+}
+
+
+/*
+ * Check if a ray enters a box before the given distance. Components of the
+ * direction close to zero are handled separately, to avoid divisions by zero.
+ *
+ * Returns: 1 if the ray hits the box and 0 if not
+ */
+static int col_bvh_r2b(vec3_t pos, vec3_t dir, float lim, vec3_t min,
+		vec3_t max)
+{
+	const float EPSILON = 0.0001;
+
+	float t0 = 0.0;
+	float t1 = lim;
+	float tn;
+	float tf;
+	float swp;
+	int k;
+
+	for(k = 0; k < 3; k++) {
+		if(ABS(dir[k]) < 0.0000001) {
+			if(pos[k] < min[k] - EPSILON || pos[k] > max[k] + EPSILON)
+				return 0;
+
+			continue;
+		}
+
+		tn = (min[k] - EPSILON - pos[k]) / dir[k];
+		tf = (max[k] + EPSILON - pos[k]) / dir[k];
+
+		if(tn > tf) {
+			swp = tn;
+			tn = tf;
+			tf = swp;
+		}
+
+		t0 = MAX(t0, tn);
+		t1 = MIN(t1, tf);
+
+		if(t0 > t1)
+			return 0;
+	}
+
+	return 1;
+}
+
+
+extern void col_bvh_r2t_check(struct col_pck_ray *pck, struct col_bvh *bvh,
+		vec3_t *vtx, int3_t *idx, vec3_t off)
+{
+	int stack[COL_BVH_DEPTH + 1];
+	int sp = 0;
+	struct col_bvh_node *n;
+	vec3_t pos;
+	float lim;
+	int i;
+	int k;
+
+	if(bvh->node_num == 0)
+		return;
+
+	/* Convert the origin of the ray to the space of the mesh */
+	vec3_sub(pck->pos, off, pos);
+
+	stack[sp++] = 0;
+
+	while(sp > 0) {
+		n = &bvh->node[stack[--sp]];
+
+		/* Skip nodes behind the closest intersection */
+		lim = pck->found ? pck->col_t : FLT_MAX;
+
+		if(!col_bvh_r2b(pos, pck->dir, lim, n->min, n->max))
+			continue;
+
+		/* Visit both children of inner nodes */
+		if(n->num == 0) {
+			stack[sp++] = n->idx;
+			stack[sp++] = n->idx + 1;
+			continue;
+		}
+
+		/* Check all triangles of the leaf */
+		for(i = n->idx; i < n->idx + n->num; i++) {
+			vec3_t tri[3];
+			int t = bvh->tri[i];
+
+			/* Move the vertices relative to the offset */
+			for(k = 0; k < 3; k++)
+				vec3_add(off, vtx[idx[t][k]], tri[k]);
+
+			col_r2t_check(pck, tri[0], tri[1], tri[2]);
+		}
+	}
+}
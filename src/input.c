@@ -25,6 +25,7 @@ extern int inp_init(void)
 	vec3_clr(g_inp.dir_old);
 
 	/* Reset the log */
+	g_inp.log.num = 0;
 	g_inp.log.start = 0;
 	g_inp.log.latest_slot = -1;
 	g_inp.log.latest_ts = 0;
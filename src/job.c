@@ -0,0 +1,179 @@
+#include "job.h"
+
+#include "error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/* Redefine the global job-wrapper */
+struct job_wrapper g_job;
+
+
+/*
+ * Process jobs of the current batch until none are left.
+ */
+static void job_process(job_fn fnc, int num, void *data, int thrd)
+{
+	int i;
+
+	while((i = SDL_AtomicAdd(&g_job.next, 1)) < num)
+		fnc(i, thrd, data);
+}
+
+
+static int job_worker(void *ptr)
+{
+	int thrd = (int)(long)ptr;
+	uint32_t gen = 0;
+
+	job_fn fnc;
+	void *data;
+	int num;
+
+	SDL_LockMutex(g_job.mtx);
+
+	while(1) {
+		/* Wait for a new batch */
+		while(g_job.running && g_job.gen == gen)
+			SDL_CondWait(g_job.start, g_job.mtx);
+
+		if(!g_job.running)
+			break;
+
+		gen = g_job.gen;
+		fnc = g_job.fnc;
+		data = g_job.data;
+		num = g_job.num;
+
+		SDL_UnlockMutex(g_job.mtx);
+
+		job_process(fnc, num, data, thrd);
+
+		SDL_LockMutex(g_job.mtx);
+
+		/* The last worker to finish wakes up the calling thread */
+		g_job.active--;
+		if(g_job.active == 0)
+			SDL_CondSignal(g_job.done);
+	}
+
+	SDL_UnlockMutex(g_job.mtx);
+	return 0;
+}
+
+
+extern int job_init(int thrd_num)
+{
+	int i;
+
+	g_job.thrd_num = 0;
+	g_job.fnc = NULL;
+	g_job.data = NULL;
+	g_job.num = 0;
+	g_job.active = 0;
+	g_job.gen = 0;
+	g_job.running = 1;
+	SDL_AtomicSet(&g_job.next, 0);
+
+	if(thrd_num < 0)
+		thrd_num = SDL_GetCPUCount() - 1;
+
+	if(thrd_num > JOB_THREAD_MAX)
+		thrd_num = JOB_THREAD_MAX;
+
+	if(!(g_job.mtx = SDL_CreateMutex())) {
+		ERR_LOG(("Failed to create mutex"));
+		return -1;
+	}
+
+	if(!(g_job.start = SDL_CreateCond())) {
+		ERR_LOG(("Failed to create condition"));
+		goto err_destroy_mtx;
+	}
+
+	if(!(g_job.done = SDL_CreateCond())) {
+		ERR_LOG(("Failed to create condition"));
+		goto err_destroy_start;
+	}
+
+	/* Start the worker-threads, the calling thread has the index 0 */
+	for(i = 0; i < thrd_num; i++) {
+		g_job.thrd[i] = SDL_CreateThread(job_worker, "job",
+				(void *)(long)(i + 1));
+
+		if(!g_job.thrd[i]) {
+			ERR_LOG(("Failed to create thread"));
+			job_close();
+			return -1;
+		}
+
+		g_job.thrd_num++;
+	}
+
+	return 0;
+
+err_destroy_start:
+	SDL_DestroyCond(g_job.start);
+
+err_destroy_mtx:
+	SDL_DestroyMutex(g_job.mtx);
+	return -1;
+}
+
+
+extern void job_close(void)
+{
+	int i;
+
+	/* Wake up all workers and wait for them to exit */
+	SDL_LockMutex(g_job.mtx);
+	g_job.running = 0;
+	SDL_CondBroadcast(g_job.start);
+	SDL_UnlockMutex(g_job.mtx);
+
+	for(i = 0; i < g_job.thrd_num; i++)
+		SDL_WaitThread(g_job.thrd[i], NULL);
+
+	g_job.thrd_num = 0;
+
+	SDL_DestroyCond(g_job.done);
+	SDL_DestroyCond(g_job.start);
+	SDL_DestroyMutex(g_job.mtx);
+}
+
+
+extern void job_run(job_fn fnc, int num, void *data)
+{
+	int i;
+
+	/* Small batches are not worth waking up the workers */
+	if(g_job.thrd_num == 0 || num < JOB_MIN_NUM) {
+		for(i = 0; i < num; i++)
+			fnc(i, 0, data);
+
+		return;
+	}
+
+	SDL_LockMutex(g_job.mtx);
+
+	g_job.fnc = fnc;
+	g_job.data = data;
+	g_job.num = num;
+	g_job.active = g_job.thrd_num;
+	g_job.gen++;
+	SDL_AtomicSet(&g_job.next, 0);
+
+	SDL_CondBroadcast(g_job.start);
+	SDL_UnlockMutex(g_job.mtx);
+
+	/* Take part in processing the batch */
+	job_process(fnc, num, data, 0);
+
+	/* Wait for the workers to finish */
+	SDL_LockMutex(g_job.mtx);
+	while(g_job.active > 0)
+		SDL_CondWait(g_job.done, g_job.mtx);
+
+	SDL_UnlockMutex(g_job.mtx);
+}
@@ -3,6 +3,7 @@
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 
 #include "error.h"
 #include "filesystem.h"
@@ -10,8 +11,25 @@
 #include "setup.h"
 
 
-int main(void)
+int main(int argc, char **argv)
 {
+	int i;
+	char headless = 0;
+	long frames = 0;
+	uint32_t start_ts;
+
+	/*
+	 * Parse the options. With --headless the game runs on the null-renderer
+	 * without a window, and with --frames it stops after the given number of
+	 * frames and prints the render-counters, for profiling and benchmarks.
+	 */
+	for(i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--headless") == 0)
+			headless = 1;
+		else if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			frames = atol(argv[++i]);
+	}
+
 	/* Set seed */
 	srand(time(0));
 
@@ -24,7 +42,7 @@ int main(void)
 	net_print_info();
 
 	/* Initialize the sdl-subsystem */
-	if(sdl_init() < 0) {
+	if(sdl_init(headless) < 0) {
 		ERR_LOG(("Failed to initialize SDL-subsystem"));
 		goto err_close_net;
 	}
@@ -33,7 +51,7 @@ int main(void)
 	sdl_print_info();
 
 	/* Initialize the window and opengl-context */
-	if(win_init() < 0) {
+	if(win_init(headless) < 0) {
 		ERR_LOG(("Failed to setup window"));
 		goto err_close_mdl;
 	}
@@ -77,10 +95,16 @@ int main(void)
 		goto err_close_camera;
 	}
 
+	/* Start the worker-threads of the job-system */
+	if(job_init(-1) < 0) {
+		ERR_LOG(("Failed to initialize the job-system"));
+		goto err_close_world;
+	}
+
 	/* Initialize the object-table */
 	if(obj_init() < 0) {
 		ERR_LOG(("Failed to initialize the object-table"));
-		goto err_close_world;
+		goto err_close_job;
 	}
 
 	/* Load the user-interface-nodes */
@@ -100,17 +124,32 @@ int main(void)
 	 */
 	net_insert("unrealguthrie\0", "CAT12345\0", &test1, &test2);
 
+	start_ts = SDL_GetTicks();
+	ren_reset_stats();
+
 	while(g_core.running) {
 		core_proc_evt();
 		
 		core_update();
 		
 		core_render();
+
+		if(frames > 0 && (long)g_ren.stats.frames >= frames)
+			g_core.running = 0;
+	}
+
+	if(frames > 0 || headless) {
+		printf("Ran %u frames in %u ms\n", g_ren.stats.frames,
+				SDL_GetTicks() - start_ts);
+		ren_print_stats();
 	}
 
 err_close_obj:
 	obj_close();
 
+err_close_job:
+	job_close();
+
 err_close_world:
 	wld_close();
 
@@ -5,6 +5,32 @@
 #include <string.h>
 #include <math.h>
 
+#ifdef __SSE__
+#include <xmmintrin.h>
+
+/*
+ * Build a shuffle-mask picking the lanes x, y from the first and z, w from the
+ * second vector.
+ */
+#define MAT4_SHUF(x, y, z, w) _MM_SHUFFLE(w, z, y, x)
+#define MAT4_SWZ(v, x, y, z, w) _mm_shuffle_ps(v, v, MAT4_SHUF(x, y, z, w))
+
+/* Multiply two 2x2-matrices stored as (a, b, c, d) */
+#define MAT2_MUL(a, b) _mm_add_ps( \
+		_mm_mul_ps(a, MAT4_SWZ(b, 0, 3, 0, 3)), \
+		_mm_mul_ps(MAT4_SWZ(a, 1, 0, 3, 2), MAT4_SWZ(b, 2, 1, 2, 1)))
+
+/* Multiply the adjugate of the first 2x2-matrix with the second one */
+#define MAT2_ADJ_MUL(a, b) _mm_sub_ps( \
+		_mm_mul_ps(MAT4_SWZ(a, 3, 3, 0, 0), b), \
+		_mm_mul_ps(MAT4_SWZ(a, 1, 1, 2, 2), MAT4_SWZ(b, 2, 3, 0, 1)))
+
+/* Multiply the first 2x2-matrix with the adjugate of the second one */
+#define MAT2_MUL_ADJ(a, b) _mm_sub_ps( \
+		_mm_mul_ps(a, MAT4_SWZ(b, 3, 0, 3, 0)), \
+		_mm_mul_ps(MAT4_SWZ(a, 1, 0, 3, 2), MAT4_SWZ(b, 2, 1, 2, 1)))
+#endif
+
 extern void mat3_zero(mat3_t m) 
 {
 	memset(m, 0, MAT3_SIZE);
@@ -80,6 +106,34 @@ extern void mat4_cpy(mat4_t out, mat4_t in)
 
 extern void mat4_mult(mat4_t m1, mat4_t m2, mat4_t out)
 {
+#ifdef __SSE__
+	__m128 c0, c1, c2, c3;
+	__m128 r[4];
+	float *col;
+	int j;
+
+	c0 = _mm_loadu_ps(m1 + 0x0);
+	c1 = _mm_loadu_ps(m1 + 0x4);
+	c2 = _mm_loadu_ps(m1 + 0x8);
+	c3 = _mm_loadu_ps(m1 + 0xc);
+
+	/*
+	 * Every column of the result is a combination of the columns of the
+	 * first matrix. The sums are built in the same order as in the scalar
+	 * version, so both return the same result.
+	 */
+	for(j = 0; j < 4; j++) {
+		col = m2 + j * 4;
+
+		r[j] = _mm_mul_ps(c0, _mm_set1_ps(col[0]));
+		r[j] = _mm_add_ps(r[j], _mm_mul_ps(c1, _mm_set1_ps(col[1])));
+		r[j] = _mm_add_ps(r[j], _mm_mul_ps(c2, _mm_set1_ps(col[2])));
+		r[j] = _mm_add_ps(r[j], _mm_mul_ps(c3, _mm_set1_ps(col[3])));
+	}
+
+	for(j = 0; j < 4; j++)
+		_mm_storeu_ps(out + j * 4, r[j]);
+#else
 	int i, j, k;
 	float a, b;
 	mat4_t conv;
@@ -97,10 +151,116 @@ extern void mat4_mult(mat4_t m1, mat4_t m2, mat4_t out)
 	}
 
 	mat4_cpy(out, conv);
+#endif
+}
+
+extern void mat4_mult_batch(mat4_t m, mat4_t *in, mat4_t *out, int num)
+{
+#ifdef __SSE__
+	__m128 c0, c1, c2, c3;
+	__m128 r;
+	float *col;
+	int i;
+	int j;
+
+	/* Keep the columns of the shared matrix in registers */
+	c0 = _mm_loadu_ps(m + 0x0);
+	c1 = _mm_loadu_ps(m + 0x4);
+	c2 = _mm_loadu_ps(m + 0x8);
+	c3 = _mm_loadu_ps(m + 0xc);
+
+	for(i = 0; i < num; i++) {
+		/*
+		 * Each column of the result only depends on the same column of
+		 * the input, so the input can be overwritten directly.
+		 */
+		for(j = 0; j < 4; j++) {
+			col = in[i] + j * 4;
+
+			r = _mm_mul_ps(c0, _mm_set1_ps(col[0]));
+			r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(col[1])));
+			r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(col[2])));
+			r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_set1_ps(col[3])));
+
+			_mm_storeu_ps(out[i] + j * 4, r);
+		}
+	}
+#else
+	int i;
+
+	for(i = 0; i < num; i++)
+		mat4_mult(m, in[i], out[i]);
+#endif
 }
 
 extern void mat4_inv(mat4_t out, mat4_t in)
 {
+#ifdef __SSE__
+	__m128 v0, v1, v2, v3;
+	__m128 a, b, c, d;
+	__m128 det_sub, det_a, det_b, det_c, det_d, det;
+	__m128 a_b, d_c;
+	__m128 x, y, z, w;
+	__m128 tr;
+
+	/*
+	 * Invert the matrix blockwise using 2x2-submatrices. The inverse of
+	 * the transposed matrix is the transposed inverse, so it doesn't
+	 * matter that the columns are treated as rows.
+	 */
+	v0 = _mm_loadu_ps(in + 0x0);
+	v1 = _mm_loadu_ps(in + 0x4);
+	v2 = _mm_loadu_ps(in + 0x8);
+	v3 = _mm_loadu_ps(in + 0xc);
+
+	a = _mm_movelh_ps(v0, v1);
+	b = _mm_movehl_ps(v1, v0);
+	c = _mm_movelh_ps(v2, v3);
+	d = _mm_movehl_ps(v3, v2);
+
+	/* The determinants of the submatrices */
+	det_sub = _mm_sub_ps(
+			_mm_mul_ps(_mm_shuffle_ps(v0, v2, MAT4_SHUF(0, 2, 0, 2)),
+				_mm_shuffle_ps(v1, v3, MAT4_SHUF(1, 3, 1, 3))),
+			_mm_mul_ps(_mm_shuffle_ps(v0, v2, MAT4_SHUF(1, 3, 1, 3)),
+				_mm_shuffle_ps(v1, v3, MAT4_SHUF(0, 2, 0, 2))));
+
+	det_a = MAT4_SWZ(det_sub, 0, 0, 0, 0);
+	det_b = MAT4_SWZ(det_sub, 1, 1, 1, 1);
+	det_c = MAT4_SWZ(det_sub, 2, 2, 2, 2);
+	det_d = MAT4_SWZ(det_sub, 3, 3, 3, 3);
+
+	d_c = MAT2_ADJ_MUL(d, c);
+	a_b = MAT2_ADJ_MUL(a, b);
+
+	x = _mm_sub_ps(_mm_mul_ps(det_d, a), MAT2_MUL(b, d_c));
+	w = _mm_sub_ps(_mm_mul_ps(det_a, d), MAT2_MUL(c, a_b));
+	y = _mm_sub_ps(_mm_mul_ps(det_b, c), MAT2_MUL_ADJ(d, a_b));
+	z = _mm_sub_ps(_mm_mul_ps(det_c, b), MAT2_MUL_ADJ(a, d_c));
+
+	/* The determinant of the whole matrix */
+	tr = _mm_mul_ps(a_b, MAT4_SWZ(d_c, 0, 2, 1, 3));
+	tr = _mm_add_ps(tr, MAT4_SWZ(tr, 2, 3, 0, 1));
+	tr = _mm_add_ps(tr, MAT4_SWZ(tr, 1, 0, 3, 2));
+
+	det = _mm_add_ps(_mm_mul_ps(det_a, det_d), _mm_mul_ps(det_b, det_c));
+	det = _mm_sub_ps(det, tr);
+
+	if(_mm_cvtss_f32(det) == 0)
+		return;
+
+	det = _mm_div_ps(_mm_setr_ps(1.0, -1.0, -1.0, 1.0), det);
+
+	x = _mm_mul_ps(x, det);
+	y = _mm_mul_ps(y, det);
+	z = _mm_mul_ps(z, det);
+	w = _mm_mul_ps(w, det);
+
+	_mm_storeu_ps(out + 0x0, _mm_shuffle_ps(x, y, MAT4_SHUF(3, 1, 3, 1)));
+	_mm_storeu_ps(out + 0x4, _mm_shuffle_ps(x, y, MAT4_SHUF(2, 0, 2, 0)));
+	_mm_storeu_ps(out + 0x8, _mm_shuffle_ps(z, w, MAT4_SHUF(3, 1, 3, 1)));
+	_mm_storeu_ps(out + 0xc, _mm_shuffle_ps(z, w, MAT4_SHUF(2, 0, 2, 0)));
+#else
 	double inv[16], det;
 	int i;
 
@@ -225,6 +385,7 @@ extern void mat4_inv(mat4_t out, mat4_t in)
 
 	for(i = 0; i < 16; i++)
 		out[i] = (float)(inv[i] * det);
+#endif
 }
 
 extern void mat4_transp(mat4_t out, mat4_t in)
@@ -2,15 +2,46 @@
 
 #include "error.h"
 #include "list.h"
+#include "quaternion.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 
 /* Redefine the global model-list */
 struct model *models[MDL_SLOTS];
 
+/*
+ * The joint-palettes written for the shared poses of the pose-cache in the
+ * current frame, so rigs sharing a pose also share the palette.
+ */
+static struct mdl_palette {
+	uint32_t frame;
+	uint32_t off;
+} mdl_pose_pal[RIG_POSE_NUM];
+
+/*
+ * The draw-list of the current frame and the sort-keys of the draws. The key
+ * orders the draws by layer, shader, vertex-attributes, texture and mesh, and
+ * the index is used to keep the order of equal keys.
+ */
+static struct mdl_draw {
+	short    slot;
+	char     rig;
+	uint32_t pal_off;
+	mat4_t   pos_mat;
+	mat4_t   rot_mat;
+} mdl_draws[MDL_DRAW_MAX];
+
+static struct mdl_draw_key {
+	uint32_t key;
+	short    idx;
+} mdl_draw_keys[MDL_DRAW_MAX];
+
+static int mdl_draw_num = 0;
+
 
 static short mdl_get_slot(void)
 {
@@ -53,6 +84,9 @@ extern void mdl_close(void)
 	int i;
 	struct model *mdl;
 
+	/* Wait for the frames still using the buffers */
+	ren_wait_idle();
+
 	for(i = 0; i < MDL_SLOTS; i++) {
 		if(!(mdl = models[i]))
 			continue;
@@ -126,23 +160,26 @@ extern short mdl_set(char *name, short shd_slot)
 	mdl->set = VK_NULL_HANDLE;
 	mdl->idx_bao = 0;
 	mdl->idx_bo.buffer = VK_NULL_HANDLE;
-	mdl->idx_bo.memory = VK_NULL_HANDLE;
+	mdl->idx_bo.alloc.size = 0;
 	mdl->idx_bo.data = NULL;
 	mdl->idx_bo.size = 0;
+	mdl->idx_bo.upload = 0;
 	mdl->idx_buf = NULL;
 	mdl->idx_num = 0;	
 	mdl->vtx_bao = 0;
 	mdl->vtx_bo.buffer = VK_NULL_HANDLE;
-	mdl->vtx_bo.memory = VK_NULL_HANDLE;
+	mdl->vtx_bo.alloc.size = 0;
 	mdl->vtx_bo.data = NULL;
 	mdl->vtx_bo.size = 0;
+	mdl->vtx_bo.upload = 0;
 	mdl->vtx_buf = NULL;
 	mdl->vtx_num = 0;
 	mdl->uni_buf = 0;
 	mdl->uni_bo.buffer = VK_NULL_HANDLE;
-	mdl->uni_bo.memory = VK_NULL_HANDLE;
+	mdl->uni_bo.alloc.size = 0;
 	mdl->uni_bo.data = NULL;
 	mdl->uni_bo.size = 0;
+	mdl->uni_bo.upload = 0;
 
 	/* Clear both texture and shader */
 	mdl->tex = -1;
@@ -152,10 +189,28 @@ extern short mdl_set(char *name, short shd_slot)
 	mdl->jnt_num = 0;
 	mdl->jnt_buf = NULL;
 	mdl->jnt_root = -1;
+	mdl->jnt_ord = NULL;
 
 	/* Initialize animation-attributes */
 	mdl->anim_buf = NULL;
 
+	/* Disable the IK-chains */
+	mdl->ik_aim_ok = 0;
+	mdl->ik_foot_num = 0;
+
+	/* Initialize the collision-mesh */
+	mdl->col.cm_vtx_c = 0;
+	mdl->col.cm_tri_c = 0;
+	mdl->col.cm_vtx = NULL;
+	mdl->col.cm_idx = NULL;
+	mdl->col.cm_nrm = NULL;
+	mdl->col.cm_equ = NULL;
+	mdl->col.cm_bvh.node_num = 0;
+	mdl->col.cm_bvh.node = NULL;
+	mdl->col.cm_bvh.tri = NULL;
+	mdl->col.cm_bvh.blk_num = 0;
+	mdl->col.cm_bvh.blk = NULL;
+
 	mdl->status = MDL_OK;
 
 	/* Generate a new vao */
@@ -190,7 +245,6 @@ extern void mdl_del(short slot)
 {
 	struct model *mdl;
 	int i;
-	int j;
 
 	if(mdl_check_slot(slot))
 		return;
@@ -198,6 +252,9 @@ extern void mdl_del(short slot)
 	if(!(mdl = models[slot]))
 		return;
 
+	/* Wait for the frames still using the buffers */
+	ren_wait_idle();
+
 	if(mdl->idx_bao || mdl->idx_bo.buffer)
 		ren_destroy_buffer(mdl->idx_bao, mdl->idx_bo);
 
@@ -220,21 +277,28 @@ extern void mdl_del(short slot)
 	if(mdl->jnt_buf)
 		free(mdl->jnt_buf);
 
-	/* Free the animation-buffer and keyframes */
+	if(mdl->jnt_ord)
+		free(mdl->jnt_ord);
+
+	/* Free the animation-buffer and tracks */
 	if(mdl->anim_buf) {
 		for(i = 0; i < mdl->anim_num; i++) {
-			for(j = 0; j < mdl->anim_buf[i].keyfr_num; j++) {
-				free(mdl->anim_buf[i].keyfr_buf[j].mask);
-				free(mdl->anim_buf[i].keyfr_buf[j].pos);
-				free(mdl->anim_buf[i].keyfr_buf[j].rot);
-			}
-
-			free(mdl->anim_buf[i].keyfr_buf);
+			free(mdl->anim_buf[i].trk_buf);
+			free(mdl->anim_buf[i].key_buf);
+			free(mdl->anim_buf[i].pos_buf);
+			free(mdl->anim_buf[i].pos_key_buf);
 		}
 
 		free(mdl->anim_buf);
 	}
 
+	/* Free the collision-mesh */
+	free(mdl->col.cm_vtx);
+	free(mdl->col.cm_idx);
+	free(mdl->col.cm_nrm);
+	free(mdl->col.cm_equ);
+	col_bvh_free(&mdl->col.cm_bvh);
+
 	free(mdl);
 	models[slot] = NULL;
 }
@@ -315,7 +379,7 @@ extern void mdl_set_data(short slot, int vtxnum, float *vtx, float *tex,
 		goto err_set_failed;
 
 	if(ren_set_model_data(mdl->vao, mdl->vtx_bao, vtx_size, jnt && wgt ? 1 : 0,
-			mdl->set, mdl->uni_bo, g_ast.tex.tex[mdl->tex]) < 0)
+			mdl->set, g_ast.tex.tex[mdl->tex]) < 0)
 		goto err_set_failed;
 
 	return;
@@ -367,7 +431,9 @@ static void mdl_order_joints(short slot)
 {
 	int i;
 	int j;
+	int num;
 	struct model *mdl;
+	struct mdl_joint *jnt;
 
 	if(mdl_check_slot(slot))
 		return;
@@ -397,33 +463,47 @@ static void mdl_order_joints(short slot)
 		mdl->jnt_buf[par].child_buf[mdl->jnt_buf[par].child_num] = i;
 		mdl->jnt_buf[par].child_num++;
 	}
+
+	/*
+	 * List the joints in parent-before-child order, so the joints can be
+	 * updated in a single loop, starting with the root-joints.
+	 */
+	num = 0;
+	for(i = 0; i < mdl->jnt_num; i++) {
+		if(mdl->jnt_buf[i].par < 0)
+			mdl->jnt_ord[num++] = i;
+	}
+
+	for(i = 0; i < num; i++) {
+		jnt = &mdl->jnt_buf[mdl->jnt_ord[i]];
+
+		for(j = 0; j < jnt->child_num; j++)
+			mdl->jnt_ord[num++] = jnt->child_buf[j];
+	}
 }
 
-static void mdl_calc_joints(struct model *mdl, short slot);
-static void mdl_calc_joints(struct model *mdl, short slot)
+static void mdl_calc_joints(struct model *mdl)
 {
 	int i;
 	struct mdl_joint *jnt;	
 	mat4_t mat;
-	static int c = 0;
-
-	jnt = &mdl->jnt_buf[slot];
 
-	mat4_cpy(mat, jnt->loc_bind_mat);
+	/* The parent-joints are always calculated before their children */
+	for(i = 0; i < mdl->jnt_num; i++) {
+		jnt = &mdl->jnt_buf[mdl->jnt_ord[i]];
 
-	/* Adjust absolute joint-matrix using parent-joint */
-	if(jnt->par != -1)
-		mat4_mult(mdl->jnt_buf[jnt->par].bind_mat, mat, mat);
+		mat4_cpy(mat, jnt->loc_bind_mat);
 
-	/* Attach base-matrix to joint */
-	mat4_cpy(jnt->bind_mat, mat);
+		/* Adjust absolute joint-matrix using parent-joint */
+		if(jnt->par != -1)
+			mat4_mult(mdl->jnt_buf[jnt->par].bind_mat, mat, mat);
 
-	/* Calculate the inverse to the base-matrix */
-	mat4_inv(jnt->inv_bind_mat, jnt->bind_mat);
+		/* Attach base-matrix to joint */
+		mat4_cpy(jnt->bind_mat, mat);
 
-	/* Call function recursivly on child-joints */
-	for(i = 0; i < jnt->child_num; i++)
-		mdl_calc_joints(mdl, jnt->child_buf[i]);
+		/* Calculate the inverse to the base-matrix */
+		mat4_inv(jnt->inv_bind_mat, jnt->bind_mat);
+	}
 }
 
 static void mdl_calc_hooks(struct model *mdl)
@@ -447,6 +527,323 @@ static void mdl_calc_hooks(struct model *mdl)
 	}
 }
 
+/*
+ * Setup the IK-chains of the model. The aim-chain is shortened if the
+ * hierarchy above the hook is not deep enough. Feet which are not found or
+ * have a too short leg are skipped.
+ */
+static void mdl_calc_ik(struct model *mdl)
+{
+	char *names[MDL_IK_FOOT_MAX] = MDL_IK_FOOT_NAMES;
+	struct rig_ik_chain *ik;
+	short num;
+	int i;
+	int j;
+
+	mdl->ik_aim_ok = 0;
+	mdl->ik_foot_num = 0;
+
+	if(mdl->hook_num > 0) {
+		for(num = MDL_IK_AIM_JNT; num > 0; num--) {
+			if(rig_ik_init(&mdl->ik_aim, mdl->slot, RIG_IK_AIM,
+						mdl->hook_buf[0].par_jnt, num, 0) == 0) {
+				mdl->ik_aim_ok = 1;
+				break;
+			}
+		}
+	}
+
+	for(i = 0; i < MDL_IK_FOOT_MAX; i++) {
+		for(j = 0; j < mdl->jnt_num; j++) {
+			if(strcmp(mdl->jnt_buf[j].name, names[i]) == 0)
+				break;
+		}
+
+		if(j >= mdl->jnt_num)
+			continue;
+
+		ik = &mdl->ik_foot[mdl->ik_foot_num];
+		if(rig_ik_init(ik, mdl->slot, RIG_IK_TWO_BONE, j, 3, -1) < 0)
+			continue;
+
+		mdl->ik_foot_hgt[mdl->ik_foot_num] = mdl->jnt_buf[j].bind_mat[0xe];
+		mdl->ik_foot_num++;
+	}
+}
+
+/*
+ * Get the position and rotation of a joint in a keyframe of the loaded
+ * animation-data. Joints missing in the keyframe are in the rest-pose.
+ */
+static void mdl_anim_jnt(struct amo_keyfr *keyfr, short idx, vec3_t pos,
+		vec4_t rot)
+{
+	if(idx < 0) {
+		vec3_set(pos, 0, 0, 0);
+		vec4_set(rot, 1, 0, 0, 0);
+		return;
+	}
+
+	vec3_cpy(pos, keyfr->pos + idx * 3);
+	vec4_cpy(rot, keyfr->rot + idx * 4);
+}
+
+/*
+ * Check if two keys of a track are equal. The quantized positions of the keys
+ * are stored with three values per key.
+ */
+static int mdl_key_equal(struct mdl_key *key, uint16_t *pos, int i, int j)
+{
+	return !memcmp(key[i].rot, key[j].rot, sizeof(key[i].rot)) &&
+		!memcmp(pos + i * 3, pos + j * 3, 3 * sizeof(uint16_t));
+}
+
+/*
+ * Get the joint-limits for inverse-kinematics from the range of rotations
+ * covered by the animations of the model.
+ */
+static void mdl_calc_limits(struct model *mdl)
+{
+	int i;
+	int j;
+	int k;
+	float agl;
+	vec4_t rot;
+	struct mdl_anim *anim;
+	struct mdl_track *trk;
+	struct mdl_joint *jnt;
+
+	for(i = 0; i < mdl->jnt_num; i++)
+		mdl->jnt_buf[i].lim = 0;
+
+	for(i = 0; i < mdl->anim_num; i++) {
+		anim = &mdl->anim_buf[i];
+
+		for(j = 0; j < anim->trk_num; j++) {
+			trk = &anim->trk_buf[j];
+			jnt = &mdl->jnt_buf[trk->jnt];
+
+			for(k = 0; k < trk->key_num; k++) {
+				qat_unpack(anim->key_buf[trk->key_off + k].rot, rot);
+
+				agl = 2.0 * acos(MIN(fabs(rot[0]), 1.0));
+				if(agl > jnt->lim)
+					jnt->lim = agl;
+			}
+		}
+	}
+
+	for(i = 0; i < mdl->jnt_num; i++) {
+		jnt = &mdl->jnt_buf[i];
+
+		if(jnt->lim < MDL_JNT_LIM_MIN)
+			jnt->lim = M_PI;
+		else
+			jnt->lim = MIN(jnt->lim + MDL_JNT_LIM_PAD, M_PI);
+	}
+}
+
+/*
+ * Compress the keyframes of an animation to quantized per-joint tracks.
+ */
+static int mdl_load_anim(struct mdl_anim *anim, struct amo_anim *data,
+		int jnt_num)
+{
+	int i;
+	int j;
+	int k;
+	int n;
+	int tmp;
+	short *map;
+	float v;
+	vec3_t pos;
+	vec4_t rot;
+	vec3_t min;
+	vec3_t max;
+	struct mdl_track *trk;
+	struct mdl_key *key;
+	struct mdl_pos *trk_pos;
+	uint16_t *key_pos;
+	void *p;
+
+	if(data->keyfr_c < 1 || jnt_num < 1)
+		return 0;
+
+	/* Map the joints to their index in each keyframe */
+	tmp = data->keyfr_c * jnt_num * sizeof(short);
+	if(!(map = malloc(tmp)))
+		return -1;
+
+	for(i = 0; i < data->keyfr_c * jnt_num; i++)
+		map[i] = -1;
+
+	for(i = 0; i < data->keyfr_c; i++) {
+		for(j = 0; j < data->keyfr_lst[i].jnt_num; j++)
+			map[i * jnt_num + data->keyfr_lst[i].jnt[j]] = j;
+	}
+
+	/* Allocate memory for the worst case and shrink the buffers later */
+	tmp = jnt_num * sizeof(struct mdl_track);
+	if(!(anim->trk_buf = malloc(tmp)))
+		goto err_free_map;
+
+	tmp = jnt_num * data->keyfr_c * sizeof(struct mdl_key);
+	if(!(anim->key_buf = malloc(tmp)))
+		goto err_free_map;
+
+	tmp = jnt_num * sizeof(struct mdl_pos);
+	if(!(anim->pos_buf = malloc(tmp)))
+		goto err_free_map;
+
+	tmp = jnt_num * data->keyfr_c * 3 * sizeof(uint16_t);
+	if(!(anim->pos_key_buf = malloc(tmp)))
+		goto err_free_map;
+
+	for(j = 0; j < jnt_num; j++) {
+		/* Skip joints, which are not animated at all */
+		for(i = 0; i < data->keyfr_c; i++) {
+			if(map[i * jnt_num + j] >= 0)
+				break;
+		}
+
+		if(i == data->keyfr_c)
+			continue;
+
+		trk = &anim->trk_buf[anim->trk_num++];
+		trk->jnt = j;
+		trk->key_off = anim->key_num;
+
+		/* Get the range of the positions */
+		for(i = 0; i < data->keyfr_c; i++) {
+			mdl_anim_jnt(&data->keyfr_lst[i], map[i * jnt_num + j],
+					pos, rot);
+
+			if(i == 0) {
+				vec3_cpy(min, pos);
+				vec3_cpy(max, pos);
+			}
+
+			for(k = 0; k < 3; k++) {
+				if(pos[k] < min[k]) min[k] = pos[k];
+				if(pos[k] > max[k]) max[k] = pos[k];
+			}
+		}
+
+		/*
+		 * Quantize the keys. The positions are written behind the
+		 * ones already stored, and are only kept if they change.
+		 */
+		trk_pos = &anim->pos_buf[anim->pos_num];
+		vec3_cpy(trk_pos->min, min);
+		for(k = 0; k < 3; k++)
+			trk_pos->scl[k] = (max[k] - min[k]) / MDL_KEY_POS_MAX;
+
+		key = &anim->key_buf[trk->key_off];
+		key_pos = &anim->pos_key_buf[anim->pos_key_num * 3];
+		for(i = 0; i < data->keyfr_c; i++) {
+			mdl_anim_jnt(&data->keyfr_lst[i], map[i * jnt_num + j],
+					pos, rot);
+
+			v = data->keyfr_lst[i].prog;
+			if(v < 0) v = 0;
+			if(v > 1) v = 1;
+			key[i].prog = (uint16_t)(v * MDL_KEY_PROG_MAX + 0.5);
+
+			qat_pack(rot, key[i].rot);
+
+			for(k = 0; k < 3; k++) {
+				if(trk_pos->scl[k] > 0)
+					v = (pos[k] - min[k]) / trk_pos->scl[k];
+				else
+					v = 0;
+
+				key_pos[i * 3 + k] = (uint16_t)(v + 0.5);
+			}
+		}
+
+		/*
+		 * Drop the keys equal to both neighbours, as the joint doesn't
+		 * move around them anyway.
+		 */
+		for(i = 1, n = 1; i < data->keyfr_c; i++) {
+			if(i < data->keyfr_c - 1 &&
+					mdl_key_equal(key, key_pos, i, i - 1) &&
+					mdl_key_equal(key, key_pos, i, i + 1))
+				continue;
+
+			key[n] = key[i];
+			memcpy(key_pos + n * 3, key_pos + i * 3,
+					3 * sizeof(uint16_t));
+			n++;
+		}
+
+		/* A constant track only needs a single key */
+		if(n == 2 && mdl_key_equal(key, key_pos, 0, 1))
+			n = 1;
+
+		trk->key_num = n;
+		anim->key_num += n;
+
+		/*
+		 * Joints staying in the rest-position need no positions, and
+		 * constant positions only need the range.
+		 */
+		if(vec3_cmp(min, max) && min[0] == 0 && min[1] == 0 &&
+				min[2] == 0) {
+			trk->pos = -1;
+		}
+		else {
+			trk->pos = anim->pos_num++;
+			trk_pos->key_off = -1;
+
+			if(!vec3_cmp(min, max)) {
+				trk_pos->key_off = anim->pos_key_num;
+				anim->pos_key_num += n;
+			}
+		}
+	}
+
+	free(map);
+
+	/* Shrink the buffers, if this fails the larger buffers are kept */
+	if(anim->trk_num > 0) {
+		tmp = anim->trk_num * sizeof(struct mdl_track);
+		if((p = realloc(anim->trk_buf, tmp)))
+			anim->trk_buf = p;
+
+		tmp = anim->key_num * sizeof(struct mdl_key);
+		if((p = realloc(anim->key_buf, tmp)))
+			anim->key_buf = p;
+	}
+
+	if(anim->pos_num > 0) {
+		tmp = anim->pos_num * sizeof(struct mdl_pos);
+		if((p = realloc(anim->pos_buf, tmp)))
+			anim->pos_buf = p;
+	}
+	else {
+		free(anim->pos_buf);
+		anim->pos_buf = NULL;
+	}
+
+	if(anim->pos_key_num > 0) {
+		tmp = anim->pos_key_num * 3 * sizeof(uint16_t);
+		if((p = realloc(anim->pos_key_buf, tmp)))
+			anim->pos_key_buf = p;
+	}
+	else {
+		free(anim->pos_key_buf);
+		anim->pos_key_buf = NULL;
+	}
+
+	return 0;
+
+err_free_map:
+	free(map);
+	return -1;
+}
+
+
 extern short mdl_load(char *name, char *pth, short tex_slot, short shd_slot,
 			enum mdl_type type)
 {
@@ -483,13 +880,10 @@ extern short mdl_load_ffd(char *name, FILE *fd, short tex_slot, short shd_slot,
 
 	int i;
 	int j;
-	int k;
 
 	/* Helper-variables */
 	int tmp;
 	struct mdl_anim *anim;
-	struct mdl_keyfr *keyfr;
-	struct amo_keyfr *amo_keyfr;
 
 	printf("Load %s...", name);
 
@@ -548,6 +942,11 @@ extern short mdl_load_ffd(char *name, FILE *fd, short tex_slot, short shd_slot,
 		if(!(mdl->jnt_buf = malloc(tmp)))
 			goto err_free_data;
 
+		/* Allocate memory for the joint-order */
+		tmp = mdl->jnt_num * sizeof(int);
+		if(!(mdl->jnt_ord = malloc(tmp)))
+			goto err_free_data;
+
 		/* Copy joint-data */
 		for(i = 0; i < mdl->jnt_num; i++) {
 			/* Copy joint-name */
@@ -565,7 +964,7 @@ extern short mdl_load_ffd(char *name, FILE *fd, short tex_slot, short shd_slot,
 		mdl_order_joints(slot);
 
 		/* Calculate the base matrices of the joints */
-		mdl_calc_joints(mdl, mdl->jnt_root);
+		mdl_calc_joints(mdl);
 	}
 
 	/* Copy animations */
@@ -578,16 +977,22 @@ extern short mdl_load_ffd(char *name, FILE *fd, short tex_slot, short shd_slot,
 		if(!(mdl->anim_buf = malloc(tmp)))
 			goto err_free_data;
 
-		/* Initialize keyframe-buffers */
+		/* Initialize the track-buffers */
 		for(i = 0; i < mdl->anim_num; i++) {
 			/* Get shortcut-pointer */
 			anim = &mdl->anim_buf[i];
 
-			anim->keyfr_num = 0;
-			anim->keyfr_buf = NULL;
+			anim->trk_num = 0;
+			anim->trk_buf = NULL;
+			anim->key_num = 0;
+			anim->key_buf = NULL;
+			anim->pos_num = 0;
+			anim->pos_buf = NULL;
+			anim->pos_key_num = 0;
+			anim->pos_key_buf = NULL;
 		}
 
-		/* Copy animation-keyframes */
+		/* Compress the animations */
 		for(i = 0; i < mdl->anim_num; i++) {
 			/* Get shortcut-pointer */
 			anim = &mdl->anim_buf[i];
@@ -598,79 +1003,15 @@ extern short mdl_load_ffd(char *name, FILE *fd, short tex_slot, short shd_slot,
 			/* Get duration of the animation */
 			anim->dur = data->ani_lst[i].dur;
 
-			/* Copy number of keyframes */
-			anim->keyfr_num = data->ani_lst[i].keyfr_c;
-
-			/* Allocate memory for keyframes */
-			tmp = anim->keyfr_num * sizeof(struct mdl_keyfr);
-			if(!(anim->keyfr_buf = malloc(tmp)))
+			if(mdl_load_anim(anim, &data->ani_lst[i], mdl->jnt_num) < 0)
 				goto err_free_data;
-
-			/* Initialize keyframe-joint-buffers */
-			for(j = 0; j < anim->keyfr_num; j++) {
-				/* Get shortcut-pointer */
-				keyfr = &anim->keyfr_buf[j];
-
-				keyfr->pos = NULL;
-				keyfr->rot = NULL;
-			}
-
-			/* Copy keyframes */
-			for(j = 0; j < anim->keyfr_num; j++) {
-				/* Get shortcut-pointers */
-				keyfr = &anim->keyfr_buf[j];
-				amo_keyfr = &data->ani_lst[i].keyfr_lst[j];
-
-				/* Allocate memory for location-data */
-				tmp = mdl->jnt_num * sizeof(char);
-				if(!(keyfr->mask = malloc(tmp)))
-					goto err_free_data;	
-
-				/* Allocate memory for location-data */
-				tmp = mdl->jnt_num * VEC3_SIZE;
-				if(!(keyfr->pos = malloc(tmp)))
-					goto err_free_data;
-
-				/* Allocate memory for rotation-data */
-				tmp = mdl->jnt_num * VEC4_SIZE;
-				if(!(keyfr->rot = malloc(tmp)))
-					goto err_free_data;
-
-				/* Reset masks */
-				for(k = 0; k < mdl->jnt_num; k++)
-					keyfr->mask[k] = -1;
-
-					
-				/* Copy timestamp */
-				keyfr->prog = data->ani_lst[i].keyfr_lst[j].prog;
-
-				/* Copy position and rotation data */
-				for(k = 0; k < amo_keyfr->jnt_num; k++) {
-					short jnti;
-					int a_off;
-
-					/* Get the joint-index in the joint-list */
-					jnti = amo_keyfr->jnt[k];
-
-					/* mask */
-					keyfr->mask[jnti] = jnti;
-
-					/* position */
-					a_off = k * 3;
-					memcpy(keyfr->pos[jnti], 
-							amo_keyfr->pos + a_off,
-							VEC3_SIZE);
-
-					/* rotation */
-					a_off = k * 4;
-					memcpy(keyfr->rot[jnti],
-							amo_keyfr->rot + a_off,
-							VEC4_SIZE);
-				}
-			}
 		}
 	}
 
+	/* Limit the joints to the range covered by the animations */
+	if(mdl->jnt_num > 0)
+		mdl_calc_limits(mdl);
+
 	/*
 	 * If handheld-hooks are defined.
 	 */
@@ -696,6 +1037,10 @@ extern short mdl_load_ffd(char *name, FILE *fd, short tex_slot, short shd_slot,
 		}
 	}
 
+	/* Setup the IK-chains for aiming and placing the feet */
+	if(mdl->jnt_num > 0)
+		mdl_calc_ik(mdl);
+
 	/*
 	 * If a bounding-box is defined.
 	 */
@@ -788,6 +1133,42 @@ extern short mdl_load_ffd(char *name, FILE *fd, short tex_slot, short shd_slot,
 			mdl->col.cm_equ[i][3] = -(nrm[0] * a[0] +
 					nrm[1] * a[1] + nrm[2] * a[2]);
 		}
+
+		/*
+		 * Extend the collision-box so it encloses the whole
+		 * collision-mesh, as it's used to cull the mesh during
+		 * collision-checks.
+		 */
+		if(mdl->col.cm_vtx_c > 0) {
+			vec3_t min;
+			vec3_t max;
+
+			if(data->attr_m & AMO_M_CBP) {
+				vec3_sub(mdl->col.bb_col.pos, mdl->col.bb_col.scl, min);
+				vec3_add(mdl->col.bb_col.pos, mdl->col.bb_col.scl, max);
+			}
+			else {
+				vec3_cpy(min, mdl->col.cm_vtx[0]);
+				vec3_cpy(max, mdl->col.cm_vtx[0]);
+			}
+
+			for(i = 0; i < mdl->col.cm_vtx_c; i++) {
+				for(j = 0; j < 3; j++) {
+					min[j] = MIN(min[j], mdl->col.cm_vtx[i][j]);
+					max[j] = MAX(max[j], mdl->col.cm_vtx[i][j]);
+				}
+			}
+
+			vec3_add(min, max, mdl->col.bb_col.pos);
+			vec3_scl(mdl->col.bb_col.pos, 0.5, mdl->col.bb_col.pos);
+
+			vec3_sub(max, mdl->col.bb_col.pos, mdl->col.bb_col.scl);
+		}
+
+		/* Build the hierarchy over the triangles */
+		if(col_bvh_build(&mdl->col.cm_bvh, mdl->col.cm_vtx,
+					mdl->col.cm_idx, mdl->col.cm_tri_c) < 0)
+			goto err_free_data;
 	}
 
 	/*
@@ -857,13 +1238,53 @@ err_return:
 }
 
 
-extern void mdl_render(short slot, mat4_t pos_mat, mat4_t rot_mat,
+/*
+ * Write the joint-palette of a rig to the palette-ring. If the rig shares a
+ * pose, whose palette has already been written this frame, that palette is
+ * used instead. Rigs interpolated by rig_lod_interp() keep the reference to
+ * the pose for the hooks, but render their own joint-matrices, so they never
+ * share a palette.
+ *
+ * @rig: Pointer to the rig
+ * @off: A pointer to write the offset of the palette to
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+static int mdl_write_palette(struct model_rig *rig, uint32_t *off)
+{
+	struct mdl_palette *pal = NULL;
+	void *p;
+
+	if(rig->pose >= 0 && rig->trans_mat != rig->own_trans_mat) {
+		pal = &mdl_pose_pal[rig->pose];
+
+		if(pal->frame == g_ren.frame) {
+			*off = pal->off;
+			return 0;
+		}
+	}
+
+	if(!(p = ren_map_palette(rig->jnt_num, off)))
+		return -1;
+
+	memcpy(p, rig->trans_mat, rig->jnt_num * MAT4_SIZE);
+	ren_unmap_palette();
+
+	if(pal) {
+		pal->frame = g_ren.frame;
+		pal->off = *off;
+	}
+
+	return 0;
+}
+
+
+extern void mdl_submit(short slot, mat4_t pos_mat, mat4_t rot_mat,
 		struct model_rig *rig)
 {
-	mat4_t view, proj;
 	struct model *mdl;
-	int attr;
-	struct uni_buffer uni;
+	struct mdl_draw *draw;
+	uint32_t pal_off = 0;
 
 	if(mdl_check_slot(slot))
 		return;
@@ -872,34 +1293,180 @@ extern void mdl_render(short slot, mat4_t pos_mat, mat4_t rot_mat,
 	if(!mdl || mdl->status != MDL_OK)
 		return;
 
-	/* Get the range of vertex-attributes (0-n) */
-	attr = (rig != NULL) ? (5) : (3);
+	/* Skip the model if there's no space left for the joint-palette */
+	if(rig != NULL && mdl_write_palette(rig, &pal_off) < 0)
+		return;
+
+	if(mdl_draw_num >= MDL_DRAW_MAX)
+		mdl_flush();
+
+	draw = &mdl_draws[mdl_draw_num];
+	draw->slot = slot;
+	draw->rig = (rig != NULL);
+	draw->pal_off = pal_off;
+
+	if(pos_mat)
+		mat4_cpy(draw->pos_mat, pos_mat);
+	else
+		mat4_idt(draw->pos_mat);
+
+	if(rot_mat)
+		mat4_cpy(draw->rot_mat, rot_mat);
+	else
+		mat4_idt(draw->rot_mat);
+
+	/*
+	 * Skyboxes are drawn first without writing the depth, so everything
+	 * else is drawn on top of them.
+	 */
+	mdl_draw_keys[mdl_draw_num].key =
+		((uint32_t)(mdl->type != MDL_TYPE_SKYBOX) << 25) |
+		((uint32_t)(mdl->shd & 0xff) << 17) |
+		((uint32_t)draw->rig << 16) |
+		((uint32_t)(mdl->tex & 0xff) << 8) |
+		((uint32_t)slot & 0xff);
+	mdl_draw_keys[mdl_draw_num].idx = mdl_draw_num;
+
+	mdl_draw_num++;
+}
+
+
+static int mdl_cmp_draws(const void *a, const void *b)
+{
+	const struct mdl_draw_key *k1 = a;
+	const struct mdl_draw_key *k2 = b;
+
+	uint32_t off1;
+	uint32_t off2;
+
+	if(k1->key != k2->key)
+		return (k1->key < k2->key) ? -1 : 1;
+
+	/* Keep rigs sharing a joint-palette together, to draw them at once */
+	off1 = mdl_draws[k1->idx].pal_off;
+	off2 = mdl_draws[k2->idx].pal_off;
+	if(off1 != off2)
+		return (off1 < off2) ? -1 : 1;
+
+	return k1->idx - k2->idx;
+}
+
+
+/*
+ * Get the number of draws starting at the given position in the sorted
+ * draw-list, which can be drawn as instances of the first one.
+ *
+ * @start: The position in the sorted draw-list
+ *
+ * Returns: The number of draws, at most REN_INST_MAX
+ */
+static int mdl_batch_draws(int start)
+{
+	struct mdl_draw *first = &mdl_draws[mdl_draw_keys[start].idx];
+	struct mdl_draw *draw;
+	int i;
+
+	for(i = start + 1; i < mdl_draw_num && i - start < REN_INST_MAX; i++) {
+		draw = &mdl_draws[mdl_draw_keys[i].idx];
+
+		if(draw->slot != first->slot || draw->rig != first->rig ||
+				draw->pal_off != first->pal_off)
+			break;
+	}
+
+	return i - start;
+}
+
+
+extern void mdl_flush(void)
+{
+	int i;
+	int j;
+	int num;
+	mat4_t view, proj;
+	struct model *mdl;
+	struct mdl_draw *draw;
+	struct uni_buffer uni;
+	uint32_t inst_off;
+	float *inst;
+	short last_slot = -1;
+	short last_shd = -1;
+	short last_tex = -1;
+	char last_rig = -1;
+	int attr;
+
+	if(mdl_draw_num == 0)
+		return;
+
+	qsort(mdl_draw_keys, mdl_draw_num, sizeof(struct mdl_draw_key),
+			mdl_cmp_draws);
 
 	/* Get the view- and projection-matrix of the camera */
 	cam_get_view(view);
 	cam_get_proj(proj);
 
-	/* Use vertices */
-	ren_set_vertices(mdl->vao, mdl->vtx_bo, mdl->idx_bo);
-
-	/* Use shader, enable vertex attributes and get uniform locations */
-	shd_use(mdl->shd, attr);
-
-	/* Set the uniform-variables */
-	mat4_cpy(uni.pos_mat, pos_mat);
-	mat4_cpy(uni.rot_mat, rot_mat);
 	mat4_cpy(uni.view, view);
 	mat4_cpy(uni.proj, proj);
-	if(rig != NULL)
-		memcpy(uni.trans_mat, rig->trans_mat, mdl->jnt_num * MAT4_SIZE);
-	
-	/* Set uniform buffer and textures */
-	ren_set_render_model_data(mdl->uni_buf, uni,
-			g_ast.tex.hdl[mdl->tex], g_ast.shd.pipeline[mdl->shd],
-			mdl->uni_bo, mdl->set, mdl->type);
 
-	/* Draw the vertices */
-	ren_draw(mdl->idx_num, mdl->type);
+	for(i = 0; i < mdl_draw_num; i += num) {
+		draw = &mdl_draws[mdl_draw_keys[i].idx];
+		mdl = models[draw->slot];
+
+		/*
+		 * Write the transformations of all draws of the same mesh and
+		 * joint-palette as instances, and skip them if there's no space
+		 * left in the palette-ring.
+		 */
+		num = mdl_batch_draws(i);
+
+		if(!(inst = ren_map_instances(num, &inst_off)))
+			continue;
+
+		for(j = 0; j < num; j++) {
+			draw = &mdl_draws[mdl_draw_keys[i + j].idx];
+
+			memcpy(inst + j * 32, draw->pos_mat, MAT4_SIZE);
+			memcpy(inst + j * 32 + 16, draw->rot_mat, MAT4_SIZE);
+		}
+
+		ren_unmap_palette();
+		draw = &mdl_draws[mdl_draw_keys[i].idx];
+
+		/* Use vertices */
+		if(draw->slot != last_slot) {
+			ren_set_vertices(mdl->vao, mdl->vtx_bo, mdl->idx_bo);
+			last_slot = draw->slot;
+		}
+
+		/* Use shader and enable vertex attributes (0-n) */
+		if(mdl->shd != last_shd || draw->rig != last_rig) {
+			attr = draw->rig ? (5) : (3);
+			shd_use(mdl->shd, attr);
+
+			last_shd = mdl->shd;
+			last_rig = draw->rig;
+		}
+
+		/*
+		 * Use the texture. Skyboxes also disable writing the depth until
+		 * the draw, so the texture is always set for them.
+		 */
+		if(mdl->tex != last_tex || mdl->type == MDL_TYPE_SKYBOX) {
+			ren_set_texture(g_ast.tex.hdl[mdl->tex], mdl->type);
+			last_tex = mdl->type == MDL_TYPE_SKYBOX ? -1 : mdl->tex;
+		}
+
+		/* Set uniform buffer, joint-palette and instances */
+		if(ren_set_render_model_data(mdl->uni_buf, &uni,
+				g_ast.shd.pipeline[mdl->shd], mdl->set,
+				draw->pal_off, inst_off) < 0)
+			continue;
+
+		/* Draw all instances */
+		ren_draw(mdl->idx_num, num, mdl->type);
+	}
+
+	mdl_draw_num = 0;
 
 	/* Unuse the texture, shader and VAO */
 	tex_unuse();
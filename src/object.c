@@ -1,8 +1,10 @@
 #include "object.h"
 
+#include "error.h"
 #include "world.h"
 #include "network.h"
 #include "collision.h"
+#include "job.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,94 +14,595 @@
 /* Redefine global object-wrapper */
 struct obj_wrapper g_obj;
 
+/*
+ * The buffers used to collect the objects to check for collision, one for
+ * every thread of the job-system.
+ */
+static struct obj_grid_res obj_col_res[JOB_THREAD_MAX + 1];
 
-extern int obj_init(void)
+
+/*
+ * Resize a buffer of the object-table. The new part of the buffer is left
+ * uninitialized.
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+static int obj_realloc(void **ptr, int size, int num)
+{
+	void *p;
+
+	if(!(p = realloc(*ptr, size * num)))
+		return -1;
+
+	*ptr = p;
+	return 0;
+}
+
+
+/*
+ * Resize the lookup-table and reinsert all objects.
+ */
+static int obj_tbl_resize(int size);
+
+
+/*
+ * Increase the number of slots in the object-table. All buffers will be
+ * resized and the new slots will be pushed onto the free-list.
+ *
+ * @alloc: The new number of slots
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+static int obj_grow(int alloc)
 {
 	int i;
+	int tbl_size;
+
+	if(alloc > OBJ_LIM)
+		alloc = OBJ_LIM;
+
+	if(alloc <= g_obj.alloc)
+		return -1;
+
+	/* Resize the management-buffers */
+	if(obj_realloc((void **)&g_obj.free_lst, sizeof(short), alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.order, sizeof(short), alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.gen, sizeof(uint16_t), alloc) < 0)
+		return -1;
+
+	for(i = 0; i < OBJ_LST_NUM; i++) {
+		if(obj_realloc((void **)&g_obj.lst[i].slot, sizeof(short),
+					alloc) < 0)
+			return -1;
+	}
+
+	/* Resize the hot data */
+	if(obj_realloc((void **)&g_obj.mask, sizeof(uint32_t), alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.id, sizeof(uint32_t), alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.ts, sizeof(uint32_t), alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.pos, VEC3_SIZE, alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.vel, VEC3_SIZE, alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.mov, VEC2_SIZE, alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.dir, VEC3_SIZE, alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.mdl, sizeof(short), alloc) < 0)
+		return -1;
+
+	/* Resize the render-data */
+	if(obj_realloc((void **)&g_obj.prev_ts, sizeof(uint32_t), alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.prev_pos, VEC3_SIZE, alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.prev_dir, VEC3_SIZE, alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.view_origin, VEC3_SIZE, alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.view_pos, VEC3_SIZE, alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.view_pos_rel, VEC3_SIZE, alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.rig, sizeof(struct model_rig *),
+				alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.pos_mat, MAT4_SIZE, alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.rot_mat, MAT4_SIZE, alloc) < 0)
+		return -1;
+
+	/* Resize the collision-data */
+	if(obj_realloc((void **)&g_obj.col_pos, VEC3_SIZE, alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.col_min, VEC3_SIZE, alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.col_max, VEC3_SIZE, alloc) < 0)
+		return -1;
+
+	if(obj_realloc((void **)&g_obj.col_blk, sizeof(struct col_trig_blk *),
+				alloc) < 0)
+		return -1;
 
-	for(i = 0; i < OBJ_LIM; i++) {
-		g_obj.order[i] = i;
+	/* Resize the cold data */
+	if(obj_realloc((void **)&g_obj.cold, sizeof(struct obj_cold),
+				alloc) < 0)
+		return -1;
+
+	/* Resize the lookup-table if it's getting too full */
+	tbl_size = g_obj.tbl_size > 0 ? g_obj.tbl_size : 1;
+	while(tbl_size < alloc * 2)
+		tbl_size *= 2;
+
+	if(tbl_size != g_obj.tbl_size && obj_tbl_resize(tbl_size) < 0)
+		return -1;
+
+	/* Initialize the new slots and push them onto the free-list */
+	for(i = alloc - 1; i >= g_obj.alloc; i--) {
 		g_obj.mask[i] = OBJ_M_NONE;
+		g_obj.gen[i] = 0;
+		g_obj.rig[i] = NULL;
+		g_obj.col_blk[i] = NULL;
+
+		g_obj.free_lst[g_obj.free_num] = i;
+		g_obj.free_num++;
 	}
 
+	g_obj.alloc = alloc;
+	return 0;
+}
+
+
+extern int obj_init(void)
+{
+	int i;
+
+	g_obj.alloc = 0;
+	g_obj.free_num = 0;
+	g_obj.free_lst = NULL;
+
 	g_obj.num = 0;
+	g_obj.order = NULL;
+
+	g_obj.tbl_size = 0;
+	g_obj.tbl = NULL;
+
+	g_obj.gen = NULL;
+
+	for(i = 0; i < OBJ_LST_NUM; i++) {
+		g_obj.lst[i].num = 0;
+		g_obj.lst[i].slot = NULL;
+	}
+
+	g_obj.mask = NULL;
+	g_obj.id = NULL;
+	g_obj.ts = NULL;
+	g_obj.pos = NULL;
+	g_obj.vel = NULL;
+	g_obj.mov = NULL;
+	g_obj.dir = NULL;
+	g_obj.mdl = NULL;
+
+	g_obj.prev_ts = NULL;
+	g_obj.prev_pos = NULL;
+	g_obj.prev_dir = NULL;
+	g_obj.view_origin = NULL;
+	g_obj.view_pos = NULL;
+	g_obj.view_pos_rel = NULL;
+	g_obj.rig = NULL;
+	g_obj.pos_mat = NULL;
+	g_obj.rot_mat = NULL;
+
+	g_obj.col_pos = NULL;
+	g_obj.col_min = NULL;
+	g_obj.col_max = NULL;
+	g_obj.col_blk = NULL;
+	obj_grid_init();
+
+	obj_snap_init();
+
+	g_obj.cold = NULL;
+
+	/* Set up the rig-pools and the pose-cache */
+	rig_pool_init();
+	rig_pose_init();
+
+	/* Allocate the initial slots */
+	if(obj_grow(OBJ_ALLOC_MIN) < 0) {
+		obj_close();
+		return -1;
+	}
+
 	return 0;
 }
 
 
-/* TODO */
 extern void obj_close(void)
 {
-	return;
+	short i;
+
+	/* Delete all remaining objects */
+	for(i = 0; i < g_obj.alloc; i++)
+		obj_del(i);
+
+	free(g_obj.free_lst);
+	free(g_obj.order);
+	free(g_obj.tbl);
+	free(g_obj.gen);
+
+	for(i = 0; i < OBJ_LST_NUM; i++)
+		free(g_obj.lst[i].slot);
+
+	free(g_obj.mask);
+	free(g_obj.id);
+	free(g_obj.ts);
+	free(g_obj.pos);
+	free(g_obj.vel);
+	free(g_obj.mov);
+	free(g_obj.dir);
+	free(g_obj.mdl);
+
+	free(g_obj.prev_ts);
+	free(g_obj.prev_pos);
+	free(g_obj.prev_dir);
+	free(g_obj.view_origin);
+	free(g_obj.view_pos);
+	free(g_obj.view_pos_rel);
+	free(g_obj.rig);
+	rig_pose_close();
+	rig_pool_close();
+	free(g_obj.pos_mat);
+	free(g_obj.rot_mat);
+
+	free(g_obj.col_pos);
+	free(g_obj.col_min);
+	free(g_obj.col_max);
+	free(g_obj.col_blk);
+	obj_grid_close();
+	for(i = 0; i <= JOB_THREAD_MAX; i++)
+		obj_grid_res_free(&obj_col_res[i]);
+
+	obj_snap_close();
+
+	free(g_obj.cold);
+
+	g_obj.alloc = 0;
+	g_obj.free_num = 0;
+	g_obj.num = 0;
+	g_obj.tbl_size = 0;
 }
 
 
+/*
+ * Take an unused slot from the free-list and grow the object-table if there
+ * are no free slots left.
+ *
+ * Returns: An unused slot or -1 if an error occurred
+ */
 static short obj_get_slot(void)
 {
-	short i;
-
-	for(i = 0; i < OBJ_LIM; i++) {
-		if(g_obj.mask[i] == OBJ_M_NONE)
-			return i;
+	if(g_obj.free_num == 0) {
+		if(obj_grow(g_obj.alloc * 2) < 0)
+			return -1;
 	}
 
-	return -1;
+	g_obj.free_num--;
+	return g_obj.free_lst[g_obj.free_num];
+}
+
+
+/*
+ * Push a slot back onto the free-list and increment the generation of the
+ * slot, to invalidate all handles to the previous object.
+ */
+static void obj_put_slot(short slot)
+{
+	g_obj.mask[slot] = OBJ_M_NONE;
+	g_obj.gen[slot]++;
+
+	g_obj.free_lst[g_obj.free_num] = slot;
+	g_obj.free_num++;
 }
 
 
 static int obj_check_slot(short slot)
 {
-	if(slot < 0 || slot > OBJ_LIM)
+	if(slot < 0 || slot >= g_obj.alloc)
 		return 1;
 
 	return 0;
 }
 
-static void obj_sort(void)
+
+/*
+ * Get the position in a list sorted by ascending IDs, at which an object with
+ * the given id would have to be inserted to keep the list sorted. If objects
+ * with the same id already exist, the position after the last one of them is
+ * returned.
+ *
+ * @lst: The list of slots
+ * @num: The number of entries in the list
+ * @id: The id to search for
+ */
+static short obj_lst_find(short *lst, short num, uint32_t id)
 {
-	int i;
-	char found = 0;
+	short low = 0;
+	short high = num;
+	short mid;
 
-	short a;
-	short b;
+	while(low < high) {
+		mid = low + ((high - low) / 2);
 
-	for(i = 0; i < OBJ_LIM; i++) {
-		g_obj.order[i] = i;
+		if(g_obj.id[lst[mid]] <= id)
+			low = mid + 1;
+		else
+			high = mid;
 	}
 
-	/*
-	 * TODO:
-	 * I did it again. uwu
-	 * Bubblesort owo, how could this happen...
-	 */
+	return low;
+}
 
-	/* Sort object-order to ascending IDs. */
-	while(1) {
-		found = 0;
 
-		for(i = 0; i < OBJ_LIM - 1; i++) {
-			a = g_obj.order[i];
-			b = g_obj.order[i + 1];
+/*
+ * Insert an object into a list, so the objects will remain in ascending order
+ * of their IDs. Note that this doesn't update the number of entries.
+ */
+static void obj_lst_ins(short *lst, short num, short slot)
+{
+	short pos = obj_lst_find(lst, num, g_obj.id[slot]);
 
-			if(g_obj.mask[a] != 0 && g_obj.mask[b] != 0) {
-				if(g_obj.id[a] > g_obj.id[b]) {
-					found = 1;
+	/* Move the following entries back by one */
+	memmove(&lst[pos + 1], &lst[pos], (num - pos) * sizeof(short));
 
-					g_obj.order[i] = b;
-					g_obj.order[i + 1] = a;
-				}
-			}
-			else if(g_obj.mask[a] == 0 && g_obj.mask[b] != 0) {
-				found = 1;
+	lst[pos] = slot;
+}
 
-				g_obj.order[i] = b;
-				g_obj.order[i + 1] = a;
-			}
-		}
 
-		if(!found)
+/*
+ * Remove an object from a list. Note that this doesn't update the number of
+ * entries.
+ *
+ * Returns: 0 on success or -1 if the object is not in the list
+ */
+static int obj_lst_rmv(short *lst, short num, short slot)
+{
+	short pos = obj_lst_find(lst, num, g_obj.id[slot]) - 1;
+
+	/* Search backwards through the objects with the same id */
+	for(; pos >= 0; pos--) {
+		if(lst[pos] == slot)
 			break;
+
+		if(g_obj.id[lst[pos]] != g_obj.id[slot])
+			return -1;
 	}
+
+	if(pos < 0)
+		return -1;
+
+	/* Move the following entries forward by one */
+	memmove(&lst[pos], &lst[pos + 1], (num - pos - 1) * sizeof(short));
+	return 0;
+}
+
+
+/*
+ * Get the capability-lists an object belongs to, depending on the current
+ * mask, model and rig of the object.
+ *
+ * Returns: A mask with one bit for each capability-list
+ */
+static uint32_t obj_get_caps(short slot)
+{
+	uint32_t caps = 0;
+
+	if(g_obj.mask[slot] & OBJ_M_MOVE)
+		caps |= (1<<OBJ_LST_MOVE);
+
+	if(g_obj.rig[slot] != NULL)
+		caps |= (1<<OBJ_LST_RIG);
+
+	if(g_obj.mdl[slot] >= 0) {
+		if(g_obj.mask[slot] & OBJ_M_MODEL)
+			caps |= (1<<OBJ_LST_MODEL);
+
+		if(g_obj.mask[slot] & OBJ_M_SOLID)
+			caps |= (1<<OBJ_LST_SOLID);
+	}
+
+	return caps;
+}
+
+
+/*
+ * Get the index in the lookup-table an object-ID will be mapped to, before
+ * probing.
+ */
+static int obj_tbl_hash(uint32_t id)
+{
+	/* Scramble the bits, as IDs are often sequential */
+	id ^= id >> 16;
+	id *= 0x45d9f3b;
+	id ^= id >> 16;
+
+	return id & (g_obj.tbl_size - 1);
+}
+
+
+/*
+ * Insert an object into the lookup-table using the current ID of the object.
+ */
+static void obj_tbl_ins(short slot)
+{
+	int i = obj_tbl_hash(g_obj.id[slot]);
+
+	/* Find the next empty entry */
+	while(g_obj.tbl[i].slot >= 0)
+		i = (i + 1) & (g_obj.tbl_size - 1);
+
+	g_obj.tbl[i].id = g_obj.id[slot];
+	g_obj.tbl[i].slot = slot;
+}
+
+
+/*
+ * Remove an object from the lookup-table. The following entries of the
+ * probe-sequence will be shifted back, so no tombstones are necessary.
+ */
+static void obj_tbl_rmv(short slot)
+{
+	int i = obj_tbl_hash(g_obj.id[slot]);
+	int j;
+	int k;
+
+	/* Find the entry of the object */
+	while(g_obj.tbl[i].slot != slot) {
+		if(g_obj.tbl[i].slot < 0)
+			return;
+
+		i = (i + 1) & (g_obj.tbl_size - 1);
+	}
+
+	/* Fill the gap with following entries of the probe-sequence */
+	j = i;
+	while(1) {
+		j = (j + 1) & (g_obj.tbl_size - 1);
+
+		if(g_obj.tbl[j].slot < 0)
+			break;
+
+		k = obj_tbl_hash(g_obj.tbl[j].id);
+
+		/* Skip entries which are already placed after the gap */
+		if((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			g_obj.tbl[i] = g_obj.tbl[j];
+			i = j;
+		}
+	}
+
+	g_obj.tbl[i].slot = -1;
+}
+
+
+/*
+ * Insert an object into the order-list, the lookup-table, all
+ * capability-lists it belongs to and the collision-grid, and increment the
+ * number of objects.
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+static int obj_link(short slot)
+{
+	uint32_t caps = obj_get_caps(slot);
+	struct obj_lst *lst;
+	int i;
+
+	obj_lst_ins(g_obj.order, g_obj.num, slot);
+	obj_tbl_ins(slot);
+	g_obj.num++;
+
+	for(i = 0; i < OBJ_LST_NUM; i++) {
+		if((caps & (1<<i)) == 0)
+			continue;
+
+		lst = &g_obj.lst[i];
+		obj_lst_ins(lst->slot, lst->num, slot);
+		lst->num++;
+	}
+
+	return obj_grid_ins(slot);
+}
+
+
+/*
+ * Remove an object from the order-list, the lookup-table, all
+ * capability-lists and the collision-grid, and decrement the number of
+ * objects. This has to be called before changing the ID, mask, model or rig
+ * of an object.
+ */
+static void obj_unlink(short slot)
+{
+	uint32_t caps = obj_get_caps(slot);
+	struct obj_lst *lst;
+	int i;
+
+	obj_grid_rmv(slot);
+
+	if(obj_lst_rmv(g_obj.order, g_obj.num, slot) == 0)
+		g_obj.num--;
+
+	obj_tbl_rmv(slot);
+
+	for(i = 0; i < OBJ_LST_NUM; i++) {
+		if((caps & (1<<i)) == 0)
+			continue;
+
+		lst = &g_obj.lst[i];
+		if(obj_lst_rmv(lst->slot, lst->num, slot) == 0)
+			lst->num--;
+	}
+}
+
+
+/*
+ * Set the matrices of a static object, which only have to be updated if the
+ * object is changed, as static objects are not processed when rendering.
+ */
+static void obj_static_matrix(short slot)
+{
+	if(g_obj.mask[slot] & OBJ_M_MOVE)
+		return;
+
+	mat4_idt(g_obj.pos_mat[slot]);
+	mat4_pfpos(g_obj.pos_mat[slot], g_obj.pos[slot]);
+
+	mat4_idt(g_obj.rot_mat[slot]);
+}
+
+static int obj_tbl_resize(int size)
+{
+	struct obj_tbl_entry *tbl;
+	int i;
+
+	if(!(tbl = malloc(size * sizeof(struct obj_tbl_entry))))
+		return -1;
+
+	for(i = 0; i < size; i++)
+		tbl[i].slot = -1;
+
+	free(g_obj.tbl);
+	g_obj.tbl = tbl;
+	g_obj.tbl_size = size;
+
+	/* Reinsert all objects */
+	for(i = 0; i < g_obj.num; i++)
+		obj_tbl_ins(g_obj.order[i]);
+
+	return 0;
 }
 
 extern short obj_set(uint32_t id, uint32_t mask, vec3_t pos, short model,
@@ -125,6 +628,7 @@ extern short obj_set(uint32_t id, uint32_t mask, vec3_t pos, short model,
 
 	/* Setup position and velocity */
 	vec3_cpy(g_obj.pos[slot], pos);
+	vec3_cpy(g_obj.col_pos[slot], pos);
 	vec3_clr(g_obj.vel[slot]);
 
 	/* Set movement and direction */
@@ -136,19 +640,13 @@ extern short obj_set(uint32_t id, uint32_t mask, vec3_t pos, short model,
 	vec3_cpy(g_obj.prev_pos[slot], g_obj.pos[slot]);
 	vec3_cpy(g_obj.prev_dir[slot], g_obj.dir[slot]);
 
-	/* Initialize the movement-log */
-	obj_log_reset(slot);
-	obj_log_set(slot, g_obj.ts[slot], g_obj.pos[slot],
-			g_obj.vel[slot], g_obj.mov[slot],
-			g_obj.dir[slot]);
-
 	/* Initialize object model and rig if requested */
 	g_obj.mdl[slot] = -1;
+	g_obj.rig[slot] = NULL;
 	if(mask & OBJ_M_MODEL) {
 		g_obj.mdl[slot] = model;
 
 		/* Attach a rig to the object */
-		g_obj.rig[slot] = NULL;
 		if(mask & OBJ_M_RIG) {
 			if(models[model]->attr_m & MDL_M_RIG) {
 				if(!(g_obj.rig[slot] = rig_derive(model)))
@@ -159,49 +657,60 @@ extern short obj_set(uint32_t id, uint32_t mask, vec3_t pos, short model,
 
 	/* Initialize the position and rotation matrices */
 	obj_update_matrix(slot);
+	obj_static_matrix(slot);
 
 	/* Initialize data-buffer if requested */
-	g_obj.len[slot] = 0;
+	g_obj.cold[slot].len = 0;
 	if(mask & OBJ_M_DATA) {
 		if(data && len) {
 			len = (len > OBJ_DATA_MAX) ? (OBJ_DATA_MAX) : (len);
-			g_obj.len[slot] = len;
-			memcpy(g_obj.data[slot], data, len);
+			g_obj.cold[slot].len = len;
+			memcpy(g_obj.cold[slot].data, data, len);
 		}
 	}
 
 	/* Initialize the handheld-handle */
-	g_obj.hnd[slot].idx = -1;
+	g_obj.cold[slot].hnd.idx = -1;
 	if(mask & OBJ_M_MOVE) {
-		g_obj.hnd[slot].idx = 0;
+		g_obj.cold[slot].hnd.idx = 0;
 	}
 
-	/* Increment number of objects in the object-table */
-	g_obj.num++;
-
-	/* Sort the order of objects in the object-list */
-	obj_sort();
+	/* Insert the object into the lists and the lookup-table */
+	if(obj_link(slot) < 0)
+		goto err_unlink;
 
-	/* Sort the objects */
 	return slot;
 
+err_unlink:
+	obj_unlink(slot);
+
+	if(g_obj.rig[slot])
+		rig_free(g_obj.rig[slot]);
+
+	g_obj.rig[slot] = NULL;
+
 err_reset_slot:
-	g_obj.mask[slot] = OBJ_M_NONE;
+	obj_put_slot(slot);
 	return -1;
 }
 
 
 extern void obj_del(short slot)
 {
-	if(obj_check_slot(slot))
+	if(obj_check_slot(slot) || g_obj.mask[slot] == OBJ_M_NONE)
 		return;
 
+	/* Remove the object from the lists and the lookup-table */
+	obj_unlink(slot);
+
 	/* Delete rig */
-	if(g_obj.mask[slot] & OBJ_M_RIG)
+	if(g_obj.rig[slot])
 		rig_free(g_obj.rig[slot]);
 
-	g_obj.mask[slot] = OBJ_M_NONE;
-	g_obj.num--;
+	g_obj.rig[slot] = NULL;
+
+	/* Release the slot */
+	obj_put_slot(slot);
 }
 
 
@@ -209,7 +718,7 @@ extern int obj_attach_rig(short slot, short mdlslot)
 {
 	struct model_rig *rig;
 
-	if(obj_check_slot(slot))
+	if(obj_check_slot(slot) || g_obj.mask[slot] == OBJ_M_NONE)
 		return -1;
 
 	if(mdl_check_slot(mdlslot))
@@ -218,8 +727,15 @@ extern int obj_attach_rig(short slot, short mdlslot)
 	if(!(rig = rig_derive(mdlslot)))
 		return -1;
 
-	g_obj.rig[slot] = rig;	
-	return 0;
+	/* Replace the old rig and update the capability-lists */
+	obj_unlink(slot);
+
+	if(g_obj.rig[slot])
+		rig_free(g_obj.rig[slot]);
+
+	g_obj.rig[slot] = rig;
+
+	return obj_link(slot);
 }
 
 
@@ -229,12 +745,47 @@ extern int obj_mod(short slot, short attr, void *data, int len)
 		return -1;
 
 	switch(attr) {
+		case OBJ_A_ID:
+			/* Reinsert the object with the new ID */
+			obj_unlink(slot);
+			g_obj.id[slot] = *(uint32_t *)data;
+			if(obj_link(slot) < 0)
+				return -1;
+			break;
+
 		case OBJ_A_MASK:
+			/* Reinsert the object with the new capabilities */
+			obj_unlink(slot);
 			g_obj.mask[slot] = *(uint32_t *)data;
+
+			/* Derive or free the rig if necessary */
+			if((g_obj.mask[slot] & OBJ_M_RIG) == 0) {
+				if(g_obj.rig[slot])
+					rig_free(g_obj.rig[slot]);
+
+				g_obj.rig[slot] = NULL;
+			}
+			else if(!g_obj.rig[slot] && g_obj.mdl[slot] >= 0 &&
+					(g_obj.mask[slot] & OBJ_M_MODEL) &&
+					(models[g_obj.mdl[slot]]->attr_m & MDL_M_RIG)) {
+				g_obj.rig[slot] = rig_derive(g_obj.mdl[slot]);
+			}
+
+			obj_static_matrix(slot);
+
+			if(obj_link(slot) < 0)
+				return -1;
 			break;
 
 		case OBJ_A_POS:
+			/* Reinsert the object into the collision-grid */
+			obj_grid_rmv(slot);
 			vec3_cpy(g_obj.pos[slot], data);
+			vec3_cpy(g_obj.col_pos[slot], data);
+			obj_static_matrix(slot);
+
+			if(obj_grid_ins(slot) < 0)
+				return -1;
 			break;
 
 		case OBJ_A_VEL:
@@ -246,8 +797,9 @@ extern int obj_mod(short slot, short attr, void *data, int len)
 			break;
 
 		case OBJ_A_BUF:
-			g_obj.len[slot] = len;
-			memcpy(g_obj.data[slot], data, len);
+			len = (len > OBJ_DATA_MAX) ? (OBJ_DATA_MAX) : (len);
+			g_obj.cold[slot].len = len;
+			memcpy(g_obj.cold[slot].data, data, len);
 			break;
 
 		default:
@@ -258,16 +810,39 @@ extern int obj_mod(short slot, short attr, void *data, int len)
 }
 
 
+extern uint32_t obj_get_hdl(short slot)
+{
+	if(obj_check_slot(slot) || g_obj.mask[slot] == OBJ_M_NONE)
+		return 0;
+
+	return OBJ_HDL(slot, g_obj.gen[slot]);
+}
+
+
+extern short obj_sel_hdl(uint32_t hdl)
+{
+	short slot = OBJ_HDL_SLOT(hdl);
+
+	if(obj_check_slot(slot) || g_obj.mask[slot] == OBJ_M_NONE)
+		return -1;
+
+	if(g_obj.gen[slot] != OBJ_HDL_GEN(hdl))
+		return -1;
+
+	return slot;
+}
+
+
 extern short obj_sel_id(uint32_t id)
 {
-	short i;
+	int i = obj_tbl_hash(id);
 
-	for(i = 0; i < OBJ_LIM; i++) {
-		if(g_obj.mask[i] == OBJ_M_NONE)
-			continue;
+	/* Follow the probe-sequence until an empty entry is reached */
+	while(g_obj.tbl[i].slot >= 0) {
+		if(g_obj.tbl[i].id == id)
+			return g_obj.tbl[i].slot;
 
-		if(g_obj.id[i] == id)
-			return i;
+		i = (i + 1) & (g_obj.tbl_size - 1);
 	}
 
 	return -1;
@@ -282,20 +857,20 @@ extern void obj_update_matrix(short slot)
 		return;
 
 	/* Reset the model-matrices to identity-matrices */
-	mat4_idt(g_obj.mat_pos[slot]);
-	mat4_idt(g_obj.mat_rot[slot]);
+	mat4_idt(g_obj.pos_mat[slot]);
+	mat4_idt(g_obj.rot_mat[slot]);
 
 	/* Set the position of the model */
-	g_obj.mat_pos[slot][0xc] = g_obj.pos[slot][0];
-	g_obj.mat_pos[slot][0xd] = g_obj.pos[slot][1];
-	g_obj.mat_pos[slot][0xe] = g_obj.pos[slot][2];
+	g_obj.pos_mat[slot][0xc] = g_obj.pos[slot][0];
+	g_obj.pos_mat[slot][0xd] = g_obj.pos[slot][1];
+	g_obj.pos_mat[slot][0xe] = g_obj.pos[slot][2];
 
 	/* Set the rotation of the model */
 	rot = atan2(g_obj.dir[slot][1], g_obj.dir[slot][0]);
-	g_obj.mat_rot[slot][0x0] =  cos(rot);
-	g_obj.mat_rot[slot][0x1] =  sin(rot);
-	g_obj.mat_rot[slot][0x4] = -sin(rot);
-	g_obj.mat_rot[slot][0x5] =  cos(rot);
+	g_obj.rot_mat[slot][0x0] =  cos(rot);
+	g_obj.rot_mat[slot][0x1] =  sin(rot);
+	g_obj.rot_mat[slot][0x4] = -sin(rot);
+	g_obj.rot_mat[slot][0x5] =  cos(rot);
 }
 
 
@@ -306,12 +881,9 @@ extern int obj_list(void *ptr, short *num, short max)
 
 	char *buf_ptr = (char *)ptr + 2;
 
-	for(i = 0; i < OBJ_LIM && obj_num < max; i++) {
-		if(g_obj.mask[i] == OBJ_M_NONE)
-			continue;
-
+	for(i = 0; i < g_obj.num && obj_num < max; i++) {
 		/* Write the id */
-		memcpy(buf_ptr, &g_obj.id[i], 4);
+		memcpy(buf_ptr, &g_obj.id[g_obj.order[i]], 4);
 		buf_ptr += 4;
 
 		obj_num++;
@@ -386,13 +958,13 @@ extern int obj_collect(uint16_t flg, void *in, short in_num, void **out,
 			}
 
 			if(flg & OBJ_A_BUF) {
-				int tmp = g_obj.len[slot];
+				int tmp = g_obj.cold[slot].len;
 
 				memcpy(ptr, &tmp, 4);
 				ptr += 4;
 				written += 4;
 
-				memcpy(ptr, g_obj.data[slot], tmp);
+				memcpy(ptr, g_obj.cold[slot].data, tmp);
 				ptr += tmp;
 				written += tmp;
 			}
@@ -452,62 +1024,79 @@ extern int obj_update(void *in)
 }
 
 
-/* Collect all triangles the object collides with */
-static void checkCollision(struct col_pck_sphere *pck)
+/*
+ * Check collision between the sphere and the collision-mesh of an object.
+ * Only the triangles overlapping the given world-space box are checked.
+ */
+static void obj_col_sphere(struct col_pck_sphere *pck, short slot, vec3_t min,
+		vec3_t max)
+{
+	struct mdl_col *col = &models[g_obj.mdl[slot]]->col;
+	vec3_t omin;
+	vec3_t omax;
+
+	/* Convert the box to object-space */
+	vec3_sub(min, g_obj.col_pos[slot], omin);
+	vec3_sub(max, g_obj.col_pos[slot], omax);
+
+	/* Use the cached triangles of static objects if possible */
+	if(g_obj.col_blk[slot]) {
+		col_bvh_s2t_check(pck, &col->cm_bvh, g_obj.col_blk[slot], NULL,
+				omin, omax);
+	}
+	else {
+		col_bvh_s2t_check(pck, &col->cm_bvh, NULL,
+				g_obj.col_pos[slot], omin, omax);
+	}
+}
+
+
+/*
+ * Collect all triangles the object collides with, using the given buffer for
+ * the query of the collision-grid.
+ */
+static void checkCollision(struct col_pck_sphere *pck,
+		struct obj_grid_res *res)
 {
 	int i;
-	int j;
 	int k;
+	int num;
+	short o;
 
-	struct model *mdl;
+	vec3_t min;
+	vec3_t max;
 
-	/* Go through all objects */
-	for(i = 0; i < OBJ_LIM; i++) {
-		if(g_obj.mask[i] == OBJ_M_NONE)
-			continue;
-
-		/* Don't check collision with the same object */
-		if(i == pck->objSlot)
-			continue;
+	/*
+	 * Calculate the box enclosing the swept sphere in eSpace and convert
+	 * it to R3-Space. A small margin is added to cover rounding-errors.
+	 */
+	for(k = 0; k < 3; k++) {
+		min[k] = MIN(pck->basePoint[k],
+				pck->basePoint[k] + pck->velocity[k]) - 1.0;
+		max[k] = MAX(pck->basePoint[k],
+				pck->basePoint[k] + pck->velocity[k]) + 1.0;
+
+		min[k] = min[k] * pck->eRadius[k] - OBJ_COL_MARGIN;
+		max[k] = max[k] * pck->eRadius[k] + OBJ_COL_MARGIN;
+	}
 
-		if((g_obj.mask[i] & OBJ_M_SOLID) == 0)
-			continue;
+	/* Get all solid objects close to the sphere */
+	if((num = obj_grid_query(min, max, res)) < 0)
+		return;
 
-		/* Get pointer to the model */
-		mdl = models[g_obj.mdl[i]];
+	for(i = 0; i < num; i++) {
+		o = res->slot[i];
 
-		/* TODO: Check collision with other player-objects */
-		if((mdl->attr_m & MDL_M_CCM) == 0)
+		/* Don't check collision with the same object */
+		if(o == pck->objSlot)
 			continue;
 
-		/* Go through all triangles */
-		for(j = 0; j < mdl->col.cm_tri_c; j++) {
-			vec3_t vtx[3];
-			int3_t idx;
-
-			/* Get indices of triangles */
-			memcpy(idx, mdl->col.cm_idx[j], INT3_SIZE);
-
-			/* Load triangle vertices and convert to eSpace */
-			for(k = 0; k < 3; k++) {
-				vec3_t tmpv;
-
-				/* Copy vertex */
-				vec3_cpy(tmpv, mdl->col.cm_vtx[idx[k]]);
-
-				/* Move relative to object-position */
-				vec3_add(g_obj.pos[i], tmpv, vtx[k]);
-
-				/* Convert to eSpace */
-				vec3_div(vtx[k], pck->eRadius, vtx[k]);
-			}
-
-			col_s2t_check(pck, vtx[0], vtx[1], vtx[2]);
-		}
+		obj_col_sphere(pck, o, min, max);
 	}
 }
 
-static void collideWithWorld(struct col_pck_sphere *pck, vec3_t pos, vec3_t del, int recDepth, vec3_t *opos)
+static void collideWithWorld(struct col_pck_sphere *pck, vec3_t pos, vec3_t del, int recDepth, vec3_t *opos,
+		struct obj_grid_res *res)
 {
 	float unitsPerMeter = 100.0;
 	float unitScale = unitsPerMeter / 100.0;
@@ -536,7 +1125,7 @@ static void collideWithWorld(struct col_pck_sphere *pck, vec3_t pos, vec3_t del,
 	pck->foundCollision = 0;
 
 	/* Check if a collision occurred and calculate the collision-point */
-	checkCollision(pck);
+	checkCollision(pck, res);
 
 	/* If no collision has been found */
 	if(pck->foundCollision == 0) {
@@ -592,10 +1181,12 @@ static void collideWithWorld(struct col_pck_sphere *pck, vec3_t pos, vec3_t del,
 	}
 
 	recDepth++;
-	collideWithWorld(pck, newBasePoint, newVelocityVector, recDepth, opos);
+	collideWithWorld(pck, newBasePoint, newVelocityVector, recDepth, opos,
+			res);
 }
 
-static int collideAndSlide(short slot, vec3_t pos, vec3_t del, vec3_t opos)
+static int collideAndSlide(short slot, vec3_t pos, vec3_t del, vec3_t opos,
+		struct obj_grid_res *res)
 {		
 	struct col_pck_sphere pck;
 
@@ -638,7 +1229,7 @@ static int collideAndSlide(short slot, vec3_t pos, vec3_t del, vec3_t opos)
 	/*
 	 * Check for collision with the triangle.
 	 */
-	collideWithWorld(&pck, epos, edel, 0, &retPos);
+	collideWithWorld(&pck, epos, edel, 0, &retPos, res);
 
 	if(pck.foundCollision) {
 		retMask = 1;
@@ -678,7 +1269,61 @@ extern void obj_print(short slot)
 static void obj_proc_rig_fpv(short slot)
 {
 	/* Calculate rig without aiming */
-	rig_update(g_obj.rig[slot]);
+	rig_set_aim(g_obj.rig[slot], 0);
+}
+
+/*
+ * Run the IK-chains of the model on a freshly sampled rig. The hook is turned
+ * towards the aim-point and feet which would sink into the ground are lifted
+ * onto it. Chains are only solved if a correction is required, so rigs in the
+ * same pose keep sharing it.
+ *
+ * @slot: The slot of the object
+ * @aim: The aim-point in model-space or NULL to not aim
+ */
+static void obj_proc_rig_ik(short slot, vec3_t aim)
+{
+	int i;
+	float d;
+	float hgt;
+	vec4_t calc;
+	vec3_t pos;
+	vec3_t trg;
+	vec3_t dir;
+	float *jnt;
+
+	struct model_rig *rig = g_obj.rig[slot];
+	struct model *mdl = models[rig->model];
+
+	if(aim && mdl->ik_aim_ok) {
+		vec3_sub(aim, rig->hook_pos[mdl->ik_aim.hook], dir);
+
+		if(vec3_angle(rig->hook_dir[mdl->ik_aim.hook], dir) >
+				mdl->ik_aim.tol)
+			rig_ik_solve(rig, &mdl->ik_aim, aim, NULL);
+	}
+
+	for(i = 0; i < mdl->ik_foot_num; i++) {
+		jnt = rig->base_mat[mdl->ik_foot[i].jnt[2]];
+
+		/* Get the position of the foot in world-space */
+		vec3_set(calc, jnt[0xc], jnt[0xd], 0);
+		calc[3] = 1;
+		vec4_trans(calc, g_obj.rot_mat[slot], calc);
+		vec3_add(g_obj.pos[slot], calc, pos);
+		pos[2] += OBJ_IK_FOOT_REACH;
+
+		if((d = obj_ground_dist(slot, pos, OBJ_IK_FOOT_REACH)) < 0)
+			continue;
+
+		/* The height the foot has to be at to stand on the ground */
+		hgt = OBJ_IK_FOOT_REACH - d + mdl->ik_foot_hgt[i];
+		if(jnt[0xe] >= hgt - mdl->ik_foot[i].tol)
+			continue;
+
+		vec3_set(trg, jnt[0xc], jnt[0xd], hgt);
+		rig_ik_solve(rig, &mdl->ik_foot[i], trg, NULL);
+	}
 }
 
 #if 0
@@ -719,16 +1364,37 @@ static void obj_proc_rig_tpv(short slot, vec3_t pos, vec3_t dir)
 }
 #endif
 
-extern void obj_sys_update(uint32_t now)
+/*
+ * Copy the current positions of the movable objects to their
+ * collision-positions.
+ */
+static void obj_sync_col_pos(void)
 {
 	int i;
-	int o;
+	short o;
+
+	for(i = 0; i < g_obj.lst[OBJ_LST_MOVE].num; i++) {
+		o = g_obj.lst[OBJ_LST_MOVE].slot[i];
+		vec3_cpy(g_obj.col_pos[o], g_obj.pos[o]);
+	}
+}
 
-	uint32_t lim_ts;
-	uint32_t run_ts;
-	uint32_t inp_ts;
 
-	char logi[OBJ_LIM];
+/*
+ * Move a single object by one tick. Other objects are only seen at their
+ * collision-positions and only the data of the object itself is written, so
+ * the objects can be moved in any order and on any thread with the same
+ * result.
+ *
+ * @idx: The index of the object in the list of movable objects
+ * @thrd: The index of the executing thread
+ * @data: Pointer to the timestamp of the current tick
+ */
+static void obj_step(int idx, int thrd, void *data)
+{
+	uint32_t run_ts = *(uint32_t *)data;
+	short o = g_obj.lst[OBJ_LST_MOVE].slot[idx];
+	struct obj_grid_res *res = &obj_col_res[thrd];
 
 	float f;
 	vec3_t acl;
@@ -741,188 +1407,167 @@ extern void obj_sys_update(uint32_t now)
 	float t_speed = 4.0;
 	vec3_t grav = {0, 0, -9.81};
 
-	struct inp_entry inp;
+	/* Skip if the object doesn't have to be updated yet */
+	if(run_ts < g_obj.ts[o])
+		return;
 
-	int c = 0;
+	/* 
+	 * Process friction.
+	 */
+	f = 1.0 - TICK_TIME_S * t_speed;
+	vec3_scl(g_obj.vel[o], f, g_obj.vel[o]);
 
-	now = floor(now / TICK_TIME) * TICK_TIME;
+	/*
+	 * Process movement-acceleration.
+	 */
 
-	/* Check if new inputs occurred */
-	if(inp_check_new()) {
-		/* Set iterator to latest input */
-		inp_begin();
+	/* Calculate the direction of acceleration */
+	vec3_set(frw, g_obj.dir[o][0], g_obj.dir[o][1], 0);
+	vec3_nrm(frw, frw);
 
-		inp_ts = inp_cur_ts();
-		run_ts = inp_ts;
+	vec3_cross(frw, up, rgt);
+	vec3_nrm(rgt, rgt);
 
-		obj_log_col(inp_ts, logi);
+	vec3_scl(frw, g_obj.mov[o][1], frw);
+	vec3_scl(rgt, g_obj.mov[o][0], rgt);
 
-		for(i = 0; i < OBJ_LIM; i++) {
-			if((g_obj.mask[i] & OBJ_M_MOVE) == 0)
-				continue;
+	vec3_add(frw, rgt, acl);
+	vec3_nrm(acl, acl);
 
-			if(g_obj.ts[i] > inp_ts) {
-				obj_log_cpy(i, logi[i],
-						&g_obj.ts[i],
-						g_obj.pos[i],
-						g_obj.vel[i],
-						g_obj.mov[i],
-						g_obj.dir[i]);
-			}
+	/* Scale acceleration */
+	vec3_scl(acl, 6, acl);
 
-			/* Update run-ts to the oldest timestamp */
-			if(run_ts > g_obj.ts[i]) {
-				run_ts = g_obj.ts[i];
-			}
-		}
+	f = TICK_TIME_S * t_speed;
+	vec3_scl(acl, f, acl);
 
-		/* Set the run-limit */	
-		lim_ts = inp_ts;
+	/* Update velocity of the object */
+	vec3_add(g_obj.vel[o], acl, g_obj.vel[o]);
+
+	/*
+	 * Process gravity.
+	 */	
+	if(g_obj.mask[o] & OBJ_M_GRAV) {
+		f = TICK_TIME_S * t_speed;
+		vec3_scl(grav, f, acl);
+
+		/* Update velocity of the object */
+		vec3_add(g_obj.vel[o], acl, g_obj.vel[o]);
+	}
+
+	/* Scale velocity by tick-time */
+	vec3_scl(g_obj.vel[o], TICK_TIME_S, del);
+	del[2] = 0.0;
+
+	/* Check collision */
+	if(g_obj.mask[o] & OBJ_M_SOLID) {
+		/* Collide and update position */
+		collideAndSlide(o, g_obj.pos[o], del, g_obj.pos[o],
+				res);
 	}
 	else {
-		for(i = 0; i < OBJ_LIM; i++) {
-			if((g_obj.mask[i] & OBJ_M_MOVE) == 0)
-				continue;
+		/* Update position */
+		vec3_add(g_obj.pos[o], del, g_obj.pos[o]);
+	}
+
 
-			/* Update run-ts to the oldest timestamp */
-			if(run_ts > g_obj.ts[i]) {
-				run_ts = g_obj.ts[i];
+	if(g_obj.mask[o] & OBJ_M_GRAV) {
+		/* Scale velocity by tick-time */
+		vec3_scl(g_obj.vel[o], TICK_TIME_S, del);
+		del[0] = 0.0;
+		del[1] = 0.0;
+
+		/* Check collision */
+		if(g_obj.mask[o] & OBJ_M_SOLID) {
+			/* Collide and update position */
+			if(collideAndSlide(o, g_obj.pos[o], del,
+						g_obj.pos[o], res)) {
+				g_obj.vel[o][2] = 0;
 			}
 		}
+		else {
+			/* Update position */
+			vec3_add(g_obj.pos[o], del, g_obj.pos[o]);
+		}
+	}
 
-		/* Set the run-limit */
-		lim_ts = now;
+	/* Limit movement-space */
+	if(ABS(g_obj.pos[o][0]) > 32.0) {
+		g_obj.pos[o][0] = 32.0 * SIGN(g_obj.pos[o][0]);
+		g_obj.vel[o][0] = 0;
 	}
 
+	if(ABS(g_obj.pos[o][1]) > 32.0) {
+		g_obj.pos[o][1] = 32.0 * SIGN(g_obj.pos[o][1]);
+		g_obj.vel[o][1] = 0;
+	}
+
+	g_obj.ts[o] += TICK_TIME;
+}
+
+
+extern void obj_sys_update(uint32_t now)
+{
+	int i;
+	short o;
+
+	uint32_t lim_ts;
+	uint32_t run_ts;
+	uint32_t late_ts = 0;
+
+	struct inp_entry inp;
+	struct obj_lst *move = &g_obj.lst[OBJ_LST_MOVE];
+
+	now = floor(now / TICK_TIME) * TICK_TIME;
+	lim_ts = now;
+
+	/* Check if new inputs occurred */
+	if(inp_check_new()) {
+		/* Set iterator to latest input */
+		inp_begin();
+
+		/*
+		 * If the tick of the input has already been simulated, restore
+		 * the state at the beginning of that tick. If the input is
+		 * older than the snapshot-ring, the oldest snapshot is restored
+		 * instead.
+		 */
+		lim_ts = inp_cur_ts();
+		obj_snap_load(lim_ts);
+	}
+
+	/* Continue from the oldest object */
+	run_ts = now;
+	for(i = 0; i < move->num; i++) {
+		o = move->slot[i];
+
+		if(run_ts > g_obj.ts[o])
+			run_ts = g_obj.ts[o];
+	}
+
+	/*
+	 * If the state couldn't be restored back to the tick of the input,
+	 * because it is older than the snapshot-ring or the ring has been
+	 * reset, apply the late inputs at the oldest tick instead of dropping
+	 * them.
+	 */
+	if(lim_ts < run_ts) {
+		ERR_LOG(("Input at %u is older than the snapshots", lim_ts));
+		late_ts = run_ts;
+	}
 
 	while(1) {
 		while(run_ts < lim_ts) {
-			c++;
+			/* Save the state for later rollbacks */
+			obj_snap_save(run_ts);
 
 			/*
-			 * Update the velocity and position of every object in
-			 * ascending order of the object-ID so collisions will
-			 * be processed equally on all clients.
+			 * Save the positions at the beginning of the tick,
+			 * which the objects collide against.
 			 */
-			for(i = 0; i < g_obj.num; i++) {
-				o = g_obj.order[i];
-
-				if((g_obj.mask[o] & OBJ_M_MOVE) == 0)
-					continue;
-
-				/* 
-				 * Skip if the object doesn't have to be updated
-				 * yet.
-				 */
-				if(run_ts < g_obj.ts[o])
-					continue;
-
-				/* 
-				 * Process friction.
-				 */
-				f = 1.0 - TICK_TIME_S * t_speed;
-				vec3_scl(g_obj.vel[o], f, g_obj.vel[o]);
-
-				/*
-				 * Process movement-acceleration.
-				 */
-
-				/* Calculate the direction of acceleration */
-				vec3_set(frw, g_obj.dir[o][0], g_obj.dir[o][1], 0);
-				vec3_nrm(frw, frw);
-
-				vec3_cross(frw, up, rgt);
-				vec3_nrm(rgt, rgt);
-
-				vec3_scl(frw, g_obj.mov[o][1], frw);
-				vec3_scl(rgt, g_obj.mov[o][0], rgt);
-
-				vec3_add(frw, rgt, acl);
-				vec3_nrm(acl, acl);
-
-				/* Scale acceleration */
-				vec3_scl(acl, 6, acl);
-
-				f = TICK_TIME_S * t_speed;
-				vec3_scl(acl, f, acl);
-
-				/* Update velocity of the object */
-				vec3_add(g_obj.vel[o], acl, g_obj.vel[o]);
-
-				/*
-				 * Process gravity.
-				 */	
-				if(g_obj.mask[o] & OBJ_M_GRAV) {
-					f = TICK_TIME_S * t_speed;
-					vec3_scl(grav, f, acl);
-
-					/* Update velocity of the object */
-					vec3_add(g_obj.vel[o], acl, g_obj.vel[o]);
-				}
-
-				/* Scale velocity by tick-time */
-				vec3_scl(g_obj.vel[o], TICK_TIME_S, del);
-				del[2] = 0.0;
-
-				/* Check collision */
-				if(g_obj.mask[o] & OBJ_M_SOLID) {
-					/* Collide and update position */
-					collideAndSlide(o, g_obj.pos[o],
-							del, g_obj.pos[o]);
-				}
-				else {
-					/* Update position */
-					vec3_add(g_obj.pos[o], del,
-							g_obj.pos[o]);
-				}
-
-
-				if(g_obj.mask[o] & OBJ_M_GRAV) {
-					/* Scale velocity by tick-time */
-					vec3_scl(g_obj.vel[o], TICK_TIME_S, del);
-					del[0] = 0.0;
-					del[1] = 0.0;
-
-					/* Check collision */
-					if(g_obj.mask[o] & OBJ_M_SOLID) {
-						/* Collide and update position */
-						if(collideAndSlide(o, g_obj.pos[o],
-									del, g_obj.pos[o])) {
-							g_obj.vel[o][2] = 0;
-						}
-					}
-					else {
-						/* Update position */
-						vec3_add(g_obj.pos[o], del,
-								g_obj.pos[o]);
-					}
-				}
-
-				/* Limit movement-space */
-				if(ABS(g_obj.pos[o][0]) > 32.0) {
-					g_obj.pos[o][0] = 32.0 * SIGN(g_obj.pos[o][0]);
-					g_obj.vel[o][0] = 0;
-				}
-
-				if(ABS(g_obj.pos[o][1]) > 32.0) {
-					g_obj.pos[o][1] = 32.0 * SIGN(g_obj.pos[o][1]);
-					g_obj.vel[o][1] = 0;
-				}
-
-				g_obj.ts[o] += TICK_TIME;
-
-				/*   */
-				if((g_obj.ts[o] % OBJ_LOG_TIME) == 0) {
-					obj_log_set(o,
-							g_obj.ts[o],
-							g_obj.pos[o],
-							g_obj.vel[o],
-							g_obj.mov[o],
-							g_obj.dir[o]);
-
-
-				}
-			}
+			obj_sync_col_pos();
+
+			/* Update the velocity and position of every object */
+			job_run(obj_step, move->num, &run_ts);
 
 			/*
 			 * Update run-timer.
@@ -931,14 +1576,15 @@ extern void obj_sys_update(uint32_t now)
 		}
 
 		if(inp_get(&inp)) {
-			short obj_slot = obj_sel_id(inp.obj_id);
+			o = obj_sel_id(inp.obj_id);
 
-			if(inp.ts >= g_obj.ts[obj_slot]) {
+			if(o >= 0 && (inp.ts >= g_obj.ts[o] ||
+						inp.ts < late_ts)) {
 				if(inp.mask & INP_M_MOV)
-					vec2_cpy(g_obj.mov[obj_slot], inp.mov);
+					vec2_cpy(g_obj.mov[o], inp.mov);
 
 				if(inp.mask & INP_M_DIR)
-					vec3_cpy(g_obj.dir[obj_slot], inp.dir);
+					vec3_cpy(g_obj.dir[o], inp.dir);
 			}
 
 			/* Jump to next input */
@@ -957,113 +1603,183 @@ extern void obj_sys_update(uint32_t now)
 			lim_ts = now;
 		}
 	}
+
+	/* Let the other systems see the new positions */
+	obj_sync_col_pos();
+}
+
+
+/*
+ * Choose the animation-LOD of a rig by the distance to the camera. Rigs
+ * outside of the view-cone of the camera are culled.
+ *
+ * @slot: The object-slot
+ * @fov: The half-angle of the view-cone in radians
+ *
+ * Returns: The LOD of the rig
+ */
+static char obj_rig_lod(short slot, float fov)
+{
+	vec3_t del;
+	float dist;
+
+	/* The rig of the player is always visible in first-person-view */
+	if(slot == g_core.obj && g_cam.mode == CAM_MODE_FPV)
+		return RIG_LOD_FULL;
+
+	vec3_sub(g_obj.pos[slot], g_cam.pos, del);
+	dist = vec3_len(del);
+
+	if(dist > OBJ_RIG_RADIUS) {
+		float agl = acos(vec3_dot(del, g_cam.v_forward) / dist);
+
+		if(agl > fov + asin(OBJ_RIG_RADIUS / dist))
+			return RIG_LOD_CULL;
+	}
+
+	if(dist >= OBJ_RIG_LOD_QUART)
+		return RIG_LOD_QUART;
+
+	if(dist >= OBJ_RIG_LOD_HALF)
+		return RIG_LOD_HALF;
+
+	return RIG_LOD_FULL;
 }
 
 
 extern void obj_sys_prerender(float interp)
 {
 	int i;
+	short o;
+	char lod;
+	float fov;
+	vec3_t aim_pos;
+	float *aim;
 
-	for(i = 0; i < OBJ_LIM; i++) {
-		if(g_obj.mask[i] & OBJ_M_MOVE) {
-			/* Calculate position the object is looking at */
-			obj_calc_view(i);
-		}
+	struct obj_lst *move = &g_obj.lst[OBJ_LST_MOVE];
+	struct obj_lst *rig = &g_obj.lst[OBJ_LST_RIG];
 
-		if(g_obj.mask[i] & OBJ_M_RIG) {
-			rig_prepare(g_obj.rig[i]);
+	/* The time passed since the last frame in milliseconds */
+	float dt = interp * TICK_TIME;
 
-			if(i == g_core.obj && g_cam.mode == CAM_MODE_FPV) {
-				obj_proc_rig_fpv(i);
-			}
-			else {
-				vec3_t off = {0, 0, 1.8};
-				vec3_t pos;
-				vec3_t tmp;
-
-				vec4_t calc;
-				mat4_t mat;
-
-				/*
-				 * Calculate the aim-point relative to the object.
-				 */
-				vec3_cpy(calc, g_obj.dir[i]);
-				calc[3] = 1;
-				mat4_inv(mat, g_obj.rot_mat[i]);
-				vec4_trans(calc, mat, calc);
-
-				vec3_scl(calc, 10, tmp);
-				vec3_add(off, tmp, pos);
-
-				/* Calculate rig with aiming */
-				rig_update_aim(g_obj.rig[i], pos);
-			}
+	/* Calculate the position the objects are looking at */
+	for(i = 0; i < move->num; i++)
+		obj_calc_view(move->slot[i]);
 
-			rig_finish(g_obj.rig[i]);
-		}
+	/* The half-angle of the cone around the view-frustum */
+	fov = atan(tan(DEG_TO_RAD(g_cam.aov) * 0.5) *
+			sqrt(1.0 + g_cam.asp * g_cam.asp));
+
+	for(i = 0; i < RIG_LOD_NUM; i++)
+		g_obj.rig_lod_num[i] = 0;
 
+	/* Update the rigs */
+	for(i = 0; i < rig->num; i++) {
+		o = rig->slot[i];
 
+		lod = obj_rig_lod(o, fov);
+		g_obj.rig_lod_num[(int)lod]++;
 
 		/*
-		 * Calculate position and rotation-matrix.
+		 * Only sample the animation if required by the LOD and
+		 * interpolate in between.
 		 */
-		if(g_obj.mask[i] & OBJ_M_MOVE) {
-			vec3_t forw;
-			float rot;
-			mat4_t pos_m;
-			mat4_t rot_m;
+		if(!rig_lod_check(g_obj.rig[o], lod, dt)) {
+			rig_lod_interp(g_obj.rig[o]);
+			continue;
+		}
 
-			vec2_set(forw, g_obj.dir[i][0], g_obj.dir[i][1]);
-			vec2_nrm(forw, forw);
+		rig_prepare(g_obj.rig[o]);
 
-			/* Set the rotation of the model */
-			rot = RAD_TO_DEG(atan2(forw[0], forw[1]));
+		if(o == g_core.obj && g_cam.mode == CAM_MODE_FPV) {
+			obj_proc_rig_fpv(o);
+			aim = NULL;
+		}
+		else {
+			vec3_t off = {0, 0, 1.8};
+			vec3_t tmp;
 
-			/* Calculate rotation-matrix */
-			mat4_idt(rot_m);
-			if(i != g_core.obj || g_cam.mode != CAM_MODE_FPV) {
-				mat4_rfagl_s(rot_m, 0, 0, rot);
-			}
-			else {
-				vec3_t off_v = {0, 0, -1.75};
-				vec3_t rev_v = {0, 0, 1.8};
-
-				mat4_t off_m;
-				mat4_t rev_m;
-				mat4_t pos_m;
-				mat4_t trans_m;
-
-				/* 
-	 			 * Calculate transformation-matrix for
-	 			 * first-person-view.
-				 */
-				mat4_idt(off_m);
-				mat4_idt(rev_m);
-				mat4_pfpos(off_m, off_v);
-				mat4_pfpos(rev_m, rev_v);
-
-				/* Calculate rotation-matrix */
-				mat4_cpy(rot_m, g_cam.forw_m);
-				mat4_mult(rot_m, off_m, rot_m);
-				mat4_mult(rev_m, rot_m, rot_m);
-			}
+			vec4_t calc;
+			mat4_t mat;
 
-			/* Calculate position-matrix */
-			mat4_idt(pos_m);
-			mat4_pfpos(pos_m, g_obj.pos[i]);
+			/*
+			 * Calculate the aim-point relative to the object.
+			 */
+			vec3_cpy(calc, g_obj.dir[o]);
+			calc[3] = 1;
+			mat4_inv(mat, g_obj.rot_mat[o]);
+			vec4_trans(calc, mat, calc);
+
+			vec3_scl(calc, 10, tmp);
+			vec3_add(off, tmp, aim_pos);
+
+			/* Calculate rig with aiming */
+			rig_update_aim(g_obj.rig[o], aim_pos);
+			aim = aim_pos;
+		}
+
+		rig_update(g_obj.rig[o], g_obj.rig[o]->lod_dt);
+		rig_finish(g_obj.rig[o]);
+
+		/* Correct the sampled pose before storing it */
+		obj_proc_rig_ik(o, aim);
+
+		rig_lod_store(g_obj.rig[o]);
+		rig_lod_interp(g_obj.rig[o]);
+	}
+
+	/*
+	 * Calculate position and rotation-matrix. The matrices of static
+	 * objects are only updated if the object is modified.
+	 */
+	for(i = 0; i < move->num; i++) {
+		vec3_t forw;
+		float rot;
+		mat4_t pos_m;
+		mat4_t rot_m;
 
-			/* Copy matrices to object */
-			mat4_cpy(g_obj.pos_mat[i], pos_m);
-			mat4_cpy(g_obj.rot_mat[i], rot_m);
+		o = move->slot[i];
+
+		vec2_set(forw, g_obj.dir[o][0], g_obj.dir[o][1]);
+		vec2_nrm(forw, forw);
+
+		/* Set the rotation of the model */
+		rot = RAD_TO_DEG(atan2(forw[0], forw[1]));
+
+		/* Calculate rotation-matrix */
+		mat4_idt(rot_m);
+		if(o != g_core.obj || g_cam.mode != CAM_MODE_FPV) {
+			mat4_rfagl_s(rot_m, 0, 0, rot);
 		}
 		else {
-			/* Set position-matrix */
-			mat4_idt(g_obj.pos_mat[i]);
-			mat4_pfpos(g_obj.pos_mat[i], g_obj.pos[i]);
+			vec3_t off_v = {0, 0, -1.75};
+			vec3_t rev_v = {0, 0, 1.8};
+
+			mat4_t off_m;
+			mat4_t rev_m;
 
-			/* Set rotation-matrix */
-			mat4_idt(g_obj.rot_mat[i]);
+			/* 
+			 * Calculate transformation-matrix for
+			 * first-person-view.
+			 */
+			mat4_idt(off_m);
+			mat4_idt(rev_m);
+			mat4_pfpos(off_m, off_v);
+			mat4_pfpos(rev_m, rev_v);
+
+			/* Calculate rotation-matrix */
+			mat4_cpy(rot_m, g_cam.forw_m);
+			mat4_mult(rot_m, off_m, rot_m);
+			mat4_mult(rev_m, rot_m, rot_m);
 		}
+
+		/* Calculate position-matrix */
+		mat4_idt(pos_m);
+		mat4_pfpos(pos_m, g_obj.pos[o]);
+
+		/* Copy matrices to object */
+		mat4_cpy(g_obj.pos_mat[o], pos_m);
+		mat4_cpy(g_obj.rot_mat[o], rot_m);
 	}
 }
 
@@ -1071,6 +1787,9 @@ extern void obj_sys_prerender(float interp)
 extern void obj_sys_render(void)
 {
 	int i;
+	short o;
+
+	struct obj_lst *model = &g_obj.lst[OBJ_LST_MODEL];
 
 	mat4_t idt;
 	mat4_t rot_m;
@@ -1081,52 +1800,52 @@ extern void obj_sys_render(void)
 
 	mat4_idt(idt);
 
-	for(i = 0; i < OBJ_LIM; i++) {
-		if(g_obj.mask[i] & OBJ_M_MODEL) {
-			mat4_cpy(pos_m, g_obj.pos_mat[i]);
-			mat4_cpy(rot_m, g_obj.rot_mat[i]);
+	for(i = 0; i < model->num; i++) {
+		o = model->slot[i];
 
-			/* Render the model */
-			if((g_obj.mask[i] & OBJ_M_MOVE) == 0 || 1)
-				mdl_render(g_obj.mdl[i], pos_m, rot_m, g_obj.rig[i]);
+		mat4_cpy(pos_m, g_obj.pos_mat[o]);
+		mat4_cpy(rot_m, g_obj.rot_mat[o]);
 
-			if(g_obj.mask[i] & OBJ_M_MOVE) {
-				/* Calculate position-matrix of hook */
-				mat4_idt(pos_m);
-				mat4_pfpos(pos_m, g_obj.pos[i]);
+		/* Render the model */
+		if((g_obj.mask[o] & OBJ_M_MOVE) == 0 || 1)
+			mdl_submit(g_obj.mdl[o], pos_m, rot_m, g_obj.rig[o]);
 
-				/* Calculate rotation-matrix of hook */
-				mat4_cpy(mat, g_hnd.hook_mat[0][0]);
-				mat4_mult(g_obj.rig[i]->hook_base_mat[0], mat, mat);
-				mat4_mult(g_obj.rot_mat[i], mat, rot_m);
+		if(g_obj.mask[o] & OBJ_M_MOVE) {
+			/* Calculate position-matrix of hook */
+			mat4_idt(pos_m);
+			mat4_pfpos(pos_m, g_obj.pos[o]);
 
-				mdl_render(mdl_get("pistol"), pos_m, rot_m, NULL);
-			}
+			/* Calculate rotation-matrix of hook */
+			mat4_cpy(mat, g_hnd.hook_mat[0][0]);
+			mat4_mult(g_obj.rig[o]->hook_base_mat[0], mat, mat);
+			mat4_mult(g_obj.rot_mat[o], mat, rot_m);
+
+			mdl_submit(mdl_get("pistol"), pos_m, rot_m, NULL);
+		}
 
-			if(g_obj.mask[i] & OBJ_M_MOVE) {
-				vec3_t pos;
+		if(g_obj.mask[o] & OBJ_M_MOVE) {
+			vec3_t pos;
 
-				/* Adjust the rotation of the handheld */
-				vec3_sub(g_obj.view_pos_rel[i], g_hnd.brl_off[0], pos);
+			/* Adjust the rotation of the handheld */
+			vec3_sub(g_obj.view_pos_rel[o], g_hnd.brl_off[0], pos);
 
-				mat4_idt(pos_m);
-				mat4_pfpos(pos_m, g_obj.pos[i]);
+			mat4_idt(pos_m);
+			mat4_pfpos(pos_m, g_obj.pos[o]);
 
-				mat4_idt(rot_m);
-				mat4_pfpos(rot_m, pos);
-				mat4_mult(g_obj.rot_mat[i], rot_m, rot_m);
+			mat4_idt(rot_m);
+			mat4_pfpos(rot_m, pos);
+			mat4_mult(g_obj.rot_mat[o], rot_m, rot_m);
 
-				mdl_render(mdl_get("sph2"), pos_m, rot_m, NULL);
-			}
+			mdl_submit(mdl_get("sph2"), pos_m, rot_m, NULL);
+		}
 
-			if(g_obj.mask[i] & OBJ_M_MOVE) {
-				/*
-				 * Render a sphere at the aiming-point.
-				 */		
-				mat4_idt(pos_m);
-				mat4_pfpos(pos_m, g_obj.view_pos[i]);
-				mdl_render(mdl_get("sph1"), pos_m, idt, NULL);
-			}
+		if(g_obj.mask[o] & OBJ_M_MOVE) {
+			/*
+			 * Render a sphere at the aiming-point.
+			 */		
+			mat4_idt(pos_m);
+			mat4_pfpos(pos_m, g_obj.view_pos[o]);
+			mdl_submit(mdl_get("sph1"), pos_m, idt, NULL);
 		}
 	}
 }
@@ -4,131 +4,734 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /*
- * object-movement-log
+ * object-snapshots
  */
 
-extern void obj_log_reset(short slot)
+/* The number of bytes needed to store the state of a single slot */
+#define OBJ_SNAP_SLOT (2 * sizeof(uint32_t) + 3 * VEC3_SIZE + VEC2_SIZE + \
+		sizeof(uint16_t))
+
+extern void obj_snap_init(void)
 {
-	g_obj.log[slot].start = 0;
-	g_obj.log[slot].num = 0;
+	g_obj.snap_lim = OBJ_SNAP_TICKS;
+	g_obj.snap_budget = OBJ_SNAP_BUDGET;
+	g_obj.snap_num = 0;
+	g_obj.snap_alloc = 0;
+	g_obj.snap = NULL;
 }
 
-extern short obj_log_set(short slot, uint32_t ts, vec3_t pos, vec3_t vel,
-		vec2_t mov, vec3_t dir)
+
+extern void obj_snap_close(void)
 {
 	short i;
-	short islot;
-	short tmp;
 
-	/*
-	 * Check if an entry with the timestamp is already in the list. If that
-	 * is the case, update the value of the entry;
-	 */	
-	for(i = 0; i < OBJ_LOG_LIM; i++) {
-		if(g_obj.log[slot].ts[i] == ts) {
-			/* Update values */
-			vec3_cpy(g_obj.log[slot].pos[i], pos);
-			vec3_cpy(g_obj.log[slot].vel[i], vel);
-
-			vec2_cpy(g_obj.log[slot].mov[i], mov);
-			vec3_cpy(g_obj.log[slot].dir[i], dir);
-			return i;
-		}
+	for(i = 0; i < g_obj.snap_num; i++)
+		free(g_obj.snap[i].obj_ts);
+
+	free(g_obj.snap);
+
+	g_obj.snap_num = 0;
+	g_obj.snap_alloc = 0;
+	g_obj.snap = NULL;
+}
+
+
+/*
+ * Split the buffer of a snapshot into the single blocks for the given number
+ * of slots.
+ */
+static void obj_snap_split(struct obj_snap *snap, char *ptr, int num)
+{
+	snap->obj_ts = (uint32_t *)ptr;
+	snap->mask = snap->obj_ts + num;
+	snap->pos = (vec3_t *)(snap->mask + num);
+	snap->vel = snap->pos + num;
+	snap->mov = (vec2_t *)(snap->vel + num);
+	snap->dir = (vec3_t *)(snap->mov + num);
+	snap->gen = (uint16_t *)(snap->dir + num);
+}
+
+
+/*
+ * Get the number of snapshots the limits allow for the current size of the
+ * object-table.
+ */
+static int obj_snap_count(void)
+{
+	int num;
+
+	num = MIN(g_obj.snap_lim, g_obj.snap_budget /
+			(int)(g_obj.alloc * OBJ_SNAP_SLOT));
+	return MAX(num, 1);
+}
+
+
+/*
+ * Allocate the snapshot-ring for the current size of the object-table, using
+ * as many snapshots as the limits allow.
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+static int obj_snap_alloc(void)
+{
+	char *ptr;
+	int num;
+	short i;
+
+	num = obj_snap_count();
+
+	if(!(g_obj.snap = calloc(num, sizeof(struct obj_snap))))
+		return -1;
+
+	for(i = 0; i < num; i++) {
+		if(!(ptr = malloc(g_obj.alloc * OBJ_SNAP_SLOT)))
+			goto err_free_snap;
+
+		g_obj.snap_num++;
+
+		g_obj.snap[i].ts = 0;
+		obj_snap_split(&g_obj.snap[i], ptr, g_obj.alloc);
 	}
 
+	g_obj.snap_alloc = g_obj.alloc;
+	return 0;
+
+err_free_snap:
+	obj_snap_close();
+	return -1;
+}
+
+
+/*
+ * Resize the buffer of a snapshot from the number of slots it has been
+ * allocated for to the current size of the object-table. The blocks only move
+ * further back, so they are moved starting with the last one. The new slots
+ * didn't hold any objects when the snapshot has been taken.
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+static int obj_snap_resize(struct obj_snap *snap)
+{
+	struct obj_snap tmp;
+	char *ptr;
+	int old = g_obj.snap_alloc;
+	int num = g_obj.alloc;
+
+	if(!(ptr = realloc(snap->obj_ts, num * OBJ_SNAP_SLOT)))
+		return -1;
+
+	obj_snap_split(snap, ptr, old);
+	obj_snap_split(&tmp, ptr, num);
+
+	memmove(tmp.gen, snap->gen, old * sizeof(uint16_t));
+	memmove(tmp.dir, snap->dir, old * VEC3_SIZE);
+	memmove(tmp.mov, snap->mov, old * VEC2_SIZE);
+	memmove(tmp.vel, snap->vel, old * VEC3_SIZE);
+	memmove(tmp.pos, snap->pos, old * VEC3_SIZE);
+	memmove(tmp.mask, snap->mask, old * sizeof(uint32_t));
+
+	memset(tmp.mask + old, 0, (num - old) * sizeof(uint32_t));
+
+	tmp.ts = snap->ts;
+	*snap = tmp;
+	return 0;
+}
+
+
+/*
+ * Grow the snapshots to the current size of the object-table and keep their
+ * contents. If the larger snapshots don't fit into the budget anymore, the
+ * oldest ones are dropped.
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+static int obj_snap_grow(void)
+{
+	struct obj_snap *ring;
+	struct obj_snap *snap;
+	char *ptr;
+	int num;
+	short i;
+	short k;
+
+	num = obj_snap_count();
+
+	if(!(ring = calloc(num, sizeof(struct obj_snap))))
+		goto err_close_snap;
+
 	/*
-	 * If the timestamp is smaller than the last entry in the list,
-	 * just return.
+	 * Move the snapshots to their place in the new ring, starting with
+	 * the newest one, and drop the unused ones.
 	 */
-	tmp = (g_obj.log[slot].start + g_obj.log[slot].num - 1) %
-		OBJ_LOG_LIM;
-	if(g_obj.log[slot].ts[tmp] > ts) {
+	while(g_obj.snap_num > 0) {
+		for(i = 1, k = 0; i < g_obj.snap_num; i++) {
+			if(g_obj.snap[i].ts > g_obj.snap[k].ts)
+				k = i;
+		}
+
+		snap = &g_obj.snap[k];
+		i = (snap->ts / TICK_TIME) % num;
+
+		if(snap->ts == 0 || ring[i].obj_ts) {
+			free(snap->obj_ts);
+		}
+		else {
+			if(obj_snap_resize(snap) < 0)
+				goto err_free_ring;
+
+			ring[i] = *snap;
+		}
+
+		*snap = g_obj.snap[--g_obj.snap_num];
+	}
+
+	/* Fill up the ring with unused snapshots */
+	for(i = 0; i < num; i++) {
+		if(ring[i].obj_ts)
+			continue;
+
+		if(!(ptr = malloc(g_obj.alloc * OBJ_SNAP_SLOT)))
+			goto err_free_ring;
+
+		ring[i].ts = 0;
+		obj_snap_split(&ring[i], ptr, g_obj.alloc);
+	}
+
+	free(g_obj.snap);
+	g_obj.snap = ring;
+	g_obj.snap_num = num;
+	g_obj.snap_alloc = g_obj.alloc;
+	return 0;
+
+err_free_ring:
+	for(i = 0; i < num; i++)
+		free(ring[i].obj_ts);
+
+	free(ring);
+
+err_close_snap:
+	obj_snap_close();
+	return -1;
+}
+
+
+extern int obj_snap_config(short ticks, int budget)
+{
+	if(ticks < 1 || budget < 0)
 		return -1;
+
+	obj_snap_close();
+
+	g_obj.snap_lim = ticks;
+	g_obj.snap_budget = budget;
+	return 0;
+}
+
+
+extern int obj_snap_save(uint32_t ts)
+{
+	struct obj_snap *snap;
+	int num = g_obj.alloc;
+
+	/* Grow the ring if the object-table has grown */
+	if(g_obj.snap_num == 0) {
+		if(obj_snap_alloc() < 0)
+			return -1;
+	}
+	else if(g_obj.snap_alloc != g_obj.alloc) {
+		if(obj_snap_grow() < 0)
+			return -1;
 	}
 
-	/* Get the slot at the end of the list */
-	islot = (g_obj.log[slot].start + g_obj.log[slot].num) %
-		OBJ_LOG_LIM;
+	snap = &g_obj.snap[(ts / TICK_TIME) % g_obj.snap_num];
+	snap->ts = ts;
+
+	memcpy(snap->obj_ts, g_obj.ts, num * sizeof(uint32_t));
+	memcpy(snap->mask, g_obj.mask, num * sizeof(uint32_t));
+	memcpy(snap->pos, g_obj.pos, num * VEC3_SIZE);
+	memcpy(snap->vel, g_obj.vel, num * VEC3_SIZE);
+	memcpy(snap->mov, g_obj.mov, num * VEC2_SIZE);
+	memcpy(snap->dir, g_obj.dir, num * VEC3_SIZE);
+	memcpy(snap->gen, g_obj.gen, num * sizeof(uint16_t));
+	return 0;
+}
 
-	/* Copy data to the slot */
-	g_obj.log[slot].ts[islot] = ts;
 
-	vec3_cpy(g_obj.log[slot].pos[islot], pos);
-	vec3_cpy(g_obj.log[slot].vel[islot], vel);
+extern int obj_snap_load(uint32_t ts)
+{
+	struct obj_snap *snap = NULL;
+	short i;
+	short o;
 
-	vec2_cpy(g_obj.log[slot].mov[islot], mov);
-	vec3_cpy(g_obj.log[slot].dir[islot], dir);
+	/* Find the oldest snapshot not older than the timestamp */
+	for(i = 0; i < g_obj.snap_num; i++) {
+		if(g_obj.snap[i].ts == 0 || g_obj.snap[i].ts < ts)
+			continue;
 
-	/* 
-	 * Move start of list to next slot so first one can be overwritten.
+		if(!snap || g_obj.snap[i].ts < snap->ts)
+			snap = &g_obj.snap[i];
+	}
+
+	if(!snap)
+		return -1;
+
+	/*
+	 * Only the movable objects are changed by the systems. Skip all
+	 * objects which have been created after the snapshot has been taken.
 	 */
-	if(g_obj.log[slot].num + 1 >= OBJ_LOG_LIM) {
-		g_obj.log[slot].start = (g_obj.log[slot].start + 1) %
-			OBJ_LOG_LIM;
+	for(i = 0; i < g_obj.lst[OBJ_LST_MOVE].num; i++) {
+		o = g_obj.lst[OBJ_LST_MOVE].slot[i];
+
+		if(snap->mask[o] == OBJ_M_NONE || snap->gen[o] != g_obj.gen[o])
+			continue;
+
+		g_obj.ts[o] = snap->obj_ts[o];
+		vec3_cpy(g_obj.pos[o], snap->pos[o]);
+		vec3_cpy(g_obj.vel[o], snap->vel[o]);
+		vec2_cpy(g_obj.mov[o], snap->mov[o]);
+		vec3_cpy(g_obj.dir[o], snap->dir[o]);
+	}
+
+	return 0;
+}
+
+
+/*
+ * object-collision-grid
+ */
+
+/* The buffer used to collect the objects to check the view-ray against */
+static struct obj_grid_res obj_view_res;
+
+extern void obj_grid_init(void)
+{
+	int i;
+
+	for(i = 0; i < OBJ_GRID_SIZE; i++) {
+		g_obj.grid.cell[i].num = 0;
+		g_obj.grid.cell[i].alloc = 0;
+		g_obj.grid.cell[i].slot = NULL;
 	}
-	else {
-		g_obj.log[slot].num += 1;
+
+	g_obj.grid.large.num = 0;
+	g_obj.grid.large.alloc = 0;
+	g_obj.grid.large.slot = NULL;
+}
+
+
+extern void obj_grid_close(void)
+{
+	int i;
+
+	for(i = 0; i < OBJ_GRID_SIZE; i++)
+		free(g_obj.grid.cell[i].slot);
+
+	free(g_obj.grid.large.slot);
+
+	obj_grid_init();
+	obj_grid_res_free(&obj_view_res);
+}
+
+
+/*
+ * Check if an object belongs into the collision-grid.
+ *
+ * Returns: 1 if the object is a static solid object with a collision-mesh,
+ * 	0 if not
+ */
+static int obj_grid_check(short slot)
+{
+	if((g_obj.mask[slot] & OBJ_M_SOLID) == 0)
+		return 0;
+
+	if(g_obj.mask[slot] & OBJ_M_MOVE)
+		return 0;
+
+	if(g_obj.mdl[slot] < 0)
+		return 0;
+
+	if((models[g_obj.mdl[slot]]->attr_m & MDL_M_CCM) == 0)
+		return 0;
+
+	return 1;
+}
+
+
+/*
+ * Convert a world-space box to the range of cells covered by the box.
+ */
+static void obj_grid_range(vec3_t min, vec3_t max, int3_t cmin, int3_t cmax)
+{
+	int i;
+
+	for(i = 0; i < 3; i++) {
+		cmin[i] = (int)floor(min[i] / OBJ_GRID_CELL);
+		cmax[i] = (int)floor(max[i] / OBJ_GRID_CELL);
 	}
+}
+
+
+/*
+ * Get the bucket a cell is mapped to.
+ */
+static struct obj_grid_cell *obj_grid_cell(int x, int y, int z)
+{
+	uint32_t h;
 
-	return islot;
+	h = ((uint32_t)x * 73856093) ^ ((uint32_t)y * 19349663) ^
+		((uint32_t)z * 83492791);
+
+	return &g_obj.grid.cell[h & (OBJ_GRID_SIZE - 1)];
 }
 
+
 /*
- * TODO: What if the timestamp is older than the oldest log-entry?!
+ * Add an object to a bucket, if it's not already in it.
+ *
+ * Returns: 0 on success or -1 if an error occurred
  */
-extern char obj_log_near(short slot, uint32_t ts)
+static int obj_grid_add(struct obj_grid_cell *cell, short slot)
 {
+	short *p;
+	short alloc;
 	int i;
-	char near = g_obj.log[slot].start;
 
-	for(i = 0; i < g_obj.log[slot].num; i++) {
-		short tmp = (g_obj.log[slot].start + i) % OBJ_LOG_LIM;
+	for(i = 0; i < cell->num; i++) {
+		if(cell->slot[i] == slot)
+			return 0;
+	}
+
+	if(cell->num >= cell->alloc) {
+		alloc = (cell->alloc > 0) ? (cell->alloc * 2) : (4);
 
-		if(g_obj.log[slot].ts[tmp] > ts)
-			break;
+		if(!(p = realloc(cell->slot, alloc * sizeof(short))))
+			return -1;
 
-		near = tmp;
+		cell->slot = p;
+		cell->alloc = alloc;
 	}
 
-	return near;
+	cell->slot[cell->num] = slot;
+	cell->num++;
+	return 0;
 }
 
-extern void obj_log_col(uint32_t ts, char *logi)
+
+/*
+ * Remove an object from a bucket. As the order of the buckets doesn't matter,
+ * the last entry will be moved into the gap.
+ */
+static void obj_grid_del(struct obj_grid_cell *cell, short slot)
 {
 	int i;
 
-	/* Collect log-entries closest to the timestamp */
-	for(i = 0; i < OBJ_LIM; i++) {
-		logi[i] = -1;
+	for(i = 0; i < cell->num; i++) {
+		if(cell->slot[i] == slot) {
+			cell->num--;
+			cell->slot[i] = cell->slot[cell->num];
+			return;
+		}
+	}
+}
+
+
+/*
+ * Get the number of cells in the given range.
+ */
+static int obj_grid_span(int3_t cmin, int3_t cmax)
+{
+	int i;
+	int span = 1;
+
+	for(i = 0; i < 3; i++) {
+		if(cmax[i] - cmin[i] >= OBJ_GRID_SPAN)
+			return OBJ_GRID_SPAN + 1;
+
+		span *= cmax[i] - cmin[i] + 1;
+	}
+
+	return span;
+}
+
+
+extern void obj_col_box(short slot, vec3_t min, vec3_t max)
+{
+	struct mdl_col *col = &models[g_obj.mdl[slot]]->col;
+
+	vec3_add(g_obj.col_pos[slot], col->bb_col.pos, min);
+	vec3_sub(min, col->bb_col.scl, min);
+
+	vec3_add(g_obj.col_pos[slot], col->bb_col.pos, max);
+	vec3_add(max, col->bb_col.scl, max);
+}
+
+
+extern int obj_grid_ins(short slot)
+{
+	struct col_bvh *bvh;
+	int tmp;
+	int3_t cmin;
+	int3_t cmax;
+	int x;
+	int y;
+	int z;
+
+	if(!obj_grid_check(slot))
+		return 0;
+
+	obj_col_box(slot, g_obj.col_min[slot], g_obj.col_max[slot]);
+	obj_grid_range(g_obj.col_min[slot], g_obj.col_max[slot], cmin, cmax);
+
+	/*
+	 * Cache the triangles of the collision-mesh in world-space, as the
+	 * object won't move until it's removed from the grid again.
+	 */
+	bvh = &models[g_obj.mdl[slot]]->col.cm_bvh;
+	if(bvh->blk_num > 0) {
+		tmp = bvh->blk_num * sizeof(struct col_trig_blk);
+		if(!(g_obj.col_blk[slot] = malloc(tmp)))
+			return -1;
+
+		col_blk_move(g_obj.col_blk[slot], bvh->blk, bvh->blk_num,
+				g_obj.col_pos[slot]);
+	}
+
+	/* Large objects are kept in a separate list */
+	if(obj_grid_span(cmin, cmax) > OBJ_GRID_SPAN)
+		return obj_grid_add(&g_obj.grid.large, slot);
+
+	for(x = cmin[0]; x <= cmax[0]; x++) {
+		for(y = cmin[1]; y <= cmax[1]; y++) {
+			for(z = cmin[2]; z <= cmax[2]; z++) {
+				if(obj_grid_add(obj_grid_cell(x, y, z), slot) < 0)
+					goto err_rmv;
+			}
+		}
+	}
+
+	return 0;
+
+err_rmv:
+	obj_grid_rmv(slot);
+	return -1;
+}
+
+
+extern void obj_grid_rmv(short slot)
+{
+	int3_t cmin;
+	int3_t cmax;
+	int x;
+	int y;
+	int z;
+
+	if(!obj_grid_check(slot))
+		return;
+
+	/* Free the cached triangles */
+	free(g_obj.col_blk[slot]);
+	g_obj.col_blk[slot] = NULL;
+
+	obj_grid_range(g_obj.col_min[slot], g_obj.col_max[slot], cmin, cmax);
 
-		if(g_obj.mask[i] != 0) {
-			logi[i] = obj_log_near(i, ts);
+	if(obj_grid_span(cmin, cmax) > OBJ_GRID_SPAN) {
+		obj_grid_del(&g_obj.grid.large, slot);
+		return;
+	}
+
+	for(x = cmin[0]; x <= cmax[0]; x++) {
+		for(y = cmin[1]; y <= cmax[1]; y++) {
+			for(z = cmin[2]; z <= cmax[2]; z++)
+				obj_grid_del(obj_grid_cell(x, y, z), slot);
 		}
 	}
 }
 
-extern void obj_log_cpy(short slot, short i, uint32_t *ts, vec3_t pos, vec3_t vel,
-		vec2_t mov, vec3_t dir)
+
+/*
+ * Append an object to the result-buffer.
+ *
+ * Returns: 0 on success or -1 if an error occurred
+ */
+static int obj_grid_res_add(struct obj_grid_res *res, short slot)
 {
-	struct obj_log *log = &g_obj.log[slot];
+	short *p;
+	short alloc;
 
-	*ts = log->ts[i];
+	if(res->num >= res->alloc) {
+		alloc = (res->alloc > 0) ? (res->alloc * 2) : (16);
 
-	vec3_cpy(pos, log->pos[i]);
-	vec3_cpy(vel, log->vel[i]);
+		if(!(p = realloc(res->slot, alloc * sizeof(short))))
+			return -1;
 
-	vec2_cpy(mov, log->mov[i]);
-	vec3_cpy(dir, log->dir[i]);
+		res->slot = p;
+		res->alloc = alloc;
+	}
+
+	res->slot[res->num] = slot;
+	res->num++;
+	return 0;
 }
 
 
-extern void obj_calc_view(short slot)
+extern int obj_grid_query(vec3_t min, vec3_t max, struct obj_grid_res *res)
 {
+	struct obj_grid_cell *cell;
+	int3_t qmin;
+	int3_t qmax;
+	int3_t omin;
+	int3_t omax;
+	vec3_t bmin;
+	vec3_t bmax;
+	int x;
+	int y;
+	int z;
 	int i;
 	int j;
+	short slot;
+
+	res->num = 0;
+
+	/* Check the large objects */
+	for(i = 0; i < g_obj.grid.large.num; i++) {
+		slot = g_obj.grid.large.slot[i];
+
+		if(!col_b2b_check(min, max, g_obj.col_min[slot],
+					g_obj.col_max[slot]))
+			continue;
+
+		if(obj_grid_res_add(res, slot) < 0)
+			return -1;
+	}
+
+	obj_grid_range(min, max, qmin, qmax);
+
+	/* If the box is too large, fall back to checking all objects */
+	if(obj_grid_span(qmin, qmax) > OBJ_GRID_SPAN) {
+		res->num = 0;
+
+		for(i = 0; i < g_obj.lst[OBJ_LST_SOLID].num; i++) {
+			slot = g_obj.lst[OBJ_LST_SOLID].slot[i];
+
+			if(!obj_grid_check(slot))
+				continue;
+
+			if(!col_b2b_check(min, max, g_obj.col_min[slot],
+						g_obj.col_max[slot]))
+				continue;
+
+			if(obj_grid_res_add(res, slot) < 0)
+				return -1;
+		}
+
+		goto check_movable;
+	}
+
+	for(x = qmin[0]; x <= qmax[0]; x++) {
+		for(y = qmin[1]; y <= qmax[1]; y++) {
+			for(z = qmin[2]; z <= qmax[2]; z++) {
+				cell = obj_grid_cell(x, y, z);
+
+				for(i = 0; i < cell->num; i++) {
+					slot = cell->slot[i];
+
+					/*
+					 * Only report an object in the first
+					 * cell it shares with the box, so each
+					 * object is only returned once.
+					 */
+					obj_grid_range(g_obj.col_min[slot],
+							g_obj.col_max[slot],
+							omin, omax);
+
+					if(x < omin[0] || x > omax[0] ||
+							y < omin[1] || y > omax[1] ||
+							z < omin[2] || z > omax[2])
+						continue;
+
+					if(x != MAX(omin[0], qmin[0]) ||
+							y != MAX(omin[1], qmin[1]) ||
+							z != MAX(omin[2], qmin[2]))
+						continue;
+
+					if(!col_b2b_check(min, max,
+								g_obj.col_min[slot],
+								g_obj.col_max[slot]))
+						continue;
+
+					if(obj_grid_res_add(res, slot) < 0)
+						return -1;
+				}
+			}
+		}
+	}
+
+check_movable:
+	/*
+	 * Movable objects are not kept in the grid, as they change their
+	 * position every tick, so check them directly.
+	 */
+	for(i = 0; i < g_obj.lst[OBJ_LST_MOVE].num; i++) {
+		slot = g_obj.lst[OBJ_LST_MOVE].slot[i];
+
+		if((g_obj.mask[slot] & OBJ_M_SOLID) == 0 || g_obj.mdl[slot] < 0)
+			continue;
+
+		if((models[g_obj.mdl[slot]]->attr_m & MDL_M_CCM) == 0)
+			continue;
+
+		obj_col_box(slot, bmin, bmax);
+		if(!col_b2b_check(min, max, bmin, bmax))
+			continue;
+
+		if(obj_grid_res_add(res, slot) < 0)
+			return -1;
+	}
+
+	/*
+	 * Sort the objects by their IDs, so the collisions are processed in
+	 * the same order on all peers.
+	 */
+	for(i = 1; i < res->num; i++) {
+		slot = res->slot[i];
+
+		for(j = i; j > 0; j--) {
+			if(g_obj.id[res->slot[j - 1]] < g_obj.id[slot])
+				break;
+
+			if(g_obj.id[res->slot[j - 1]] == g_obj.id[slot] &&
+					res->slot[j - 1] < slot)
+				break;
+
+			res->slot[j] = res->slot[j - 1];
+		}
+
+		res->slot[j] = slot;
+	}
+
+	return res->num;
+}
+
+
+extern void obj_grid_res_free(struct obj_grid_res *res)
+{
+	free(res->slot);
+
+	res->num = 0;
+	res->alloc = 0;
+	res->slot = NULL;
+}
+
+
+extern void obj_calc_view(short slot)
+{
+	int i;
 	int k;
+	int num;
+	short o;
 
 	vec3_t pos;
 	vec3_t dir;
@@ -139,6 +742,9 @@ extern void obj_calc_view(short slot)
 	vec4_t calc;
 	mat4_t mat;
 
+	vec3_t min;
+	vec3_t max;
+
 	/* Calculate the origin of the view-ray */
 	vec3_cpy(pos, g_obj.pos[slot]);
 	vec3_add(pos, off, pos);
@@ -153,50 +759,40 @@ extern void obj_calc_view(short slot)
 	/* Initialize the collision-package */
 	col_init_pck_ray(&pck, pos, dir);
 
-	/* Go through all objects */
-	for(i = 0; i < OBJ_LIM; i++) {
-		if(g_obj.mask[i] == OBJ_M_NONE)
-			continue;
+	/*
+	 * Calculate the box enclosing the view-ray, as hits outside of the
+	 * view-range are ignored anyway.
+	 */
+	for(k = 0; k < 3; k++) {
+		min[k] = MIN(pos[k], pos[k] + dir[k] * OBJ_VIEW_RANGE);
+		max[k] = MAX(pos[k], pos[k] + dir[k] * OBJ_VIEW_RANGE);
 
-		/* Don't check collision with the same object */
-		if(i == slot)
-			continue;
+		min[k] -= OBJ_COL_MARGIN;
+		max[k] += OBJ_COL_MARGIN;
+	}
 
-		if((g_obj.mask[i] & OBJ_M_SOLID) == 0)
-			continue;
+	/* Get all solid objects close to the view-ray */
+	if((num = obj_grid_query(min, max, &obj_view_res)) < 0)
+		num = 0;
 
-		/* Get pointer to the model */
-		mdl = models[g_obj.mdl[i]];
+	for(i = 0; i < num; i++) {
+		o = obj_view_res.slot[i];
 
-		/* TODO: Check collision with other player-objects */
-		if((mdl->attr_m & MDL_M_CCM) == 0)
+		/* Don't check collision with the same object */
+		if(o == slot)
 			continue;
 
-		/* Go through all triangles */
-		for(j = 0; j < mdl->col.cm_tri_c; j++) {
-			vec3_t vtx[3];
-			int3_t idx;
-
-			/* Get indices of triangles */
-			memcpy(idx, mdl->col.cm_idx[j], INT3_SIZE);
-
-			/* Copy corner-points */
-			for(k = 0; k < 3; k++) {
-				/* Copy vertex */
-				vec3_cpy(vtx[k], mdl->col.cm_vtx[idx[k]]);
-
-				/* Move relative to object-position */
-				vec3_add(g_obj.pos[i], vtx[k], vtx[k]);
-			}
+		/* Get pointer to the model */
+		mdl = models[g_obj.mdl[o]];
 
-			col_r2t_check(&pck, vtx[0], vtx[1], vtx[2]);
-		}
+		col_bvh_r2t_check(&pck, &mdl->col.cm_bvh, mdl->col.cm_vtx,
+				mdl->col.cm_idx, g_obj.pos[o]);
 	}
 
 
 	/* Limit view-range */
-	if(!pck.found || pck.col_t > 10) {
-		pck.col_t = 10;
+	if(!pck.found || pck.col_t > OBJ_VIEW_RANGE) {
+		pck.col_t = OBJ_VIEW_RANGE;
 	}
 
 	/* 
@@ -218,6 +814,57 @@ extern void obj_calc_view(short slot)
 }
 
 
+extern float obj_ground_dist(short slot, vec3_t pos, float max)
+{
+	int i;
+	int num;
+	short o;
+
+	vec3_t dir = {0, 0, -1};
+	struct col_pck_ray pck;
+
+	struct model *mdl;
+
+	vec3_t min;
+	vec3_t max_pos;
+
+	col_init_pck_ray(&pck, pos, dir);
+
+	/* The box enclosing the ray */
+	vec3_cpy(min, pos);
+	vec3_cpy(max_pos, pos);
+	min[2] -= max;
+
+	for(i = 0; i < 3; i++) {
+		min[i] -= OBJ_COL_MARGIN;
+		max_pos[i] += OBJ_COL_MARGIN;
+	}
+
+	/* Get all solid objects close to the ray */
+	if((num = obj_grid_query(min, max_pos, &obj_view_res)) < 0)
+		num = 0;
+
+	for(i = 0; i < num; i++) {
+		o = obj_view_res.slot[i];
+
+		/* Don't check collision with the same object */
+		if(o == slot)
+			continue;
+
+		/* Get pointer to the model */
+		mdl = models[g_obj.mdl[o]];
+
+		col_bvh_r2t_check(&pck, &mdl->col.cm_bvh, mdl->col.cm_vtx,
+				mdl->col.cm_idx, g_obj.pos[o]);
+	}
+
+	if(!pck.found || pck.col_t > max)
+		return -1;
+
+	return pck.col_t;
+}
+
+
 extern void obj_hnd_update(short slot)
 {
 	vec4_t calc;
@@ -228,7 +875,7 @@ extern void obj_hnd_update(short slot)
 	mat4_t hook_mat;
 
 	/* Get the index of the handheld */
-	if((hnd_idx = g_obj.hnd[slot].idx) < 0)
+	if((hnd_idx = g_obj.cold[slot].hnd.idx) < 0)
 		return;
 
 	/* Get the slot of the parent-hook */
@@ -241,15 +888,15 @@ extern void obj_hnd_update(short slot)
 	vec3_cpy(calc, g_hnd.hook_vec[hnd_idx][par_hook]);
 	calc[3] = 1.0;
 	vec4_trans(calc, hook_mat, calc);
-	vec3_cpy(g_obj.hnd[slot].pos, calc);
+	vec3_cpy(g_obj.cold[slot].hnd.pos, calc);
 
 	/* Calculate the position-matrix of the handheld */
 	mat4_mult(hook_mat, g_hnd.hook_mat[hnd_idx][par_hook], mat);
-	mat4_cpy(g_obj.hnd[slot].pos_mat, mat);
+	mat4_cpy(g_obj.cold[slot].hnd.pos_mat, mat);
 
 	/* Calculate the barrel-position */
 	vec3_cpy(calc, g_hnd.brl_off[hnd_idx]);
 	calc[3] = 1;
 	vec4_trans(calc, hook_mat, calc);
-	vec3_cpy(g_obj.hnd[slot].brl_pos, calc);
+	vec3_cpy(g_obj.cold[slot].hnd.brl_pos, calc);
 }
@@ -5,6 +5,14 @@
 
 struct opengl_wrapper {
 	SDL_GLContext context;
+
+	/*
+	 * The palette-ring with the alignment of the offsets and a fence for
+	 * each region, to wait until the GPU has finished reading from it.
+	 */
+	uint32_t palette;
+	uint32_t palette_align;
+	GLsync palette_sync[REN_PALETTE_FRAMES];
 };
 
 static struct opengl_wrapper ogl;
@@ -85,6 +93,9 @@ static void GLAPIENTRY gl_callback(GLenum source,
 
 extern int gl_init(SDL_Window *window)
 {
+	int i;
+	GLint align;
+
 	ogl.context = SDL_GL_CreateContext(window);
 	if(ogl.context == NULL) {
 		ERR_LOG(("Couldn't create opengl context"));
@@ -101,12 +112,33 @@ extern int gl_init(SDL_Window *window)
 	glEnable(GL_DEBUG_OUTPUT);
 	glDebugMessageCallback(gl_callback, 0);
 
+	/* Create the palette-ring */
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+	ogl.palette_align = (align > 0) ? (align) : (1);
+
+	glGenBuffers(1, &ogl.palette);
+	glBindBuffer(GL_UNIFORM_BUFFER, ogl.palette);
+	glBufferData(GL_UNIFORM_BUFFER, REN_PALETTE_BUF, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	for(i = 0; i < REN_PALETTE_FRAMES; i++)
+		ogl.palette_sync[i] = NULL;
+
 	return 0;
 }
 
 
 extern void gl_destroy(void)
 {
+	int i;
+
+	for(i = 0; i < REN_PALETTE_FRAMES; i++) {
+		if(ogl.palette_sync[i])
+			glDeleteSync(ogl.palette_sync[i]);
+	}
+
+	glDeleteBuffers(1, &ogl.palette);
+
 	SDL_GL_DeleteContext(ogl.context);
 }
 
@@ -419,20 +451,86 @@ extern void gl_render_set_texture(uint32_t hdl, enum mdl_type type)
 
 
 extern void gl_render_set_uniform_buffer(unsigned int buf,
-					 struct uni_buffer uni)
+					 struct uni_buffer *uni)
 {
 
 	glBindBuffer(GL_UNIFORM_BUFFER, buf);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(struct uni_buffer), &uni,
-				GL_STATIC_DRAW);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(struct uni_buffer), uni,
+				GL_STREAM_DRAW);
 	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 	glBindBufferBase(GL_UNIFORM_BUFFER, 0, buf);
 }
 
 
-extern void gl_render_draw(size_t indices, enum mdl_type type)
+extern uint32_t gl_get_palette_align(void)
+{
+	return ogl.palette_align;
+}
+
+
+extern void gl_begin_palette(int frm)
+{
+	GLenum res;
+
+	if(!ogl.palette_sync[frm])
+		return;
+
+	/* Wait until the GPU is done with the last frame using the region */
+	do {
+		res = glClientWaitSync(ogl.palette_sync[frm],
+				GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+	} while(res == GL_TIMEOUT_EXPIRED);
+
+	glDeleteSync(ogl.palette_sync[frm]);
+	ogl.palette_sync[frm] = NULL;
+}
+
+
+extern void gl_end_palette(int frm)
+{
+	ogl.palette_sync[frm] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+
+extern void *gl_map_palette(uint32_t off, uint32_t size)
+{
+	/*
+	 * The region is not in use by the GPU anymore, so the range can be
+	 * mapped without synchronization.
+	 */
+	glBindBuffer(GL_UNIFORM_BUFFER, ogl.palette);
+	return glMapBufferRange(GL_UNIFORM_BUFFER, off, size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+			GL_MAP_UNSYNCHRONIZED_BIT);
+}
+
+
+extern void gl_unmap_palette(void)
+{
+	glUnmapBuffer(GL_UNIFORM_BUFFER);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+
+extern void gl_render_set_palette(uint32_t off)
+{
+	glBindBufferRange(GL_UNIFORM_BUFFER, 2, ogl.palette, off,
+			REN_PALETTE_SIZE);
+}
+
+
+extern void gl_render_set_instances(uint32_t off)
+{
+	glBindBufferRange(GL_UNIFORM_BUFFER, 3, ogl.palette, off,
+			REN_INST_SIZE);
+}
+
+
+extern void gl_render_draw(size_t indices, uint32_t inst_num,
+                           enum mdl_type type)
 {
-	glDrawElements(GL_TRIANGLES, indices, GL_UNSIGNED_INT, NULL);
+	glDrawElementsInstanced(GL_TRIANGLES, indices, GL_UNSIGNED_INT, NULL,
+			inst_num);
 	if(type == MDL_TYPE_SKYBOX) {
 		glDepthMask(GL_TRUE);
 	}
@@ -1,5 +1,12 @@
 #include "quaternion.h"
 
+#include <math.h>
+
+
+/* The range of the three smallest components of a unit-quaternion */
+#define QAT_PACK_LIM  0.70710678118654752440
+#define QAT_PACK_MAX  32767
+
 
 extern void qat_add(vec4_t q1, vec4_t q2, vec4_t out)
 {
@@ -32,3 +39,169 @@ extern void qat_interp(vec4_t q1, vec4_t q2, float p, vec4_t out)
 
 	vec4_nrm(conv, out);
 }
+
+
+extern void qat_pack(vec4_t q, uint16_t *out)
+{
+	int i;
+	int j;
+	int max = 0;
+	float sgn;
+	float v;
+
+	/* Find the largest component */
+	for(i = 1; i < 4; i++) {
+		if(fabs(q[i]) > fabs(q[max]))
+			max = i;
+	}
+
+	/*
+	 * As q and -q are the same rotation, flip the quaternion so the largest
+	 * component is positive and can be restored from the others.
+	 */
+	sgn = q[max] < 0 ? -1.0 : 1.0;
+
+	for(i = 0, j = 0; i < 4; i++) {
+		if(i == max)
+			continue;
+
+		v = (q[i] * sgn / QAT_PACK_LIM + 1.0) * 0.5;
+		if(v < 0) v = 0;
+		if(v > 1) v = 1;
+
+		out[j++] = (uint16_t)(v * QAT_PACK_MAX + 0.5);
+	}
+
+	/* Store the index of the largest component in the top bits */
+	out[0] |= (max & 1) << 15;
+	out[1] |= (max >> 1) << 15;
+}
+
+
+extern void qat_unpack(uint16_t *in, vec4_t out)
+{
+	int i;
+	int j;
+	int max;
+	float sum = 0;
+	float v;
+
+	max = (in[0] >> 15) | ((in[1] >> 15) << 1);
+
+	for(i = 0, j = 0; i < 4; i++) {
+		if(i == max)
+			continue;
+
+		v = (in[j++] & 0x7fff) * (2.0 / QAT_PACK_MAX) - 1.0;
+		out[i] = v * QAT_PACK_LIM;
+		sum += out[i] * out[i];
+	}
+
+	out[max] = sum < 1.0 ? sqrt(1.0 - sum) : 0.0;
+}
+
+
+extern void qat_conj(vec4_t q, vec4_t out)
+{
+	out[0] =  q[0];
+	out[1] = -q[1];
+	out[2] = -q[2];
+	out[3] = -q[3];
+}
+
+
+extern void qat_rot_vec(vec4_t q, vec3_t v, vec3_t out)
+{
+	vec3_t u;
+	vec3_t t;
+	vec3_t c;
+
+	/* v' = v + w * t + u x t with t = 2 * (u x v) */
+	vec3_set(u, q[1], q[2], q[3]);
+	vec3_cross(u, v, t);
+	vec3_scl(t, 2, t);
+	vec3_cross(u, t, c);
+
+	out[0] = v[0] + q[0] * t[0] + c[0];
+	out[1] = v[1] + q[0] * t[1] + c[1];
+	out[2] = v[2] + q[0] * t[2] + c[2];
+}
+
+
+extern void qat_from_mat(mat4_t m, vec4_t out)
+{
+	float tr = m[0x0] + m[0x5] + m[0xa];
+	float s;
+
+	/* Use the largest diagonal-element to keep the division stable */
+	if(tr > 0) {
+		s = 0.5 / sqrt(tr + 1.0);
+		out[0] = 0.25 / s;
+		out[1] = (m[0x6] - m[0x9]) * s;
+		out[2] = (m[0x8] - m[0x2]) * s;
+		out[3] = (m[0x1] - m[0x4]) * s;
+	}
+	else if(m[0x0] > m[0x5] && m[0x0] > m[0xa]) {
+		s = 2.0 * sqrt(1.0 + m[0x0] - m[0x5] - m[0xa]);
+		out[0] = (m[0x6] - m[0x9]) / s;
+		out[1] = 0.25 * s;
+		out[2] = (m[0x4] + m[0x1]) / s;
+		out[3] = (m[0x8] + m[0x2]) / s;
+	}
+	else if(m[0x5] > m[0xa]) {
+		s = 2.0 * sqrt(1.0 + m[0x5] - m[0x0] - m[0xa]);
+		out[0] = (m[0x8] - m[0x2]) / s;
+		out[1] = (m[0x4] + m[0x1]) / s;
+		out[2] = 0.25 * s;
+		out[3] = (m[0x9] + m[0x6]) / s;
+	}
+	else {
+		s = 2.0 * sqrt(1.0 + m[0xa] - m[0x0] - m[0x5]);
+		out[0] = (m[0x1] - m[0x4]) / s;
+		out[1] = (m[0x8] + m[0x2]) / s;
+		out[2] = (m[0x9] + m[0x6]) / s;
+		out[3] = 0.25 * s;
+	}
+
+	vec4_nrm(out, out);
+}
+
+
+extern void qat_from_agl(vec3_t axis, float agl, vec4_t out)
+{
+	vec3_t n;
+	float s = sin(agl * 0.5);
+
+	vec3_nrm(axis, n);
+	out[0] = cos(agl * 0.5);
+	out[1] = n[0] * s;
+	out[2] = n[1] * s;
+	out[3] = n[2] * s;
+}
+
+
+extern void qat_from_vecs(vec3_t v1, vec3_t v2, vec4_t out)
+{
+	vec3_t n1;
+	vec3_t n2;
+	vec3_t axis;
+	float d;
+
+	vec3_nrm(v1, n1);
+	vec3_nrm(v2, n2);
+	d = vec3_dot(n1, n2);
+
+	/* Opposite vectors, turn around any axis orthogonal to them */
+	if(d < -0.999999) {
+		vec3_t x = {1, 0, 0};
+		vec3_t y = {0, 1, 0};
+
+		vec3_cross(fabs(n1[0]) < 0.9 ? x : y, n1, axis);
+		qat_from_agl(axis, M_PI, out);
+		return;
+	}
+
+	vec3_cross(n1, n2, axis);
+	vec4_set(out, 1.0 + d, axis[0], axis[1], axis[2]);
+	vec4_nrm(out, out);
+}
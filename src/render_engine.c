@@ -1,5 +1,9 @@
 #include "render_engine.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 
 /* Redefine global render-wrapper */
 struct ren_wrapper g_ren;
@@ -13,6 +17,7 @@ extern int ren_init(SDL_Window *window, char mode)
 			return -1;
 		}
 
+		vk_get_palette(&g_ren.pal_align);
 	}
 	else if(mode == 1) {
 		g_ren.mode = REN_MODE_OPENGL;
@@ -20,7 +25,26 @@ extern int ren_init(SDL_Window *window, char mode)
 		if(gl_init(window) < 0) {
 			return -1;
 		}
+
+		g_ren.pal_align = gl_get_palette_align();
+	}
+	else if(mode == REN_MODE_NULL) {
+		g_ren.mode = REN_MODE_NULL;
+
+		if(!(g_ren.null_pal = malloc(REN_PALETTE_BUF)))
+			return -1;
+
+		g_ren.pal_align = REN_NULL_ALIGN;
+	}
+	else {
+		return -1;
 	}
+
+	ren_reset_stats();
+
+	g_ren.frame = 0;
+	g_ren.pal_frm = 0;
+	g_ren.pal_head = 0;
 	
 	return 0;
 }
@@ -34,12 +58,16 @@ extern void ren_destroy(void)
 	else if(g_ren.mode == REN_MODE_OPENGL) {
 		gl_destroy();
 	}
+	else if(g_ren.mode == REN_MODE_NULL) {
+		free(g_ren.null_pal);
+		g_ren.null_pal = NULL;
+	}
 }
 
 
 extern int ren_resize(int w, int h)
 {
-	int res;
+	int res = 0;
 
 	if(g_ren.mode == REN_MODE_VULKAN) {
 		res = vk_resize();
@@ -118,6 +146,10 @@ extern int ren_create_shader(char *vs, char *fs, uint32_t *prog,
 	else if(g_ren.mode == REN_MODE_OPENGL) {
 		res = gl_create_program(vs, fs, prog, num, vars);
 	}
+	else if(g_ren.mode == REN_MODE_NULL) {
+		*prog = 0;
+		res = 0;
+	}
 
 	free(vk_vs);
 	free(vk_fs);
@@ -153,6 +185,13 @@ extern int ren_create_texture(char *pth, uint32_t *hdl,
 	else if(g_ren.mode == REN_MODE_OPENGL) {
 		res = gl_create_texture(pth, hdl);
 	}
+	else if(g_ren.mode == REN_MODE_NULL) {
+		*hdl = 0;
+		res = 0;
+	}
+
+	if(res == 0)
+		g_ren.stats.textures++;
 
 	return res;
 }
@@ -180,6 +219,13 @@ extern int ren_create_skybox(char *pths[6], uint32_t *hdl,
 	else if(g_ren.mode == REN_MODE_OPENGL) {
 		res = gl_create_skybox(pths, hdl);
 	}
+	else if(g_ren.mode == REN_MODE_NULL) {
+		*hdl = 0;
+		res = 0;
+	}
+
+	if(res == 0)
+		g_ren.stats.textures++;
 
 	return res;
 }
@@ -197,6 +243,10 @@ extern int ren_create_model_data(struct vk_pipeline pipeline, uint32_t *vao,
 		gl_create_vao(vao);
 		res = 0;
 	}
+	else if(g_ren.mode == REN_MODE_NULL) {
+		*vao = 0;
+		res = 0;
+	}
 
 	return res;
 }
@@ -204,7 +254,7 @@ extern int ren_create_model_data(struct vk_pipeline pipeline, uint32_t *vao,
 
 extern int ren_destroy_model_data(uint32_t vao, VkDescriptorSet set)
 {
-	int res;
+	int res = 0;
 
 	if(g_ren.mode == REN_MODE_VULKAN) {
 		res = vk_destroy_constant_data(set);
@@ -238,17 +288,42 @@ extern int ren_create_buffer(uint32_t vao, int type, size_t size, char *buf,
 	}
 
 	if(g_ren.mode == REN_MODE_VULKAN) {
-		if(vk_create_buffer(size, usage, 1, buffer) < 0)
-			return -1;
-		
+		/* The uniform data is written to the palette-ring */
+		if(type == GL_UNIFORM_BUFFER) {
+			memset(buffer, 0, sizeof(struct vk_buffer));
+			return 0;
+		}
+
+		/* Buffers with content are uploaded to device-local memory */
 		if(buf) {
-			vk_copy_data_to_buffer(buf, *buffer);
-			res = 0;
+			usage |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+			if(vk_create_buffer(size, usage, 0, buffer) < 0)
+				return -1;
+
+			if(vk_upload_buffer(buffer, buf) < 0) {
+				vk_destroy_buffer(*buffer);
+				return -1;
+			}
+		}
+		else if(vk_create_buffer(size, usage, 1, buffer) < 0) {
+			return -1;
 		}
 	}
 	else if(g_ren.mode == REN_MODE_OPENGL) {
 		res = gl_create_buffer(vao, type, size, buf, bo);
 	}
+	else if(g_ren.mode == REN_MODE_NULL) {
+		*bo = 0;
+		res = 0;
+	}
+
+	if(res == 0) {
+		g_ren.stats.buffers++;
+
+		if(buf)
+			g_ren.stats.upl_bytes += size;
+	}
 
 	return res;
 }
@@ -265,17 +340,32 @@ extern void ren_destroy_buffer(uint32_t bo, struct vk_buffer buffer)
 }
 
 
+extern int ren_flush_uploads(void)
+{
+	int res = 0;
+
+	if(g_ren.mode == REN_MODE_VULKAN) {
+		res = vk_upload_flush(0);
+	}
+
+	return res;
+}
+
+
+extern void ren_wait_idle(void)
+{
+	if(g_ren.mode == REN_MODE_VULKAN) {
+		vk_wait_idle();
+	}
+}
+
+
 extern int ren_set_model_data(uint32_t vao, uint32_t vbo, int stride, int rig,
-                              VkDescriptorSet set,
-                              struct vk_buffer uniform_buffer,
-                              struct vk_texture texture)
+                              VkDescriptorSet set, struct vk_texture texture)
 {
-	int res;
+	int res = 0;
 
 	if(g_ren.mode == REN_MODE_VULKAN) {
-		if(vk_set_uniform_buffer(uniform_buffer, set) < 0)
-			return -1;
-		
 		res = vk_set_texture(texture, set);
 	}
 	else if(g_ren.mode == REN_MODE_OPENGL) {
@@ -289,12 +379,18 @@ extern int ren_set_model_data(uint32_t vao, uint32_t vbo, int stride, int rig,
 
 extern int ren_start(void)
 {
-	int res;
+	int res = 0;
+
+	/* Move on to the next region of the palette-ring */
+	g_ren.frame++;
+	g_ren.pal_frm = (g_ren.pal_frm + 1) % REN_PALETTE_FRAMES;
+	g_ren.pal_head = 0;
 
 	if(g_ren.mode == REN_MODE_VULKAN) {
-		res = vk_render_start();
+		res = vk_render_start(g_ren.pal_frm);
 	}
 	else if(g_ren.mode == REN_MODE_OPENGL) {
+		gl_begin_palette(g_ren.pal_frm);
 		gl_render_start();
 		res = 0;
 	}
@@ -305,7 +401,9 @@ extern int ren_start(void)
 
 extern int ren_set_shader(uint32_t prog, int attr, struct vk_pipeline pipeline)
 {
-	int res;
+	int res = 0;
+
+	g_ren.stats.shd_changes++;
 
 	if(g_ren.mode == REN_MODE_VULKAN) {
 		vk_render_set_pipeline(pipeline);
@@ -322,6 +420,8 @@ extern int ren_set_shader(uint32_t prog, int attr, struct vk_pipeline pipeline)
 extern void ren_set_vertices(uint32_t vao, struct vk_buffer vtx_buffer,
                             struct vk_buffer idx_buffer)
 {
+	g_ren.stats.vtx_changes++;
+
 	if(g_ren.mode == REN_MODE_VULKAN) {
 		vk_render_set_vertex_buffer(vtx_buffer);
 		vk_render_set_index_buffer(idx_buffer);
@@ -332,42 +432,140 @@ extern void ren_set_vertices(uint32_t vao, struct vk_buffer vtx_buffer,
 }
 
 
-extern void ren_set_render_model_data(unsigned int uni_buf,
-                                     struct uni_buffer uni, uint32_t hdl,
+/*
+ * Reserve a range in the region of the palette-ring for the current frame and
+ * map it.
+ *
+ * @size: The size of the range in bytes
+ * @off: A pointer to write the offset of the range in the ring to
+ *
+ * Returns: A pointer to the mapped range or NULL if the region is full or an
+ *          error occured
+ */
+static void *ren_map_ring(uint32_t size, uint32_t *off)
+{
+	uint32_t algn_size;
+
+	/* The offsets of the palettes have to be aligned */
+	algn_size = ((size + g_ren.pal_align - 1) / g_ren.pal_align) *
+		g_ren.pal_align;
+
+	if(g_ren.pal_head + algn_size > REN_PALETTE_RING)
+		return NULL;
+
+	*off = g_ren.pal_frm * REN_PALETTE_RING + g_ren.pal_head;
+	g_ren.pal_head += algn_size;
+
+	if(g_ren.mode == REN_MODE_VULKAN) {
+		return vk_get_palette(NULL) + *off;
+	}
+	else if(g_ren.mode == REN_MODE_OPENGL) {
+		return gl_map_palette(*off, size);
+	}
+	else if(g_ren.mode == REN_MODE_NULL) {
+		return g_ren.null_pal + *off;
+	}
+
+	return NULL;
+}
+
+
+extern void *ren_map_palette(int jnt_num, uint32_t *off)
+{
+	uint32_t size = jnt_num * MAT4_SIZE;
+
+	g_ren.stats.pal_bytes += size;
+	return ren_map_ring(size, off);
+}
+
+
+extern void *ren_map_instances(int num, uint32_t *off)
+{
+	uint32_t size = num * 2 * MAT4_SIZE;
+
+	if(num < 1 || num > REN_INST_MAX)
+		return NULL;
+
+	g_ren.stats.upl_bytes += size;
+	return ren_map_ring(size, off);
+}
+
+
+extern void ren_unmap_palette(void)
+{
+	/* The vulkan palette-ring is coherent and always mapped */
+	if(g_ren.mode == REN_MODE_OPENGL) {
+		gl_unmap_palette();
+	}
+}
+
+
+extern void ren_set_texture(uint32_t hdl, enum mdl_type type)
+{
+	g_ren.stats.tex_changes++;
+
+	if(g_ren.mode == REN_MODE_OPENGL) {
+		gl_render_set_texture(hdl, type);
+	}
+}
+
+
+extern int ren_set_render_model_data(unsigned int uni_buf,
+                                     struct uni_buffer *uni,
                                      struct vk_pipeline pipeline,
-                                     struct vk_buffer vk_uni_buf,
-                                     VkDescriptorSet set, enum mdl_type type)
+                                     VkDescriptorSet set, uint32_t pal_off,
+                                     uint32_t inst_off)
 {
+	uint32_t uni_off;
+	void *p;
+
+	g_ren.stats.dat_changes++;
+	g_ren.stats.upl_bytes += sizeof(struct uni_buffer);
+
 	if(g_ren.mode == REN_MODE_VULKAN) {
-		vk_copy_data_to_buffer(&uni, vk_uni_buf);
-		vk_render_set_constant_data(pipeline, set);
+		if(!(p = ren_map_ring(sizeof(struct uni_buffer), &uni_off)))
+			return -1;
+
+		memcpy(p, uni, sizeof(struct uni_buffer));
+		vk_render_set_constant_data(pipeline, set, uni_off, pal_off,
+				inst_off);
 	}
 	else if(g_ren.mode == REN_MODE_OPENGL) {
 		gl_render_set_uniform_buffer(uni_buf, uni);
-		gl_render_set_texture(hdl, type);
+		gl_render_set_palette(pal_off);
+		gl_render_set_instances(inst_off);
 	}
+
+	return 0;
 }
 
 
-extern void ren_draw(uint32_t indices, enum mdl_type type)
+extern void ren_draw(uint32_t indices, uint32_t inst_num, enum mdl_type type)
 {
+	g_ren.stats.draws++;
+	g_ren.stats.instances += inst_num;
+	g_ren.stats.indices += indices * inst_num;
+
 	if(g_ren.mode == REN_MODE_VULKAN) {
-		vk_render_draw(indices);
+		vk_render_draw(indices, inst_num);
 	}
 	else if(g_ren.mode == REN_MODE_OPENGL) {
-		gl_render_draw(indices, type);
+		gl_render_draw(indices, inst_num, type);
 	}
 }
 
 
 extern int ren_end(SDL_Window *window)
 {
-	int res;
+	int res = 0;
+
+	g_ren.stats.frames++;
 
 	if(g_ren.mode == REN_MODE_VULKAN) {
 		res = vk_render_end();
 	}
 	else if(g_ren.mode == REN_MODE_OPENGL) {
+		gl_end_palette(g_ren.pal_frm);
 		gl_render_end(window);
 		res = 0;
 	}
@@ -376,9 +574,56 @@ extern int ren_end(SDL_Window *window)
 }
 
 
+extern void ren_reset_stats(void)
+{
+	memset(&g_ren.stats, 0, sizeof(struct ren_stats));
+}
+
+
+extern void ren_print_stats(void)
+{
+	struct ren_stats *st = &g_ren.stats;
+	uint32_t frm = st->frames > 0 ? st->frames : 1;
+
+	printf("------------------- Render Stats -----------------\n");
+	printf("Frames: %u\n", st->frames);
+	printf("Draws: %u (%.1f per frame)\n", st->draws,
+			(double)st->draws / frm);
+	printf("Instances: %u (%.1f per draw)\n", st->instances,
+			(double)st->instances / (st->draws > 0 ? st->draws : 1));
+	printf("Indices: %u (%.1f per frame)\n", st->indices,
+			(double)st->indices / frm);
+	printf("Shader changes: %u\n", st->shd_changes);
+	printf("Vertex changes: %u\n", st->vtx_changes);
+	printf("Data changes: %u\n", st->dat_changes);
+	printf("Texture changes: %u\n", st->tex_changes);
+	printf("Buffers: %u, Textures: %u\n", st->buffers, st->textures);
+	printf("Uploaded: %lu bytes\n", st->upl_bytes);
+	printf("Palettes: %lu bytes\n", st->pal_bytes);
+
+	if(g_ren.mode == REN_MODE_VULKAN) {
+		struct vk_mem_stats mem;
+
+		vk_get_mem_stats(&mem);
+		printf("Memory blocks: %u of %u, Allocations: %u\n",
+				mem.block_num, mem.dev_alloc_max, mem.alloc_num);
+		printf("Device memory: %lu of %lu bytes\n",
+				(unsigned long)mem.dev_used,
+				(unsigned long)mem.dev_size);
+		printf("Host memory: %lu of %lu bytes\n",
+				(unsigned long)mem.host_used,
+				(unsigned long)mem.host_size);
+		printf("Uploads: %lu bytes in %u submits\n",
+				(unsigned long)mem.upload_bytes,
+				mem.upload_submits);
+	}
+	printf("--------------------------------------------------\n");
+}
+
+
 extern int ren_print_info(void)
 {
-	int res;
+	int res = 0;
 	if(g_ren.mode == REN_MODE_VULKAN) {
 		res = vk_print_info();
 	}
@@ -386,6 +631,11 @@ extern int ren_print_info(void)
 		gl_print_info();
 		res = 0;
 	}
+	else if(g_ren.mode == REN_MODE_NULL) {
+		printf("------------------- Render Info ------------------\n");
+		printf("Null-renderer, no output\n");
+		printf("--------------------------------------------------\n");
+	}
 
 	return res;
 }
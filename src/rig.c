@@ -4,11 +4,382 @@
 #include "model.h"
 #include "sdl.h"
 
+#include <string.h>
+#include <math.h>
+
+
+/*
+ * The quantized animation-state of a rig, which identifies a pose.
+ */
+struct rig_pose_key {
+	short     model;
+	short     anim[RIG_LAYER_MAX];
+	char      mode[RIG_LAYER_MAX];
+	uint8_t   weight[RIG_LAYER_MAX];
+	uint16_t  time[RIG_LAYER_MAX];
+};
+
+/*
+ * A cached pose with the joint-matrices calculated for the key.
+ */
+struct rig_pose {
+	struct rig_pose_key key;
+	uint32_t  hash;
+
+	/* The next pose in the hash-bucket or -1 */
+	short     next;
+	char      used;
+
+	/*
+	 * The number of rigs referencing the pose. Only unreferenced poses
+	 * can be replaced.
+	 */
+	int       ref;
+
+	/* 1 if the joint-matrices have been calculated */
+	char      ready;
+
+	int       jnt_alloc;
+	mat4_t    *base_mat;
+	mat4_t    *trans_mat;
+};
+
+static struct rig_pose_cache {
+	short            bucket[RIG_POSE_HASH];
+	struct rig_pose  pose[RIG_POSE_NUM];
+
+	/* The next pose to check when looking for one to replace */
+	short            evict;
+} rig_cache;
+
+
+extern void rig_pose_init(void)
+{
+	int i;
+
+	for(i = 0; i < RIG_POSE_HASH; i++)
+		rig_cache.bucket[i] = -1;
+
+	for(i = 0; i < RIG_POSE_NUM; i++) {
+		rig_cache.pose[i].next = -1;
+		rig_cache.pose[i].used = 0;
+		rig_cache.pose[i].ref = 0;
+		rig_cache.pose[i].ready = 0;
+		rig_cache.pose[i].jnt_alloc = 0;
+		rig_cache.pose[i].base_mat = NULL;
+		rig_cache.pose[i].trans_mat = NULL;
+	}
+
+	rig_cache.evict = 0;
+}
+
+
+extern void rig_pose_close(void)
+{
+	int i;
+
+	for(i = 0; i < RIG_POSE_NUM; i++)
+		free(rig_cache.pose[i].base_mat);
+
+	rig_pose_init();
+}
+
+
+static uint32_t rig_pose_hash(struct rig_pose_key *key)
+{
+	uint8_t *p = (uint8_t *)key;
+	uint32_t hash = 2166136261u;
+	unsigned int i;
+
+	for(i = 0; i < sizeof(struct rig_pose_key); i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * Remove a pose from its hash-bucket.
+ */
+static void rig_pose_unlink(short idx)
+{
+	struct rig_pose *pose = &rig_cache.pose[idx];
+	short *ptr = &rig_cache.bucket[pose->hash % RIG_POSE_HASH];
+
+	while(*ptr != idx)
+		ptr = &rig_cache.pose[*ptr].next;
+
+	*ptr = pose->next;
+	pose->next = -1;
+	pose->used = 0;
+}
+
+/*
+ * Look up the pose for the key or replace an unreferenced pose to store a new
+ * one. The reference-counter of the pose is incremented.
+ *
+ * Returns: The index of the pose or -1 if the cache is full
+ */
+static short rig_pose_get(struct rig_pose_key *key, int jnt_num)
+{
+	struct rig_pose *pose;
+	uint32_t hash = rig_pose_hash(key);
+	short idx;
+	int i;
+	void *p;
+
+	for(idx = rig_cache.bucket[hash % RIG_POSE_HASH]; idx >= 0;
+			idx = pose->next) {
+		pose = &rig_cache.pose[idx];
+
+		if(pose->hash == hash && !memcmp(&pose->key, key, sizeof(*key))) {
+			pose->ref++;
+			return idx;
+		}
+	}
+
+	/* Find an unreferenced pose to replace */
+	for(i = 0; i < RIG_POSE_NUM; i++) {
+		idx = rig_cache.evict;
+		rig_cache.evict = (rig_cache.evict + 1) % RIG_POSE_NUM;
+
+		if(rig_cache.pose[idx].ref == 0)
+			break;
+	}
+
+	if(i == RIG_POSE_NUM)
+		return -1;
+
+	pose = &rig_cache.pose[idx];
+
+	if(pose->jnt_alloc < jnt_num) {
+		if(!(p = realloc(pose->base_mat, 2 * jnt_num * MAT4_SIZE)))
+			return -1;
+
+		pose->base_mat = p;
+		pose->jnt_alloc = jnt_num;
+	}
+	pose->trans_mat = pose->base_mat + pose->jnt_alloc;
+
+	if(pose->used)
+		rig_pose_unlink(idx);
+
+	memcpy(&pose->key, key, sizeof(*key));
+	pose->hash = hash;
+	pose->ready = 0;
+	pose->ref = 1;
+
+	/* Insert the pose into the hash-bucket */
+	pose->next = rig_cache.bucket[hash % RIG_POSE_HASH];
+	rig_cache.bucket[hash % RIG_POSE_HASH] = idx;
+	pose->used = 1;
+
+	return idx;
+}
+
+/*
+ * Stop sharing a pose and use the own joint-matrices of the rig again.
+ */
+static void rig_pose_release(struct model_rig *rig)
+{
+	if(rig->pose >= 0)
+		rig_cache.pose[rig->pose].ref--;
+
+	rig->pose = -1;
+	rig->base_mat = rig->own_base_mat;
+	rig->trans_mat = rig->own_trans_mat;
+}
+
+/*
+ * Copy a shared pose to the own joint-matrices of the rig, so they can be
+ * modified.
+ */
+static void rig_pose_detach(struct model_rig *rig)
+{
+	int tmp = rig->jnt_num * MAT4_SIZE;
+
+	if(rig->base_mat != rig->own_base_mat)
+		memcpy(rig->own_base_mat, rig->base_mat, tmp);
+
+	if(rig->trans_mat != rig->own_trans_mat)
+		memcpy(rig->own_trans_mat, rig->trans_mat, tmp);
+
+	rig_pose_release(rig);
+}
+
+
+/* Round up a size, so all buffers in a rig-block stay aligned */
+#define RIG_ALIGN(x) (((x) + 15) & ~15)
+
+/*
+ * A chunk of rig-blocks allocated at once.
+ */
+struct rig_chunk {
+	struct rig_chunk *next;
+};
+
+/*
+ * The pool of rig-blocks for a single model. Unused blocks are linked
+ * through their first bytes.
+ */
+struct rig_pool {
+	int               blk_size;
+	struct rig_chunk  *chunk;
+	void              *free;
+
+	int               chunk_num;
+	int               rig_num;
+	int               free_num;
+};
+
+static struct rig_pool rig_pools[MDL_SLOTS];
+static uint32_t rig_alloc_num;
+static uint32_t rig_malloc_num;
+
+
+/*
+ * Get the size of a rig-block for a model, containing the rig-struct, the
+ * joint-buffers and the hook-buffers.
+ */
+static int rig_blk_size(struct model *mdl)
+{
+	int jnt = mdl->jnt_num;
+	int hk = mdl->hook_num;
+
+	return RIG_ALIGN(sizeof(struct model_rig)) +
+		RIG_ALIGN(jnt * (4 * MAT4_SIZE + VEC4_SIZE + VEC3_SIZE)) +
+		RIG_ALIGN(hk * (3 * MAT4_SIZE + 2 * VEC3_SIZE));
+}
+
+static void rig_pool_clear(struct rig_pool *pool)
+{
+	struct rig_chunk *chunk;
+
+	while((chunk = pool->chunk)) {
+		pool->chunk = chunk->next;
+		free(chunk);
+	}
+
+	pool->blk_size = 0;
+	pool->free = NULL;
+	pool->chunk_num = 0;
+	pool->rig_num = 0;
+	pool->free_num = 0;
+}
+
+
+extern void rig_pool_init(void)
+{
+	int i;
+
+	for(i = 0; i < MDL_SLOTS; i++) {
+		rig_pools[i].chunk = NULL;
+		rig_pool_clear(&rig_pools[i]);
+	}
+
+	rig_alloc_num = 0;
+	rig_malloc_num = 0;
+}
+
+
+extern void rig_pool_close(void)
+{
+	int i;
+
+	for(i = 0; i < MDL_SLOTS; i++)
+		rig_pool_clear(&rig_pools[i]);
+}
+
+
+extern void rig_pool_stats(struct rig_pool_stats *stats)
+{
+	int i;
+
+	stats->chunk_num = 0;
+	stats->rig_num = 0;
+	stats->free_num = 0;
+
+	for(i = 0; i < MDL_SLOTS; i++) {
+		stats->chunk_num += rig_pools[i].chunk_num;
+		stats->rig_num += rig_pools[i].rig_num;
+		stats->free_num += rig_pools[i].free_num;
+	}
+
+	stats->alloc_num = rig_alloc_num;
+	stats->malloc_num = rig_malloc_num;
+}
+
+/*
+ * Take a block from the pool of a model and allocate a new chunk if the pool
+ * is empty.
+ *
+ * Returns: The block or NULL if an error occurred
+ */
+static void *rig_pool_alloc(short slot, int size)
+{
+	struct rig_pool *pool = &rig_pools[slot];
+	struct rig_chunk *chunk;
+	char *ptr;
+	void *blk;
+	int i;
+
+	/* The model in the slot has changed */
+	if(pool->blk_size != size) {
+		if(pool->rig_num > 0)
+			return NULL;
+
+		rig_pool_clear(pool);
+		pool->blk_size = size;
+	}
+
+	if(!pool->free) {
+		i = RIG_ALIGN(sizeof(struct rig_chunk)) + RIG_POOL_CHUNK * size;
+		if(!(chunk = malloc(i)))
+			return NULL;
+
+		rig_malloc_num++;
+
+		chunk->next = pool->chunk;
+		pool->chunk = chunk;
+		pool->chunk_num++;
+
+		/* Link the blocks, so they are handed out in order */
+		ptr = (char *)chunk + RIG_ALIGN(sizeof(struct rig_chunk));
+		for(i = RIG_POOL_CHUNK - 1; i >= 0; i--) {
+			*(void **)(ptr + i * size) = pool->free;
+			pool->free = ptr + i * size;
+		}
+
+		pool->free_num += RIG_POOL_CHUNK;
+	}
+
+	blk = pool->free;
+	pool->free = *(void **)blk;
+	pool->free_num--;
+	pool->rig_num++;
+
+	rig_alloc_num++;
+	return blk;
+}
+
+static void rig_pool_free(short slot, void *blk)
+{
+	struct rig_pool *pool = &rig_pools[slot];
+
+	*(void **)blk = pool->free;
+	pool->free = blk;
+	pool->free_num++;
+	pool->rig_num--;
+}
+
 
 extern struct model_rig *rig_derive(short slot)
 {
 	struct model_rig *rig;
 	struct model *mdl;
+	int i;
+	char *ptr;
 
 	if(mdl_check_slot(slot))
 		return NULL;
@@ -20,73 +391,65 @@ extern struct model_rig *rig_derive(short slot)
 	if(!(mdl->attr_m & MDL_M_RIG))
 		return NULL;
 
-	/* Allocate memory for the rig-struct */
-	if(!(rig = malloc(sizeof(struct model_rig))))
+	if(mdl->jnt_num > JOINT_MAX_NUM)
+		return NULL;
+
+	/* Get a block for the rig-struct and all buffers */
+	if(!(ptr = rig_pool_alloc(slot, rig_blk_size(mdl))))
 		return NULL;
 
+	rig = (struct model_rig *)ptr;
+	ptr += RIG_ALIGN(sizeof(struct model_rig));
+
 	/* Initialize the rig-attributes */
 	rig->model = slot;
-	rig->anim = 0;
-	rig->keyfr = 0;
-	rig->prog = 0;
-	rig->ts = 0;
 	rig->jnt_num = mdl->jnt_num;
 
-	/* Set hook-arrays to NULL */
-	rig->hook_num = 0;
-	rig->hook_pos = NULL;
-	rig->hook_dir = NULL;
-	rig->hook_base_mat = NULL;
-	rig->hook_loc_mat = NULL;
-	rig->hook_trans_mat = NULL;
-
-
-	/* Add hooks to rig */
-	if(mdl->hook_num > 0) {
-		int tmp;
-		short num;
-
-		num = rig->hook_num = mdl->hook_num;
-
-		/* Allocate memory for hook-positions */
-		tmp = num * VEC3_SIZE; 
-		if(!(rig->hook_pos = malloc(tmp)))
-			goto err_free_hooks;
-
-		/* Allocate memory for hook-forward-vectors */
-		tmp = num * VEC3_SIZE;
-		if(!(rig->hook_dir = malloc(tmp)))
-			goto err_free_hooks;
-
-		/* Allocate memory for hook-base-matrices */
-		tmp = num * MAT4_SIZE;
-		if(!(rig->hook_base_mat = malloc(tmp)))
-			goto err_free_hooks;
+	/* Carve the joint-buffers, with the matrices coming first */
+	rig->own_base_mat = (mat4_t *)ptr;
+	rig->own_trans_mat = rig->own_base_mat + rig->jnt_num;
+	rig->lod_mat[0] = rig->own_trans_mat + rig->jnt_num;
+	rig->lod_mat[1] = rig->lod_mat[0] + rig->jnt_num;
+	rig->loc_rot = (vec4_t *)(rig->lod_mat[1] + rig->jnt_num);
+	rig->loc_pos = (vec3_t *)(rig->loc_rot + rig->jnt_num);
+	ptr += RIG_ALIGN(rig->jnt_num * (4 * MAT4_SIZE + VEC4_SIZE +
+				VEC3_SIZE));
 
-		/* Allocate memory for hook-local-transformation-matrices */
-		tmp = num * MAT4_SIZE;
-		if(!(rig->hook_loc_mat = malloc(tmp)))
-			goto err_free_hooks;
+	rig->pose = -1;
+	rig->base_mat = rig->own_base_mat;
+	rig->trans_mat = rig->own_trans_mat;
 
-		/* Allocate memory for hook-transformation-matrices */
-		tmp = num * MAT4_SIZE;
-		if(!(rig->hook_trans_mat = malloc(tmp)))
-			goto err_free_hooks;
+	/*
+	 * By default only the first animation is used, with its time being
+	 * set by the aim-pitch.
+	 */
+	for(i = 0; i < RIG_LAYER_MAX; i++)
+		rig_play(rig, i, -1, RIG_LAYER_BLEND, 0);
+
+	rig->lod = RIG_LOD_FULL;
+	rig->lod_frm = 0;
+	rig->lod_dt = 0;
+	rig->lod_num = 0;
+
+	rig->aim = -1;
+	if(mdl->anim_num > 0) {
+		rig_play(rig, 0, 0, RIG_LAYER_BLEND, 1);
+		rig->aim = 0;
 	}
 
-	return rig;
-
+	/* Carve the hook-buffers */
+	rig->hook_num = mdl->hook_num;
+	rig->hook_base_mat = (mat4_t *)ptr;
+	rig->hook_loc_mat = rig->hook_base_mat + rig->hook_num;
+	rig->hook_trans_mat = rig->hook_loc_mat + rig->hook_num;
+	rig->hook_pos = (vec3_t *)(rig->hook_trans_mat + rig->hook_num);
+	rig->hook_dir = rig->hook_pos + rig->hook_num;
 
-err_free_hooks:
-	if(rig->hook_pos) free(rig->hook_pos);
-	if(rig->hook_dir) free(rig->hook_dir);
-	if(rig->hook_base_mat) free(rig->hook_base_mat);
-	if(rig->hook_loc_mat) free(rig->hook_loc_mat);
-	if(rig->hook_trans_mat) free(rig->hook_trans_mat);
+	/* Start in the rest-pose, so the hooks are valid for the first frame */
+	rig_prepare(rig);
+	rig_finish(rig);
 
-err_free_rig:
-	free(rig);
-	return NULL;
+	return rig;
 }
 
 
@@ -95,13 +458,10 @@ extern void rig_free(struct model_rig *rig)
 	if(!rig)
 		return;
 
-	if(rig->hook_pos) free(rig->hook_pos);
-	if(rig->hook_dir) free(rig->hook_dir);
-	if(rig->hook_base_mat) free(rig->hook_base_mat);
-	if(rig->hook_loc_mat) free(rig->hook_loc_mat);
-	if(rig->hook_trans_mat) free(rig->hook_trans_mat);
+	rig_pose_release(rig);
 
-	free(rig);
+	/* The buffers are part of the same block as the rig */
+	rig_pool_free(rig->model, rig);
 }
 
 
@@ -109,114 +469,178 @@ extern void rig_prepare(struct model_rig *rig)
 {
 	int i;
 
+	/* The local transformations no longer match a shared pose */
+	rig_pose_release(rig);
+
 	for(i = 0; i < rig->jnt_num; i++) {
-		rig->jnt_m[i] = 1;
 		vec3_set(rig->loc_pos[i], 0, 0, 0);
 		vec4_set(rig->loc_rot[i], 1, 0, 0, 0);
 	}
 }
 
 
-static void rig_calc_jnt(struct model_rig *rig, short anim, short *keyfr,
-		float prog)
+/*
+ * Get the progress at the given time in the range of the keys.
+ */
+static float rig_prog(float time, struct mdl_anim *anim)
 {
-	int i;
-	struct model *mdl;
-	struct mdl_anim *animp;
-	struct mdl_keyfr *keyfr0;
-	struct mdl_keyfr *keyfr1;
-	vec3_t p0, p1, p;
-	vec4_t r0, r1, r;
+	if(anim->dur <= 0)
+		return 0;
 
-	mdl = models[rig->model];
-	animp = &mdl->anim_buf[anim];
-	
-	keyfr0 = &animp->keyfr_buf[keyfr[0]];
-	keyfr1 = &animp->keyfr_buf[keyfr[1]];
+	return time / anim->dur * MDL_KEY_PROG_MAX;
+}
 
-	/* Reset values */
-	for(i = 0; i < mdl->jnt_num; i++) {
-		if(keyfr0->mask[i] < 0 && keyfr1->mask[i] < 0)
-			continue;
+/*
+ * Decompress the position and rotation of a key.
+ */
+static void rig_decode_key(struct mdl_anim *anim, struct mdl_track *trk,
+		int idx, vec3_t pos, vec4_t rot)
+{
+	struct mdl_pos *p;
+	uint16_t *q;
 
-		if(keyfr0->mask[i] == -1) {
-			vec3_set(p0, 0, 0, 0);
-			vec4_set(r0, 1, 0, 0, 0);
-		}
-		else {
-			vec3_cpy(p0, keyfr0->pos[i]);
-			vec4_cpy(r0, keyfr0->rot[i]);
-		}
+	qat_unpack(anim->key_buf[trk->key_off + idx].rot, rot);
 
-		if(keyfr1->mask[i] == -1) {
-			vec3_set(p1, 0, 0, 0);
-			vec4_set(r1, 1, 0, 0, 0);
-		}
-		else {
-			vec3_cpy(p1, keyfr1->pos[i]);
-			vec4_cpy(r1, keyfr1->rot[i]);
-		}
+	if(trk->pos < 0) {
+		vec3_set(pos, 0, 0, 0);
+		return;
+	}
 
-		vec3_interp(p0, p1, prog, p);
-		qat_interp(r0, r1, prog, r);
-	
-		vec3_add(p, rig->loc_pos[i], rig->loc_pos[i]);
-		qat_add(r, rig->loc_rot[i], rig->loc_rot[i]);
+	p = &anim->pos_buf[trk->pos];
+	if(p->key_off < 0) {
+		vec3_cpy(pos, p->min);
+		return;
 	}
+
+	q = &anim->pos_key_buf[(p->key_off + idx) * 3];
+	pos[0] = p->min[0] + q[0] * p->scl[0];
+	pos[1] = p->min[1] + q[1] * p->scl[1];
+	pos[2] = p->min[2] + q[2] * p->scl[2];
 }
 
-static void rig_update_joints(struct model_rig *rig, int idx);
-static void rig_update_joints(struct model_rig *rig, int idx)
-{	
-	struct model *mdl;
-	int i;
-	mat4_t mat;
-	int par;
+/*
+ * Sample a joint-track using a binary search to find the two keys
+ * surrounding the progress, and interpolate between them.
+ */
+static void rig_sample_trk(struct mdl_anim *anim, struct mdl_track *trk,
+		float prog, vec3_t pos, vec4_t rot)
+{
+	struct mdl_key *key = &anim->key_buf[trk->key_off];
+	int lo = 0;
+	int hi = trk->key_num - 1;
+	int mid;
+	float t;
+	vec3_t p0, p1;
+	vec4_t r0, r1;
+
+	while(hi - lo > 1) {
+		mid = (lo + hi) / 2;
+
+		if(key[mid].prog <= prog)
+			lo = mid;
+		else
+			hi = mid;
+	}
 
-	mat4_t loc_posm;
-	mat4_t loc_rotm;
-	mat4_t loc_trans_mat;
-	vec4_t tmp;
+	if(key[hi].prog <= key[lo].prog || prog <= key[lo].prog) {
+		rig_decode_key(anim, trk, lo, pos, rot);
+		return;
+	}
 
-	mdl = models[rig->model];
+	if(prog >= key[hi].prog) {
+		rig_decode_key(anim, trk, hi, pos, rot);
+		return;
+	}
 
-	/*
-	 * Set current local animation-matrix for the joint.
-	 */
-	mat4_idt(loc_rotm);
-	vec4_cpy(tmp, rig->loc_rot[idx]);
-	mat4_rfqat_s(loc_rotm, tmp[0], tmp[1], tmp[2], tmp[3]);
-	mat4_idt(loc_posm);
-	mat4_pfpos(loc_posm, rig->loc_pos[idx]);
-	mat4_mult(loc_posm, loc_rotm, loc_trans_mat);
+	t = (prog - key[lo].prog) / (float)(key[hi].prog - key[lo].prog);
 
-	/*
-	 * Add matrix to relative joint-matrix.
-	 */
-	mat4_mult(mdl->jnt_buf[idx].loc_bind_mat, loc_trans_mat, mat);
+	rig_decode_key(anim, trk, lo, p0, r0);
+	rig_decode_key(anim, trk, hi, p1, r1);
 
-	/*
-	 * Multiply with parent matrix if joint has a parent, to convert it from
-	 * local space to model space.
-	 */
-	if((par = mdl->jnt_buf[idx].par) != -1)
-		mat4_mult(rig->base_mat[par], mat, mat);
+	vec3_interp(p0, p1, t, pos);
+	qat_interp(r0, r1, t, rot);
+}
 
-	/*
-	 * Write base matrix for joint.
-	 */
-	mat4_cpy(rig->base_mat[idx], mat);
+/*
+ * Advance the time of a layer and wrap or clamp it to the duration.
+ */
+static void rig_advance(struct rig_layer *lay, struct mdl_anim *anim, float dt)
+{
+	lay->time += dt * lay->speed;
 
-	/*
-	 * Calculate transformation-matrix.
-	 */
-	mat4_mult(mat, mdl->jnt_buf[idx].inv_bind_mat, rig->trans_mat[idx]);
+	if(anim->dur <= 0) {
+		lay->time = 0;
+	}
+	else if(lay->loop) {
+		lay->time = fmod(lay->time, anim->dur);
+		if(lay->time < 0)
+			lay->time += anim->dur;
+	}
+	else {
+		if(lay->time < 0) lay->time = 0;
+		if(lay->time > anim->dur) lay->time = anim->dur;
+	}
+}
+
+/*
+ * Build the local animation-matrix of a joint from the position and the
+ * rotation, which is the same as multiplying the position-matrix with the
+ * rotation-matrix.
+ */
+static void rig_calc_trs(mat4_t m, vec3_t pos, vec4_t rot)
+{
+	mat4_rfqat_s(m, rot[0], rot[1], rot[2], rot[3]);
+
+	m[0xc] = pos[0];
+	m[0xd] = pos[1];
+	m[0xe] = pos[2];
+}
+
+static void rig_update_joints(struct model_rig *rig)
+{	
+	struct model *mdl;
+	struct mdl_joint *jnt;
+	int i;
+	int idx;
+	mat4_t mat;
+	mat4_t loc_trans_mat;
+
+	mdl = models[rig->model];
 
 	/*
-	 * Call function recusivly for child-joints.
+	 * The joints are ordered parent-before-child, so the base-matrix of the
+	 * parent is always ready when processing a joint.
 	 */
-	for(i = 0; i < mdl->jnt_buf[idx].child_num; i++)
-		rig_update_joints(rig, mdl->jnt_buf[idx].child_buf[i]);
+	for(i = 0; i < mdl->jnt_num; i++) {
+		idx = mdl->jnt_ord[i];
+		jnt = &mdl->jnt_buf[idx];
+
+		/*
+		 * Set current local animation-matrix for the joint.
+		 */
+		rig_calc_trs(loc_trans_mat, rig->loc_pos[idx],
+				rig->loc_rot[idx]);
+
+		/*
+		 * Add matrix to relative joint-matrix.
+		 */
+		mat4_mult(jnt->loc_bind_mat, loc_trans_mat, mat);
+
+		/*
+		 * Multiply with parent matrix if joint has a parent, to convert
+		 * it from local space to model space.
+		 */
+		if(jnt->par != -1)
+			mat4_mult(rig->base_mat[jnt->par], mat, rig->base_mat[idx]);
+		else
+			mat4_cpy(rig->base_mat[idx], mat);
+
+		/*
+		 * Calculate transformation-matrix.
+		 */
+		mat4_mult(rig->base_mat[idx], jnt->inv_bind_mat,
+				rig->trans_mat[idx]);
+	}
 }
 
 static void rig_update_hooks(struct model_rig *rig)
@@ -264,75 +688,195 @@ static void rig_update_hooks(struct model_rig *rig)
 	}
 }
 
-extern void rig_update(struct model_rig *rig)
+extern int rig_play(struct model_rig *rig, short lay, short anim, char mode,
+		float weight)
+{
+	struct rig_layer *l;
+
+	if(lay < 0 || lay >= RIG_LAYER_MAX)
+		return -1;
+
+	if(anim >= models[rig->model]->anim_num)
+		return -1;
+
+	l = &rig->lay[lay];
+	l->anim = anim < 0 ? -1 : anim;
+	l->mode = mode;
+	l->loop = 1;
+	l->time = 0;
+	l->speed = 1;
+	l->weight = weight;
+	return 0;
+}
+
+
+extern void rig_update(struct model_rig *rig, float dt)
 {
 	struct model *mdl;
 	struct mdl_anim *anim;
+	struct rig_layer *lay;
+	struct mdl_track *trk;
+	struct rig_pose_key key;
+	struct rig_pose *pose;
 	int i;
-	short keyfr[2];
+	int j;
+	int k;
+	float prog;
+	float w;
+	float wgt = 0;
+	float lay_time[RIG_LAYER_MAX];
+	float lay_wgt[RIG_LAYER_MAX];
+	vec3_t pos;
+	vec4_t rot;
+	vec4_t idt = {1, 0, 0, 0};
 
-	vec3_t del;
-	vec2_t calc2;
-	
-	vec2_t ap;
-	vec2_t bp;
-	vec2_t del2;
+	mdl = models[rig->model];
 
-	float alpha;
-	float beta;
+	/* Clear the padding as the key is compared bytewise */
+	memset(&key, 0, sizeof(key));
+	key.model = rig->model;
 
-	float p;
+	/*
+	 * Advance the layers and quantize their state, which is then used
+	 * to sample the animations.
+	 */
+	for(i = 0; i < RIG_LAYER_MAX; i++) {
+		lay = &rig->lay[i];
+		key.anim[i] = -1;
+		lay_wgt[i] = 0;
+		lay_time[i] = 0;
 
-	mdl = models[rig->model];
-	anim = &mdl->anim_buf[rig->anim];
+		if(lay->anim < 0)
+			continue;
 
-	/* Update the progress */
-	rig->prog += 0.05;
-	if(rig->prog >= 1.0) {
-		rig->prog -= 1.0;
-		rig->keyfr = (rig->keyfr + 1);
+		if(i != rig->aim)
+			rig_advance(lay, &mdl->anim_buf[lay->anim], dt);
+
+		w = lay->weight * RIG_POSE_WEIGHT + 0.5;
+		if(w < 1)
+			continue;
+
+		key.anim[i] = lay->anim;
+		key.mode[i] = lay->mode;
+		key.weight[i] = w > 255 ? 255 : (uint8_t)w;
+		key.time[i] = (uint16_t)(lay->time / RIG_POSE_TIME);
+
+		lay_wgt[i] = key.weight[i] / RIG_POSE_WEIGHT;
+		lay_time[i] = key.time[i] * RIG_POSE_TIME;
+
+		if(lay->mode == RIG_LAYER_BLEND)
+			wgt += lay_wgt[i];
+	}
 
-		if(rig->keyfr >= anim->keyfr_num - 1) {
-			rig->keyfr = 0;
+	/* Share the pose with other rigs in the same state */
+	rig_pose_release(rig);
+	if((rig->pose = rig_pose_get(&key, rig->jnt_num)) >= 0) {
+		pose = &rig_cache.pose[rig->pose];
+		rig->base_mat = pose->base_mat;
+		rig->trans_mat = pose->trans_mat;
+
+		if(pose->ready)
+			return;
+	}
+
+	/*
+	 * Mix the blend-layers. The rotations are summed up in the same
+	 * hemisphere and normalized afterwards.
+	 */
+	if(wgt > 0) {
+		for(j = 0; j < rig->jnt_num; j++) {
+			vec3_set(rig->loc_pos[j], 0, 0, 0);
+			vec4_set(rig->loc_rot[j], 0, 0, 0, 0);
+		}
+
+		for(i = 0; i < RIG_LAYER_MAX; i++) {
+			if(key.anim[i] < 0 || key.mode[i] != RIG_LAYER_BLEND)
+				continue;
+
+			anim = &mdl->anim_buf[key.anim[i]];
+			prog = rig_prog(lay_time[i], anim);
+			w = lay_wgt[i] / wgt;
+
+			/* Joints without a track are in the rest-pose */
+			for(j = 0, k = 0; j < rig->jnt_num; j++) {
+				if(k < anim->trk_num && anim->trk_buf[k].jnt == j) {
+					rig_sample_trk(anim, &anim->trk_buf[k],
+							prog, pos, rot);
+					k++;
+				}
+				else {
+					vec3_set(pos, 0, 0, 0);
+					vec4_set(rot, 1, 0, 0, 0);
+				}
+
+				if(vec4_dot(rig->loc_rot[j], rot) < 0)
+					vec4_scl(rot, -w, rot);
+				else
+					vec4_scl(rot, w, rot);
+
+				vec3_scl(pos, w, pos);
+				vec3_add(rig->loc_pos[j], pos, rig->loc_pos[j]);
+				vec4_add(rig->loc_rot[j], rot, rig->loc_rot[j]);
+			}
 		}
+
+		for(j = 0; j < rig->jnt_num; j++)
+			vec4_nrm(rig->loc_rot[j], rig->loc_rot[j]);
 	}
 
-	keyfr[0] = 0;
-	keyfr[1] = 1;
-	rig_calc_jnt(rig, 0, keyfr, 1);
+	/* Apply the additive layers on top of the mixed pose */
+	for(i = 0; i < RIG_LAYER_MAX; i++) {
+		if(key.anim[i] < 0 || key.mode[i] != RIG_LAYER_ADD)
+			continue;
+
+		anim = &mdl->anim_buf[key.anim[i]];
+		prog = rig_prog(lay_time[i], anim);
+
+		for(k = 0; k < anim->trk_num; k++) {
+			trk = &anim->trk_buf[k];
+			j = trk->jnt;
+
+			rig_sample_trk(anim, trk, prog, pos, rot);
+
+			if(lay_wgt[i] < 1) {
+				vec3_scl(pos, lay_wgt[i], pos);
+				qat_interp(idt, rot, lay_wgt[i], rot);
+			}
+
+			vec3_add(pos, rig->loc_pos[j], rig->loc_pos[j]);
+			qat_add(rot, rig->loc_rot[j], rig->loc_rot[j]);
+		}
+	}
 }
 
-extern void rig_update_aim(struct model_rig *rig, vec3_t viewp)
+
+extern void rig_set_aim(struct model_rig *rig, float pitch)
 {
-	struct model *mdl;
+	struct rig_layer *lay;
 	struct mdl_anim *anim;
-	int i;
-	short keyfr[2];
 
-	vec3_t del;
-	vec2_t calc2;
-	
-	vec2_t ap;
-	vec2_t bp;
-	vec2_t del2;
+	if(rig->aim < 0 || rig->lay[rig->aim].anim < 0)
+		return;
 
-	float alpha;
-	float beta;
+	lay = &rig->lay[rig->aim];
+	anim = &models[rig->model]->anim_buf[lay->anim];
 
-	float p;
+	if(pitch > RIG_AIM_MAX) pitch = RIG_AIM_MAX;
+	if(pitch < -RIG_AIM_MAX) pitch = -RIG_AIM_MAX;
 
-	mdl = models[rig->model];
-	anim = &mdl->anim_buf[rig->anim];
+	lay->time = (0.5 - pitch / (2.0 * RIG_AIM_MAX)) * anim->dur;
+}
 
-	/* Update the progress */
-	rig->prog += 0.05;
-	if(rig->prog >= 1.0) {
-		rig->prog -= 1.0;
-		rig->keyfr = (rig->keyfr + 1);
 
-		if(rig->keyfr >= anim->keyfr_num - 1) {
-			rig->keyfr = 0;
-		}
+extern void rig_update_aim(struct model_rig *rig, vec3_t viewp)
+{
+	vec2_t ap;
+	vec2_t bp;
+	vec2_t del2;
+
+	if(rig->hook_num < 1) {
+		rig_set_aim(rig, 0);
+		return;
 	}
 
 	/* Calculate the direction-vector from the hook to the view-point */
@@ -340,111 +884,664 @@ extern void rig_update_aim(struct model_rig *rig, vec3_t viewp)
 	vec2_set(bp, 0, rig->hook_pos[0][2]);
 	vec2_sub(ap, bp, del2);
 	vec2_nrm(del2, del2);
-	
-	/* Calculate alpha aka height */
-	alpha = RAD_TO_DEG(asin(del2[1]));
-	if(alpha > 70) alpha = 70;
 
-	if(alpha > 0) {
-		keyfr[0] = 1;
-		keyfr[1] = 0;
-		p = alpha / 70.0;
+	/* Calculate the pitch */
+	rig_set_aim(rig, RAD_TO_DEG(asin(del2[1])));
+}
+
+
+extern void rig_mult_mat(struct model_rig *rig, mat4_t m)
+{
+	rig_pose_detach(rig);
+	mat4_mult_batch(m, rig->trans_mat, rig->trans_mat, rig->jnt_num);
+}
+
+
+extern void rig_finish(struct model_rig *rig)
+{
+	/* 
+	 * Calculate the base matrix for each joint, unless the rig shares a
+	 * pose, which has already been calculated by another rig.
+	 */
+	if(rig->pose < 0 || !rig_cache.pose[rig->pose].ready) {
+		rig_update_joints(rig);
+
+		if(rig->pose >= 0)
+			rig_cache.pose[rig->pose].ready = 1;
+	}
+
+	if(rig->hook_num > 0) rig_update_hooks(rig);	
+}
+
+
+extern int rig_lod_check(struct model_rig *rig, char lod, float dt)
+{
+	rig->lod_dt += dt;
+
+	/* Drop the stored samples and resample immediately if the LOD changes */
+	if(lod != rig->lod) {
+		rig->lod = lod;
+		rig->lod_frm = 0;
+		rig->lod_num = 0;
 	}
-	else if(alpha <= 0) {
-		keyfr[0] = 1;
-		keyfr[1] = 2;
-		p = -alpha / 70.0;
+
+	if(lod == RIG_LOD_CULL)
+		return 0;
+
+	rig->lod_frm++;
+	return rig->lod_num < 2 || rig->lod_frm >= (1 << lod);
+}
+
+
+extern void rig_lod_store(struct model_rig *rig)
+{
+	int tmp = rig->jnt_num * MAT4_SIZE;
+
+	/* Rigs with full LOD are not interpolated */
+	if(rig->lod != RIG_LOD_FULL) {
+		memcpy(rig->lod_mat[0], rig->lod_mat[1], tmp);
+		memcpy(rig->lod_mat[1], rig->trans_mat, tmp);
+
+		if(rig->lod_num < 2)
+			rig->lod_num++;
 	}
 
+	rig->lod_frm = 0;
+	rig->lod_dt = 0;
+}
 
-	rig_calc_jnt(rig, 0, keyfr, p);
 
-#if 0
-	/* Calculate beta aka horizontal correction */
-	vec2_set(calc2, del[0], del[1]);
-	vec2_nrm(calc2, calc2);
-#endif
+extern void rig_lod_interp(struct model_rig *rig)
+{
+	int i;
+	int j;
+	float t;
+	float *m0;
+	float *m1;
+	float *out;
 
+	if(rig->lod == RIG_LOD_FULL || rig->lod_num < 2)
+		return;
 
-	/* 
-	 * Calculate the base matrix for each joint recursivly.
+	/*
+	 * The rig is shown one sample late, so it can be interpolated towards
+	 * the newest sample without guessing the next one.
 	 */
-	rig_update_joints(rig, mdl->jnt_root);
-	if(rig->hook_num > 0) rig_update_hooks(rig);
+	t = (float)rig->lod_frm / (float)(1 << rig->lod);
+	if(t > 1) t = 1;
+
+	for(i = 0; i < rig->jnt_num; i++) {
+		m0 = rig->lod_mat[0][i];
+		m1 = rig->lod_mat[1][i];
+		out = rig->own_trans_mat[i];
+
+		for(j = 0; j < 16; j++)
+			out[j] = m0[j] + (m1[j] - m0[j]) * t;
+	}
+
+	/* A shared base-pose is still used by the hooks */
+	rig->trans_mat = rig->own_trans_mat;
 }
 
 
-extern void rig_mult_mat(struct model_rig *rig, mat4_t m)
+/* Lengths and angles below this are treated as zero by the IK-solvers */
+#define RIG_IK_EPS 0.000001
+
+/*
+ * The state of an IK-chain while solving. The joints are moved by changing
+ * their local rotations, from which the model-space frames of the chain are
+ * rebuilt. All rotations are unit-quaternions.
+ */
+struct rig_ik_state {
+	int       num;
+
+	/* The model-space frame of the parent of the root-joint */
+	vec4_t    par_rot;
+	vec3_t    par_pos;
+
+	/* The rest-frames of the joints relative to their parents */
+	vec4_t    bind_rot[RIG_IK_JNT_MAX];
+	vec3_t    bind_pos[RIG_IK_JNT_MAX];
+
+	/* The local animation-transformations and the joint-limits */
+	vec4_t    loc_rot[RIG_IK_JNT_MAX];
+	vec3_t    loc_pos[RIG_IK_JNT_MAX];
+	float     lim[RIG_IK_JNT_MAX];
+
+	/* The resulting model-space frames */
+	vec4_t    rot[RIG_IK_JNT_MAX];
+	vec3_t    pos[RIG_IK_JNT_MAX];
+
+	/*
+	 * The effector relative to the last joint and its current position
+	 * and direction in model-space.
+	 */
+	vec3_t    eff_off;
+	vec3_t    eff_dir;
+	vec3_t    eff;
+	vec3_t    dir;
+};
+
+/*
+ * Split a matrix without scaling into a rotation and a position.
+ */
+static void rig_ik_split(mat4_t m, vec4_t rot, vec3_t pos)
+{
+	qat_from_mat(m, rot);
+	vec3_set(pos, m[0xc], m[0xd], m[0xe]);
+}
+
+/*
+ * Get the model-space frame of the parent of a joint in the chain.
+ */
+static void rig_ik_parent(struct rig_ik_state *s, int i, float **rot,
+		float **pos)
+{
+	if(i > 0) {
+		*rot = s->rot[i - 1];
+		*pos = s->pos[i - 1];
+	}
+	else {
+		*rot = s->par_rot;
+		*pos = s->par_pos;
+	}
+}
+
+/*
+ * Rebuild the model-space frames of the chain starting with the given joint,
+ * and the position and direction of the effector.
+ */
+static void rig_ik_forward(struct rig_ik_state *s, int from)
 {
 	int i;
-	mat4_t conv_m;
+	float *pr;
+	float *pp;
+	vec3_t v;
 
-	for(i = 0; i < rig->jnt_num; i++) {
-		mat4_cpy(conv_m, rig->trans_mat[i]);
+	for(i = from; i < s->num; i++) {
+		rig_ik_parent(s, i, &pr, &pp);
 
-		mat4_mult(m, conv_m, conv_m);
+		/* pos = par_pos + par_rot * (bind_pos + bind_rot * loc_pos) */
+		qat_rot_vec(s->bind_rot[i], s->loc_pos[i], v);
+		vec3_add(v, s->bind_pos[i], v);
+		qat_rot_vec(pr, v, v);
+		vec3_add(pp, v, s->pos[i]);
 
-		mat4_cpy(rig->trans_mat[i], conv_m);
+		qat_add(pr, s->bind_rot[i], s->rot[i]);
+		qat_add(s->rot[i], s->loc_rot[i], s->rot[i]);
 	}
+
+	i = s->num - 1;
+	qat_rot_vec(s->rot[i], s->eff_off, v);
+	vec3_add(s->pos[i], v, s->eff);
+	qat_rot_vec(s->rot[i], s->eff_dir, s->dir);
 }
 
+/*
+ * Turn a joint of the chain around its origin by a rotation given in
+ * model-space, limit the local rotation and update the following joints.
+ */
+static void rig_ik_rotate(struct rig_ik_state *s, int i, vec4_t r)
+{
+	float *pr;
+	float *pp;
+	float agl;
+	vec4_t g;
+	vec4_t inv;
+	vec4_t q;
+
+	rig_ik_parent(s, i, &pr, &pp);
+
+	/* Convert the rotation into the rest-frame of the joint */
+	qat_add(pr, s->bind_rot[i], g);
+	qat_conj(g, inv);
+
+	qat_add(inv, r, q);
+	qat_add(q, g, q);
+	qat_add(q, s->loc_rot[i], q);
+	vec4_nrm(q, q);
+
+	/* Limit the angle to the rest-pose */
+	if(q[0] < 0)
+		vec4_scl(q, -1, q);
+
+	agl = 2.0 * acos(MIN(q[0], 1.0));
+	if(agl > s->lim[i]) {
+		vec3_t axis;
+
+		vec3_set(axis, q[1], q[2], q[3]);
+		qat_from_agl(axis, s->lim[i], q);
+	}
 
-extern void rig_finish(struct model_rig *rig)
+	vec4_cpy(s->loc_rot[i], q);
+	rig_ik_forward(s, i);
+}
+
+/*
+ * Turn a joint, so the direction v1 relative to its origin points along v2,
+ * taking only the given share of the rotation.
+ */
+static void rig_ik_turn(struct rig_ik_state *s, int i, vec3_t v1, vec3_t v2,
+		float wgt)
 {
-	struct model *mdl = models[rig->model];
+	vec4_t r;
+	vec4_t idt = {1, 0, 0, 0};
 
-	/* 
-	 * Calculate the base matrix for each joint recursivly.
+	if(vec3_len(v1) < RIG_IK_EPS || vec3_len(v2) < RIG_IK_EPS)
+		return;
+
+	qat_from_vecs(v1, v2, r);
+	if(wgt < 1)
+		qat_interp(idt, r, wgt, r);
+
+	rig_ik_rotate(s, i, r);
+}
+
+/*
+ * Get the angle between two vectors in radians.
+ */
+static float rig_ik_angle(vec3_t v1, vec3_t v2)
+{
+	float l = vec3_len(v1) * vec3_len(v2);
+
+	if(l < RIG_IK_EPS)
+		return 0;
+
+	return acos(MAX(-1.0, MIN(vec3_dot(v1, v2) / l, 1.0)));
+}
+
+static void rig_ik_two_bone(struct rig_ik_state *s, vec3_t trg, vec3_t pole)
+{
+	vec3_t ab;
+	vec3_t ae;
+	vec3_t at;
+	vec3_t ba;
+	vec3_t be;
+	vec3_t axis;
+	vec3_t tmp;
+	float lab;
+	float lbe;
+	float lat;
+	float agl;
+	vec4_t r;
+
+	vec3_sub(trg, s->pos[0], at);
+	vec3_sub(s->pos[0], s->pos[1], ba);
+	vec3_sub(s->eff, s->pos[1], be);
+
+	lab = vec3_len(ba);
+	lbe = vec3_len(be);
+	if(lab < RIG_IK_EPS || lbe < RIG_IK_EPS)
+		return;
+
+	/* Keep the target in reach, so the triangle doesn't degenerate */
+	lat = vec3_len(at);
+	lat = MAX(lat, fabs(lab - lbe) + RIG_IK_EPS);
+	lat = MIN(lat, (lab + lbe) * (1.0 - RIG_IK_EPS));
+
+	/*
+	 * Open or close the middle joint to get the required distance between
+	 * the root and the effector. A straight chain is bent in any direction,
+	 * which is then corrected by turning it towards the pole.
 	 */
-	rig_update_joints(rig, mdl->jnt_root);
-	if(rig->hook_num > 0) rig_update_hooks(rig);	
+	vec3_cross(be, ba, axis);
+	if(vec3_len(axis) < RIG_IK_EPS) {
+		vec3_t x = {1, 0, 0};
+		vec3_t y = {0, 1, 0};
+
+		vec3_nrm(be, tmp);
+		vec3_cross(fabs(tmp[0]) < 0.9 ? x : y, tmp, axis);
+	}
+
+	agl = acos(MAX(-1.0, MIN((lab * lab + lbe * lbe - lat * lat) /
+			(2.0 * lab * lbe), 1.0)));
+	qat_from_agl(axis, rig_ik_angle(ba, be) - agl, r);
+	rig_ik_rotate(s, 1, r);
+
+	/* Swing the chain towards the target */
+	vec3_sub(s->eff, s->pos[0], ae);
+	rig_ik_turn(s, 0, ae, at, 1);
+
+	/* Twist the chain around the target-axis towards the pole */
+	if(pole && vec3_len(at) > RIG_IK_EPS) {
+		vec3_t n;
+		vec3_t ap;
+
+		vec3_nrm(at, n);
+		vec3_sub(s->pos[1], s->pos[0], ab);
+		vec3_sub(pole, s->pos[0], ap);
+
+		vec3_scl(n, vec3_dot(ab, n), tmp);
+		vec3_sub(ab, tmp, ab);
+		vec3_scl(n, vec3_dot(ap, n), tmp);
+		vec3_sub(ap, tmp, ap);
+
+		rig_ik_turn(s, 0, ab, ap, 1);
+	}
 }
 
+static void rig_ik_ccd(struct rig_ik_state *s, struct rig_ik_chain *ik,
+		vec3_t trg)
+{
+	int it;
+	int i;
+	vec3_t v1;
+	vec3_t v2;
+
+	for(it = 0; it < ik->iter; it++) {
+		vec3_sub(trg, s->eff, v1);
+		if(vec3_len(v1) <= ik->tol)
+			return;
+
+		/* Turn each joint from the end towards the root */
+		for(i = s->num - 1; i >= 0; i--) {
+			vec3_sub(s->eff, s->pos[i], v1);
+			vec3_sub(trg, s->pos[i], v2);
+			rig_ik_turn(s, i, v1, v2, ik->wgt[i]);
+		}
+	}
+}
 
-extern int rig_hk_lookat(struct model_rig *rig, short hk, vec3_t pos)
+static void rig_ik_fabrik(struct rig_ik_state *s, struct rig_ik_chain *ik,
+		vec3_t trg)
 {
+	int it;
 	int i;
+	int n = s->num + 1;
+	float len[RIG_IK_JNT_MAX];
+	float sum = 0;
+	vec3_t pnt[RIG_IK_JNT_MAX + 1];
 	vec3_t v1;
 	vec3_t v2;
 
-	vec3_t tmp;
-	float dot;
-	float cross;
-	mat4_t mat;
+	/* The points are the joints followed by the effector */
+	for(i = 0; i < s->num; i++)
+		vec3_cpy(pnt[i], s->pos[i]);
+	vec3_cpy(pnt[s->num], s->eff);
+
+	for(i = 0; i < n - 1; i++) {
+		vec3_sub(pnt[i + 1], pnt[i], v1);
+		len[i] = vec3_len(v1);
+		sum += len[i];
+	}
+
+	vec3_sub(trg, pnt[0], v1);
+	if(vec3_len(v1) >= sum) {
+		/* Out of reach, so stretch the chain towards the target */
+		for(i = 0; i < n - 1; i++) {
+			vec3_sub(trg, pnt[i], v1);
+			vec3_setlen(v1, len[i], v1);
+			vec3_add(pnt[i], v1, pnt[i + 1]);
+		}
+	}
+	else {
+		for(it = 0; it < ik->iter; it++) {
+			vec3_sub(trg, pnt[n - 1], v1);
+			if(vec3_len(v1) <= ik->tol)
+				break;
+
+			/* Move the end to the target and pull the chain along */
+			vec3_cpy(pnt[n - 1], trg);
+			for(i = n - 2; i >= 0; i--) {
+				vec3_sub(pnt[i], pnt[i + 1], v1);
+				if(vec3_len(v1) < RIG_IK_EPS)
+					continue;
+
+				vec3_setlen(v1, len[i], v1);
+				vec3_add(pnt[i + 1], v1, pnt[i]);
+			}
+
+			/* Move the root back and push the chain along */
+			vec3_cpy(pnt[0], s->pos[0]);
+			for(i = 0; i < n - 1; i++) {
+				vec3_sub(pnt[i + 1], pnt[i], v1);
+				if(vec3_len(v1) < RIG_IK_EPS)
+					continue;
+
+				vec3_setlen(v1, len[i], v1);
+				vec3_add(pnt[i], v1, pnt[i + 1]);
+			}
+		}
+	}
+
+	/* Turn the joints, so they follow the solved points */
+	for(i = 0; i < s->num; i++) {
+		if(i < s->num - 1)
+			vec3_sub(s->pos[i + 1], s->pos[i], v1);
+		else
+			vec3_sub(s->eff, s->pos[i], v1);
+
+		vec3_sub(pnt[i + 1], s->pos[i], v2);
+		rig_ik_turn(s, i, v1, v2, 1);
+	}
+}
+
+static void rig_ik_aim(struct rig_ik_state *s, struct rig_ik_chain *ik,
+		vec3_t trg)
+{
+	int it;
+	int i;
+	vec3_t v;
+
+	for(it = 0; it < ik->iter; it++) {
+		vec3_sub(trg, s->eff, v);
+		if(rig_ik_angle(s->dir, v) <= ik->tol)
+			return;
+
+		/* Spread the rotation over the chain, starting at the root */
+		for(i = 0; i < s->num; i++) {
+			vec3_sub(trg, s->eff, v);
+			rig_ik_turn(s, i, s->dir, v, ik->wgt[i]);
+		}
+	}
+}
+
+/*
+ * Write the solved frames of the chain back to the joint-matrices of the rig
+ * and move all joints attached to the chain along.
+ */
+static void rig_ik_apply(struct model_rig *rig, struct rig_ik_chain *ik,
+		struct rig_ik_state *s)
+{
+	struct model *mdl = models[rig->model];
+	struct mdl_joint *jnt;
+	mat4_t dlt[RIG_IK_JNT_MAX];
+	mat4_t m;
+	short own[JOINT_MAX_NUM];
+	int i;
+	int j;
+	int idx;
+
+	/* Get the change of each joint in the chain */
+	for(i = 0; i < s->num; i++) {
+		mat4_rfqat_s(m, s->rot[i][0], s->rot[i][1], s->rot[i][2],
+				s->rot[i][3]);
+		m[0xc] = s->pos[i][0];
+		m[0xd] = s->pos[i][1];
+		m[0xe] = s->pos[i][2];
+
+		mat4_inv(dlt[i], rig->base_mat[ik->jnt[i]]);
+		mat4_mult(m, dlt[i], dlt[i]);
+	}
 
+	/*
+	 * The joints are ordered parent-before-child, so every joint attached
+	 * to the chain can take the change of the closest joint of the chain.
+	 */
+	for(i = 0; i < mdl->jnt_num; i++) {
+		idx = mdl->jnt_ord[i];
+		jnt = &mdl->jnt_buf[idx];
+
+		own[idx] = -1;
+		for(j = 0; j < s->num; j++) {
+			if(ik->jnt[j] == idx)
+				own[idx] = j;
+		}
+
+		if(own[idx] < 0 && jnt->par >= 0)
+			own[idx] = own[jnt->par];
+
+		if(own[idx] < 0)
+			continue;
+
+		mat4_mult(dlt[own[idx]], rig->base_mat[idx], rig->base_mat[idx]);
+		mat4_mult(rig->base_mat[idx], jnt->inv_bind_mat,
+				rig->trans_mat[idx]);
+	}
+
+	if(rig->hook_num > 0) rig_update_hooks(rig);
+}
+
+
+extern int rig_ik_init(struct rig_ik_chain *ik, short slot, char type,
+		short tip, short num, short hook)
+{
+	struct model *mdl;
 	short jnt;
+	int i;
+
+	if(mdl_check_slot(slot) || !(mdl = models[slot]))
+		return -1;
+
+	if(tip < 0 || tip >= mdl->jnt_num || num < 1 || num > RIG_IK_JNT_MAX)
+		return -1;
+
+	if((type == RIG_IK_TWO_BONE && num != 3) ||
+			(type == RIG_IK_AIM && hook < 0))
+		return -1;
+
+	if(hook >= 0 && (hook >= mdl->hook_num ||
+				mdl->hook_buf[hook].par_jnt != tip))
+		return -1;
+
+	/* Collect the joints from the end of the chain up to the root */
+	for(i = num - 1, jnt = tip; i >= 0; i--) {
+		if(jnt < 0)
+			return -1;
 
-	if(rig == NULL)
+		ik->jnt[i] = jnt;
+		jnt = mdl->jnt_buf[jnt].par;
+	}
+
+	/*
+	 * By default the aim-solver spreads the rotation evenly over the
+	 * chain, with each joint taking its share of the remaining rotation.
+	 */
+	for(i = 0; i < num; i++)
+		ik->wgt[i] = (type == RIG_IK_AIM) ? 1.0 / (num - i) : 1.0;
+
+	ik->model = slot;
+	ik->type = type;
+	ik->num = num;
+	ik->hook = hook;
+	ik->iter = RIG_IK_ITER;
+	ik->tol = (type == RIG_IK_AIM) ? RIG_IK_AIM_TOL : RIG_IK_TOL;
+	return 0;
+}
+
+
+extern int rig_ik_solve(struct model_rig *rig, struct rig_ik_chain *ik,
+		vec3_t trg, vec3_t pole)
+{
+	struct rig_ik_state s;
+	struct model *mdl;
+	struct mdl_joint *jnt;
+	vec4_t rot;
+	vec4_t inv;
+	vec3_t pos;
+	vec3_t v;
+	float *pr;
+	float *pp;
+	int i;
+
+	if(rig == NULL || ik->model != rig->model)
 		return -1;
 
-	vec3_cpy(v2, rig->hook_dir[hk]);
+	mdl = models[rig->model];
+	s.num = ik->num;
 
-	vec3_sub(pos, rig->hook_pos[hk], v1);
-	vec3_nrm(v1, v1);
+	/* The chain is moved, so it can't share the pose anymore */
+	rig_pose_detach(rig);
 
-	
-	dot = vec3_dot(v1, v2);
-	vec3_cross(v1, v2, tmp);
-	cross = vec3_len(tmp);
+	jnt = &mdl->jnt_buf[ik->jnt[0]];
+	if(jnt->par >= 0) {
+		rig_ik_split(rig->base_mat[jnt->par], s.par_rot, s.par_pos);
+	}
+	else {
+		vec4_set(s.par_rot, 1, 0, 0, 0);
+		vec3_set(s.par_pos, 0, 0, 0);
+	}
 
-	mat4_idt(mat);
+	/*
+	 * Get the local transformations of the joints from the current
+	 * joint-matrices, as the rig may have used a shared pose.
+	 */
+	for(i = 0; i < s.num; i++) {
+		jnt = &mdl->jnt_buf[ik->jnt[i]];
+
+		rig_ik_split(jnt->loc_bind_mat, s.bind_rot[i], s.bind_pos[i]);
+		rig_ik_split(rig->base_mat[ik->jnt[i]], s.rot[i], s.pos[i]);
+		s.lim[i] = jnt->lim;
+
+		rig_ik_parent(&s, i, &pr, &pp);
+
+		/* loc_rot = (par_rot * bind_rot)^-1 * rot */
+		qat_add(pr, s.bind_rot[i], rot);
+		qat_conj(rot, inv);
+		qat_add(inv, s.rot[i], s.loc_rot[i]);
+		vec4_nrm(s.loc_rot[i], s.loc_rot[i]);
+
+		/* loc_pos = bind_rot^-1 * (par_rot^-1 * (pos - par_pos) - bind_pos) */
+		vec3_sub(s.pos[i], pp, v);
+		qat_conj(pr, inv);
+		qat_rot_vec(inv, v, v);
+		vec3_sub(v, s.bind_pos[i], v);
+		qat_conj(s.bind_rot[i], inv);
+		qat_rot_vec(inv, v, s.loc_pos[i]);
+	}
 
-	mat[0x5] = dot;
-	mat[0x6] = cross;
-	mat[0x9] = -cross;
-	mat[0xa] = dot;
+	/* Get the effector relative to the last joint */
+	i = s.num - 1;
+	qat_conj(s.rot[i], inv);
+	if(ik->hook >= 0) {
+		vec3_sub(rig->hook_pos[ik->hook], s.pos[i], pos);
+		qat_rot_vec(inv, pos, s.eff_off);
+		qat_rot_vec(inv, rig->hook_dir[ik->hook], s.eff_dir);
+	}
+	else {
+		vec3_set(s.eff_off, 0, 0, 0);
+		vec3_set(s.eff_dir, 0, 0, 0);
+	}
 
-	mat4_cpy(rig->hook_loc_mat[hk], mat);
+	rig_ik_forward(&s, 0);
 
-	jnt = models[rig->model]->hook_buf[0].par_jnt; 
-	mat4_mult(rig->base_mat[jnt], mat, rig->base_mat[jnt]);	
-	mat4_mult(rig->base_mat[jnt], models[rig->model]->jnt_buf[jnt].inv_bind_mat,
-			rig->trans_mat[jnt]);
+	switch(ik->type) {
+		case RIG_IK_TWO_BONE:
+			rig_ik_two_bone(&s, trg, pole);
+			break;
 
-#if 0
-	for(i = 0; i < models[rig->model]->jnt_buf[jnt].child_num; i++)
-		rig_update_joints(rig, models[rig->model]->jnt_buf[jnt].child_buf[i]);
-#endif
+		case RIG_IK_CCD:
+			rig_ik_ccd(&s, ik, trg);
+			break;
 
-	return 0;
+		case RIG_IK_FABRIK:
+			rig_ik_fabrik(&s, ik, trg);
+			break;
+
+		case RIG_IK_AIM:
+			rig_ik_aim(&s, ik, trg);
+			break;
+
+		default:
+			return -1;
+	}
+
+	rig_ik_apply(rig, ik, &s);
+
+	/* Check if the target has been reached */
+	vec3_sub(trg, s.eff, v);
+	if(ik->type == RIG_IK_AIM)
+		return rig_ik_angle(s.dir, v) <= ik->tol;
+
+	return vec3_len(v) <= ik->tol;
 }
@@ -7,9 +7,14 @@
 #include <stdlib.h>
 
 
-extern int sdl_init(void)
+extern int sdl_init(char headless)
 {
-	if(SDL_Init(SDL_INIT_EVERYTHING) < 0) {
+	uint32_t flgs = SDL_INIT_EVERYTHING;
+
+	if(headless)
+		flgs = SDL_INIT_TIMER | SDL_INIT_EVENTS;
+
+	if(SDL_Init(flgs) < 0) {
 		ERR_LOG(("Failed to initialize SDL-subsystem"));
 		return -1;
 	}
@@ -83,6 +83,10 @@ int load_resources(void)
 	if(hnd_load("res/models/pistol.hnd", tex_get("pal"), shd_get("mdl")) < 0)
 		return -1;
 
+	/* Submit the uploads of all textures and models at once */
+	if(ren_flush_uploads() < 0)
+		return -1;
+
 	printf("Finished loading resources\n");
 	return 0;
 }
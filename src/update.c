@@ -228,4 +228,7 @@ void game_render(void)
 
 	/* Render the objects */
 	obj_sys_render();
+
+	/* Draw all submitted models */
+	mdl_flush();
 }
@@ -5,6 +5,10 @@
 #include <math.h>
 #include <string.h>
 
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
 
 /*
  *
@@ -457,6 +461,23 @@ extern float vec4_dot(vec4_t in1, vec4_t in2)
 
 extern void vec4_trans(vec4_t in, mat4_t mat, vec4_t out)
 {
+#ifdef __SSE__
+	__m128 c0, c1, c2, c3;
+	__m128 r;
+
+	c0 = _mm_loadu_ps(mat + 0x0);
+	c1 = _mm_loadu_ps(mat + 0x4);
+	c2 = _mm_loadu_ps(mat + 0x8);
+	c3 = _mm_loadu_ps(mat + 0xc);
+
+	/* Sum up in the same order as the scalar version */
+	r = _mm_mul_ps(c0, _mm_set1_ps(in[0]));
+	r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(in[1])));
+	r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(in[2])));
+	r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_set1_ps(in[3])));
+
+	_mm_storeu_ps(out, r);
+#else
 	vec4_t tmp;
 	vec4_cpy(tmp, in);
 
@@ -464,6 +485,7 @@ extern void vec4_trans(vec4_t in, mat4_t mat, vec4_t out)
 	out[1] = tmp[0] * mat[0x1] + tmp[1] * mat[0x5] + tmp[2] * mat[0x9] + tmp[3] * mat[0xd];
 	out[2] = tmp[0] * mat[0x2] + tmp[1] * mat[0x6] + tmp[2] * mat[0xa] + tmp[3] * mat[0xe];
 	out[3] = tmp[0] * mat[0x3] + tmp[1] * mat[0x7] + tmp[2] * mat[0xb] + tmp[3] * mat[0xf];
+#endif
 }
 
 extern void vec4_print(vec4_t in)
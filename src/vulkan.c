@@ -10,6 +10,41 @@
         printf("[VULKAN] %s:%d : ", __FILE__, __LINE__);\
         print_error(res); return -1;}
 
+/*
+ * The number of frames recorded and rendered at once. Every frame uses its own
+ * region of the palette-ring, which is protected by the fence of the frame.
+ */
+#define VK_FRAMES REN_PALETTE_FRAMES
+
+/*
+ * The max. number of memory-blocks and their default sizes. Requests larger
+ * than the default size get a dedicated block, which is freed again as soon
+ * as the allocation is freed.
+ */
+#define VK_BLOCK_MAX     64
+#define VK_BLOCK_DEVICE  (64 * 1024 * 1024)
+#define VK_BLOCK_HOST    (16 * 1024 * 1024)
+
+/*
+ * The kinds of memory-blocks. Buffers and images are never placed in the same
+ * block, so the bufferImageGranularity doesn't have to be respected. Buffers
+ * freed right after they are used, like the staging-buffers of the textures,
+ * are allocated linearly from separate blocks, which are reset as soon as
+ * they are empty.
+ */
+#define VK_BLOCK_BUFFER  0
+#define VK_BLOCK_IMAGE   1
+#define VK_BLOCK_LINEAR  2
+
+/*
+ * The size of the staging-ring all uploads are copied through, the alignment
+ * of the copies in it and the max. number of temporary staging-buffers per
+ * batch, which are used for uploads larger than the ring.
+ */
+#define VK_UPLOAD_SIZE   (8 * 1024 * 1024)
+#define VK_UPLOAD_ALIGN  256
+#define VK_UPLOAD_TEMP   16
+
 /* MAX is not in the POSIX standard */
 #ifndef MAX
 #define MAX(a,b) (((a)>(b))?(a):(b))
@@ -18,6 +53,36 @@
 /* Don't judge me. It removes the warning. */
 double log2(double __x);
 
+/*
+ * A free range in a memory-block.
+ */
+struct vk_range {
+	VkDeviceSize off;
+	VkDeviceSize size;
+};
+
+/*
+ * A block of device-memory, which buffers and images are allocated from.
+ * Host-visible blocks stay mapped. Linear blocks only move the head forward,
+ * while the other blocks keep a list of free ranges sorted by offset.
+ */
+struct vk_block {
+	VkDeviceMemory memory;
+	uint32_t type;
+	char kind;
+	char dedicated;
+	VkDeviceSize size;
+	VkDeviceSize used;
+	uint8_t *data;
+	int alloc_num;
+
+	VkDeviceSize head;
+
+	int free_num;
+	int free_cap;
+	struct vk_range *free;
+};
+
 struct vk_wrapper {
 	VkInstance instance;
 	VkSurfaceKHR surface;
@@ -34,16 +99,48 @@ struct vk_wrapper {
 	VkImageView *image_views;
 	VkPhysicalDeviceMemoryProperties mem_props;
 	VkImage depth_image;
-	VkDeviceMemory depth_memory;
+	struct vk_alloc depth_alloc;
 	VkImageView depth_view;
 	VkRenderPass render_pass;
 	VkFramebuffer *frame_buffers;
 	VkCommandPool command_pool;
-	VkCommandBuffer command_buffer;
 	VkDescriptorPool pool;
-	VkSemaphore image_aquired;
-	VkFence queue_submit;
+
+	/*
+	 * The command buffer, semaphores and fence of every frame in flight,
+	 * the current frame and the command buffer recorded in it.
+	 */
+	VkCommandBuffer frame_cmd[VK_FRAMES];
+	VkSemaphore image_aquired[VK_FRAMES];
+	VkSemaphore render_done[VK_FRAMES];
+	VkFence frame_fence[VK_FRAMES];
+	int frame;
+	VkCommandBuffer command_buffer;
+
+	/*
+	 * The upload-queue. All pending copies are recorded to one command
+	 * buffer and read from the staging-ring or temporary staging-buffers.
+	 * The fence is signaled once the last submitted batch is completed.
+	 */
+	VkCommandBuffer upload_cmd;
+	VkFence upload_fence;
+	uint32_t upload_batch;
+	struct vk_buffer upload_ring;
+	VkDeviceSize upload_head;
+	struct vk_buffer upload_temp[VK_UPLOAD_TEMP];
+	int upload_temp_num;
+	char upload_open;
+	char upload_pending;
+	uint32_t upload_submits;
+	VkDeviceSize upload_bytes;
+
 	uint32_t image_index;
+	struct vk_buffer palette;
+	uint32_t palette_align;
+
+	/* The memory-blocks and the max. number of them allowed by the driver */
+	struct vk_block blocks[VK_BLOCK_MAX];
+	uint32_t mem_alloc_max;
 };
 
 static struct vk_wrapper vk;
@@ -538,6 +635,373 @@ static uint32_t get_memory_type(uint32_t type_bits, VkMemoryPropertyFlags props)
 	return 0;
 }
 
+/*
+ * Insert a free range into the free-list of a memory-block.
+ *
+ * @b: The memory-block
+ * @idx: The position in the free-list
+ * @off: The offset of the range
+ * @size: The size of the range
+ *
+ * Returns: 0 on success or -1 if an error occured
+ */
+static int mem_insert_range(struct vk_block *b, int idx, VkDeviceSize off,
+		VkDeviceSize size)
+{
+	struct vk_range *p;
+	int cap;
+
+	if(b->free_num >= b->free_cap) {
+		cap = (b->free_cap > 0) ? (b->free_cap * 2) : (16);
+
+		if(!(p = realloc(b->free, cap * sizeof(struct vk_range))))
+			return -1;
+
+		b->free = p;
+		b->free_cap = cap;
+	}
+
+	memmove(&b->free[idx + 1], &b->free[idx],
+			(b->free_num - idx) * sizeof(struct vk_range));
+
+	b->free[idx].off = off;
+	b->free[idx].size = size;
+	b->free_num++;
+	return 0;
+}
+
+/*
+ * Remove a range from the free-list of a memory-block.
+ *
+ * @b: The memory-block
+ * @idx: The position in the free-list
+ */
+static void mem_remove_range(struct vk_block *b, int idx)
+{
+	memmove(&b->free[idx], &b->free[idx + 1],
+			(b->free_num - idx - 1) * sizeof(struct vk_range));
+	b->free_num--;
+}
+
+/*
+ * Allocate a new memory-block and map it, if it's host-visible.
+ *
+ * @type: The index of the memory-type
+ * @kind: The kind of the block
+ * @size: The size of the block
+ * @dedicated: 1 if the block is only used for a single allocation
+ *
+ * Returns: The index of the block or -1 if an error occured
+ */
+static int mem_create_block(uint32_t type, char kind, VkDeviceSize size,
+		char dedicated)
+{
+	VkResult res;
+	VkMemoryAllocateInfo alloc_info;
+	struct vk_block *b = NULL;
+	uint32_t num = 0;
+	int i;
+	int slot = -1;
+
+	for(i = 0; i < VK_BLOCK_MAX; i++) {
+		if(vk.blocks[i].memory != VK_NULL_HANDLE)
+			num++;
+		else if(slot < 0)
+			slot = i;
+	}
+
+	if(slot < 0 || num >= vk.mem_alloc_max) {
+		ERR_LOG(("No memory-blocks left"));
+		return -1;
+	}
+
+	b = &vk.blocks[slot];
+
+	alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	alloc_info.pNext = NULL;
+	alloc_info.allocationSize = size;
+	alloc_info.memoryTypeIndex = type;
+
+	res = vkAllocateMemory(vk.device, &alloc_info, NULL, &b->memory);
+	vk_assert(res);
+
+	b->type = type;
+	b->kind = kind;
+	b->dedicated = dedicated;
+	b->size = size;
+	b->used = 0;
+	b->data = NULL;
+	b->alloc_num = 0;
+	b->head = 0;
+	b->free_num = 0;
+	b->free_cap = 0;
+	b->free = NULL;
+
+	if(vk.mem_props.memoryTypes[type].propertyFlags &
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		res = vkMapMemory(vk.device, b->memory, 0, size, 0,
+		                  (void **)&b->data);
+		if(res != VK_SUCCESS)
+			goto err_free_memory;
+	}
+
+	if(kind != VK_BLOCK_LINEAR && mem_insert_range(b, 0, 0, size) < 0)
+		goto err_free_memory;
+
+	return slot;
+
+err_free_memory:
+	vkFreeMemory(vk.device, b->memory, NULL);
+	b->memory = VK_NULL_HANDLE;
+	return -1;
+}
+
+/*
+ * Free a memory-block. The memory is unmapped implicitly.
+ *
+ * @slot: The index of the block
+ */
+static void mem_destroy_block(int slot)
+{
+	struct vk_block *b = &vk.blocks[slot];
+
+	vkFreeMemory(vk.device, b->memory, NULL);
+	free(b->free);
+	memset(b, 0, sizeof(struct vk_block));
+	b->memory = VK_NULL_HANDLE;
+}
+
+/*
+ * Carve a range from a memory-block. The free-list is searched for the first
+ * range, which fits the aligned size. The padding in front of the allocation
+ * stays in the free-list.
+ *
+ * @b: The memory-block
+ * @size: The size of the range
+ * @align: The required alignment of the offset
+ * @off: A pointer to write the offset of the range to
+ *
+ * Returns: 0 on success or -1 if the range doesn't fit into the block
+ */
+static int mem_block_alloc(struct vk_block *b, VkDeviceSize size,
+		VkDeviceSize align, VkDeviceSize *off)
+{
+	struct vk_range *r;
+	VkDeviceSize o;
+	VkDeviceSize end;
+	int i;
+
+	if(b->kind == VK_BLOCK_LINEAR) {
+		o = ((b->head + align - 1) / align) * align;
+		if(o + size > b->size)
+			return -1;
+
+		b->head = o + size;
+		goto found;
+	}
+
+	for(i = 0; i < b->free_num; i++) {
+		r = &b->free[i];
+		o = ((r->off + align - 1) / align) * align;
+		end = r->off + r->size;
+
+		if(o + size > end)
+			continue;
+
+		if(o > r->off) {
+			/* Keep the padding and insert the rest after it */
+			if(o + size < end && mem_insert_range(b, i + 1,
+					o + size, end - o - size) < 0)
+				return -1;
+
+			b->free[i].size = o - b->free[i].off;
+		}
+		else if(o + size < end) {
+			r->off = o + size;
+			r->size = end - r->off;
+		}
+		else {
+			mem_remove_range(b, i);
+		}
+
+		goto found;
+	}
+
+	return -1;
+
+found:
+	b->used += size;
+	b->alloc_num++;
+	*off = o;
+	return 0;
+}
+
+/*
+ * Return a range to a memory-block and merge it with the neighbouring free
+ * ranges.
+ *
+ * @b: The memory-block
+ * @off: The offset of the range
+ * @size: The size of the range
+ */
+static void mem_block_free(struct vk_block *b, VkDeviceSize off,
+		VkDeviceSize size)
+{
+	struct vk_range *prev;
+	struct vk_range *next;
+	int i;
+
+	b->used -= size;
+	b->alloc_num--;
+
+	if(b->kind == VK_BLOCK_LINEAR) {
+		if(b->alloc_num == 0)
+			b->head = 0;
+
+		return;
+	}
+
+	for(i = 0; i < b->free_num; i++) {
+		if(b->free[i].off > off)
+			break;
+	}
+
+	prev = (i > 0) ? (&b->free[i - 1]) : (NULL);
+	next = (i < b->free_num) ? (&b->free[i]) : (NULL);
+
+	if(prev && prev->off + prev->size == off) {
+		prev->size += size;
+
+		if(next && off + size == next->off) {
+			prev->size += next->size;
+			mem_remove_range(b, i);
+		}
+	}
+	else if(next && off + size == next->off) {
+		next->off = off;
+		next->size += size;
+	}
+	else if(mem_insert_range(b, i, off, size) < 0) {
+		/* The range is lost until the block is freed */
+		ERR_LOG(("Failed to return memory to the block"));
+	}
+}
+
+/*
+ * Allocate memory for a buffer or image from the memory-blocks. If no block
+ * of the right type and kind has enough space left, a new one is allocated.
+ *
+ * @req: The memory-requirements of the buffer or image
+ * @props: The required memory-properties
+ * @kind: The kind of the block
+ * @alloc: A pointer to write the allocation to
+ *
+ * Returns: 0 on success or -1 if an error occured
+ */
+static int mem_alloc(VkMemoryRequirements *req, VkMemoryPropertyFlags props,
+		char kind, struct vk_alloc *alloc)
+{
+	uint32_t type;
+	VkDeviceSize size;
+	VkDeviceSize off;
+	struct vk_block *b;
+	char dedicated = 0;
+	int i;
+	int slot = -1;
+
+	type = get_memory_type(req->memoryTypeBits, props);
+
+	for(i = 0; i < VK_BLOCK_MAX; i++) {
+		b = &vk.blocks[i];
+
+		if(b->memory == VK_NULL_HANDLE || b->dedicated ||
+				b->type != type || b->kind != kind)
+			continue;
+
+		if(mem_block_alloc(b, req->size, req->alignment, &off) == 0) {
+			slot = i;
+			break;
+		}
+	}
+
+	if(slot < 0) {
+		if(props & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+			size = VK_BLOCK_HOST;
+		else
+			size = VK_BLOCK_DEVICE;
+
+		if(req->size > size) {
+			size = req->size;
+			dedicated = 1;
+		}
+
+		if((slot = mem_create_block(type, kind, size, dedicated)) < 0)
+			return -1;
+
+		if(mem_block_alloc(&vk.blocks[slot], req->size, req->alignment,
+					&off) < 0) {
+			mem_destroy_block(slot);
+			return -1;
+		}
+	}
+
+	alloc->block = slot;
+	alloc->off = off;
+	alloc->size = req->size;
+	return 0;
+}
+
+/*
+ * Return an allocation to its memory-block. Dedicated blocks are freed.
+ *
+ * @alloc: The allocation
+ */
+static void mem_free(struct vk_alloc *alloc)
+{
+	struct vk_block *b;
+
+	if(alloc->size == 0)
+		return;
+
+	b = &vk.blocks[alloc->block];
+	mem_block_free(b, alloc->off, alloc->size);
+
+	if(b->dedicated && b->alloc_num == 0)
+		mem_destroy_block(alloc->block);
+
+	alloc->size = 0;
+}
+
+/*
+ * Setup the memory-blocks and get the max. number of allocations.
+ */
+static void mem_init(void)
+{
+	VkPhysicalDeviceProperties props;
+	int i;
+
+	vkGetPhysicalDeviceProperties(vk.gpu, &props);
+	vk.mem_alloc_max = props.limits.maxMemoryAllocationCount;
+
+	for(i = 0; i < VK_BLOCK_MAX; i++) {
+		memset(&vk.blocks[i], 0, sizeof(struct vk_block));
+		vk.blocks[i].memory = VK_NULL_HANDLE;
+	}
+}
+
+/*
+ * Free all memory-blocks.
+ */
+static void mem_close(void)
+{
+	int i;
+
+	for(i = 0; i < VK_BLOCK_MAX; i++) {
+		if(vk.blocks[i].memory != VK_NULL_HANDLE)
+			mem_destroy_block(i);
+	}
+}
+
 /*
  * Create an image
  *
@@ -549,8 +1013,8 @@ static uint32_t get_memory_type(uint32_t type_bits, VkMemoryPropertyFlags props)
  * @samples: The amount of msaa
  * @usage: The usage of the image
  * @image: a pointer to the handle of the image, which the function creates
- * @memory: a pointer to the handle of the image memory, which the function
- *          creates
+ * @alloc: a pointer to the allocation of the image memory, which the function
+ *         carves from the memory-blocks
  *
  * Returns: 0 on success or -1 if an error occured
  */
@@ -558,12 +1022,12 @@ static int create_image(VkFormat format, uint32_t width, uint32_t height,
 			char changeable, uint32_t mipLevels,
 			uint32_t arrayLayers, VkSampleCountFlags samples,
 			VkImageUsageFlags usage, VkImage *image,
-			VkDeviceMemory *memory)
+			struct vk_alloc *alloc)
 {
 	VkResult res;
 	VkImageCreateInfo create_info;
 	VkMemoryRequirements req;
-	VkMemoryAllocateInfo alloc_info;
+	VkMemoryPropertyFlags props;
 
 	create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 	create_info.pNext = NULL;
@@ -592,22 +1056,20 @@ static int create_image(VkFormat format, uint32_t width, uint32_t height,
 
 	vkGetImageMemoryRequirements(vk.device, *image, &req);
 
-	alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	alloc_info.pNext = NULL;
-	alloc_info.allocationSize = req.size;
 	if(changeable) {
-		alloc_info.memoryTypeIndex = get_memory_type(req.memoryTypeBits,
-					VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
-					VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+		props = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
 	} else {
-		alloc_info.memoryTypeIndex = get_memory_type(req.memoryTypeBits,
-					VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		props = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
 	}
 
-	res = vkAllocateMemory(vk.device, &alloc_info, NULL, memory);
-	vk_assert(res);
+	if(mem_alloc(&req, props, VK_BLOCK_IMAGE, alloc) < 0) {
+		vkDestroyImage(vk.device, *image, NULL);
+		return -1;
+	}
 
-	res = vkBindImageMemory(vk.device, *image, *memory, 0);
+	res = vkBindImageMemory(vk.device, *image,
+	                        vk.blocks[alloc->block].memory, alloc->off);
 	vk_assert(res);
 
 	return 0;
@@ -832,7 +1294,7 @@ static int create_depth_buffer(void)
 	if(create_image(vk.depth_format, vk.win_size.width, vk.win_size.height,
 			0, 1, 1, VK_SAMPLE_COUNT_1_BIT,
 			VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-			&vk.depth_image, &vk.depth_memory) < 0) {
+			&vk.depth_image, &vk.depth_alloc) < 0) {
 		return -1;
 	}
 
@@ -985,7 +1447,8 @@ static int create_command_pool(void)
 }
 
 /*
- * Allocate a command buffer, which records the render commands.
+ * Allocate the command buffers, which record the render commands of every
+ * frame, and the command buffer of the upload-queue.
  * 
  * Returns: 0 on success or -1 if an error occured
  */
@@ -998,11 +1461,18 @@ static int allocate_command_buffer(void)
 	alloc_info.pNext = NULL;
 	alloc_info.commandPool = vk.command_pool;
 	alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	alloc_info.commandBufferCount = VK_FRAMES;
+
+	res = vkAllocateCommandBuffers(vk.device, &alloc_info, vk.frame_cmd);
+	vk_assert(res);
+
 	alloc_info.commandBufferCount = 1;
 
-	res = vkAllocateCommandBuffers(vk.device, &alloc_info,
-	                               &vk.command_buffer);
+	res = vkAllocateCommandBuffers(vk.device, &alloc_info, &vk.upload_cmd);
 	vk_assert(res);
+
+	vk.frame = 0;
+	vk.command_buffer = vk.frame_cmd[0];
 	return 0;
 }
 
@@ -1014,7 +1484,7 @@ static int allocate_command_buffer(void)
 static int create_descriptor_pool(void)
 {
 	VkResult res;
-	VkDescriptorPoolSize sizes[2];
+	VkDescriptorPoolSize sizes[3];
 	VkDescriptorPoolCreateInfo create_info;
 
 	/* Set the types and amounts of the descriptors */
@@ -1022,13 +1492,15 @@ static int create_descriptor_pool(void)
 	sizes[0].descriptorCount = 10;
 	sizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 	sizes[1].descriptorCount = 10;
+	sizes[2].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	sizes[2].descriptorCount = 30;
 
 	/* Create the descriptor pool */
 	create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	create_info.pNext = NULL;
 	create_info.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
 	create_info.maxSets = 128;
-	create_info.poolSizeCount = 2;
+	create_info.poolSizeCount = 3;
 	create_info.pPoolSizes = sizes;
 
 	res = vkCreateDescriptorPool(vk.device, &create_info, NULL, &vk.pool);
@@ -1037,7 +1509,8 @@ static int create_descriptor_pool(void)
 }
 
 /*
- * Create a semaphore.
+ * Create the semaphores of every frame, signaled when the swapchain image has
+ * been aquired and when the frame has been rendered.
  * 
  * Returns: 0 on success or -1 if an error occured
  */
@@ -1045,20 +1518,41 @@ static int create_semaphore(void)
 {
 	VkResult res;
 	VkSemaphoreCreateInfo create_info;
+	int i;
 
 	create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 	create_info.pNext = NULL;
 	create_info.flags = 0;
 
-	res = vkCreateSemaphore(vk.device, &create_info, NULL,
-	                        &vk.image_aquired);
-	vk_assert(res);
+	for(i = 0; i < VK_FRAMES; i++) {
+		res = vkCreateSemaphore(vk.device, &create_info, NULL,
+		                        &vk.image_aquired[i]);
+		vk_assert(res);
+
+		res = vkCreateSemaphore(vk.device, &create_info, NULL,
+		                        &vk.render_done[i]);
+		vk_assert(res);
+	}
 
 	return 0;
 }
 
 /*
- * Create a fence.
+ * Destroy the semaphores of all frames.
+ */
+static void destroy_semaphore(void)
+{
+	int i;
+
+	for(i = 0; i < VK_FRAMES; i++) {
+		vkDestroySemaphore(vk.device, vk.image_aquired[i], NULL);
+		vkDestroySemaphore(vk.device, vk.render_done[i], NULL);
+	}
+}
+
+/*
+ * Create the fences of every frame. They are created signaled, as no frame
+ * has been submitted yet.
  * 
  * Returns: 0 on success or -1 if an error occured
  */
@@ -1066,16 +1560,52 @@ static int create_fence(void)
 {
 	VkResult res;
 	VkFenceCreateInfo create_info;
+	int i;
 
 	create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
 	create_info.pNext = NULL;
-	create_info.flags = 0;
+	create_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+	for(i = 0; i < VK_FRAMES; i++) {
+		res = vkCreateFence(vk.device, &create_info, NULL,
+		                    &vk.frame_fence[i]);
+		vk_assert(res);
+	}
 
-	res = vkCreateFence(vk.device, &create_info, NULL, &vk.queue_submit);
-	vk_assert(res);
 	return 0;
 }
 
+/*
+ * Destroy the fences of all frames.
+ */
+static void destroy_fence(void)
+{
+	int i;
+
+	for(i = 0; i < VK_FRAMES; i++)
+		vkDestroyFence(vk.device, vk.frame_fence[i], NULL);
+}
+
+/*
+ * Create the palette-ring, a mapped uniform buffer the joint-palettes are
+ * written to directly, and get the alignment of the offsets into it.
+ * 
+ * Returns: 0 on success or -1 if an error occured
+ */
+static int create_palette(void)
+{
+	VkPhysicalDeviceProperties props;
+
+	vkGetPhysicalDeviceProperties(vk.gpu, &props);
+	vk.palette_align = props.limits.minUniformBufferOffsetAlignment;
+	if(vk.palette_align < 1)
+		vk.palette_align = 1;
+
+	return vk_create_buffer(REN_PALETTE_BUF,
+	                        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, 1,
+	                        &vk.palette);
+}
+
 /*
  * Create a shader.
  * 
@@ -1122,12 +1652,12 @@ static int create_shader(char *path, VkShaderModule *shd)
 static int create_set_layout(VkDescriptorSetLayout *set_layout)
 {
 	VkResult res;
-	VkDescriptorSetLayoutBinding bindings[2];
+	VkDescriptorSetLayoutBinding bindings[4];
 	VkDescriptorSetLayoutCreateInfo create_info;
 
 	/* Determine, where each descriptor should be in the shaders */
 	bindings[0].binding = 0;
-	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	bindings[0].descriptorCount = 1;
 	bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 	bindings[0].pImmutableSamplers = NULL;
@@ -1136,12 +1666,22 @@ static int create_set_layout(VkDescriptorSetLayout *set_layout)
 	bindings[1].descriptorCount = 1;
 	bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 	bindings[1].pImmutableSamplers = NULL;
+	bindings[2].binding = 2;
+	bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	bindings[2].descriptorCount = 1;
+	bindings[2].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	bindings[2].pImmutableSamplers = NULL;
+	bindings[3].binding = 3;
+	bindings[3].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	bindings[3].descriptorCount = 1;
+	bindings[3].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	bindings[3].pImmutableSamplers = NULL;
 
 	/* Create the descriptor set layout */
 	create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
 	create_info.pNext = NULL;
 	create_info.flags = 0;
-	create_info.bindingCount = 2;
+	create_info.bindingCount = 4;
 	create_info.pBindings = bindings;
 
 	res = vkCreateDescriptorSetLayout(vk.device, &create_info, NULL,
@@ -1602,7 +2142,48 @@ static int allocate_descriptor_set(VkDescriptorSetLayout *set_layout,
 extern int vk_create_constant_data(struct vk_pipeline pipeline,
                                    VkDescriptorSet *set)
 {
-	return allocate_descriptor_set(&pipeline.set_layout, set);
+	VkDescriptorBufferInfo buffer_info[3];
+	VkWriteDescriptorSet write[3];
+	uint32_t binding[3];
+	int i;
+
+	if(allocate_descriptor_set(&pipeline.set_layout, set) < 0)
+		return -1;
+
+	/*
+	 * Every set points to the palette-ring three times, for the uniform
+	 * data, the joint-palette and the instances. The offsets are set per
+	 * draw.
+	 */
+	binding[0] = 0;
+	buffer_info[0].buffer = vk.palette.buffer;
+	buffer_info[0].offset = 0;
+	buffer_info[0].range = sizeof(struct uni_buffer);
+	binding[1] = 2;
+	buffer_info[1].buffer = vk.palette.buffer;
+	buffer_info[1].offset = 0;
+	buffer_info[1].range = REN_PALETTE_SIZE;
+	binding[2] = 3;
+	buffer_info[2].buffer = vk.palette.buffer;
+	buffer_info[2].offset = 0;
+	buffer_info[2].range = REN_INST_SIZE;
+
+	for(i = 0; i < 3; i++) {
+		write[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		write[i].pNext = NULL;
+		write[i].dstSet = *set;
+		write[i].dstBinding = binding[i];
+		write[i].dstArrayElement = 0;
+		write[i].descriptorCount = 1;
+		write[i].descriptorType =
+			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+		write[i].pImageInfo = NULL;
+		write[i].pBufferInfo = &buffer_info[i];
+		write[i].pTexelBufferView = NULL;
+	}
+
+	vkUpdateDescriptorSets(vk.device, 3, write, 0, NULL);
+	return 0;
 }
 
 
@@ -1615,15 +2196,29 @@ extern int vk_destroy_constant_data(VkDescriptorSet set)
 }
 
 
-extern int vk_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
-                            char staging, struct vk_buffer *buffer)
+/*
+ * Create a new buffer and carve its memory from a memory-block.
+ * 
+ * @size: The size of the buffer
+ * @usage: The type of the buffer
+ * @staging: A charean which enables memory mapping
+ * @kind: VK_BLOCK_BUFFER or VK_BLOCK_LINEAR for buffers, which are freed
+ *        right after they are used
+ * @buffer: A pointer to the buffer, which will be filled by the function
+ * 
+ * Returns: 0 on success or -1 if an error occured
+ */
+static int create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                         char staging, char kind, struct vk_buffer *buffer)
 {
 	VkResult res;
 	VkBufferCreateInfo create_info;
 	VkMemoryRequirements req;
-	VkMemoryAllocateInfo alloc_info;
+	VkMemoryPropertyFlags props;
+	struct vk_block *b;
 
 	buffer->size = size;
+	buffer->upload = 0;
 
 	/* Create the buffer */
 	create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -1641,33 +2236,338 @@ extern int vk_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
 	/* Allocate the buffer memory */
 	vkGetBufferMemoryRequirements(vk.device, buffer->buffer, &req);
 
-	alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	alloc_info.pNext = NULL;
-	alloc_info.allocationSize = req.size;
 	if(staging)
-		alloc_info.memoryTypeIndex = get_memory_type(req.memoryTypeBits,
-		                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
-		                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+		props = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
 	else
-		alloc_info.memoryTypeIndex = get_memory_type(req.memoryTypeBits,
-		                           VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		props = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+
+	if(mem_alloc(&req, props, kind, &buffer->alloc) < 0) {
+		vkDestroyBuffer(vk.device, buffer->buffer, NULL);
+		return -1;
+	}
+
+	b = &vk.blocks[buffer->alloc.block];
 
-	res = vkAllocateMemory(vk.device, &alloc_info, NULL, &buffer->memory);
+	res = vkBindBufferMemory(vk.device, buffer->buffer, b->memory,
+	                         buffer->alloc.off);
 	vk_assert(res);
 
-	res = vkBindBufferMemory(vk.device, buffer->buffer, buffer->memory, 0);
+	/* Host-visible blocks are always mapped */
+	buffer->data = (staging) ? (b->data + buffer->alloc.off) : (NULL);
+
+	return 0;
+}
+
+
+extern int vk_create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                            char staging, struct vk_buffer *buffer)
+{
+	return create_buffer(size, usage, staging, VK_BLOCK_BUFFER, buffer);
+}
+
+
+/*
+ * Create the upload-queue, consisting of the staging-ring and the fence
+ * signaled when a batch of uploads has been completed.
+ * 
+ * Returns: 0 on success or -1 if an error occured
+ */
+static int create_upload(void)
+{
+	VkResult res;
+	VkFenceCreateInfo create_info;
+
+	create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	create_info.pNext = NULL;
+	create_info.flags = 0;
+
+	res = vkCreateFence(vk.device, &create_info, NULL, &vk.upload_fence);
 	vk_assert(res);
 
-	if(staging) {
-		res = vkMapMemory(vk.device, buffer->memory, 0, size, 0,
-		                  (void **)&buffer->data);
-		vk_assert(res);
+	if(create_buffer(VK_UPLOAD_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 1,
+	                 VK_BLOCK_BUFFER, &vk.upload_ring) < 0) {
+		vkDestroyFence(vk.device, vk.upload_fence, NULL);
+		return -1;
+	}
+
+	vk.upload_head = 0;
+	vk.upload_temp_num = 0;
+	vk.upload_open = 0;
+	vk.upload_pending = 0;
+	vk.upload_batch = 0;
+	return 0;
+}
+
+/*
+ * Destroy the upload-queue. The pending uploads have to be completed.
+ */
+static void destroy_upload(void)
+{
+	vk_destroy_buffer(vk.upload_ring);
+	vkDestroyFence(vk.device, vk.upload_fence, NULL);
+}
+
+/*
+ * Wait until the last submitted batch of uploads has been completed and
+ * release its staging-memory, so the command buffer and the staging-ring can
+ * be reused.
+ * 
+ * Returns: 0 on success or -1 if an error occured
+ */
+static int upload_wait(void)
+{
+	VkResult res;
+	int i;
+
+	if(!vk.upload_pending)
+		return 0;
+
+	do {
+		res = vkWaitForFences(vk.device, 1, &vk.upload_fence, VK_TRUE,
+		                      UINT64_MAX);
+	} while(res == VK_TIMEOUT);
+	vk_assert(res);
+
+	res = vkResetFences(vk.device, 1, &vk.upload_fence);
+	vk_assert(res);
+
+	for(i = 0; i < vk.upload_temp_num; i++) {
+		vkDestroyBuffer(vk.device, vk.upload_temp[i].buffer, NULL);
+		mem_free(&vk.upload_temp[i].alloc);
+	}
+
+	vk.upload_temp_num = 0;
+	vk.upload_head = 0;
+	vk.upload_pending = 0;
+	return 0;
+}
+
+/*
+ * Start recording a new batch of uploads, if none is recorded yet.
+ * 
+ * Returns: 0 on success or -1 if an error occured
+ */
+static int upload_begin(void)
+{
+	VkResult res;
+	VkCommandBufferBeginInfo begin_info;
+
+	if(vk.upload_open)
+		return 0;
+
+	/* The command buffer is still used by the last batch */
+	if(upload_wait() < 0)
+		return -1;
+
+	begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	begin_info.pNext = NULL;
+	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	begin_info.pInheritanceInfo = NULL;
+
+	res = vkBeginCommandBuffer(vk.upload_cmd, &begin_info);
+	vk_assert(res);
+
+	vk.upload_open = 1;
+	vk.upload_batch++;
+	return 0;
+}
+
+/*
+ * Submit the recorded batch of uploads without waiting for it. Commands
+ * submitted to the queue afterwards, like the frames, are ordered after the
+ * uploads by the barriers at the end of the batch.
+ * 
+ * Returns: 0 on success or -1 if an error occured
+ */
+static int upload_submit(void)
+{
+	VkResult res;
+	VkMemoryBarrier barrier;
+	VkSubmitInfo submit;
+
+	if(!vk.upload_open)
+		return 0;
+
+	/* Make all buffer-copies of the batch visible to the vertex-input */
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.pNext = NULL;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+	                        VK_ACCESS_INDEX_READ_BIT;
+
+	vkCmdPipelineBarrier(vk.upload_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	                     VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &barrier,
+	                     0, NULL, 0, NULL);
+
+	res = vkEndCommandBuffer(vk.upload_cmd);
+	vk_assert(res);
+
+	submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit.pNext = NULL;
+	submit.waitSemaphoreCount = 0;
+	submit.pWaitSemaphores = NULL;
+	submit.pWaitDstStageMask = NULL;
+	submit.commandBufferCount = 1;
+	submit.pCommandBuffers = &vk.upload_cmd;
+	submit.signalSemaphoreCount = 0;
+	submit.pSignalSemaphores = NULL;
+
+	res = vkQueueSubmit(vk.queue, 1, &submit, vk.upload_fence);
+	vk_assert(res);
+
+	vk.upload_open = 0;
+	vk.upload_pending = 1;
+	vk.upload_submits++;
+	return 0;
+}
+
+/*
+ * Reserve staging-memory for an upload in the current batch and start
+ * recording the batch if necessary. If the staging-ring is full, the batch
+ * is submitted and a new one is started. Uploads larger than the ring get a
+ * temporary staging-buffer, which is freed with the batch.
+ * 
+ * @size: The number of bytes to upload
+ * @buf: A pointer to write the staging-buffer to copy from to
+ * @off: A pointer to write the offset into the staging-buffer to
+ * @data: A pointer to write the mapped staging-memory to
+ * 
+ * Returns: 0 on success or -1 if an error occured
+ */
+static int upload_stage(VkDeviceSize size, VkBuffer *buf, VkDeviceSize *off,
+                        uint8_t **data)
+{
+	VkDeviceSize head;
+	struct vk_buffer *tmp;
+
+	if(upload_begin() < 0)
+		return -1;
+
+	if(size > VK_UPLOAD_SIZE) {
+		if(vk.upload_temp_num >= VK_UPLOAD_TEMP) {
+			if(upload_submit() < 0 || upload_begin() < 0)
+				return -1;
+		}
+
+		tmp = &vk.upload_temp[vk.upload_temp_num];
+		if(create_buffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 1,
+		                 VK_BLOCK_LINEAR, tmp) < 0)
+			return -1;
+
+		vk.upload_temp_num++;
+		vk.upload_bytes += size;
+
+		*buf = tmp->buffer;
+		*off = 0;
+		*data = tmp->data;
+		return 0;
+	}
+
+	head = (vk.upload_head + VK_UPLOAD_ALIGN - 1) & ~(VkDeviceSize)
+		(VK_UPLOAD_ALIGN - 1);
+
+	if(head + size > VK_UPLOAD_SIZE) {
+		if(upload_submit() < 0 || upload_begin() < 0)
+			return -1;
+
+		head = 0;
 	}
 
+	vk.upload_head = head + size;
+	vk.upload_bytes += size;
+
+	*buf = vk.upload_ring.buffer;
+	*off = head;
+	*data = vk.upload_ring.data + head;
+	return 0;
+}
+
+
+extern int vk_upload_buffer(struct vk_buffer *buffer, void *data)
+{
+	VkBuffer src;
+	VkDeviceSize off;
+	uint8_t *ptr;
+	VkBufferCopy copy;
+
+	if(upload_stage(buffer->size, &src, &off, &ptr) < 0)
+		return -1;
+
+	memcpy(ptr, data, buffer->size);
+
+	copy.srcOffset = off;
+	copy.dstOffset = 0;
+	copy.size = buffer->size;
+
+	vkCmdCopyBuffer(vk.upload_cmd, src, buffer->buffer, 1, &copy);
+	buffer->upload = vk.upload_batch;
+	return 0;
+}
+
+/*
+ * Check if a batch of uploads is still recorded or pending. Only the last
+ * batch can be, as a new one is only started after the last one completed.
+ *
+ * @batch: The index of the batch
+ *
+ * Returns: 1 if the batch is still in use or 0 if not
+ */
+static int upload_in_use(uint32_t batch)
+{
+	return (vk.upload_open || vk.upload_pending) &&
+		batch == vk.upload_batch;
+}
+
+
+extern int vk_upload_flush(char wait)
+{
+	if(upload_submit() < 0)
+		return -1;
+
+	if(wait)
+		return upload_wait();
+
 	return 0;
 }
 
 
+extern void vk_get_mem_stats(struct vk_mem_stats *stats)
+{
+	struct vk_block *b;
+	VkMemoryPropertyFlags flags;
+	int i;
+
+	memset(stats, 0, sizeof(struct vk_mem_stats));
+	stats->dev_alloc_max = vk.mem_alloc_max;
+	stats->upload_submits = vk.upload_submits;
+	stats->upload_bytes = vk.upload_bytes;
+
+	for(i = 0; i < VK_BLOCK_MAX; i++) {
+		b = &vk.blocks[i];
+		if(b->memory == VK_NULL_HANDLE)
+			continue;
+
+		stats->block_num++;
+		stats->alloc_num += b->alloc_num;
+
+		/*
+		 * Classify by the memory-type, as device-local memory may be
+		 * mapped as well, e.g. on integrated GPUs.
+		 */
+		flags = vk.mem_props.memoryTypes[b->type].propertyFlags;
+		if(flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) {
+			stats->dev_size += b->size;
+			stats->dev_used += b->used;
+		}
+		else {
+			stats->host_size += b->size;
+			stats->host_used += b->used;
+		}
+	}
+}
+
+
 extern void vk_copy_data_to_buffer(void* data, struct vk_buffer buffer)
 {
 	memcpy(buffer.data, data, buffer.size);
@@ -1676,8 +2576,21 @@ extern void vk_copy_data_to_buffer(void* data, struct vk_buffer buffer)
 
 extern void vk_destroy_buffer(struct vk_buffer buffer)
 {
+	/* The buffer might still be written by the pending uploads */
+	if(upload_in_use(buffer.upload))
+		vk_upload_flush(1);
+
 	vkDestroyBuffer(vk.device, buffer.buffer, NULL);
-	vkFreeMemory(vk.device, buffer.memory, NULL);
+	mem_free(&buffer.alloc);
+}
+
+
+extern uint8_t *vk_get_palette(uint32_t *align)
+{
+	if(align)
+		*align = vk.palette_align;
+
+	return vk.palette.data;
 }
 
 
@@ -1686,14 +2599,13 @@ extern int vk_create_texture(char *pth, struct vk_texture *texture)
 	int w, h;
 	uint32_t i;
 	uint8_t *buf;
-	VkResult res;
-	struct vk_buffer staging;
-	VkCommandBufferBeginInfo begin_info;
+	VkBuffer staging;
+	VkDeviceSize off;
+	uint8_t *data;
 	VkImageMemoryBarrier barrier;
 	VkBufferImageCopy copy;
-	VkSubmitInfo submit;
 
-	/* Load the png and load the data into a staging buffer */
+	/* Load the png and copy the data to the staging-memory */
 	if(fs_load_png(pth, &buf, &w, &h) < 0) {
 		ERR_LOG(("Failed to load texture: %s", pth));
 		return -1;
@@ -1701,33 +2613,27 @@ extern int vk_create_texture(char *pth, struct vk_texture *texture)
 
 	texture->mip_levels = floor(log2(MAX(w, h)))+1;
 
-	if(vk_create_buffer(w*h*4, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 1,
-	                    &staging) < 0) {
-		ERR_LOG(("Failed to create staging buffer"));
-		return -1;
-	}
-	memcpy(staging.data, buf, w*h*4);
-	vkUnmapMemory(vk.device, staging.memory);
-	free(buf);
-
 	if(create_image(VK_FORMAT_R8G8B8A8_SRGB, w, h, 0,
 			texture->mip_levels, 1, VK_SAMPLE_COUNT_1_BIT,
 			VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
 			VK_IMAGE_USAGE_TRANSFER_DST_BIT |
 			VK_IMAGE_USAGE_SAMPLED_BIT, &texture->image,
-			&texture->memory) < 0) {
+			&texture->alloc) < 0) {
+		free(buf);
 		return -1;
 	}
 
-	/* Copy the data from the buffer to the image */
-	begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	begin_info.pNext = NULL;
-	begin_info.flags = 0;
-	begin_info.pInheritanceInfo = NULL;
+	if(upload_stage(w*h*4, &staging, &off, &data) < 0) {
+		ERR_LOG(("Failed to get staging memory"));
+		free(buf);
+		return -1;
+	}
+	memcpy(data, buf, w*h*4);
+	free(buf);
 
-	res = vkBeginCommandBuffer(vk.command_buffer, &begin_info);
-	vk_assert(res);
+	texture->upload = vk.upload_batch;
 
+	/* Record the copy from the staging-memory to the image */
 	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
 	barrier.pNext = NULL;
 	barrier.srcAccessMask = 0;
@@ -1743,11 +2649,11 @@ extern int vk_create_texture(char *pth, struct vk_texture *texture)
 	barrier.subresourceRange.baseArrayLayer = 0;
 	barrier.subresourceRange.layerCount = 1;
 
-	vkCmdPipelineBarrier(vk.command_buffer, VK_PIPELINE_STAGE_HOST_BIT,
+	vkCmdPipelineBarrier(vk.upload_cmd, VK_PIPELINE_STAGE_HOST_BIT,
 	                     VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0,
 	                     NULL, 1, &barrier);
 
-	copy.bufferOffset = 0;
+	copy.bufferOffset = off;
 	copy.bufferRowLength = 0;
 	copy.bufferImageHeight = 0;
 	copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -1761,8 +2667,7 @@ extern int vk_create_texture(char *pth, struct vk_texture *texture)
 	copy.imageExtent.height = h;
 	copy.imageExtent.depth = 1;
 
-	vkCmdCopyBufferToImage(vk.command_buffer, staging.buffer,
-	                       texture->image,
+	vkCmdCopyBufferToImage(vk.upload_cmd, staging, texture->image,
 	                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
 
 	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
@@ -1770,7 +2675,7 @@ extern int vk_create_texture(char *pth, struct vk_texture *texture)
 	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
 	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
 
-	vkCmdPipelineBarrier(vk.command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	vkCmdPipelineBarrier(vk.upload_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
 	                     VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL,
 	                     0, NULL, 1, &barrier);
 
@@ -1807,12 +2712,12 @@ extern int vk_create_texture(char *pth, struct vk_texture *texture)
 		barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
 
-		vkCmdPipelineBarrier(vk.command_buffer,
+		vkCmdPipelineBarrier(vk.upload_cmd,
 		                     VK_PIPELINE_STAGE_TRANSFER_BIT,
 		                     VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL,
 		                     0, NULL, 1, &barrier);
 
-		vkCmdBlitImage(vk.command_buffer, texture->image,
+		vkCmdBlitImage(vk.upload_cmd, texture->image,
 		               VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
 		               texture->image,
 		               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
@@ -1823,7 +2728,7 @@ extern int vk_create_texture(char *pth, struct vk_texture *texture)
 		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
 		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
 
-		vkCmdPipelineBarrier(vk.command_buffer,
+		vkCmdPipelineBarrier(vk.upload_cmd,
 		                     VK_PIPELINE_STAGE_TRANSFER_BIT,
 		                     VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL,
 		                     0, NULL, 1, &barrier);
@@ -1836,34 +2741,10 @@ extern int vk_create_texture(char *pth, struct vk_texture *texture)
 	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
 	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
-	vkCmdPipelineBarrier(vk.command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	vkCmdPipelineBarrier(vk.upload_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
 	                     VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL,
 	                     0, NULL, 1, &barrier);
 
-	res = vkEndCommandBuffer(vk.command_buffer);
-	vk_assert(res);
-
-	submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submit.pNext = NULL;
-	submit.waitSemaphoreCount = 0;
-	submit.pWaitSemaphores = NULL;
-	submit.pWaitDstStageMask = NULL;
-	submit.commandBufferCount = 1;
-	submit.pCommandBuffers = &vk.command_buffer;
-	submit.signalSemaphoreCount = 0;
-	submit.pSignalSemaphores = NULL;;
-
-	res = vkQueueSubmit(vk.queue, 1, &submit, VK_NULL_HANDLE);
-	vk_assert(res);
-
-	res = vkQueueWaitIdle(vk.queue);
-	vk_assert(res);
-
-	res = vkResetCommandPool(vk.device, vk.command_pool, 0);
-	vk_assert(res);
-
-	vk_destroy_buffer(staging);
-
 	if(create_image_view(texture->image, VK_FORMAT_R8G8B8A8_SRGB,
 			VK_IMAGE_ASPECT_COLOR_BIT, texture->mip_levels, 1,
 			&texture->image_view) < 0) {
@@ -1881,59 +2762,55 @@ extern int vk_create_texture(char *pth, struct vk_texture *texture)
 
 extern void vk_destroy_texture(struct vk_texture texture)
 {
+	/* The image might still be written by the pending uploads */
+	if(upload_in_use(texture.upload))
+		vk_upload_flush(1);
+
 	vkDestroySampler(vk.device, texture.sampler, NULL);
 	vkDestroyImageView(vk.device, texture.image_view, NULL);
 	vkDestroyImage(vk.device, texture.image, NULL);
-	vkFreeMemory(vk.device, texture.memory, NULL);
+	mem_free(&texture.alloc);
 }
 
 
 extern int vk_create_skybox(char *pths[6], struct vk_texture *skybox)
 {
 	uint32_t i;
+	uint32_t num;
 	uint8_t *buf[6];
 	int w;
 	int h;
-	VkResult res;
-	struct vk_buffer staging;
-	VkCommandBufferBeginInfo begin_info;
+	VkBuffer staging;
+	VkDeviceSize off;
+	uint8_t *data;
 	VkImageMemoryBarrier barrier;
 	VkBufferImageCopy copies[6];
-	VkSubmitInfo submit;
 
-	for(i = 0; i < 6; i++) {
-		if(fs_load_png(pths[i], &buf[i], &w, &h) < 0) {
-			ERR_LOG(("Failed to load texture: %s", pths[i]));
-			return -1;
+	for(num = 0; num < 6; num++) {
+		if(fs_load_png(pths[num], &buf[num], &w, &h) < 0) {
+			ERR_LOG(("Failed to load texture: %s", pths[num]));
+			goto err_free_buf;
 		}
 	}
 
-	if(vk_create_buffer(w*h*4*6, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 1,
-				&staging) < 0) {
-		ERR_LOG(("Failed to create staging buffer"));
-		return -1;
-	}
-
-	for(i = 0; i < 6; i++) {
-		memcpy(staging.data+(w*h*4*i), buf[i], w*h*4);
-		free(buf[i]);
-	}
-	vkUnmapMemory(vk.device, staging.memory);
-	
 	if(create_image(VK_FORMAT_R8G8B8A8_SRGB, w, h, 0, 1, 6,
 			VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_USAGE_TRANSFER_DST_BIT |
 			VK_IMAGE_USAGE_SAMPLED_BIT, &skybox->image,
-			&skybox->memory) < 0) {
-		return -1;
+			&skybox->alloc) < 0) {
+		goto err_free_buf;
 	}
 
-	begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	begin_info.pNext = NULL;
-	begin_info.flags = 0;
-	begin_info.pInheritanceInfo = NULL;
+	if(upload_stage(w*h*4*6, &staging, &off, &data) < 0) {
+		ERR_LOG(("Failed to get staging memory"));
+		goto err_free_buf;
+	}
 
-	res = vkBeginCommandBuffer(vk.command_buffer, &begin_info);
-	vk_assert(res);
+	for(i = 0; i < 6; i++) {
+		memcpy(data+(w*h*4*i), buf[i], w*h*4);
+		free(buf[i]);
+	}
+
+	skybox->upload = vk.upload_batch;
 
 	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
 	barrier.pNext = NULL;
@@ -1950,12 +2827,12 @@ extern int vk_create_skybox(char *pths[6], struct vk_texture *skybox)
 	barrier.subresourceRange.baseArrayLayer = 0;
 	barrier.subresourceRange.layerCount = 6;
 
-	vkCmdPipelineBarrier(vk.command_buffer, VK_PIPELINE_STAGE_HOST_BIT,
+	vkCmdPipelineBarrier(vk.upload_cmd, VK_PIPELINE_STAGE_HOST_BIT,
 				VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0,
 				NULL, 1, &barrier);
 
 	for(i = 0; i < 6; i++) {
-		copies[i].bufferOffset = w*h*4*i;
+		copies[i].bufferOffset = off + w*h*4*i;
 		copies[i].bufferRowLength = 0;
 		copies[i].bufferImageHeight = 0;
 		copies[i].imageSubresource.aspectMask = 
@@ -1971,7 +2848,7 @@ extern int vk_create_skybox(char *pths[6], struct vk_texture *skybox)
 		copies[i].imageExtent.depth = 1;
 	}
 
-	vkCmdCopyBufferToImage(vk.command_buffer, staging.buffer, skybox->image,
+	vkCmdCopyBufferToImage(vk.upload_cmd, staging, skybox->image,
 				VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 6,
 				copies);
 
@@ -1980,34 +2857,10 @@ extern int vk_create_skybox(char *pths[6], struct vk_texture *skybox)
 	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
 	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
-	vkCmdPipelineBarrier(vk.command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	vkCmdPipelineBarrier(vk.upload_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
 				VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0,
 				NULL, 0, NULL, 1, &barrier);
 
-	res = vkEndCommandBuffer(vk.command_buffer);
-	vk_assert(res);
-
-	submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submit.pNext = NULL;
-	submit.waitSemaphoreCount = 0;
-	submit.pWaitSemaphores = NULL;
-	submit.pWaitDstStageMask = NULL;
-	submit.commandBufferCount = 1;
-	submit.pCommandBuffers = &vk.command_buffer;
-	submit.signalSemaphoreCount = 0;
-	submit.pSignalSemaphores = NULL;
-
-	res = vkQueueSubmit(vk.queue, 1, &submit, VK_NULL_HANDLE);
-	vk_assert(res);
-
-	res = vkQueueWaitIdle(vk.queue);
-	vk_assert(res);
-
-	res = vkResetCommandPool(vk.device, vk.command_pool, 0);
-	vk_assert(res);
-
-	vk_destroy_buffer(staging);
-
 	if(create_image_view(skybox->image, VK_FORMAT_R8G8B8A8_SRGB,
 			VK_IMAGE_ASPECT_COLOR_BIT, 1, 6, &skybox->image_view)
 			 < 0) {
@@ -2019,6 +2872,12 @@ extern int vk_create_skybox(char *pths[6], struct vk_texture *skybox)
 	}
 
 	return 0;
+
+err_free_buf:
+	for(i = 0; i < num; i++)
+		free(buf[i]);
+
+	return -1;
 }
 
 
@@ -2051,6 +2910,7 @@ extern int vk_init(SDL_Window* window)
 		goto err_device;
 
 	get_memory_properties();
+	mem_init();
 
 	if(get_swapchain_images() < 0)
 		goto err_swapchain;
@@ -2079,10 +2939,20 @@ extern int vk_init(SDL_Window* window)
 	if(create_fence() < 0)
 		goto err_semaphore;
 
+	if(create_palette() < 0)
+		goto err_fence;
+
+	if(create_upload() < 0)
+		goto err_palette;
+
 	return 0;
 
+err_palette:
+	vk_destroy_buffer(vk.palette);
+err_fence:
+	destroy_fence();
 err_semaphore:
-	vkDestroySemaphore(vk.device, vk.image_aquired, NULL);
+	destroy_semaphore();
 err_descriptor_pool:
 	vkDestroyDescriptorPool(vk.device, vk.pool, NULL);
 err_command_pool:
@@ -2096,7 +2966,7 @@ err_render_pass:
 err_depth_buffer:
 	vkDestroyImageView(vk.device, vk.depth_view, NULL);
 	vkDestroyImage(vk.device, vk.depth_image, NULL);
-	vkFreeMemory(vk.device, vk.depth_memory, NULL);
+	mem_free(&vk.depth_alloc);
 err_swapchain_images:
 	for(i = 0; i < vk.image_count; i++)
 		vkDestroyImageView(vk.device, vk.image_views[i], NULL);
@@ -2105,6 +2975,7 @@ err_swapchain_images:
 err_swapchain:
 	vkDestroySwapchainKHR(vk.device, vk.swapchain, NULL);
 err_device:
+	mem_close();
 	vkDestroyDevice(vk.device, NULL);
 err_surface:
 	vkDestroySurfaceKHR(vk.instance, vk.surface, NULL);
@@ -2115,18 +2986,30 @@ err:
 }
 
 
+extern void vk_wait_idle(void)
+{
+	vk_upload_flush(1);
+	vkDeviceWaitIdle(vk.device);
+}
+
+
 extern void vk_destroy(void)
 {
 	uint32_t i;
 
-	vkDestroyFence(vk.device, vk.queue_submit, NULL);
-	vkDestroySemaphore(vk.device, vk.image_aquired, NULL);
+	/* Wait for the frames in flight and the pending uploads */
+	vk_wait_idle();
+
+	destroy_upload();
+	vk_destroy_buffer(vk.palette);
+	destroy_fence();
+	destroy_semaphore();
 	vkDestroyDescriptorPool(vk.device, vk.pool, NULL);
 	vkDestroyCommandPool(vk.device, vk.command_pool, NULL);
 	vkDestroyRenderPass(vk.device, vk.render_pass, NULL);
 	vkDestroyImageView(vk.device, vk.depth_view, NULL);
 	vkDestroyImage(vk.device, vk.depth_image, NULL);
-	vkFreeMemory(vk.device, vk.depth_memory, NULL);
+	mem_free(&vk.depth_alloc);
 	for(i = 0; i < vk.image_count; i++) {
 		vkDestroyFramebuffer(vk.device, vk.frame_buffers[i], NULL);
 		vkDestroyImageView(vk.device, vk.image_views[i], NULL);
@@ -2135,6 +3018,7 @@ extern void vk_destroy(void)
 	free(vk.image_views);
 	free(vk.images);
 	vkDestroySwapchainKHR(vk.device, vk.swapchain, NULL);
+	mem_close();
 	vkDestroyDevice(vk.device, NULL);
 	vkDestroySurfaceKHR(vk.instance, vk.surface, NULL);
 	vkDestroyInstance(vk.instance, NULL);
@@ -2145,9 +3029,12 @@ extern int vk_resize(void)
 {
 	uint32_t i;
 
+	/* Wait for the frames in flight using the old swapchain */
+	vkDeviceWaitIdle(vk.device);
+
 	vkDestroyImageView(vk.device, vk.depth_view, NULL);
 	vkDestroyImage(vk.device, vk.depth_image, NULL);
-	vkFreeMemory(vk.device, vk.depth_memory, NULL);
+	mem_free(&vk.depth_alloc);
 	for(i = 0; i < vk.image_count; i++) {
 		vkDestroyFramebuffer(vk.device, vk.frame_buffers[i], NULL);
 		vkDestroyImageView(vk.device, vk.image_views[i], NULL);
@@ -2174,7 +3061,7 @@ extern int vk_resize(void)
 err_depth_buffer:
 	vkDestroyImageView(vk.device, vk.depth_view, NULL);
 	vkDestroyImage(vk.device, vk.depth_image, NULL);
-	vkFreeMemory(vk.device, vk.depth_memory, NULL);
+	mem_free(&vk.depth_alloc);
 err_swapchain_images:
 	for(i = 0; i < vk.image_count; i++)
 		vkDestroyImageView(vk.device, vk.image_views[i], NULL);
@@ -2187,31 +3074,6 @@ err:
 }
 
 
-extern int vk_set_uniform_buffer(struct vk_buffer buffer, VkDescriptorSet set)
-{
-	VkDescriptorBufferInfo buffer_info;
-	VkWriteDescriptorSet write;
-
-	buffer_info.buffer = buffer.buffer;
-	buffer_info.offset = 0;
-	buffer_info.range = buffer.size;
-
-	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-	write.pNext = NULL;
-	write.dstSet = set;
-	write.dstBinding = 0;
-	write.dstArrayElement = 0;
-	write.descriptorCount = 1;
-	write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	write.pImageInfo = NULL;
-	write.pBufferInfo = &buffer_info;
-	write.pTexelBufferView = NULL;
-
-	vkUpdateDescriptorSets(vk.device, 1, &write, 0, NULL);
-	return 0;
-}
-
-
 extern int vk_set_texture(struct vk_texture texture, VkDescriptorSet set)
 {
 	VkDescriptorImageInfo image_info;
@@ -2237,7 +3099,7 @@ extern int vk_set_texture(struct vk_texture texture, VkDescriptorSet set)
 }
 
 
-extern int vk_render_start(void)
+extern int vk_render_start(int frm)
 {
 	int height;
 	VkResult res;
@@ -2247,12 +3109,30 @@ extern int vk_render_start(void)
 	VkViewport viewport;
 	VkRect2D scissor;
 
+	/*
+	 * Wait until the GPU has finished the last frame, which used the same
+	 * command buffer and region of the palette-ring.
+	 */
+	do {
+		res = vkWaitForFences(vk.device, 1, &vk.frame_fence[frm],
+		                      VK_TRUE, UINT64_MAX);
+	} while(res == VK_TIMEOUT);
+	vk_assert(res);
+
 	/* Get the swapchain image, it should render to */
 	res = vkAcquireNextImageKHR(vk.device, vk.swapchain, UINT64_MAX,
-	                            vk.image_aquired, VK_NULL_HANDLE,
+	                            vk.image_aquired[frm], VK_NULL_HANDLE,
 	                            &vk.image_index);
+	if(res != VK_SUBOPTIMAL_KHR)
+		vk_assert(res);
+
+	/* Only reset the fence, if the frame is going to be submitted */
+	res = vkResetFences(vk.device, 1, &vk.frame_fence[frm]);
 	vk_assert(res);
 
+	vk.frame = frm;
+	vk.command_buffer = vk.frame_cmd[frm];
+
 	/* Start recording */
 	begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 	begin_info.pNext = NULL;
@@ -2320,11 +3200,19 @@ extern void vk_render_set_pipeline(struct vk_pipeline pipeline)
 
 
 extern void vk_render_set_constant_data(struct vk_pipeline pipeline,
-                                        VkDescriptorSet set)
+                                        VkDescriptorSet set, uint32_t uni_off,
+                                        uint32_t pal_off, uint32_t inst_off)
 {
+	/* The dynamic offsets are ordered by binding */
+	uint32_t offs[3];
+
+	offs[0] = uni_off;
+	offs[1] = pal_off;
+	offs[2] = inst_off;
+
 	vkCmdBindDescriptorSets(vk.command_buffer,
 	                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-	                        pipeline.layout, 0, 1, &set, 0, NULL);
+	                        pipeline.layout, 0, 1, &set, 3, offs);
 }
 
 
@@ -2344,9 +3232,9 @@ extern void vk_render_set_index_buffer(struct vk_buffer buffer)
 }
 
 
-extern void vk_render_draw(uint32_t index_count)
+extern void vk_render_draw(uint32_t index_count, uint32_t inst_num)
 {
-	vkCmdDrawIndexed(vk.command_buffer, index_count, 1, 0, 0, 1);
+	vkCmdDrawIndexed(vk.command_buffer, index_count, inst_num, 0, 0, 0);
 }
 
 
@@ -2363,43 +3251,45 @@ extern int vk_render_end(void)
 	res = vkEndCommandBuffer(vk.command_buffer);
 	vk_assert(res);
 
+	/* Submit the uploads recorded so far, so they are done before the frame */
+	if(upload_submit() < 0)
+		return -1;
+
 	/* Render */
 	wait_stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 
 	submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 	submit_info.pNext = NULL;
 	submit_info.waitSemaphoreCount = 1;
-	submit_info.pWaitSemaphores = &vk.image_aquired;
+	submit_info.pWaitSemaphores = &vk.image_aquired[vk.frame];
 	submit_info.pWaitDstStageMask = &wait_stage;
 	submit_info.commandBufferCount = 1;
 	submit_info.pCommandBuffers = &vk.command_buffer;
-	submit_info.signalSemaphoreCount = 0;
-	submit_info.pSignalSemaphores = NULL;
+	submit_info.signalSemaphoreCount = 1;
+	submit_info.pSignalSemaphores = &vk.render_done[vk.frame];
 
-	res = vkQueueSubmit(vk.queue, 1, &submit_info, vk.queue_submit);
-	vk_assert(res);
-
-	do {
-		res = vkWaitForFences(vk.device, 1, &vk.queue_submit, VK_TRUE,
-		                      UINT64_MAX);
-	} while(res == VK_TIMEOUT);
+	/*
+	 * Don't wait for the frame to finish, the fence is only waited for
+	 * before the command buffer is recorded again.
+	 */
+	res = vkQueueSubmit(vk.queue, 1, &submit_info,
+	                    vk.frame_fence[vk.frame]);
 	vk_assert(res);
 
-	/* Display */
+	/* Display as soon as the frame has been rendered */
 	present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
 	present_info.pNext = NULL;
-	present_info.waitSemaphoreCount = 0;
-	present_info.pWaitSemaphores = NULL;
+	present_info.waitSemaphoreCount = 1;
+	present_info.pWaitSemaphores = &vk.render_done[vk.frame];
 	present_info.swapchainCount = 1;
 	present_info.pSwapchains = &vk.swapchain;
 	present_info.pImageIndices = &vk.image_index;
 	present_info.pResults = NULL;
 
 	res = vkQueuePresentKHR(vk.queue, &present_info);
-	vk_assert(res);
+	if(res != VK_SUBOPTIMAL_KHR)
+		vk_assert(res);
 
-	res = vkResetFences(vk.device, 1, &vk.queue_submit);
-	vk_assert(res);
 	return 0;
 }
 
@@ -20,18 +20,33 @@ static int win_setup_shader(void)
 
 static int win_load_cursors(void)
 {
+	/* There is no video-subsystem to create cursors in headless mode */
+	if(g_win.win == NULL) {
+		memset(g_win.cursors, 0, sizeof(g_win.cursors));
+		return 0;
+	}
+
 	g_win.cursors[0] = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_ARROW);
 	g_win.cursors[1] = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_IBEAM);
 	g_win.cursors[2] = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_HAND);
 	return 0;
 }
 
-extern int win_init(void)
+extern int win_init(char headless)
 {
 	int win_flgs;
 	struct ui_node *root = NULL;
 	char mode;
 
+	if(headless) {
+		g_win.win = NULL;
+
+		if(ren_init(NULL, REN_MODE_NULL) < 0)
+			return -1;
+
+		goto setup;
+	}
+
 #if USE_OPENGL
 	win_flgs = SDL_WINDOW_OPENGL;
 	mode = 1;
@@ -69,6 +84,7 @@ extern int win_init(void)
 			goto err_close_window;
 	}
 
+setup:
 	if(win_setup_shader() < 0)
 		goto err_destroy_render;
 
@@ -98,7 +114,9 @@ err_destroy_render:
 	ren_destroy();
 
 err_close_window:
-	SDL_DestroyWindow(g_win.win);
+	if(g_win.win)
+		SDL_DestroyWindow(g_win.win);
+
 	g_win.win = NULL;
 	return -1;
 }
@@ -108,7 +126,9 @@ extern void win_close(void)
 	ui_remv(g_win.root);
 	ren_destroy_shader(g_win.shader, g_win.pipeline);
 	ren_destroy();
-	SDL_DestroyWindow(g_win.win);
+
+	if(g_win.win)
+		SDL_DestroyWindow(g_win.win);
 }
 
 extern void win_update(void)
@@ -55,7 +55,7 @@ extern void wld_render(float interp)
 {
 	if(interp) {}
 	if(g_wld.skybox)
-		mdl_render(g_wld.skybox, NULL, NULL, NULL);
+		mdl_submit(g_wld.skybox, NULL, NULL, NULL);
 	return;
 }
 
@@ -0,0 +1,428 @@
+#include "test.h"
+#include "model.h"
+#include "rig.h"
+#include "quaternion.h"
+
+#include <math.h>
+
+/*
+ * Check that the compressed animation-tracks of a model stay within the
+ * error-bounds of the quantization. The keys of every track are decoded and
+ * compared to the keyframes of the uncompressed animation-data. Then the rigs
+ * are sampled in between the keyframes and the joint-matrices are compared to
+ * the ones of the interpolated uncompressed animation-data.
+ */
+
+#define TEST_MODEL    "res/models/player.amo"
+
+/*
+ * The largest allowed rotation-error in radians. Each of the three stored
+ * components of a quaternion is off by at most half a step of the 15-bit
+ * quantization, which is an angle of about 1e-4 radians.
+ */
+#define TEST_ROT_ERR  0.0002
+
+/* The allowed position-error on top of half a quantization-step */
+#define TEST_POS_ERR  0.00001
+
+/* The number of samples per animation, which are between the keyframes */
+#define TEST_SAMPLES  1000
+
+
+/*
+ * Get the track of a joint in an animation.
+ */
+static struct mdl_track *test_get_trk(struct mdl_anim *anim, short jnt)
+{
+	int i;
+
+	for(i = 0; i < anim->trk_num; i++) {
+		if(anim->trk_buf[i].jnt == jnt)
+			return &anim->trk_buf[i];
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Get the angle between two rotations in radians from the length of their
+ * difference, as the acos() of the dot-product is too imprecise for small
+ * angles. Also q and -q are the same rotation.
+ */
+static float test_angle(vec4_t q1, vec4_t q2)
+{
+	vec4_t tmp;
+
+	if(vec4_dot(q1, q2) < 0)
+		vec4_scl(q1, -1, tmp);
+	else
+		vec4_cpy(tmp, q1);
+
+	vec4_sub(tmp, q2, tmp);
+	return 4.0 * asin(MIN(vec4_len(tmp) * 0.5, 1.0));
+}
+
+
+/*
+ * Decode the key of a track at the progress of a keyframe. Keys equal to both
+ * of their neighbours are dropped by the compression, so the last key at or
+ * before the progress holds the same value.
+ */
+static void test_decode(struct mdl_anim *anim, struct mdl_track *trk,
+		uint16_t prog, vec3_t pos, vec4_t rot)
+{
+	struct mdl_key *key = &anim->key_buf[trk->key_off];
+	struct mdl_pos *p;
+	uint16_t *q;
+	int i;
+	int k;
+
+	for(i = 1; i < trk->key_num; i++) {
+		if(key[i].prog > prog)
+			break;
+	}
+
+	qat_unpack(key[i - 1].rot, rot);
+
+	vec3_set(pos, 0, 0, 0);
+	if(trk->pos < 0)
+		return;
+
+	p = &anim->pos_buf[trk->pos];
+	q = &anim->pos_key_buf[(p->key_off + i - 1) * 3];
+	for(k = 0; k < 3; k++)
+		pos[k] = p->min[k] + (p->key_off < 0 ? 0 : q[k] * p->scl[k]);
+}
+
+
+/*
+ * Get the quantization-step of a position-track, which is zero if the
+ * position is constant or the rest-position.
+ */
+static float test_pos_scl(struct mdl_anim *anim, struct mdl_track *trk, int k)
+{
+	struct mdl_pos *p;
+
+	if(trk->pos < 0)
+		return 0;
+
+	p = &anim->pos_buf[trk->pos];
+	return p->key_off < 0 ? 0 : p->scl[k];
+}
+
+
+/*
+ * Compare a joint of a keyframe with the decoded track.
+ */
+static void test_compare_jnt(struct mdl_anim *anim, struct mdl_track *trk,
+		struct amo_keyfr *keyfr, int idx, float *max_rot)
+{
+	uint16_t prog;
+	vec3_t pos;
+	vec4_t rot;
+	float err;
+	float d;
+	int k;
+
+	prog = (uint16_t)(keyfr->prog * MDL_KEY_PROG_MAX + 0.5);
+	test_decode(anim, trk, prog, pos, rot);
+
+	err = test_angle(rot, keyfr->rot + idx * 4);
+	*max_rot = MAX(*max_rot, err);
+
+	TEST_CHECK(err <= TEST_ROT_ERR, "A rotation exceeds the error-bound");
+
+	for(k = 0; k < 3; k++) {
+		d = pos[k] - keyfr->pos[idx * 3 + k];
+		d = ABS(d);
+
+		TEST_CHECK(d <= test_pos_scl(anim, trk, k) * 0.5 + TEST_POS_ERR,
+				"A position exceeds the error-bound");
+	}
+}
+
+
+/*
+ * Compare the compressed animations of a model with the keyframes of the
+ * uncompressed animation-data.
+ */
+static void test_compare(struct model *mdl, struct amo_model *data)
+{
+	struct mdl_anim *anim;
+	struct mdl_track *trk;
+	struct amo_keyfr *keyfr;
+	float max_rot = 0;
+	int keys = 0;
+	int size = 0;
+	int i;
+	int j;
+	int k;
+
+	TEST_CHECK(mdl->anim_num == data->ani_c,
+			"The number of animations differs");
+	if(test_fail)
+		return;
+
+	for(i = 0; i < mdl->anim_num; i++) {
+		anim = &mdl->anim_buf[i];
+		size += anim->trk_num * sizeof(struct mdl_track);
+		size += anim->key_num * sizeof(struct mdl_key);
+		size += anim->pos_num * sizeof(struct mdl_pos);
+		size += anim->pos_key_num * 3 * sizeof(uint16_t);
+
+		for(j = 0; j < data->ani_lst[i].keyfr_c; j++) {
+			keyfr = &data->ani_lst[i].keyfr_lst[j];
+
+			for(k = 0; k < keyfr->jnt_num; k++) {
+				trk = test_get_trk(anim, keyfr->jnt[k]);
+				TEST_CHECK(trk != NULL,
+					"An animated joint has no track");
+				if(!trk)
+					continue;
+
+				test_compare_jnt(anim, trk, keyfr, k, &max_rot);
+				keys++;
+			}
+		}
+	}
+
+	TEST_CHECK(keys > 0, "The model has no animated joints");
+	printf("Compared %d keys, largest rotation-error %g rad\n", keys,
+			max_rot);
+	printf("Compressed animations use %d bytes\n", size);
+}
+
+
+/*
+ * Interpolate the uncompressed animation-data at the given progress and write
+ * the pose to the local transformations of the rig. Joints missing in a
+ * keyframe are in the rest-pose.
+ */
+static void test_sample_ref(struct amo_anim *data, float prog,
+		struct model_rig *rig)
+{
+	struct amo_keyfr *kf0;
+	struct amo_keyfr *kf1;
+	int i;
+	int j;
+	float t;
+	vec3_t p0, p1;
+	vec4_t r0, r1;
+
+	for(i = 0; i < data->keyfr_c - 2; i++) {
+		if(data->keyfr_lst[i + 1].prog > prog)
+			break;
+	}
+
+	kf0 = &data->keyfr_lst[i];
+	kf1 = &data->keyfr_lst[MIN(i + 1, data->keyfr_c - 1)];
+
+	t = 0;
+	if(kf1->prog > kf0->prog)
+		t = (prog - kf0->prog) / (kf1->prog - kf0->prog);
+	t = MIN(MAX(t, 0), 1);
+
+	rig_prepare(rig);
+
+	for(j = 0; j < kf0->jnt_num; j++) {
+		vec3_cpy(rig->loc_pos[kf0->jnt[j]], kf0->pos + j * 3);
+		vec4_cpy(rig->loc_rot[kf0->jnt[j]], kf0->rot + j * 4);
+	}
+
+	/* Interpolate towards the pose of the second keyframe */
+	for(j = 0; j < rig->jnt_num; j++) {
+		vec3_cpy(p0, rig->loc_pos[j]);
+		vec4_cpy(r0, rig->loc_rot[j]);
+		vec3_set(p1, 0, 0, 0);
+		vec4_set(r1, 1, 0, 0, 0);
+
+		for(i = 0; i < kf1->jnt_num; i++) {
+			if(kf1->jnt[i] == j) {
+				vec3_cpy(p1, kf1->pos + i * 3);
+				vec4_cpy(r1, kf1->rot + i * 4);
+				break;
+			}
+		}
+
+		vec3_interp(p0, p1, t, rig->loc_pos[j]);
+		qat_interp(r0, r1, t, rig->loc_rot[j]);
+	}
+}
+
+
+/*
+ * Get the error-bound of the joint-matrices of an animation. The error of a
+ * joint adds up along its chain of parents, and a rotation-error moves the
+ * joints further away from the origin more.
+ */
+static void test_mat_err(struct model *mdl, struct mdl_anim *anim,
+		float *err)
+{
+	float pos_err = 0;
+	float ext = 0;
+	int depth;
+	int i;
+	int j;
+	int k;
+
+	for(i = 0; i < anim->trk_num; i++) {
+		for(k = 0; k < 3; k++)
+			pos_err = MAX(pos_err, test_pos_scl(anim,
+					&anim->trk_buf[i], k));
+	}
+	pos_err = pos_err * 0.5 + TEST_POS_ERR;
+
+	for(j = 0; j < mdl->jnt_num; j++) {
+		for(k = 0; k < 3; k++)
+			ext = MAX(ext, ABS(mdl->jnt_buf[j].bind_mat[0xc + k]));
+	}
+
+	for(j = 0; j < mdl->jnt_num; j++) {
+		for(depth = 1, i = mdl->jnt_buf[j].par; i != -1; depth++)
+			i = mdl->jnt_buf[i].par;
+
+		err[j] = depth * (TEST_ROT_ERR * (1 + ext) + pos_err);
+	}
+}
+
+
+/*
+ * Sample the animations of a model in between the keyframes and compare the
+ * joint-matrices with the ones of the uncompressed animation-data.
+ */
+static void test_sample(short slot, struct amo_model *data)
+{
+	struct model *mdl = models[slot];
+	struct model_rig *rig;
+	struct model_rig *ref;
+	struct rig_layer *lay;
+	float err[JOINT_MAX_NUM];
+	float max_rot = 0;
+	float max_mat = 0;
+	float dur;
+	float prog;
+	float d;
+	int i;
+	int j;
+	int k;
+
+	rig = rig_derive(slot);
+	ref = rig_derive(slot);
+	TEST_CHECK(rig && ref, "Failed to derive the rigs");
+	if(test_fail)
+		goto err_free_rigs;
+
+	/* Advance the layer with the playback instead of the aim-pitch */
+	rig->aim = -1;
+	lay = &rig->lay[0];
+
+	for(i = 0; i < mdl->anim_num; i++) {
+		dur = mdl->anim_buf[i].dur;
+		test_mat_err(mdl, &mdl->anim_buf[i], err);
+
+		rig_play(rig, 0, i, RIG_LAYER_BLEND, 1);
+		rig_update(rig, dur / TEST_SAMPLES * 0.5);
+
+		for(j = 0; j < TEST_SAMPLES; j++) {
+			if(j > 0)
+				rig_update(rig, dur / TEST_SAMPLES);
+
+			/* The rig samples at the time quantized for the cache */
+			prog = (int)(lay->time / RIG_POSE_TIME) *
+				RIG_POSE_TIME / dur;
+			test_sample_ref(&data->ani_lst[i], prog, ref);
+
+			for(k = 0; k < mdl->jnt_num; k++) {
+				d = test_angle(rig->loc_rot[k],
+						ref->loc_rot[k]);
+				max_rot = MAX(max_rot, d);
+			}
+
+			rig_finish(rig);
+			rig_finish(ref);
+
+			for(k = 0; k < mdl->jnt_num * 16; k++) {
+				d = rig->trans_mat[k / 16][k % 16] -
+					ref->trans_mat[k / 16][k % 16];
+				d = ABS(d);
+				max_mat = MAX(max_mat, d);
+
+				TEST_CHECK(d <= err[k / 16],
+					"A matrix exceeds the error-bound");
+				if(test_fail)
+					goto err_free_rigs;
+			}
+		}
+	}
+
+	TEST_CHECK(max_rot <= TEST_ROT_ERR,
+			"A sampled rotation exceeds the error-bound");
+	printf("Sampled %d poses, largest rotation-error %g rad, "
+			"largest matrix-error %g\n",
+			mdl->anim_num * TEST_SAMPLES, max_rot, max_mat);
+
+err_free_rigs:
+	if(rig)
+		rig_free(rig);
+
+	if(ref)
+		rig_free(ref);
+}
+
+
+int main(void)
+{
+	struct amo_model *data;
+	FILE *fd;
+	short slot;
+
+	/* Load the uncompressed animation-data */
+	if(!(fd = fopen(TEST_MODEL, "r"))) {
+		TEST_CHECK(0, "Failed to open the model");
+		return TEST_RESULT("mdl_load_anim error-bounds");
+	}
+
+	data = amo_load(fd);
+	fclose(fd);
+
+	TEST_CHECK(data != NULL, "Failed to load the animation-data");
+	if(test_fail)
+		return TEST_RESULT("mdl_load_anim error-bounds");
+
+	/* Load the compressed animations without a window */
+	TEST_CHECK(ren_init(NULL, REN_MODE_NULL) == 0,
+			"Failed to initialize the renderer");
+	if(test_fail)
+		goto err_destroy_data;
+
+	TEST_CHECK(mdl_init() == 0, "Failed to initialize the models");
+	if(test_fail)
+		goto err_destroy_ren;
+
+	slot = mdl_load("plr", TEST_MODEL, 0, 0, MDL_TYPE_DEFAULT);
+	TEST_CHECK(slot >= 0, "Failed to load the model");
+	if(test_fail)
+		goto err_close_mdl;
+
+	/* Set up the rig-pools and the pose-cache used by rig_update() */
+	rig_pool_init();
+	rig_pose_init();
+
+	test_compare(models[slot], data);
+	if(!test_fail)
+		test_sample(slot, data);
+
+	rig_pose_close();
+	rig_pool_close();
+
+err_close_mdl:
+	mdl_close();
+
+err_destroy_ren:
+	ren_destroy();
+
+err_destroy_data:
+	amo_destroy(data);
+	return TEST_RESULT("mdl_load_anim error-bounds");
+}
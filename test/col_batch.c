@@ -0,0 +1,123 @@
+#include "test.h"
+#include "collision.h"
+
+#include <string.h>
+
+/*
+ * Check that col_s2t_check_batch() finds the same collisions as running
+ * col_s2t_check() on every triangle, on random triangle-soups and spheres.
+ * If SSE is available, this compares the filtered check with the scalar one.
+ */
+
+#define TEST_RUNS     2000
+#define TEST_TRI_MAX  64
+
+
+static void test_rand_vec(uint32_t *seed, float min, float max, vec3_t v)
+{
+	int k;
+
+	for(k = 0; k < 3; k++)
+		v[k] = TEST_RANDF(*seed, min, max);
+}
+
+
+/*
+ * Check all triangles one by one, converting them to eSpace the same way
+ * col_s2t_check_batch() does.
+ */
+static void test_check_each(struct col_pck_sphere *pck,
+		struct col_trig_blk *blk, int num, vec3_t off)
+{
+	vec3_t tri[3];
+	int i;
+	int c;
+	int k;
+
+	for(i = 0; i < num; i++) {
+		for(c = 0; c < 3; c++) {
+			for(k = 0; k < 3; k++) {
+				tri[c][k] = blk[i / COL_BLK_NUM].vtx[c][k]
+					[i % COL_BLK_NUM];
+
+				if(off)
+					tri[c][k] += off[k];
+
+				tri[c][k] /= pck->eRadius[k];
+			}
+		}
+
+		col_s2t_check(pck, tri[0], tri[1], tri[2]);
+	}
+}
+
+
+int main(void)
+{
+	struct col_trig_blk blk[TEST_TRI_MAX / COL_BLK_NUM];
+	struct col_pck_sphere ref;
+	struct col_pck_sphere pck;
+	uint32_t seed = 1;
+	vec3_t p[3];
+	vec3_t pos;
+	vec3_t vel;
+	vec3_t e;
+	vec3_t off;
+	int found = 0;
+	int run;
+	int num;
+	int i;
+	int c;
+
+	for(run = 0; run < TEST_RUNS; run++) {
+		/* Create a triangle-soup with a random number of triangles */
+		memset(blk, 0, sizeof(blk));
+		num = 1 + TEST_RAND(seed) % TEST_TRI_MAX;
+
+		for(i = 0; i < num; i++) {
+			test_rand_vec(&seed, -3, 3, p[0]);
+
+			for(c = 1; c < 3; c++) {
+				test_rand_vec(&seed, -1.5, 1.5, p[c]);
+				vec3_add(p[0], p[c], p[c]);
+			}
+
+			/* Include some degenerated triangles */
+			if(TEST_RAND(seed) % 16 == 0)
+				vec3_cpy(p[2], p[1]);
+
+			col_blk_set(&blk[i / COL_BLK_NUM], i % COL_BLK_NUM,
+					p[0], p[1], p[2]);
+		}
+
+		/* Create a random sphere moving through the soup */
+		test_rand_vec(&seed, -3, 3, pos);
+		test_rand_vec(&seed, -2, 2, vel);
+		test_rand_vec(&seed, 0.3, 1.5, e);
+		test_rand_vec(&seed, -0.5, 0.5, off);
+
+		col_init_pck_sphere(&ref, pos, vel, e);
+		memcpy(&pck, &ref, sizeof(pck));
+
+		/* Use an offset for every second soup */
+		test_check_each(&ref, blk, num, (run % 2) ? off : NULL);
+		col_s2t_check_batch(&pck, blk, num, (run % 2) ? off : NULL);
+
+		TEST_CHECK(pck.foundCollision == ref.foundCollision,
+				"Different collision found");
+
+		if(!ref.foundCollision || !pck.foundCollision)
+			continue;
+
+		found++;
+		TEST_CHECK(pck.nearestDistance == ref.nearestDistance,
+				"Different distance to the collision");
+		TEST_CHECK(!memcmp(pck.colPnt, ref.colPnt, sizeof(vec3_t)),
+				"Different collision-point");
+	}
+
+	/* Make sure the soups actually test collisions */
+	TEST_CHECK(found > TEST_RUNS / 10, "Too few collisions found");
+
+	return TEST_RESULT("col_s2t_check_batch");
+}
@@ -0,0 +1,218 @@
+#include "test.h"
+#include "object.h"
+#include "job.h"
+
+#include <string.h>
+
+/*
+ * Check that the simulation is deterministic regardless of the number of
+ * worker-threads. The same scene is simulated over the same recorded
+ * input-log with only the calling thread and with several workers, and the
+ * positions have to be equal bit for bit.
+ */
+
+#define TEST_PROPS    64
+#define TEST_MOVERS   48
+#define TEST_TICKS    300
+#define TEST_INPUTS   200
+#define TEST_WORKERS  4
+
+
+/*
+ * A recorded input of one of the moving objects, which is passed through the
+ * input-pipe like the inputs received from peers.
+ */
+struct test_input {
+	uint32_t id;
+	uint32_t ts;
+	vec2_t   mov;
+	vec3_t   dir;
+};
+
+static struct test_input test_log[TEST_INPUTS];
+
+static short test_mdl_wld;
+static short test_mdl_prop[2];
+static short test_mdl_plr;
+
+/* The start-positions of the moving objects */
+static vec3_t test_start[TEST_MOVERS];
+
+
+/*
+ * Record the inputs, spread over the simulated ticks in ascending order of
+ * their timestamps.
+ */
+static void test_record(void)
+{
+	int i;
+	uint32_t seed = 2;
+
+	for(i = 0; i < TEST_INPUTS; i++) {
+		test_log[i].id = TEST_PROPS + 2 + TEST_RAND(seed) % TEST_MOVERS;
+		test_log[i].ts = (1 + i * TEST_TICKS / TEST_INPUTS) * TICK_TIME;
+
+		test_log[i].mov[0] = TEST_RANDF(seed, -1, 1);
+		test_log[i].mov[1] = TEST_RANDF(seed, -1, 1);
+
+		test_log[i].dir[0] = TEST_RANDF(seed, -1, 1);
+		test_log[i].dir[1] = TEST_RANDF(seed, -1, 1);
+		test_log[i].dir[2] = 0;
+	}
+}
+
+
+/*
+ * Simulate the scene tick by tick while replaying the input-log, and write
+ * the positions of the moving objects, ordered by their IDs, to the buffer.
+ */
+static int test_simulate(int workers, vec3_t *out)
+{
+	int i;
+	int j;
+	uint32_t seed = 1;
+	uint32_t id = 1;
+	uint32_t now;
+	short slot;
+	vec3_t pos;
+
+	if(inp_init() < 0)
+		return -1;
+
+	if(job_init(workers) < 0)
+		goto err_close_inp;
+
+	if(obj_init() < 0)
+		goto err_close_job;
+
+	vec3_set(pos, 0, 0, 0);
+	if(obj_set(id++, OBJ_M_STATIC, pos, test_mdl_wld, NULL, 0, 0) < 0)
+		goto err_close_obj;
+
+	for(i = 0; i < TEST_PROPS; i++) {
+		pos[0] = TEST_RANDF(seed, -12, 12);
+		pos[1] = TEST_RANDF(seed, -12, 12);
+		pos[2] = 0;
+
+		if(obj_set(id++, OBJ_M_STATIC, pos, test_mdl_prop[i % 2], NULL,
+					0, 0) < 0)
+			goto err_close_obj;
+	}
+
+	/* Crowd the objects, so they also collide with each other */
+	for(i = 0; i < TEST_MOVERS; i++) {
+		pos[0] = TEST_RANDF(seed, -8, 8);
+		pos[1] = TEST_RANDF(seed, -8, 8);
+		pos[2] = 0;
+
+		slot = obj_set(id++, OBJ_M_MODEL | OBJ_M_GRAV | OBJ_M_MOVE |
+				OBJ_M_SOLID, pos, test_mdl_plr, NULL, 0, 0);
+		if(slot < 0)
+			goto err_close_obj;
+
+		vec3_cpy(test_start[i], g_obj.pos[slot]);
+		g_obj.mov[slot][0] = TEST_RANDF(seed, -1, 1);
+		g_obj.mov[slot][1] = TEST_RANDF(seed, -1, 1);
+		g_obj.dir[slot][0] = TEST_RANDF(seed, -1, 1);
+		g_obj.dir[slot][1] = TEST_RANDF(seed, -1, 1);
+		g_obj.dir[slot][2] = 0;
+	}
+
+	for(i = 1, j = 0; i <= TEST_TICKS; i++) {
+		now = i * TICK_TIME;
+
+		/* Pass the inputs up to this tick through the in-pipe */
+		for(; j < TEST_INPUTS && test_log[j].ts <= now; j++) {
+			if(inp_push(INP_PIPE_IN, test_log[j].id,
+						INP_M_MOV | INP_M_DIR,
+						test_log[j].ts, test_log[j].mov,
+						test_log[j].dir) < 0)
+				goto err_close_obj;
+		}
+
+		inp_update();
+		obj_sys_update(now);
+	}
+
+	for(i = 0; i < TEST_MOVERS; i++) {
+		slot = obj_sel_id(TEST_PROPS + 2 + i);
+		vec3_cpy(out[i], g_obj.pos[slot]);
+	}
+
+	obj_close();
+	job_close();
+	inp_close();
+	return 0;
+
+err_close_obj:
+	obj_close();
+
+err_close_job:
+	job_close();
+
+err_close_inp:
+	inp_close();
+	return -1;
+}
+
+
+int main(void)
+{
+	vec3_t single[TEST_MOVERS];
+	vec3_t multi[TEST_MOVERS];
+	vec3_t del;
+	int moved = 0;
+	int i;
+
+	/* Load the models without a window */
+	TEST_CHECK(ren_init(NULL, REN_MODE_NULL) == 0,
+			"Failed to initialize the renderer");
+	if(test_fail)
+		return TEST_RESULT("obj_sys_update determinism");
+
+	TEST_CHECK(mdl_init() == 0, "Failed to initialize the models");
+	if(test_fail)
+		goto err_destroy_ren;
+
+	test_mdl_wld = mdl_load("wld", "res/models/plane.amo", 0, 0,
+			MDL_TYPE_DEFAULT);
+	test_mdl_prop[0] = mdl_load("slp", "res/models/slope.amo", 0, 0,
+			MDL_TYPE_DEFAULT);
+	test_mdl_prop[1] = mdl_load("tst", "res/models/test.amo", 0, 0,
+			MDL_TYPE_DEFAULT);
+	test_mdl_plr = mdl_load("plr", "res/models/player.amo", 0, 0,
+			MDL_TYPE_DEFAULT);
+
+	TEST_CHECK(test_mdl_wld >= 0 && test_mdl_prop[0] >= 0 &&
+			test_mdl_prop[1] >= 0 && test_mdl_plr >= 0,
+			"Failed to load the models");
+	if(test_fail)
+		goto err_close_mdl;
+
+	test_record();
+
+	TEST_CHECK(test_simulate(0, single) == 0,
+			"Failed to simulate on one thread");
+	TEST_CHECK(test_simulate(TEST_WORKERS, multi) == 0,
+			"Failed to simulate with several workers");
+	if(test_fail)
+		goto err_close_mdl;
+
+	TEST_CHECK(!memcmp(single, multi, sizeof(single)),
+			"The positions depend on the number of workers");
+
+	/* Make sure the objects actually moved */
+	for(i = 0; i < TEST_MOVERS; i++) {
+		vec3_sub(single[i], test_start[i], del);
+		if(vec3_len(del) > 1.0)
+			moved++;
+	}
+	TEST_CHECK(moved > TEST_MOVERS / 2, "The objects didn't move");
+
+err_close_mdl:
+	mdl_close();
+
+err_destroy_ren:
+	ren_destroy();
+	return TEST_RESULT("obj_sys_update determinism");
+}
@@ -0,0 +1,40 @@
+#ifndef _TEST_H
+#define _TEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Helpers shared by the tests. Every test is a program returning 0 if all
+ * checks passed and 1 if not.
+ */
+
+/* The number of failed checks */
+static int test_fail = 0;
+
+/* Check a condition and print the location and message if it failed */
+#define TEST_CHECK(cond, msg)                                               \
+	do {                                                                \
+		if(!(cond)) {                                               \
+			printf("%s:%d: %s\n", __FILE__, __LINE__, (msg));   \
+			test_fail++;                                        \
+		}                                                           \
+	} while(0)
+
+/* Print the result of the test and get the exit-code */
+#define TEST_RESULT(name)                                                   \
+	(printf("%-44s %s\n", (name), test_fail ? "FAILED" : "passed"),     \
+	 test_fail ? 1 : 0)
+
+/*
+ * Get a pseudo-random number between 0 and 0x7fffffff, so every run of a
+ * test uses the same input. The seed is a uint32_t updated in-place.
+ */
+#define TEST_RAND(seed)                                                     \
+	((seed) = (seed) * 1103515245 + 12345, ((seed) >> 1) & 0x7fffffff)
+
+/* Get a pseudo-random float between min and max */
+#define TEST_RANDF(seed, min, max)                                          \
+	((min) + ((max) - (min)) * (TEST_RAND(seed) / (float)0x7fffffff))
+
+#endif